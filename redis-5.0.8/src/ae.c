@@ -30,6 +30,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "fmacros.h"
 #include <stdio.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -49,13 +50,17 @@
 #ifdef HAVE_EVPORT
 #include "ae_evport.c"
 #else
-    #ifdef HAVE_EPOLL
-    #include "ae_epoll.c"
+    #ifdef HAVE_IO_URING
+    #include "ae_iouring.c"
     #else
-        #ifdef HAVE_KQUEUE
-        #include "ae_kqueue.c"
+        #ifdef HAVE_EPOLL
+        #include "ae_epoll.c"
         #else
-        #include "ae_select.c"
+            #ifdef HAVE_KQUEUE
+            #include "ae_kqueue.c"
+            #else
+            #include "ae_select.c"
+            #endif
         #endif
     #endif
 #endif
@@ -70,7 +75,11 @@ aeEventLoop *aeCreateEventLoop(int setsize) {
     if (eventLoop->events == NULL || eventLoop->fired == NULL) goto err;
     eventLoop->setsize = setsize;
     eventLoop->lastTime = time(NULL);
-    eventLoop->timeEventHead = NULL;
+    eventLoop->timeEvents = NULL;
+    eventLoop->timeEventsCount = 0;
+    eventLoop->timeEventsSize = 0;
+    eventLoop->timeEventsCycle = 0;
+    eventLoop->timeEventsDeleted = NULL;
     eventLoop->timeEventNextId = 0;
     eventLoop->stop = 0;
     eventLoop->maxfd = -1;
@@ -123,7 +132,17 @@ int aeResizeSetSize(aeEventLoop *eventLoop, int setsize) {
 }
 
 void aeDeleteEventLoop(aeEventLoop *eventLoop) {
+    int j;
+
     aeApiFree(eventLoop);
+    for (j = 0; j < eventLoop->timeEventsCount; j++)
+        zfree(eventLoop->timeEvents[j]);
+    while (eventLoop->timeEventsDeleted) {
+        aeTimeEvent *next = eventLoop->timeEventsDeleted->next;
+        zfree(eventLoop->timeEventsDeleted);
+        eventLoop->timeEventsDeleted = next;
+    }
+    zfree(eventLoop->timeEvents);
     zfree(eventLoop->events);
     zfree(eventLoop->fired);
     zfree(eventLoop);
@@ -205,6 +224,86 @@ static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms)
     *ms = when_ms;
 }
 
+/* Time events are stored in a binary min-heap ordered by fire time (ties
+ * are broken by id, so older timers fire first), so that the nearest timer
+ * is always eventLoop->timeEvents[0]: finding it is O(1), while adding,
+ * rescheduling and removing a timer is O(log(N)). Every event knows its
+ * position in the heap in order to be removed without searching it. */
+static int aeTimeEventBefore(aeTimeEvent *a, aeTimeEvent *b) {
+    if (a->when_sec != b->when_sec) return a->when_sec < b->when_sec;
+    if (a->when_ms != b->when_ms) return a->when_ms < b->when_ms;
+    return a->id < b->id;
+}
+
+static void aeTimeHeapSet(aeEventLoop *eventLoop, int idx, aeTimeEvent *te) {
+    eventLoop->timeEvents[idx] = te;
+    te->heapIndex = idx;
+}
+
+static void aeTimeHeapUp(aeEventLoop *eventLoop, int idx) {
+    aeTimeEvent *te = eventLoop->timeEvents[idx];
+
+    while (idx > 0) {
+        int parent = (idx-1)/2;
+
+        if (!aeTimeEventBefore(te,eventLoop->timeEvents[parent])) break;
+        aeTimeHeapSet(eventLoop,idx,eventLoop->timeEvents[parent]);
+        idx = parent;
+    }
+    aeTimeHeapSet(eventLoop,idx,te);
+}
+
+static void aeTimeHeapDown(aeEventLoop *eventLoop, int idx) {
+    aeTimeEvent *te = eventLoop->timeEvents[idx];
+    int count = eventLoop->timeEventsCount;
+
+    while (1) {
+        int child = idx*2+1;
+
+        if (child >= count) break;
+        if (child+1 < count &&
+            aeTimeEventBefore(eventLoop->timeEvents[child+1],
+                              eventLoop->timeEvents[child])) child++;
+        if (!aeTimeEventBefore(eventLoop->timeEvents[child],te)) break;
+        aeTimeHeapSet(eventLoop,idx,eventLoop->timeEvents[child]);
+        idx = child;
+    }
+    aeTimeHeapSet(eventLoop,idx,te);
+}
+
+static void aeTimeHeapInsert(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    if (eventLoop->timeEventsCount == eventLoop->timeEventsSize) {
+        eventLoop->timeEventsSize = eventLoop->timeEventsSize ?
+                                    eventLoop->timeEventsSize*2 : 16;
+        eventLoop->timeEvents = zrealloc(eventLoop->timeEvents,
+            sizeof(aeTimeEvent*)*eventLoop->timeEventsSize);
+    }
+    aeTimeHeapSet(eventLoop,eventLoop->timeEventsCount++,te);
+    aeTimeHeapUp(eventLoop,te->heapIndex);
+}
+
+static void aeTimeHeapRemove(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    int idx = te->heapIndex;
+    aeTimeEvent *last = eventLoop->timeEvents[--eventLoop->timeEventsCount];
+
+    te->heapIndex = -1;
+    if (last == te) return;
+    aeTimeHeapSet(eventLoop,idx,last);
+    aeTimeHeapUp(eventLoop,idx);
+    aeTimeHeapDown(eventLoop,last->heapIndex);
+}
+
+/* Remove the event from the heap and queue it for deletion: the finalizer
+ * is called, and the event freed, at the start of the next
+ * processTimeEvents() call, so that it is safe to delete an event from
+ * within its own callback. */
+static void aeTimeEventRelease(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    aeTimeHeapRemove(eventLoop,te);
+    te->id = AE_DELETED_EVENT_ID;
+    te->next = eventLoop->timeEventsDeleted;
+    eventLoop->timeEventsDeleted = te;
+}
+
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
         aeTimeProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc)
@@ -219,23 +318,26 @@ long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
     te->timeProc = proc;
     te->finalizerProc = finalizerProc;
     te->clientData = clientData;
-    te->prev = NULL;
-    te->next = eventLoop->timeEventHead;
-    if (te->next)
-        te->next->prev = te;
-    eventLoop->timeEventHead = te;
+    te->cycle = -1;
+    te->next = NULL;
+    aeTimeHeapInsert(eventLoop,te);
     return id;
 }
 
+/* Note that looking up the event by id is O(N), however it is just a scan
+ * of the heap array, and unlike searching the nearest timer, it is not
+ * performed at every event loop iteration. */
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    while(te) {
+    int j;
+
+    for (j = 0; j < eventLoop->timeEventsCount; j++) {
+        aeTimeEvent *te = eventLoop->timeEvents[j];
+
         if (te->id == id) {
-            te->id = AE_DELETED_EVENT_ID;
+            aeTimeEventRelease(eventLoop,te);
             return AE_OK;
         }
-        te = te->next;
     }
     return AE_ERR; /* NO event with the specified ID found */
 }
@@ -245,32 +347,18 @@ int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
  * put in sleep without to delay any event.
  * If there are no timers NULL is returned.
  *
- * Note that's O(N) since time events are unsorted.
- * Possible optimizations (not needed by Redis so far, but...):
- * 1) Insert the event in order, so that the nearest is just the head.
- *    Much better but still insertion or deletion of timers is O(N).
- * 2) Use a skiplist to have this operation as O(1) and insertion as O(log(N)).
- */
+ * This is O(1) since time events are kept in a min-heap. */
 static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    aeTimeEvent *nearest = NULL;
-
-    while(te) {
-        if (!nearest || te->when_sec < nearest->when_sec ||
-                (te->when_sec == nearest->when_sec &&
-                 te->when_ms < nearest->when_ms))
-            nearest = te;
-        te = te->next;
-    }
-    return nearest;
+    return eventLoop->timeEventsCount ? eventLoop->timeEvents[0] : NULL;
 }
 
 /* Process time events */
 static int processTimeEvents(aeEventLoop *eventLoop) {
-    int processed = 0;
+    int processed = 0, j;
     aeTimeEvent *te;
-    long long maxId;
+    long long maxId, cycle;
+    long now_sec, now_ms;
     time_t now = time(NULL);
 
     /* If the system clock is moved to the future, and then set back to the
@@ -282,61 +370,51 @@ static int processTimeEvents(aeEventLoop *eventLoop) {
      * processing events earlier is less dangerous than delaying them
      * indefinitely, and practice suggests it is. */
     if (now < eventLoop->lastTime) {
-        te = eventLoop->timeEventHead;
-        while(te) {
-            te->when_sec = 0;
-            te = te->next;
-        }
+        for (j = 0; j < eventLoop->timeEventsCount; j++)
+            eventLoop->timeEvents[j]->when_sec = 0;
+        /* The relative order changed: rebuild the heap. */
+        for (j = eventLoop->timeEventsCount/2-1; j >= 0; j--)
+            aeTimeHeapDown(eventLoop,j);
     }
     eventLoop->lastTime = now;
 
-    te = eventLoop->timeEventHead;
-    maxId = eventLoop->timeEventNextId-1;
-    while(te) {
-        long now_sec, now_ms;
-        long long id;
-
-        /* Remove events scheduled for deletion. */
-        if (te->id == AE_DELETED_EVENT_ID) {
-            aeTimeEvent *next = te->next;
-            if (te->prev)
-                te->prev->next = te->next;
-            else
-                eventLoop->timeEventHead = te->next;
-            if (te->next)
-                te->next->prev = te->prev;
-            if (te->finalizerProc)
-                te->finalizerProc(eventLoop, te->clientData);
-            zfree(te);
-            te = next;
-            continue;
-        }
+    /* Free the events scheduled for deletion. */
+    while ((te = eventLoop->timeEventsDeleted) != NULL) {
+        eventLoop->timeEventsDeleted = te->next;
+        if (te->finalizerProc)
+            te->finalizerProc(eventLoop, te->clientData);
+        zfree(te);
+    }
 
-        /* Make sure we don't process time events created by time events in
-         * this iteration. Note that this check is currently useless: we always
-         * add new timers on the head, however if we change the implementation
-         * detail, this check may be useful again: we keep it here for future
-         * defense. */
-        if (te->id > maxId) {
-            te = te->next;
-            continue;
-        }
-        aeGetTime(&now_sec, &now_ms);
-        if (now_sec > te->when_sec ||
-            (now_sec == te->when_sec && now_ms >= te->when_ms))
-        {
-            int retval;
-
-            id = te->id;
-            retval = te->timeProc(eventLoop, id, te->clientData);
-            processed++;
-            if (retval != AE_NOMORE) {
-                aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
-            } else {
-                te->id = AE_DELETED_EVENT_ID;
-            }
+    /* Fire the due events from the top of the heap. Events created by time
+     * events in this iteration (id > maxId), or already fired in this
+     * iteration and rescheduled to fire immediately, are left for the next
+     * call: since they are due, the next call will not sleep. */
+    maxId = eventLoop->timeEventNextId-1;
+    cycle = ++eventLoop->timeEventsCycle;
+    aeGetTime(&now_sec, &now_ms);
+    while(eventLoop->timeEventsCount) {
+        int retval;
+
+        te = eventLoop->timeEvents[0];
+        if (now_sec < te->when_sec ||
+            (now_sec == te->when_sec && now_ms < te->when_ms)) break;
+        if (te->id > maxId || te->cycle == cycle) break;
+
+        te->cycle = cycle;
+        retval = te->timeProc(eventLoop, te->id, te->clientData);
+        processed++;
+        /* The callback may have deleted the event itself. */
+        if (te->id == AE_DELETED_EVENT_ID) continue;
+        if (retval != AE_NOMORE) {
+            /* The fire time can only move forward, and the callback may
+             * have changed the heap, so just sift it down from where it
+             * is now. */
+            aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
+            aeTimeHeapDown(eventLoop,te->heapIndex);
+        } else {
+            aeTimeEventRelease(eventLoop,te);
         }
-        te = te->next;
     }
     return processed;
 }
@@ -513,3 +591,132 @@ void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep
 void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep) {
     eventLoop->aftersleep = aftersleep;
 }
+
+#ifdef REDIS_TEST
+#define AE_TEST_TIMERS 100000
+#define AE_TEST_ITERATIONS 100000
+
+#define assert(_e) ((_e)?(void)0:(_aeAssert(#_e,__FILE__,__LINE__),exit(1)))
+static void _aeAssert(char *estr, char *file, int line) {
+    printf("\n\n=== ASSERTION FAILED ===\n");
+    printf("==> %s:%d '%s' is not true\n",file,line,estr);
+}
+
+static long long aeTestUsec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+static long long aeTestFired[16];
+static int aeTestFiredCount, aeTestFinalized, aeTestRepeat;
+
+static int aeTestRecordProc(aeEventLoop *el, long long id, void *data) {
+    AE_NOTUSED(el);
+    AE_NOTUSED(data);
+    aeTestFired[aeTestFiredCount++] = id;
+    return AE_NOMORE;
+}
+
+static int aeTestRepeatProc(aeEventLoop *el, long long id, void *data) {
+    AE_NOTUSED(data);
+    aeTestRepeat++;
+    if (aeTestRepeat == 3) aeDeleteTimeEvent(el,id);
+    return 0;
+}
+
+static int aeTestNopProc(aeEventLoop *el, long long id, void *data) {
+    AE_NOTUSED(el);
+    AE_NOTUSED(id);
+    AE_NOTUSED(data);
+    return 0;
+}
+
+static void aeTestFinalizer(aeEventLoop *el, void *data) {
+    AE_NOTUSED(el);
+    AE_NOTUSED(data);
+    aeTestFinalized++;
+}
+
+/* Check the heap invariant: every event fires after its parent. */
+static void aeTestCheckHeap(aeEventLoop *el) {
+    int j;
+
+    for (j = 1; j < el->timeEventsCount; j++) {
+        assert(el->timeEvents[j]->heapIndex == j);
+        assert(!aeTimeEventBefore(el->timeEvents[j],
+                                  el->timeEvents[(j-1)/2]));
+    }
+}
+
+int aeTest(int argc, char **argv) {
+    aeEventLoop *el;
+    long long start, elapsed, id, j;
+    AE_NOTUSED(argc);
+    AE_NOTUSED(argv);
+
+    el = aeCreateEventLoop(64);
+
+    printf("Time events fire in order: ");
+    {
+        long long ids[4];
+
+        ids[2] = aeCreateTimeEvent(el,30,aeTestRecordProc,NULL,aeTestFinalizer);
+        ids[0] = aeCreateTimeEvent(el,10,aeTestRecordProc,NULL,aeTestFinalizer);
+        ids[3] = aeCreateTimeEvent(el,40,aeTestRecordProc,NULL,aeTestFinalizer);
+        ids[1] = aeCreateTimeEvent(el,20,aeTestRecordProc,NULL,aeTestFinalizer);
+        id = aeCreateTimeEvent(el,15,aeTestRecordProc,NULL,aeTestFinalizer);
+        aeTestCheckHeap(el);
+        assert(aeDeleteTimeEvent(el,id) == AE_OK);
+        assert(aeDeleteTimeEvent(el,id) == AE_ERR);
+        aeTestCheckHeap(el);
+        while (aeTestFiredCount < 4) aeProcessEvents(el,AE_TIME_EVENTS);
+        for (j = 0; j < 4; j++) assert(aeTestFired[j] == ids[j]);
+        assert(el->timeEventsCount == 0);
+        /* Finalizers are called in the next processTimeEvents() call. */
+        aeProcessEvents(el,AE_TIME_EVENTS|AE_DONT_WAIT);
+        assert(aeTestFinalized == 5);
+        printf("OK\n");
+    }
+
+    printf("Time event deleting itself from its callback: ");
+    {
+        aeTestFinalized = 0;
+        aeCreateTimeEvent(el,0,aeTestRepeatProc,NULL,aeTestFinalizer);
+        while (el->timeEventsCount) aeProcessEvents(el,AE_TIME_EVENTS);
+        aeProcessEvents(el,AE_TIME_EVENTS|AE_DONT_WAIT);
+        assert(aeTestRepeat == 3);
+        assert(aeTestFinalized == 1);
+        printf("OK\n");
+    }
+
+    printf("Create %d timers: ", AE_TEST_TIMERS);
+    start = aeTestUsec();
+    for (j = 0; j < AE_TEST_TIMERS; j++) {
+        /* Far in the future, spread over one hour. */
+        aeCreateTimeEvent(el,3600000+(rand()%3600000),aeTestNopProc,NULL,NULL);
+    }
+    elapsed = aeTestUsec()-start;
+    aeTestCheckHeap(el);
+    printf("%lld usec (%.1f nsec per timer)\n", elapsed,
+        (double)elapsed*1000/AE_TEST_TIMERS);
+
+    /* Loop overhead: what aeProcessEvents() does for time events at
+     * every iteration, with one timer firing at every iteration while the
+     * other timers are pending. */
+    printf("Event loop time events overhead with %d timers: ", AE_TEST_TIMERS);
+    aeCreateTimeEvent(el,0,aeTestNopProc,NULL,NULL);
+    start = aeTestUsec();
+    for (j = 0; j < AE_TEST_ITERATIONS; j++) {
+        assert(aeSearchNearestTimer(el) != NULL);
+        processTimeEvents(el);
+    }
+    elapsed = aeTestUsec()-start;
+    printf("%.1f nsec per iteration\n",
+        (double)elapsed*1000/AE_TEST_ITERATIONS);
+    aeTestCheckHeap(el);
+
+    aeDeleteEventLoop(el);
+    return 0;
+}
+#endif
@@ -83,8 +83,9 @@ typedef struct aeTimeEvent {
     aeTimeProc *timeProc;
     aeEventFinalizerProc *finalizerProc;
     void *clientData;
-    struct aeTimeEvent *prev;
-    struct aeTimeEvent *next;
+    int heapIndex; /* Position in the time events heap, -1 if not there. */
+    long long cycle; /* Last processTimeEvents() cycle that fired it. */
+    struct aeTimeEvent *next; /* Next deleted event waiting to be freed. */
 } aeTimeEvent;
 
 /* A fired event */
@@ -101,7 +102,11 @@ typedef struct aeEventLoop {
     time_t lastTime;     /* Used to detect system clock skew */
     aeFileEvent *events; /* Registered events */
     aeFiredEvent *fired; /* Fired events */
-    aeTimeEvent *timeEventHead;
+    aeTimeEvent **timeEvents; /* Min-heap of time events by fire time. */
+    int timeEventsCount;      /* Number of time events in the heap. */
+    int timeEventsSize;       /* Number of allocated heap slots. */
+    long long timeEventsCycle; /* Incremented by every processTimeEvents(). */
+    aeTimeEvent *timeEventsDeleted; /* Deleted events, not yet finalized. */
     int stop;
     void *apidata; /* This is used for polling API specific data */
     aeBeforeSleepProc *beforesleep;
@@ -129,4 +134,8 @@ void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep);
 int aeGetSetSize(aeEventLoop *eventLoop);
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize);
 
+#ifdef REDIS_TEST
+int aeTest(int argc, char **argv);
+#endif
+
 #endif
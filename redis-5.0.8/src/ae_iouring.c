@@ -0,0 +1,495 @@
+/* Linux io_uring(7) based ae.c module
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* The event loop is readiness based: this module does not perform reads
+ * and writes itself, it uses the io_uring POLL_ADD operation as a
+ * replacement for epoll_ctl()/epoll_wait(). The advantage is that all the
+ * interest changes happened while processing events (new clients, write
+ * handlers installed and removed, ...) are queued in the submission ring
+ * and handed to the kernel together with the wait for new events, with a
+ * single io_uring_enter() call per event loop iteration, instead of one
+ * epoll_ctl() call per change plus the epoll_wait() call.
+ *
+ * Poll requests are one-shot: every fd has at most one poll request in
+ * flight, armed with the mask of the events the fd is currently registered
+ * for, and re-armed after it completes. Since a re-armed poll completes
+ * immediately if the fd is still ready, the semantics are the same level
+ * triggered ones of the epoll backend.
+ *
+ * io_uring is not available in every kernel (or may be disabled by a
+ * sandbox / by the kernel.io_uring_disabled sysctl), so if the ring can't
+ * be created the module falls back to the epoll backend, that is included
+ * here with its functions renamed. */
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+
+#define aeApiState aeEpollState
+#define aeApiCreate aeEpollCreate
+#define aeApiResize aeEpollResize
+#define aeApiFree aeEpollFree
+#define aeApiAddEvent aeEpollAddEvent
+#define aeApiDelEvent aeEpollDelEvent
+#define aeApiPoll aeEpollPoll
+#define aeApiName aeEpollName
+#include "ae_epoll.c"
+#undef aeApiState
+#undef aeApiCreate
+#undef aeApiResize
+#undef aeApiFree
+#undef aeApiAddEvent
+#undef aeApiDelEvent
+#undef aeApiPoll
+#undef aeApiName
+
+#define AE_URING_MIN_ENTRIES 64
+#define AE_URING_MAX_ENTRIES 4096
+
+/* user_data of the POLL_REMOVE requests: their completions are ignored. */
+#define AE_URING_REMOVE_UDATA UINT64_MAX
+
+/* Flag of aeApiState.armed: the poll request in flight must be replaced
+ * even if it is armed with the mask the fd is registered for. */
+#define AE_URING_RESYNC (1<<30)
+
+typedef struct aeApiState {
+    int ringfd;
+    /* Submission queue. */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;     /* Tail including SQEs not yet published. */
+    struct io_uring_sqe *sqes;
+    /* Completion queue. */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    /* Mapped regions, in order to unmap them on free. */
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    /* Per fd state, arrays of eventLoop->setsize elements. */
+    int *armed;             /* Mask of the poll request in flight, or 0. */
+    uint32_t *gen;          /* Generation of the poll request in flight. */
+    unsigned char *queued;  /* Non zero if the fd is in the 'changed' list. */
+    int *changed;           /* Fds whose poll request must be updated. */
+    int numchanged;
+} aeApiState;
+
+/* Set once io_uring turned out to be unusable: from then on every event
+ * loop of the process uses the epoll backend. It is only set when no event
+ * loop is using io_uring, so the two backends are never mixed. */
+static int aeUringDisabled = 0;
+static int aeUringLoops = 0;
+
+static int aeUringSetup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int aeUringCreate(aeEventLoop *eventLoop) {
+    struct io_uring_params p;
+    aeApiState *state;
+    unsigned entries = eventLoop->setsize, j;
+    int fd;
+
+    if (entries < AE_URING_MIN_ENTRIES) entries = AE_URING_MIN_ENTRIES;
+    if (entries > AE_URING_MAX_ENTRIES) entries = AE_URING_MAX_ENTRIES;
+
+    memset(&p,0,sizeof(p));
+    fd = aeUringSetup(entries,&p);
+    if (fd == -1) return -1;
+
+    /* We need the kernel to never drop completions (or we may lose the
+     * completion of a poll request forever) and to accept the wait
+     * timeout as argument of io_uring_enter(). */
+    if (!(p.features & IORING_FEAT_NODROP) ||
+        !(p.features & IORING_FEAT_EXT_ARG))
+    {
+        close(fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    state = zcalloc(sizeof(aeApiState));
+    state->ringfd = fd;
+    state->sq_len = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    state->cq_len = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    state->sqes_len = p.sq_entries*sizeof(struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (state->cq_len > state->sq_len) state->sq_len = state->cq_len;
+        state->cq_len = 0;
+    }
+
+    state->sq_ptr = mmap(NULL,state->sq_len,PROT_READ|PROT_WRITE,
+                         MAP_SHARED,fd,IORING_OFF_SQ_RING);
+    if (state->sq_ptr == MAP_FAILED) goto err;
+    if (state->cq_len) {
+        state->cq_ptr = mmap(NULL,state->cq_len,PROT_READ|PROT_WRITE,
+                             MAP_SHARED,fd,IORING_OFF_CQ_RING);
+        if (state->cq_ptr == MAP_FAILED) goto err;
+    } else {
+        state->cq_ptr = state->sq_ptr;
+    }
+    state->sqes = mmap(NULL,state->sqes_len,PROT_READ|PROT_WRITE,
+                       MAP_SHARED,fd,IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) goto err;
+
+    state->sq_head = (unsigned*)((char*)state->sq_ptr + p.sq_off.head);
+    state->sq_tail = (unsigned*)((char*)state->sq_ptr + p.sq_off.tail);
+    state->sq_mask = (unsigned*)((char*)state->sq_ptr + p.sq_off.ring_mask);
+    state->sq_array = (unsigned*)((char*)state->sq_ptr + p.sq_off.array);
+    state->sq_entries = p.sq_entries;
+    state->sq_local_tail = *state->sq_tail;
+    state->cq_head = (unsigned*)((char*)state->cq_ptr + p.cq_off.head);
+    state->cq_tail = (unsigned*)((char*)state->cq_ptr + p.cq_off.tail);
+    state->cq_mask = (unsigned*)((char*)state->cq_ptr + p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe*)((char*)state->cq_ptr + p.cq_off.cqes);
+
+    /* SQE slot N is always published at position N of the array. */
+    for (j = 0; j < state->sq_entries; j++) state->sq_array[j] = j;
+
+    state->armed = zcalloc(sizeof(int)*eventLoop->setsize);
+    state->gen = zcalloc(sizeof(uint32_t)*eventLoop->setsize);
+    state->queued = zcalloc(eventLoop->setsize);
+    state->changed = zmalloc(sizeof(int)*eventLoop->setsize);
+    state->numchanged = 0;
+    eventLoop->apidata = state;
+    return 0;
+
+err:
+    if (state->sq_ptr && state->sq_ptr != MAP_FAILED)
+        munmap(state->sq_ptr,state->sq_len);
+    if (state->cq_len && state->cq_ptr && state->cq_ptr != MAP_FAILED)
+        munmap(state->cq_ptr,state->cq_len);
+    close(fd);
+    zfree(state);
+    return -1;
+}
+
+/* Publish the queued SQEs and enter the kernel. If 'wait' is non zero
+ * we block until at least one completion is available, or the timeout
+ * pointed by 'tvp' (if not NULL) elapses. */
+static int aeUringEnter(aeApiState *state, int wait, struct timeval *tvp) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned to_submit, flags = IORING_ENTER_GETEVENTS;
+    void *argp = NULL;
+    size_t argsz = 0;
+
+    __atomic_store_n(state->sq_tail,state->sq_local_tail,__ATOMIC_RELEASE);
+    to_submit = state->sq_local_tail -
+                __atomic_load_n(state->sq_head,__ATOMIC_ACQUIRE);
+    if (wait && tvp) {
+        memset(&arg,0,sizeof(arg));
+        ts.tv_sec = tvp->tv_sec;
+        ts.tv_nsec = (long long)tvp->tv_usec*1000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        argp = &arg;
+        argsz = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    return syscall(__NR_io_uring_enter,state->ringfd,to_submit,wait ? 1 : 0,
+                   flags,argp,argsz);
+}
+
+/* Return a zeroed SQE, or NULL if the submission queue is full and can't
+ * be drained right now. */
+static struct io_uring_sqe *aeUringGetSqe(aeApiState *state) {
+    struct io_uring_sqe *sqe;
+    unsigned head = __atomic_load_n(state->sq_head,__ATOMIC_ACQUIRE);
+
+    if (state->sq_local_tail - head >= state->sq_entries) {
+        /* Too many interest changes in a single iteration: submit the
+         * ones queued so far without waiting. */
+        if (aeUringEnter(state,0,NULL) == -1) return NULL;
+        head = __atomic_load_n(state->sq_head,__ATOMIC_ACQUIRE);
+        if (state->sq_local_tail - head >= state->sq_entries) return NULL;
+    }
+    sqe = &state->sqes[state->sq_local_tail & *state->sq_mask];
+    state->sq_local_tail++;
+    memset(sqe,0,sizeof(*sqe));
+    return sqe;
+}
+
+static uint64_t aeUringUserData(aeApiState *state, int fd) {
+    return ((uint64_t)fd << 32) | state->gen[fd];
+}
+
+/* Cancel the poll request in flight for 'fd', if any. Returns 0 on
+ * success, -1 if the submission queue is full. */
+static int aeUringDisarm(aeApiState *state, int fd) {
+    struct io_uring_sqe *sqe;
+
+    if (state->armed[fd]) {
+        if ((sqe = aeUringGetSqe(state)) == NULL) return -1;
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = aeUringUserData(state,fd);
+        sqe->user_data = AE_URING_REMOVE_UDATA;
+        state->armed[fd] = 0;
+    }
+    /* Any completion of the old request is stale from now on. */
+    state->gen[fd]++;
+    return 0;
+}
+
+/* Bring the poll request of 'fd' in sync with the mask the fd is
+ * registered for. Returns 0 on success, -1 if the submission queue is
+ * full, so that the fd must be processed again later. */
+static int aeUringSyncFd(aeEventLoop *eventLoop, int fd) {
+    aeApiState *state = eventLoop->apidata;
+    int mask = eventLoop->events[fd].mask;
+    struct io_uring_sqe *sqe;
+    unsigned events = 0;
+
+    if (state->armed[fd] == mask) return 0;
+    if (aeUringDisarm(state,fd) == -1) return -1;
+    if (mask == AE_NONE) return 0;
+
+    if ((sqe = aeUringGetSqe(state)) == NULL) return -1;
+    if (mask & AE_READABLE) events |= POLLIN;
+    if (mask & AE_WRITABLE) events |= POLLOUT;
+#if (BYTE_ORDER == BIG_ENDIAN)
+    events = (events << 16) | (events >> 16);
+#endif
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = aeUringUserData(state,fd);
+    state->armed[fd] = mask;
+    return 0;
+}
+
+/* Queue the SQEs for all the fds whose poll request must change. The fds
+ * we had no room for are kept in the list. */
+static void aeUringFlushChanges(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+    int j, left = 0;
+
+    for (j = 0; j < state->numchanged; j++) {
+        int fd = state->changed[j];
+
+        if (aeUringSyncFd(eventLoop,fd) == -1) {
+            state->changed[left++] = fd;
+        } else {
+            state->queued[fd] = 0;
+        }
+    }
+    state->numchanged = left;
+}
+
+static void aeUringQueueChange(aeApiState *state, int fd) {
+    if (state->queued[fd]) return;
+    state->queued[fd] = 1;
+    state->changed[state->numchanged++] = fd;
+}
+
+static int aeUringResize(aeEventLoop *eventLoop, int setsize) {
+    aeApiState *state = eventLoop->apidata;
+    int oldsize = eventLoop->setsize, j;
+
+    /* Fds over the new size may still have a poll request to remove. */
+    if (setsize < oldsize) {
+        aeUringFlushChanges(eventLoop);
+        aeUringEnter(state,0,NULL);
+        for (j = 0; j < state->numchanged; j++)
+            if (state->changed[j] >= setsize) return -1;
+    }
+
+    state->armed = zrealloc(state->armed,sizeof(int)*setsize);
+    state->gen = zrealloc(state->gen,sizeof(uint32_t)*setsize);
+    state->queued = zrealloc(state->queued,setsize);
+    state->changed = zrealloc(state->changed,sizeof(int)*setsize);
+    if (setsize > oldsize) {
+        memset(state->armed+oldsize,0,sizeof(int)*(setsize-oldsize));
+        memset(state->gen+oldsize,0,sizeof(uint32_t)*(setsize-oldsize));
+        memset(state->queued+oldsize,0,setsize-oldsize);
+    }
+    return 0;
+}
+
+static void aeUringFree(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+
+    munmap(state->sqes,state->sqes_len);
+    if (state->cq_len) munmap(state->cq_ptr,state->cq_len);
+    munmap(state->sq_ptr,state->sq_len);
+    close(state->ringfd);
+    zfree(state->armed);
+    zfree(state->gen);
+    zfree(state->queued);
+    zfree(state->changed);
+    zfree(state);
+}
+
+/* Move the completions available in the CQ ring to eventLoop->fired,
+ * returning the number of fired events. */
+static int aeUringReap(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+    unsigned head = *state->cq_head;
+    unsigned tail = __atomic_load_n(state->cq_tail,__ATOMIC_ACQUIRE);
+    int numevents = 0;
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &state->cqes[head & *state->cq_mask];
+        uint64_t ud = cqe->user_data;
+        int fd = (int)(ud >> 32), mask = 0;
+
+        head++;
+        if (ud == AE_URING_REMOVE_UDATA) continue;
+        if (fd >= eventLoop->setsize || !state->armed[fd] ||
+            (uint32_t)ud != state->gen[fd]) continue; /* Stale. */
+
+        state->armed[fd] = 0;
+        /* On errors we don't re-arm the request: it would fail again and
+         * again, like epoll, an fd that is no longer valid is forgotten. */
+        if (cqe->res < 0) continue;
+
+        aeUringQueueChange(state,fd);
+        if (cqe->res & POLLIN) mask |= AE_READABLE;
+        if (cqe->res & POLLOUT) mask |= AE_WRITABLE;
+        if (cqe->res & POLLERR) mask |= AE_WRITABLE;
+        if (cqe->res & POLLHUP) mask |= AE_WRITABLE;
+        eventLoop->fired[numevents].fd = fd;
+        eventLoop->fired[numevents].mask = mask;
+        numevents++;
+    }
+    __atomic_store_n(state->cq_head,head,__ATOMIC_RELEASE);
+    return numevents;
+}
+
+static long long aeUringMonotonicUs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static int aeUringPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeApiState *state = eventLoop->apidata;
+    int wait = !tvp || tvp->tv_sec || tvp->tv_usec;
+    long long deadline = 0;
+    struct timeval tv;
+    int numevents;
+
+    if (tvp) {
+        deadline = aeUringMonotonicUs() +
+                   (long long)tvp->tv_sec*1000000 + tvp->tv_usec;
+        tv = *tvp;
+    }
+
+    aeUringFlushChanges(eventLoop);
+    while(1) {
+        if (aeUringEnter(state,wait,tvp ? &tv : NULL) == -1 &&
+            errno == EINTR) return 0;
+        numevents = aeUringReap(eventLoop);
+        if (numevents || !wait) break;
+
+        /* We were woken up only by stale completions (for instance the
+         * ones of the poll requests cancelled by POLL_REMOVE): go back
+         * waiting for the remaining time. */
+        if (tvp) {
+            long long left = deadline - aeUringMonotonicUs();
+            if (left <= 0) break;
+            tv.tv_sec = left/1000000;
+            tv.tv_usec = left%1000000;
+        }
+    }
+    return numevents;
+}
+
+static int aeApiCreate(aeEventLoop *eventLoop) {
+    if (!aeUringDisabled) {
+        if (aeUringCreate(eventLoop) == 0) {
+            aeUringLoops++;
+            return 0;
+        }
+        if (aeUringLoops) return -1;
+        aeUringDisabled = 1;
+    }
+    return aeEpollCreate(eventLoop);
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+    if (aeUringDisabled) return aeEpollResize(eventLoop,setsize);
+    return aeUringResize(eventLoop,setsize);
+}
+
+static void aeApiFree(aeEventLoop *eventLoop) {
+    if (aeUringDisabled) {
+        aeEpollFree(eventLoop);
+        return;
+    }
+    aeUringFree(eventLoop);
+    aeUringLoops--;
+}
+
+/* Adding and removing events just records that the poll request of the fd
+ * must be updated: the mask is read from eventLoop->events[fd] when the
+ * request is submitted, right before waiting for events. This also means
+ * that an fd deleted and closed before the next poll never reaches the
+ * kernel with a stale mask.
+ *
+ * The only exception is an fd that is no longer registered for any event:
+ * its poll request is cancelled right away. Such an fd is usually about to
+ * be closed, and the same fd number may be accepted and registered again
+ * with the same mask before the next poll, so deferring the update could
+ * find the mask unchanged and keep the old request, that references the
+ * old file, armed forever. */
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    if (aeUringDisabled) return aeEpollAddEvent(eventLoop,fd,mask);
+    aeUringQueueChange(eventLoop->apidata,fd);
+    return 0;
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    if (aeUringDisabled) {
+        aeEpollDelEvent(eventLoop,fd,delmask);
+        return;
+    }
+    aeApiState *state = eventLoop->apidata;
+    if ((eventLoop->events[fd].mask & ~delmask) == AE_NONE &&
+        aeUringDisarm(state,fd) == -1)
+    {
+        /* No room to cancel the request now: make sure the fd is never
+         * considered in sync, so that it is cancelled and re-armed later
+         * whatever mask it is registered for. */
+        state->armed[fd] |= AE_URING_RESYNC;
+    }
+    aeUringQueueChange(state,fd);
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    if (aeUringDisabled) return aeEpollPoll(eventLoop,tvp);
+    return aeUringPoll(eventLoop,tvp);
+}
+
+static char *aeApiName(void) {
+    return aeUringDisabled ? aeEpollName() : "io_uring";
+}
@@ -660,6 +660,12 @@ struct client *createFakeClient(void) {
     c->argc = 0;
     c->argv = NULL;
     c->bufpos = 0;
+    /* Replies to the fake client are never buffered, see
+     * prepareClientToWrite(), so it needs no reply buffer. */
+    c->buf = NULL;
+    c->buf_usable_size = 0;
+    c->buf_peak = 0;
+    c->buf_peak_last_reset_time = 0;
     c->flags = 0;
     c->btype = BLOCKED_NONE;
     /* We set the fake client as a slave waiting for the synchronization
@@ -667,6 +673,7 @@ struct client *createFakeClient(void) {
     c->replstate = SLAVE_STATE_WAIT_BGSAVE_START;
     c->reply = listCreate();
     c->reply_bytes = 0;
+    c->reply_obj_refs = 0;
     c->obuf_soft_limit_reached_time = 0;
     c->watched_keys = listCreate();
     c->peerid = NULL;
@@ -687,6 +694,7 @@ void freeFakeClientArgv(struct client *c) {
 void freeFakeClient(struct client *c) {
     sdsfree(c->querybuf);
     listRelease(c->reply);
+    zfree(c->buf);
     listRelease(c->watched_keys);
     freeClientMultiState(c);
     zfree(c);
@@ -1013,7 +1021,7 @@ int rewriteSetObject(rio *r, robj *key, robj *o) {
 int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
     long long count = 0, items = zsetLength(o);
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = o->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -1021,13 +1029,13 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
         long long vll;
         double score;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpSeek(zl,0);
         serverAssert(eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         while (eptr != NULL) {
-            serverAssert(ziplistGet(eptr,&vstr,&vlen,&vll));
+            vstr = lpGetValue(eptr,&vlen,&vll);
             score = zzlGetScore(sptr);
 
             if (count == 0) {
@@ -1084,12 +1092,12 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
  *
  * The function returns 0 on error, non-zero on success. */
 static int rioWriteHashIteratorCursor(rio *r, hashTypeIterator *hi, int what) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        hashTypeCurrentFromZiplist(hi, what, &vstr, &vlen, &vll);
+        hashTypeCurrentFromListpack(hi, what, &vstr, &vlen, &vll);
         if (vstr)
             return rioWriteBulkString(r, (char*)vstr, vlen);
         else
@@ -1131,6 +1139,37 @@ int rewriteHashObject(rio *r, robj *key, robj *o) {
     return 1;
 }
 
+/* Emit the commands needed to restore the expires of the fields of a hash,
+ * an HPEXPIREAT for every field with an expire.
+ * The function returns 0 on error, 1 on success. */
+int rewriteHashFieldExpires(rio *r, redisDb *db, robj *key) {
+    hashFieldExpires *hfe;
+    dictIterator *di;
+    dictEntry *de;
+
+    if (dictSize(db->hexpires) == 0 ||
+        (hfe = dictFetchValue(db->hexpires,key->ptr)) == NULL) return 1;
+
+    di = dictGetIterator(hfe->fields);
+    while((de = dictNext(di)) != NULL) {
+        sds field = dictGetKey(de);
+
+        if (rioWriteBulkCount(r,'*',6) == 0 ||
+            rioWriteBulkString(r,"HPEXPIREAT",10) == 0 ||
+            rioWriteBulkObject(r,key) == 0 ||
+            rioWriteBulkLongLong(r,dictGetSignedIntegerVal(de)) == 0 ||
+            rioWriteBulkString(r,"FIELDS",6) == 0 ||
+            rioWriteBulkLongLong(r,1) == 0 ||
+            rioWriteBulkString(r,field,sdslen(field)) == 0)
+        {
+            dictReleaseIterator(di);
+            return 0;
+        }
+    }
+    dictReleaseIterator(di);
+    return 1;
+}
+
 /* Helper for rewriteStreamObject() that generates a bulk string into the
  * AOF representing the ID 'id'. */
 int rioWriteBulkStreamID(rio *r,streamID *id) {
@@ -1297,7 +1336,7 @@ ssize_t aofReadDiffFromParent(void) {
 }
 
 int rewriteAppendOnlyFileRio(rio *aof) {
-    dictIterator *di = NULL;
+    dbIterator *di = NULL;
     dictEntry *de;
     size_t processed = 0;
     int j;
@@ -1305,16 +1344,15 @@ int rewriteAppendOnlyFileRio(rio *aof) {
     for (j = 0; j < server.dbnum; j++) {
         char selectcmd[] = "*2\r\n$6\r\nSELECT\r\n";
         redisDb *db = server.db+j;
-        dict *d = db->dict;
-        if (dictSize(d) == 0) continue;
-        di = dictGetSafeIterator(d);
+        if (dbSize(db) == 0) continue;
+        di = dbGetSafeIterator(db);
 
         /* SELECT the new DB */
         if (rioWrite(aof,selectcmd,sizeof(selectcmd)-1) == 0) goto werr;
         if (rioWriteBulkLongLong(aof,j) == 0) goto werr;
 
         /* Iterate this DB writing every entry */
-        while((de = dictNext(di)) != NULL) {
+        while((de = dbIteratorNext(di)) != NULL) {
             sds keystr;
             robj key, *o;
             long long expiretime;
@@ -1323,7 +1361,7 @@ int rewriteAppendOnlyFileRio(rio *aof) {
             o = dictGetVal(de);
             initStaticStringObject(key,keystr);
 
-            expiretime = getExpire(db,&key);
+            expiretime = keyGetExpire(keystr);
 
             /* Save the key and associated value */
             if (o->type == OBJ_STRING) {
@@ -1341,6 +1379,7 @@ int rewriteAppendOnlyFileRio(rio *aof) {
                 if (rewriteSortedSetObject(aof,&key,o) == 0) goto werr;
             } else if (o->type == OBJ_HASH) {
                 if (rewriteHashObject(aof,&key,o) == 0) goto werr;
+                if (rewriteHashFieldExpires(aof,db,&key) == 0) goto werr;
             } else if (o->type == OBJ_STREAM) {
                 if (rewriteStreamObject(aof,&key,o) == 0) goto werr;
             } else if (o->type == OBJ_MODULE) {
@@ -1361,13 +1400,13 @@ int rewriteAppendOnlyFileRio(rio *aof) {
                 aofReadDiffFromParent();
             }
         }
-        dictReleaseIterator(di);
+        dbReleaseIterator(di);
         di = NULL;
     }
     return C_OK;
 
 werr:
-    if (di) dictReleaseIterator(di);
+    if (di) dbReleaseIterator(di);
     return C_ERR;
 }
 
@@ -515,6 +515,8 @@ void blockForKeys(client *c, int btype, robj **keys, int numkeys, mstime_t timeo
 
     if (target != NULL) incrRefCount(target);
 
+    if (c->bpop.keys == NULL)
+        c->bpop.keys = dictCreate(&objectKeyHeapPointerValueDictType,NULL);
     for (j = 0; j < numkeys; j++) {
         /* The value associated with the key name in the bpop.keys dictionary
          * is NULL for lists and sorted sets, or the stream ID for streams. */
@@ -500,7 +500,7 @@ void clusterInit(void) {
     }
 
     if (listenToPort(server.port+CLUSTER_PORT_INCR,
-        server.cfd,&server.cfd_count) == C_ERR)
+        server.cfd,&server.cfd_count,1) == C_ERR)
     {
         exit(1);
     } else {
@@ -514,11 +514,6 @@ void clusterInit(void) {
         }
     }
 
-    /* The slots -> keys map is a radix tree. Initialize it here. */
-    server.cluster->slots_to_keys = raxNew();
-    memset(server.cluster->slots_keys_count,0,
-           sizeof(server.cluster->slots_keys_count));
-
     /* Set myself->port / cport to my listening ports, we'll just need to
      * discover the IP address via MEET messages. */
     myself->port = server.port;
@@ -647,10 +642,10 @@ void clusterAcceptHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
                     "Error accepting cluster node: %s", server.neterr);
             return;
         }
-        anetNonBlock(NULL,cfd);
         anetEnableTcpNoDelay(NULL,cfd);
 
-        /* Use non-blocking I/O for cluster messages. */
+        /* Use non-blocking I/O for cluster messages: the accepted socket
+         * is already non blocking. */
         serverLog(LL_VERBOSE,"Accepted cluster node %s:%d", cip, cport);
         /* Create a link object we use to handle the connection.
          * It gets passed to the readable handler when data is available.
@@ -3903,7 +3898,7 @@ int verifyClusterConfigWithData(void) {
 
     /* Make sure we only have keys in DB0. */
     for (j = 1; j < server.dbnum; j++) {
-        if (dictSize(server.db[j].dict)) return C_ERR;
+        if (dbSize(server.db+j)) return C_ERR;
     }
 
     /* Check that all the slots we see populated memory have a corresponding
@@ -4279,7 +4274,7 @@ NULL
         clusterReplyMultiBulkSlots(c);
     } else if (!strcasecmp(c->argv[1]->ptr,"flushslots") && c->argc == 2) {
         /* CLUSTER FLUSHSLOTS */
-        if (dictSize(server.db[0].dict) != 0) {
+        if (dbSize(server.db) != 0) {
             addReplyError(c,"DB must be empty to perform CLUSTER FLUSHSLOTS.");
             return;
         }
@@ -4614,7 +4609,7 @@ NULL
          * slots nor keys to accept to replicate some other node.
          * Slaves can switch to another master without issues. */
         if (nodeIsMaster(myself) &&
-            (myself->numslots != 0 || dictSize(server.db[0].dict) != 0)) {
+            (myself->numslots != 0 || dbSize(server.db) != 0)) {
             addReplyError(c,
                 "To set a master the node must be empty and "
                 "without assigned slots.");
@@ -4771,7 +4766,7 @@ NULL
 
         /* Slaves can be reset while containing data, but not master nodes
          * that must be empty. */
-        if (nodeIsMaster(myself) && dictSize(c->db->dict) != 0) {
+        if (nodeIsMaster(myself) && dbSize(c->db) != 0) {
             addReplyError(c,"CLUSTER RESET can't be called with "
                             "master nodes containing keys");
             return;
@@ -4790,15 +4785,18 @@ NULL
 
 /* Generates a DUMP-format representation of the object 'o', adding it to the
  * io stream pointed by 'rio'. This function can't fail. */
-void createDumpPayload(rio *payload, robj *o, robj *key) {
+void createDumpPayload(rio *payload, redisDb *db, robj *o, robj *key) {
     unsigned char buf[2];
     uint64_t crc;
 
     /* Serialize the object in a RDB-like format. It consist of an object type
-     * byte followed by the serialized object. This is understood by RESTORE. */
+     * byte followed by the serialized object. This is understood by RESTORE.
+     * Hashes are followed by the expires of their fields, if any. */
     rioInitWithBuffer(payload,sdsempty());
     serverAssert(rdbSaveObjectType(payload,o));
     serverAssert(rdbSaveObject(payload,o,key));
+    if (o->type == OBJ_HASH)
+        serverAssert(rdbSaveHashFieldExpires(payload,db,key) != -1);
 
     /* Write the footer, this is how it looks like:
      * ----------------+---------------------+---------------+
@@ -4856,7 +4854,7 @@ void dumpCommand(client *c) {
     }
 
     /* Create the DUMP encoded representation. */
-    createDumpPayload(&payload,o,c->argv[1]);
+    createDumpPayload(&payload,c->db,o,c->argv[1]);
 
     /* Transfer to the client */
     dumpobj = createObject(OBJ_STRING,payload.io.buffer.ptr);
@@ -4871,6 +4869,7 @@ void restoreCommand(client *c) {
     rio payload;
     int j, type, replace = 0, absttl = 0;
     robj *obj;
+    dict *field_expires = NULL;
 
     /* Parse additional options */
     for (j = 4; j < c->argc; j++) {
@@ -4935,16 +4934,34 @@ void restoreCommand(client *c) {
         return;
     }
 
+    /* Load the expires of the fields of a hash, if present before the
+     * footer of the payload. */
+    if ((size_t)payload.io.buffer.pos+10 < sdslen(c->argv[3]->ptr)) {
+        if (obj->type != OBJ_HASH ||
+            rdbLoadType(&payload) != RDB_OPCODE_HASH_FIELD_EXPIRES ||
+            (field_expires = rdbLoadHashFieldExpires(&payload)) == NULL)
+        {
+            decrRefCount(obj);
+            addReplyError(c,"Bad data format");
+            return;
+        }
+    }
+
     /* Remove the old key if needed. */
     if (replace) dbDelete(c->db,c->argv[1]);
 
     /* Create the key and set the TTL if any */
-    dbAdd(c->db,c->argv[1],obj);
+    obj = dbCompactValue(c->argv[1],obj,ttl != 0);
     if (ttl) {
         if (!absttl) ttl+=mstime();
+        dbAddExpiring(c->db,c->argv[1],obj);
         setExpire(c,c->db,c->argv[1],ttl);
+    } else {
+        dbAdd(c->db,c->argv[1],obj);
     }
     objectSetLRUOrLFU(obj,lfu_freq,lru_idle,lru_clock);
+    if (field_expires)
+        rdbSetHashFieldExpires(c->db,c->argv[1],obj,field_expires);
     signalModifiedKey(c->db,c->argv[1]);
     addReply(c,shared.ok);
     server.dirty++;
@@ -5217,7 +5234,7 @@ try_again:
 
         /* Emit the payload argument, that is the serialized object using
          * the DUMP format. */
-        createDumpPayload(&payload,ov[j],kv[j]);
+        createDumpPayload(&payload,c->db,ov[j],kv[j]);
         serverAssertWithInfo(c,NULL,
             rioWriteBulkString(&cmd,payload.io.buffer.ptr,
                                sdslen(payload.io.buffer.ptr)));
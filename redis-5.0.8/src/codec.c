@@ -0,0 +1,333 @@
+/* Compression codecs used for quicklist nodes and RDB strings.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* All the codecs have the semantics of lzf_compress() and lzf_decompress():
+ * compression fails, returning 0, if the output does not fit in 'outlen'
+ * bytes, so callers pass a buffer smaller than the input in order to only
+ * get compressed data when it is actually smaller. Decompression returns
+ * the number of bytes written to 'out', or 0 on corrupted input.
+ *
+ * LZ4 is about as dense as LZF but several times faster to decompress, zstd
+ * is denser than both at a compression speed comparable to LZF. */
+
+#include <limits.h>
+#include "codec.h"
+#include "lzf.h"
+
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef USE_ZSTD
+#include <zstd.h>
+
+/* The default zstd level: good ratios at a speed still close to LZF. */
+#define CODEC_ZSTD_LEVEL 3
+
+/* Compression only happens in the main thread, or in the child saving the
+ * RDB file, so a single lazily created context for each direction is
+ * enough, and saves the setup of a new context for every call. */
+static ZSTD_CCtx *zstd_cctx = NULL;
+static ZSTD_DCtx *zstd_dctx = NULL;
+#endif
+
+/* Return 1 if 'codec' is supported by this build. */
+int codecAvailable(int codec) {
+    switch(codec) {
+    case CODEC_LZF: return 1;
+#ifdef USE_LZ4
+    case CODEC_LZ4: return 1;
+#endif
+#ifdef USE_ZSTD
+    case CODEC_ZSTD: return 1;
+#endif
+    default: return 0;
+    }
+}
+
+const char *codecName(int codec) {
+    switch(codec) {
+    case CODEC_LZF: return "lzf";
+    case CODEC_LZ4: return "lz4";
+    case CODEC_ZSTD: return "zstd";
+    default: return "unknown";
+    }
+}
+
+/* Compress 'inlen' bytes at 'in' into 'out'. Returns the compressed length,
+ * or 0 if the codec is not available or the result does not fit 'outlen'. */
+size_t codecCompress(int codec, const void *in, size_t inlen, void *out,
+                     size_t outlen) {
+    switch(codec) {
+    case CODEC_LZF:
+        if (inlen > UINT_MAX) return 0;
+        if (outlen > UINT_MAX) outlen = UINT_MAX;
+        return lzf_compress(in,inlen,out,outlen);
+#ifdef USE_LZ4
+    case CODEC_LZ4: {
+        if (inlen > LZ4_MAX_INPUT_SIZE) return 0;
+        if (outlen > INT_MAX) outlen = INT_MAX;
+        int n = LZ4_compress_default(in,out,inlen,outlen);
+        return n > 0 ? (size_t)n : 0;
+    }
+#endif
+#ifdef USE_ZSTD
+    case CODEC_ZSTD: {
+        if (zstd_cctx == NULL && (zstd_cctx = ZSTD_createCCtx()) == NULL)
+            return 0;
+        size_t n = ZSTD_compressCCtx(zstd_cctx,out,outlen,in,inlen,
+                                     CODEC_ZSTD_LEVEL);
+        return ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+    default:
+        return 0;
+    }
+}
+
+/* Decompress 'inlen' bytes at 'in' into 'out', that has room for 'outlen'
+ * bytes. Returns the decompressed length, or 0 on error. */
+size_t codecDecompress(int codec, const void *in, size_t inlen, void *out,
+                       size_t outlen) {
+    switch(codec) {
+    case CODEC_LZF:
+        if (inlen > UINT_MAX || outlen > UINT_MAX) return 0;
+        return lzf_decompress(in,inlen,out,outlen);
+#ifdef USE_LZ4
+    case CODEC_LZ4: {
+        if (inlen > INT_MAX || outlen > INT_MAX) return 0;
+        int n = LZ4_decompress_safe(in,out,inlen,outlen);
+        return n > 0 ? (size_t)n : 0;
+    }
+#endif
+#ifdef USE_ZSTD
+    case CODEC_ZSTD: {
+        if (zstd_dctx == NULL && (zstd_dctx = ZSTD_createDCtx()) == NULL)
+            return 0;
+        size_t n = ZSTD_decompressDCtx(zstd_dctx,out,outlen,in,inlen);
+        return ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+    default:
+        return 0;
+    }
+}
+
+#ifdef REDIS_TEST
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "zmalloc.h"
+#include "listpack.h"
+
+#define UNUSED(x) (void)(x)
+#define NODE_SIZE 8192
+
+static long long usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+/* Fill 'count' blocks of data with listpacks of about NODE_SIZE bytes, like
+ * the nodes of a list used as a timeline of small JSON documents. */
+static unsigned char **benchListNodes(int count, size_t *lens) {
+    static const char *words[] = {"the","redis","list","timeline","post",
+        "cache","user","reply","like","share","photo","video","today","new"};
+    unsigned char **blocks = zmalloc(sizeof(unsigned char*)*count);
+    char buf[256];
+    int id = 0;
+
+    for (int j = 0; j < count; j++) {
+        unsigned char *lp = lpNew();
+        while (lpBytes(lp) < NODE_SIZE-sizeof(buf)) {
+            int len = snprintf(buf,sizeof(buf),
+                "{\"id\":%d,\"user\":\"user:%d\",\"ts\":%d,\"text\":\"",
+                id, rand()%100000, 1600000000+id*7);
+            int nwords = 3+rand()%12;
+            while (nwords--)
+                len += snprintf(buf+len,sizeof(buf)-len,"%s ",
+                                words[rand()%(sizeof(words)/sizeof(*words))]);
+            len += snprintf(buf+len,sizeof(buf)-len,"\"}");
+            lp = lpAppend(lp,(unsigned char*)buf,len);
+            id++;
+        }
+        lens[j] = lpBytes(lp);
+        blocks[j] = lp;
+    }
+    return blocks;
+}
+
+/* Split the file at 'path' in blocks of NODE_SIZE bytes. */
+static unsigned char **benchFileBlocks(const char *path, int *count,
+                                       size_t **lens) {
+    FILE *fp = fopen(path,"r");
+    unsigned char **blocks = NULL;
+    size_t nread;
+
+    *count = 0;
+    *lens = NULL;
+    if (!fp) return NULL;
+    while (1) {
+        unsigned char *block = zmalloc(NODE_SIZE);
+        if ((nread = fread(block,1,NODE_SIZE,fp)) == 0) {
+            zfree(block);
+            break;
+        }
+        blocks = zrealloc(blocks,sizeof(unsigned char*)*(*count+1));
+        *lens = zrealloc(*lens,sizeof(size_t)*(*count+1));
+        blocks[*count] = block;
+        (*lens)[*count] = nread;
+        (*count)++;
+    }
+    fclose(fp);
+    return blocks;
+}
+
+/* Compress and decompress every block with every codec, reporting the
+ * ratio and the speed. Blocks that don't compress are counted as stored
+ * uncompressed, like quicklist nodes and RDB strings are. */
+static int benchCodecs(const char *title, unsigned char **blocks,
+                       size_t *lens, int count) {
+    unsigned char *comp = zmalloc(NODE_SIZE);
+    unsigned char *plain = zmalloc(NODE_SIZE);
+    size_t *clens = zmalloc(sizeof(size_t)*count);
+    unsigned char **cblocks = zmalloc(sizeof(unsigned char*)*count);
+    size_t total = 0;
+    int errors = 0;
+
+    for (int j = 0; j < count; j++) total += lens[j];
+    printf("%s: %d blocks, %zu bytes\n", title, count, total);
+    for (int codec = 0; codec <= CODEC_MAX; codec++) {
+        if (!codecAvailable(codec)) continue;
+
+        size_t stored = 0;
+        long long start = usec();
+        for (int j = 0; j < count; j++) {
+            clens[j] = codecCompress(codec,blocks[j],lens[j],comp,lens[j]-1);
+            stored += clens[j] ? clens[j] : lens[j];
+            cblocks[j] = clens[j] ? zmalloc(clens[j]) : NULL;
+            if (clens[j]) memcpy(cblocks[j],comp,clens[j]);
+        }
+        long long ctime = usec()-start;
+
+        start = usec();
+        for (int j = 0; j < count; j++) {
+            if (!clens[j]) continue;
+            if (codecDecompress(codec,cblocks[j],clens[j],plain,
+                                lens[j]) != lens[j] ||
+                memcmp(plain,blocks[j],lens[j]) != 0)
+            {
+                printf("ERROR! %s: block %d does not round trip\n",
+                    codecName(codec), j);
+                errors++;
+            }
+        }
+        long long dtime = usec()-start;
+
+        printf("  %-5s ratio %.2f (%5.1f%% of the original size), "
+               "compress %.0f MB/s, decompress %.0f MB/s\n",
+            codecName(codec), (double)total/stored,
+            (double)stored*100/total,
+            (double)total/(ctime ? ctime : 1),
+            (double)total/(dtime ? dtime : 1));
+        for (int j = 0; j < count; j++) zfree(cblocks[j]);
+    }
+    zfree(cblocks);
+    zfree(clens);
+    zfree(plain);
+    zfree(comp);
+    return errors;
+}
+
+/* Test the codecs and benchmark them on list nodes, plus on the file passed
+ * as argument if any, for instance an RDB file:
+ *
+ *     redis-server test codec [/path/to/dump.rdb] */
+int codecTest(int argc, char *argv[]) {
+    int errors = 0;
+    size_t lens[1024];
+
+    srand(1234);
+    for (int codec = 0; codec <= CODEC_MAX; codec++) {
+        if (!codecAvailable(codec)) {
+            printf("%s: not available in this build\n", codecName(codec));
+            continue;
+        }
+
+        /* Incompressible data must be rejected instead of expanded. */
+        unsigned char in[4096], out[4096], back[4096];
+        for (size_t j = 0; j < sizeof(in); j++) in[j] = rand();
+        if (codecCompress(codec,in,sizeof(in),out,sizeof(in)-1) != 0) {
+            printf("ERROR! %s: random data compressed\n", codecName(codec));
+            errors++;
+        }
+
+        /* Repetitive data must round trip, and corruption be detected. */
+        for (size_t j = 0; j < sizeof(in); j++) in[j] = "redis"[j%5];
+        size_t clen = codecCompress(codec,in,sizeof(in),out,sizeof(in)-1);
+        if (clen == 0 ||
+            codecDecompress(codec,out,clen,back,sizeof(back)) != sizeof(in) ||
+            memcmp(in,back,sizeof(in)) != 0)
+        {
+            printf("ERROR! %s: round trip failed\n", codecName(codec));
+            errors++;
+        }
+        if (clen && codecDecompress(codec,out,clen,back,sizeof(in)/2) != 0) {
+            printf("ERROR! %s: overflow not detected\n", codecName(codec));
+            errors++;
+        }
+    }
+
+    int count = sizeof(lens)/sizeof(*lens);
+    unsigned char **blocks = benchListNodes(count,lens);
+    errors += benchCodecs("List nodes",blocks,lens,count);
+    for (int j = 0; j < count; j++) lpFree(blocks[j]);
+    zfree(blocks);
+
+    if (argc >= 4) {
+        size_t *flens;
+        blocks = benchFileBlocks(argv[3],&count,&flens);
+        if (blocks == NULL) {
+            printf("ERROR! Can't read %s\n", argv[3]);
+            errors++;
+        } else {
+            errors += benchCodecs(argv[3],blocks,flens,count);
+            for (int j = 0; j < count; j++) zfree(blocks[j]);
+            zfree(blocks);
+            zfree(flens);
+        }
+    }
+
+    if (!errors) printf("ALL TESTS PASSED!\n");
+    return errors;
+}
+#endif
@@ -0,0 +1,55 @@
+/* Compression codecs used for quicklist nodes and RDB strings.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __CODEC_H
+#define __CODEC_H
+
+#include <stddef.h>
+
+/* LZF is always available, LZ4 and zstd only if Redis was built with
+ * USE_LZ4=yes and USE_ZSTD=yes. These values are part of the encoding of
+ * compressed quicklist nodes, see quicklist.h. */
+#define CODEC_LZF 0
+#define CODEC_LZ4 1
+#define CODEC_ZSTD 2
+#define CODEC_MAX CODEC_ZSTD
+
+int codecAvailable(int codec);
+const char *codecName(int codec);
+size_t codecCompress(int codec, const void *in, size_t inlen, void *out,
+                     size_t outlen);
+size_t codecDecompress(int codec, const void *in, size_t inlen, void *out,
+                       size_t outlen);
+
+#ifdef REDIS_TEST
+int codecTest(int argc, char *argv[]);
+#endif
+
+#endif
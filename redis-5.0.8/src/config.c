@@ -51,6 +51,8 @@ configEnum maxmemory_policy_enum[] = {
     {"allkeys-lru",MAXMEMORY_ALLKEYS_LRU},
     {"allkeys-lfu",MAXMEMORY_ALLKEYS_LFU},
     {"allkeys-random",MAXMEMORY_ALLKEYS_RANDOM},
+    {"volatile-gdsf",MAXMEMORY_VOLATILE_GDSF},
+    {"allkeys-gdsf",MAXMEMORY_ALLKEYS_GDSF},
     {"noeviction",MAXMEMORY_NO_EVICTION},
     {NULL, 0}
 };
@@ -84,6 +86,24 @@ configEnum supervised_mode_enum[] = {
     {NULL, 0}
 };
 
+configEnum data_hash_function_enum[] = {
+    {"siphash", DICT_HASH_SIPHASH},
+    {"wyhash", DICT_HASH_WYHASH},
+    {NULL, 0}
+};
+
+/* Only the codecs available in this build can be selected. */
+configEnum compression_codec_enum[] = {
+    {"lzf", CODEC_LZF},
+#ifdef USE_LZ4
+    {"lz4", CODEC_LZ4},
+#endif
+#ifdef USE_ZSTD
+    {"zstd", CODEC_ZSTD},
+#endif
+    {NULL, 0}
+};
+
 configEnum aof_fsync_enum[] = {
     {"everysec", AOF_FSYNC_EVERYSEC},
     {"always", AOF_FSYNC_ALWAYS},
@@ -216,6 +236,21 @@ void loadServerConfigFromString(char *config) {
             if ((server.protected_mode = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"io-threads") && argc == 2) {
+            server.io_threads_num = atoi(argv[1]);
+            if (server.io_threads_num < 1 ||
+                server.io_threads_num > IO_THREADS_MAX_NUM)
+            {
+                err = "Invalid number of I/O threads"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"io-threads-do-reads") && argc == 2) {
+            if ((server.io_threads_do_reads = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"shared-query-buffer") && argc == 2) {
+            if ((server.shared_query_buffer = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"port") && argc == 2) {
             server.port = atoi(argv[1]);
             if (server.port < 0 || server.port > 65535) {
@@ -226,6 +261,19 @@ void loadServerConfigFromString(char *config) {
             if (server.tcp_backlog < 0) {
                 err = "Invalid backlog value"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"tcp-listeners") && argc == 2) {
+            server.tcp_listeners = atoi(argv[1]);
+            if (server.tcp_listeners < 1 ||
+                server.tcp_listeners > CONFIG_TCP_LISTENERS_MAX)
+            {
+                err = "Invalid number of TCP listeners"; goto loaderr;
+            }
+#ifndef SO_REUSEPORT
+            if (server.tcp_listeners > 1) {
+                err = "Multiple TCP listeners require SO_REUSEPORT, that is "
+                      "not supported on this platform"; goto loaderr;
+            }
+#endif
         } else if (!strcasecmp(argv[0],"bind") && argc >= 2) {
             int j, addresses = argc-1;
 
@@ -313,6 +361,11 @@ void loadServerConfigFromString(char *config) {
             if (server.maxclients < 1) {
                 err = "Invalid max clients limit"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"client-pool-size") && argc == 2) {
+            server.client_pool_size = atoi(argv[1]);
+            if (server.client_pool_size < 0) {
+                err = "Invalid client pool size"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"maxmemory") && argc == 2) {
             server.maxmemory = memtoll(argv[1],NULL);
         } else if (!strcasecmp(argv[0],"maxmemory-policy") && argc == 2) {
@@ -328,6 +381,16 @@ void loadServerConfigFromString(char *config) {
                 err = "maxmemory-samples must be 1 or greater";
                 goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"maxmemory-eviction-headroom") &&
+                   argc == 2)
+        {
+            server.maxmemory_eviction_headroom = atoi(argv[1]);
+            if (server.maxmemory_eviction_headroom < 0 ||
+                server.maxmemory_eviction_headroom > 50)
+            {
+                err = "maxmemory-eviction-headroom must be between 0 and 50";
+                goto loaderr;
+            }
         } else if ((!strcasecmp(argv[0],"proto-max-bulk-len")) && argc == 2) {
             server.proto_max_bulk_len = memtoll(argv[1],NULL);
         } else if ((!strcasecmp(argv[0],"client-query-buffer-limit")) && argc == 2) {
@@ -420,6 +483,15 @@ void loadServerConfigFromString(char *config) {
             if ((server.rdb_compression = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"rdbcompression-codec") && argc == 2) {
+            server.rdb_compression_codec =
+                configEnumGetValue(compression_codec_enum,argv[1]);
+            if (server.rdb_compression_codec == INT_MIN) {
+                err = "Invalid option for 'rdbcompression-codec'. Allowed "
+                    "values: 'lzf', 'lz4' or 'zstd', if Redis was built with "
+                    "USE_LZ4=yes or USE_ZSTD=yes";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"rdbchecksum") && argc == 2) {
             if ((server.rdb_checksum = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
@@ -428,6 +500,33 @@ void loadServerConfigFromString(char *config) {
             if ((server.activerehashing = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"keyspace-open-addressing") && argc == 2) {
+            if ((server.keyspace_open_addressing = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"data-hash-function") && argc == 2) {
+            server.data_hash_function =
+                configEnumGetValue(data_hash_function_enum,argv[1]);
+            if (server.data_hash_function == INT_MIN) {
+                err = "Invalid option for 'data-hash-function'. "
+                    "Allowed values: 'siphash' or 'wyhash'";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"keyspace-segmented-tables") && argc == 2) {
+            if ((server.keyspace_segmented_tables = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"keyspace-compact-entries") && argc == 2) {
+            if ((server.keyspace_compact_entries = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"prefetch-batch-max-size") && argc == 2) {
+            server.prefetch_batch_max_size = atoi(argv[1]);
+            if (server.prefetch_batch_max_size < 0 ||
+                server.prefetch_batch_max_size > CONFIG_PREFETCH_BATCH_MAX)
+            {
+                err = "Invalid prefetch batch max size"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"lazyfree-lazy-eviction") && argc == 2) {
             if ((server.lazyfree_lazy_eviction = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
@@ -596,6 +695,15 @@ void loadServerConfigFromString(char *config) {
             server.list_max_ziplist_size = atoi(argv[1]);
         } else if (!strcasecmp(argv[0],"list-compress-depth") && argc == 2) {
             server.list_compress_depth = atoi(argv[1]);
+        } else if (!strcasecmp(argv[0],"list-compress-codec") && argc == 2) {
+            server.list_compress_codec =
+                configEnumGetValue(compression_codec_enum,argv[1]);
+            if (server.list_compress_codec == INT_MIN) {
+                err = "Invalid option for 'list-compress-codec'. Allowed "
+                    "values: 'lzf', 'lz4' or 'zstd', if Redis was built with "
+                    "USE_LZ4=yes or USE_ZSTD=yes";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"set-max-intset-entries") && argc == 2) {
             server.set_max_intset_entries = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"zset-max-ziplist-entries") && argc == 2) {
@@ -1098,6 +1206,8 @@ void configSetCommand(client *c) {
       "replica-ignore-maxmemory",server.repl_slave_ignore_maxmemory) {
     } config_set_bool_field(
       "activerehashing",server.activerehashing) {
+    } config_set_bool_field(
+      "keyspace-compact-entries",server.keyspace_compact_entries) {
     } config_set_bool_field(
       "activedefrag",server.active_defrag_enabled) {
 #ifndef HAVE_DEFRAG
@@ -1115,6 +1225,8 @@ void configSetCommand(client *c) {
       "protected-mode",server.protected_mode) {
     } config_set_bool_field(
       "stop-writes-on-bgsave-error",server.stop_writes_on_bgsave_err) {
+    } config_set_bool_field(
+      "shared-query-buffer",server.shared_query_buffer) {
     } config_set_bool_field(
       "lazyfree-lazy-eviction",server.lazyfree_lazy_eviction) {
     } config_set_bool_field(
@@ -1134,8 +1246,15 @@ void configSetCommand(client *c) {
      * config_set_numerical_field(name,var,min,max) */
     } config_set_numerical_field(
       "tcp-keepalive",server.tcpkeepalive,0,INT_MAX) {
+    } config_set_numerical_field(
+      "client-pool-size",server.client_pool_size,0,INT_MAX) {
+        trimClientPool();
+    } config_set_numerical_field(
+      "prefetch-batch-max-size",server.prefetch_batch_max_size,0,CONFIG_PREFETCH_BATCH_MAX) {
     } config_set_numerical_field(
       "maxmemory-samples",server.maxmemory_samples,1,INT_MAX) {
+    } config_set_numerical_field(
+      "maxmemory-eviction-headroom",server.maxmemory_eviction_headroom,0,50) {
     } config_set_numerical_field(
       "lfu-log-factor",server.lfu_log_factor,0,INT_MAX) {
     } config_set_numerical_field(
@@ -1267,6 +1386,12 @@ void configSetCommand(client *c) {
       "maxmemory-policy",server.maxmemory_policy,maxmemory_policy_enum) {
     } config_set_enum_field(
       "appendfsync",server.aof_fsync,aof_fsync_enum) {
+    } config_set_enum_field(
+      "rdbcompression-codec",server.rdb_compression_codec,
+      compression_codec_enum) {
+    } config_set_enum_field(
+      "list-compress-codec",server.list_compress_codec,
+      compression_codec_enum) {
 
     /* Everyhing else is an error... */
     } config_set_else {
@@ -1346,6 +1471,7 @@ void configGetCommand(client *c) {
     config_get_numerical_field("proto-max-bulk-len",server.proto_max_bulk_len);
     config_get_numerical_field("client-query-buffer-limit",server.client_max_querybuf_len);
     config_get_numerical_field("maxmemory-samples",server.maxmemory_samples);
+    config_get_numerical_field("maxmemory-eviction-headroom",server.maxmemory_eviction_headroom);
     config_get_numerical_field("lfu-log-factor",server.lfu_log_factor);
     config_get_numerical_field("lfu-decay-time",server.lfu_decay_time);
     config_get_numerical_field("timeout",server.maxidletime);
@@ -1390,13 +1516,17 @@ void configGetCommand(client *c) {
     config_get_numerical_field("cluster-announce-port",server.cluster_announce_port);
     config_get_numerical_field("cluster-announce-bus-port",server.cluster_announce_bus_port);
     config_get_numerical_field("tcp-backlog",server.tcp_backlog);
+    config_get_numerical_field("tcp-listeners",server.tcp_listeners);
     config_get_numerical_field("databases",server.dbnum);
+    config_get_numerical_field("io-threads",server.io_threads_num);
     config_get_numerical_field("repl-ping-slave-period",server.repl_ping_slave_period);
     config_get_numerical_field("repl-ping-replica-period",server.repl_ping_slave_period);
     config_get_numerical_field("repl-timeout",server.repl_timeout);
     config_get_numerical_field("repl-backlog-size",server.repl_backlog_size);
     config_get_numerical_field("repl-backlog-ttl",server.repl_backlog_time_limit);
     config_get_numerical_field("maxclients",server.maxclients);
+    config_get_numerical_field("client-pool-size",server.client_pool_size);
+    config_get_numerical_field("prefetch-batch-max-size",server.prefetch_batch_max_size);
     config_get_numerical_field("watchdog-period",server.watchdog_period);
     config_get_numerical_field("slave-priority",server.slave_priority);
     config_get_numerical_field("replica-priority",server.slave_priority);
@@ -1441,8 +1571,16 @@ void configGetCommand(client *c) {
     config_get_bool_field("rdbcompression", server.rdb_compression);
     config_get_bool_field("rdbchecksum", server.rdb_checksum);
     config_get_bool_field("activerehashing", server.activerehashing);
+    config_get_bool_field("keyspace-open-addressing",
+            server.keyspace_open_addressing);
+    config_get_bool_field("keyspace-segmented-tables",
+            server.keyspace_segmented_tables);
+    config_get_bool_field("keyspace-compact-entries",
+            server.keyspace_compact_entries);
     config_get_bool_field("activedefrag", server.active_defrag_enabled);
     config_get_bool_field("protected-mode", server.protected_mode);
+    config_get_bool_field("io-threads-do-reads", server.io_threads_do_reads);
+    config_get_bool_field("shared-query-buffer", server.shared_query_buffer);
     config_get_bool_field("repl-disable-tcp-nodelay",
             server.repl_disable_tcp_nodelay);
     config_get_bool_field("repl-diskless-sync",
@@ -1475,8 +1613,14 @@ void configGetCommand(client *c) {
             server.verbosity,loglevel_enum);
     config_get_enum_field("supervised",
             server.supervised_mode,supervised_mode_enum);
+    config_get_enum_field("data-hash-function",
+            server.data_hash_function,data_hash_function_enum);
     config_get_enum_field("appendfsync",
             server.aof_fsync,aof_fsync_enum);
+    config_get_enum_field("rdbcompression-codec",
+            server.rdb_compression_codec,compression_codec_enum);
+    config_get_enum_field("list-compress-codec",
+            server.list_compress_codec,compression_codec_enum);
     config_get_enum_field("syslog-facility",
             server.syslog_facility,syslog_facility_enum);
 
@@ -2125,6 +2269,7 @@ int rewriteConfig(char *path) {
     rewriteConfigNumericalOption(state,"cluster-announce-port",server.cluster_announce_port,CONFIG_DEFAULT_CLUSTER_ANNOUNCE_PORT);
     rewriteConfigNumericalOption(state,"cluster-announce-bus-port",server.cluster_announce_bus_port,CONFIG_DEFAULT_CLUSTER_ANNOUNCE_BUS_PORT);
     rewriteConfigNumericalOption(state,"tcp-backlog",server.tcp_backlog,CONFIG_DEFAULT_TCP_BACKLOG);
+    rewriteConfigNumericalOption(state,"tcp-listeners",server.tcp_listeners,CONFIG_DEFAULT_TCP_LISTENERS);
     rewriteConfigBindOption(state);
     rewriteConfigStringOption(state,"unixsocket",server.unixsocket,NULL);
     rewriteConfigOctalOption(state,"unixsocketperm",server.unixsocketperm,CONFIG_DEFAULT_UNIX_SOCKET_PERM);
@@ -2140,6 +2285,7 @@ int rewriteConfig(char *path) {
     rewriteConfigNumericalOption(state,"databases",server.dbnum,CONFIG_DEFAULT_DBNUM);
     rewriteConfigYesNoOption(state,"stop-writes-on-bgsave-error",server.stop_writes_on_bgsave_err,CONFIG_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR);
     rewriteConfigYesNoOption(state,"rdbcompression",server.rdb_compression,CONFIG_DEFAULT_RDB_COMPRESSION);
+    rewriteConfigEnumOption(state,"rdbcompression-codec",server.rdb_compression_codec,compression_codec_enum,CONFIG_DEFAULT_RDB_COMPRESSION_CODEC);
     rewriteConfigYesNoOption(state,"rdbchecksum",server.rdb_checksum,CONFIG_DEFAULT_RDB_CHECKSUM);
     rewriteConfigStringOption(state,"dbfilename",server.rdb_filename,CONFIG_DEFAULT_RDB_FILENAME);
     rewriteConfigDirOption(state);
@@ -2162,11 +2308,13 @@ int rewriteConfig(char *path) {
     rewriteConfigNumericalOption(state,"min-replicas-max-lag",server.repl_min_slaves_max_lag,CONFIG_DEFAULT_MIN_SLAVES_MAX_LAG);
     rewriteConfigStringOption(state,"requirepass",server.requirepass,NULL);
     rewriteConfigNumericalOption(state,"maxclients",server.maxclients,CONFIG_DEFAULT_MAX_CLIENTS);
+    rewriteConfigNumericalOption(state,"client-pool-size",server.client_pool_size,CONFIG_DEFAULT_CLIENT_POOL_SIZE);
     rewriteConfigBytesOption(state,"maxmemory",server.maxmemory,CONFIG_DEFAULT_MAXMEMORY);
     rewriteConfigBytesOption(state,"proto-max-bulk-len",server.proto_max_bulk_len,CONFIG_DEFAULT_PROTO_MAX_BULK_LEN);
     rewriteConfigBytesOption(state,"client-query-buffer-limit",server.client_max_querybuf_len,PROTO_MAX_QUERYBUF_LEN);
     rewriteConfigEnumOption(state,"maxmemory-policy",server.maxmemory_policy,maxmemory_policy_enum,CONFIG_DEFAULT_MAXMEMORY_POLICY);
     rewriteConfigNumericalOption(state,"maxmemory-samples",server.maxmemory_samples,CONFIG_DEFAULT_MAXMEMORY_SAMPLES);
+    rewriteConfigNumericalOption(state,"maxmemory-eviction-headroom",server.maxmemory_eviction_headroom,CONFIG_DEFAULT_MAXMEMORY_EVICTION_HEADROOM);
     rewriteConfigNumericalOption(state,"lfu-log-factor",server.lfu_log_factor,CONFIG_DEFAULT_LFU_LOG_FACTOR);
     rewriteConfigNumericalOption(state,"lfu-decay-time",server.lfu_decay_time,CONFIG_DEFAULT_LFU_DECAY_TIME);
     rewriteConfigNumericalOption(state,"active-defrag-threshold-lower",server.active_defrag_threshold_lower,CONFIG_DEFAULT_DEFRAG_THRESHOLD_LOWER);
@@ -2199,13 +2347,22 @@ int rewriteConfig(char *path) {
     rewriteConfigNumericalOption(state,"stream-node-max-entries",server.stream_node_max_entries,OBJ_STREAM_NODE_MAX_ENTRIES);
     rewriteConfigNumericalOption(state,"list-max-ziplist-size",server.list_max_ziplist_size,OBJ_LIST_MAX_ZIPLIST_SIZE);
     rewriteConfigNumericalOption(state,"list-compress-depth",server.list_compress_depth,OBJ_LIST_COMPRESS_DEPTH);
+    rewriteConfigEnumOption(state,"list-compress-codec",server.list_compress_codec,compression_codec_enum,OBJ_LIST_COMPRESS_CODEC);
     rewriteConfigNumericalOption(state,"set-max-intset-entries",server.set_max_intset_entries,OBJ_SET_MAX_INTSET_ENTRIES);
     rewriteConfigNumericalOption(state,"zset-max-ziplist-entries",server.zset_max_ziplist_entries,OBJ_ZSET_MAX_ZIPLIST_ENTRIES);
     rewriteConfigNumericalOption(state,"zset-max-ziplist-value",server.zset_max_ziplist_value,OBJ_ZSET_MAX_ZIPLIST_VALUE);
     rewriteConfigNumericalOption(state,"hll-sparse-max-bytes",server.hll_sparse_max_bytes,CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES);
     rewriteConfigYesNoOption(state,"activerehashing",server.activerehashing,CONFIG_DEFAULT_ACTIVE_REHASHING);
+    rewriteConfigYesNoOption(state,"keyspace-open-addressing",server.keyspace_open_addressing,CONFIG_DEFAULT_KEYSPACE_OPEN_ADDRESSING);
+    rewriteConfigYesNoOption(state,"keyspace-segmented-tables",server.keyspace_segmented_tables,CONFIG_DEFAULT_KEYSPACE_SEGMENTED_TABLES);
+    rewriteConfigEnumOption(state,"data-hash-function",server.data_hash_function,data_hash_function_enum,CONFIG_DEFAULT_DATA_HASH_FUNCTION);
+    rewriteConfigYesNoOption(state,"keyspace-compact-entries",server.keyspace_compact_entries,CONFIG_DEFAULT_KEYSPACE_COMPACT_ENTRIES);
+    rewriteConfigNumericalOption(state,"prefetch-batch-max-size",server.prefetch_batch_max_size,CONFIG_DEFAULT_PREFETCH_BATCH_MAX_SIZE);
     rewriteConfigYesNoOption(state,"activedefrag",server.active_defrag_enabled,CONFIG_DEFAULT_ACTIVE_DEFRAG);
     rewriteConfigYesNoOption(state,"protected-mode",server.protected_mode,CONFIG_DEFAULT_PROTECTED_MODE);
+    rewriteConfigNumericalOption(state,"io-threads",server.io_threads_num,CONFIG_DEFAULT_IO_THREADS_NUM);
+    rewriteConfigYesNoOption(state,"io-threads-do-reads",server.io_threads_do_reads,CONFIG_DEFAULT_IO_THREADS_DO_READS);
+    rewriteConfigYesNoOption(state,"shared-query-buffer",server.shared_query_buffer,CONFIG_DEFAULT_SHARED_QUERY_BUFFER);
     rewriteConfigClientoutputbufferlimitOption(state);
     rewriteConfigNumericalOption(state,"hz",server.config_hz,CONFIG_DEFAULT_HZ);
     rewriteConfigYesNoOption(state,"aof-rewrite-incremental-fsync",server.aof_rewrite_incremental_fsync,CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC);
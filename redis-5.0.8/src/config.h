@@ -76,6 +76,11 @@
 /* Test for polling API */
 #ifdef __linux__
 #define HAVE_EPOLL 1
+/* io_uring is opt-in at build time (make USE_IO_URING=yes), the backend
+ * falls back to epoll at runtime if the kernel does not support it. */
+#ifdef USE_IO_URING
+#define HAVE_IO_URING 1
+#endif
 #endif
 
 #if (defined(__APPLE__) && defined(MAC_OS_X_VERSION_10_6)) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined (__NetBSD__)
@@ -89,6 +94,20 @@
 #endif
 #endif
 
+/* Test for accept4(), that sets the flags of the accepted socket without
+ * additional fcntl() calls. */
+#if defined(__linux__) || defined(__FreeBSD__)
+#define HAVE_ACCEPT4 1
+#endif
+
+/* Define redis_prefetch() to load a memory location in the CPU cache ahead of
+ * its use, where the compiler supports it. */
+#if defined(__GNUC__)
+#define redis_prefetch(addr) __builtin_prefetch(addr)
+#else
+#define redis_prefetch(addr) ((void)(addr))
+#endif
+
 /* Define redis_fsync to fdatasync() in Linux and fsync() for all the rest */
 #ifdef __linux__
 #define redis_fsync fdatasync
@@ -34,6 +34,248 @@
 #include <signal.h>
 #include <ctype.h>
 
+/*-----------------------------------------------------------------------------
+ * Keyspace tables
+ *----------------------------------------------------------------------------*/
+
+/* Create the keyspace of 'db' as 'numdicts' tables of the specified type.
+ * With more than one table keys are distributed by hash slot, so 'numdicts'
+ * must be CLUSTER_SLOTS: in cluster mode the keys of a slot are then
+ * counted, listed and deleted accessing just the table of the slot. */
+void dbCreateDicts(redisDb *db, dictType *type, int numdicts) {
+    int j;
+
+    db->dicts = zmalloc(sizeof(dict*)*numdicts);
+    for (j = 0; j < numdicts; j++) db->dicts[j] = dictCreate(type,NULL);
+    db->numdicts = numdicts;
+    db->dicts_index = (numdicts == 1) ? NULL :
+                      zcalloc(sizeof(unsigned long)*(numdicts+1));
+    db->dicts_pending = (numdicts == 1) ? NULL :
+                        zmalloc(sizeof(int)*numdicts);
+    db->numpending = 0;
+    db->dicts_queued = (numdicts == 1) ? NULL : zcalloc(numdicts);
+    db->rehash_cursor = 0;
+}
+
+/* Account for 'delta' keys added to the table 'didx' (removed if negative).
+ * Must be called every time keys are added or removed from a table. */
+void dbUpdateDictSize(redisDb *db, int didx, long delta) {
+    unsigned long j;
+
+    if (db->dicts_index == NULL) return;
+    for (j = didx+1; j <= (unsigned long)db->numdicts; j += j & -j)
+        db->dicts_index[j] += delta;
+
+    /* Adding or removing keys is what makes a table start rehashing or
+     * need a resize: remember the table for the cron. */
+    if (!db->dicts_queued[didx]) {
+        db->dicts_queued[didx] = 1;
+        db->dicts_pending[db->numpending++] = didx;
+    }
+}
+
+/* Reset the keys accounting after all the tables were emptied. */
+void dbResetDictsSize(redisDb *db) {
+    if (db->dicts_index == NULL) return;
+    memset(db->dicts_index,0,sizeof(unsigned long)*(db->numdicts+1));
+}
+
+/* Return the number of keys in the tables from 0 to 'didx' included. */
+static unsigned long dbCountKeysUpTo(redisDb *db, int didx) {
+    unsigned long j, count = 0;
+
+    for (j = didx+1; j > 0; j -= j & -j) count += db->dicts_index[j];
+    return count;
+}
+
+/* Return the number of keys in the DB. */
+unsigned long long dbSize(redisDb *db) {
+    if (db->numdicts == 1) return dictSize(db->dicts[0]);
+    return dbCountKeysUpTo(db,db->numdicts-1);
+}
+
+/* Return the number of buckets of all the tables of the DB. */
+unsigned long long dbBuckets(redisDb *db) {
+    unsigned long long buckets = 0;
+    int j;
+
+    for (j = 0; j < db->numdicts; j++) buckets += dictSlots(db->dicts[j]);
+    return buckets;
+}
+
+/* Return the table holding the key at position 'idx' of the keyspace, when
+ * the keys are ordered by table, so 'idx' must be less than dbSize(). */
+int dbFindDictByKeyIndex(redisDb *db, unsigned long idx) {
+    int pos = 0, step = 1;
+
+    if (db->numdicts == 1) return 0;
+    while (step*2 <= db->numdicts) step *= 2;
+    for (; step; step /= 2) {
+        if (pos+step <= db->numdicts && db->dicts_index[pos+step] <= idx) {
+            pos += step;
+            idx -= db->dicts_index[pos];
+        }
+    }
+    return pos;
+}
+
+/* Return a table of the DB picked at random with a probability proportional
+ * to the number of keys it holds, or NULL if the DB is empty. */
+static dict *dbRandomDict(redisDb *db) {
+    unsigned long long size = dbSize(db);
+    unsigned long idx;
+
+    if (size == 0) return NULL;
+    if (db->numdicts == 1) return db->dicts[0];
+    idx = random();
+    if (size > RAND_MAX) idx = (idx << 31) | random();
+    return db->dicts[dbFindDictByKeyIndex(db,idx % size)];
+}
+
+/* Return a random entry of the keyspace, or NULL if the DB is empty. */
+dictEntry *dbRandomEntry(redisDb *db) {
+    dict *d = dbRandomDict(db);
+
+    return d ? dictGetRandomKey(d) : NULL;
+}
+
+/* Like dictGetSomeKeys() for the keyspace. With multiple tables all the
+ * entries are sampled from a single table picked at random. */
+unsigned int dbGetSomeEntries(redisDb *db, dictEntry **des, unsigned int count) {
+    dict *d = dbRandomDict(db);
+
+    return d ? dictGetSomeKeys(d,des,count) : 0;
+}
+
+static dbIterator *dbGetGenericIterator(redisDb *db, int safe) {
+    dbIterator *iter = zmalloc(sizeof(*iter));
+
+    iter->db = db;
+    iter->didx = -1;
+    iter->safe = safe;
+    iter->di = NULL;
+    return iter;
+}
+
+/* Iterators over all the keys of the DB, see dictGetIterator() and
+ * dictGetSafeIterator() for the difference between the two. */
+dbIterator *dbGetIterator(redisDb *db) {
+    return dbGetGenericIterator(db,0);
+}
+
+dbIterator *dbGetSafeIterator(redisDb *db) {
+    return dbGetGenericIterator(db,1);
+}
+
+dictEntry *dbIteratorNext(dbIterator *iter) {
+    redisDb *db = iter->db;
+    dictEntry *de;
+
+    while(1) {
+        if (iter->di) {
+            if ((de = dictNext(iter->di)) != NULL) return de;
+            dictReleaseIterator(iter->di);
+            iter->di = NULL;
+        }
+        /* Move to the next non empty table. */
+        do {
+            if (iter->didx+1 >= db->numdicts) {
+                iter->didx = db->numdicts;
+                return NULL;
+            }
+            iter->didx++;
+        } while (dictSize(db->dicts[iter->didx]) == 0);
+        iter->di = iter->safe ? dictGetSafeIterator(db->dicts[iter->didx]) :
+                                dictGetIterator(db->dicts[iter->didx]);
+    }
+}
+
+void dbReleaseIterator(dbIterator *iter) {
+    if (iter->di) dictReleaseIterator(iter->di);
+    zfree(iter);
+}
+
+/* Like dictScan() for the keyspace. With multiple tables the index of the
+ * table being scanned is stored in the low bits of the cursor, and the
+ * cursor of the table in the remaining bits: once a table is completely
+ * scanned the cursor moves to the start of the next non empty table. */
+unsigned long dbScan(redisDb *db, unsigned long cursor,
+                     dictScanFunction *fn, dictScanBucketFunction *bucketfn,
+                     void *privdata)
+{
+    int bits = 0, didx;
+    unsigned long before;
+
+    while ((1 << bits) < db->numdicts) bits++;
+    didx = cursor & ((1UL << bits)-1);
+    cursor = dictScan(db->dicts[didx],cursor >> bits,fn,bucketfn,privdata);
+    if (cursor == 0) {
+        if (db->numdicts == 1) return 0;
+        before = dbCountKeysUpTo(db,didx);
+        if (before == dbSize(db)) return 0;
+        didx = dbFindDictByKeyIndex(db,before);
+    }
+    return (cursor << bits) | didx;
+}
+
+/* Expand the keyspace so that it can hold 'size' keys without rehashing.
+ * With multiple tables nothing is done, since we can't know how the keys
+ * will be distributed among them. */
+void dbExpandDicts(redisDb *db, unsigned long size) {
+    if (db->numdicts == 1) dictExpand(db->dicts[0],size);
+}
+
+/* Remove all the keys of the DB, see dictEmpty() for 'callback'. */
+void dbEmptyDicts(redisDb *db, void(callback)(void*)) {
+    int j;
+
+    for (j = 0; j < db->numdicts; j++) {
+        if (dictSize(db->dicts[j])) dictEmpty(db->dicts[j],callback);
+    }
+    dbResetDictsSize(db);
+}
+
+/* Memory used by the tables of the keyspace, see dictMemUsage(). */
+size_t dbDictsMemUsage(redisDb *db) {
+    size_t usage = 0;
+    int j;
+
+    for (j = 0; j < db->numdicts; j++) usage += dictMemUsage(db->dicts[j]);
+    if (db->numdicts > 1) {
+        usage += db->numdicts*(sizeof(dict*)+sizeof(dict)) +
+                 (db->numdicts+1)*sizeof(unsigned long);
+    }
+    return usage;
+}
+
+/* Memory used by the old tables of the keyspace tables being rehashed. */
+size_t dbDictsRehashingOverhead(redisDb *db) {
+    size_t overhead = 0;
+    int j;
+
+    for (j = 0; j < db->numdicts; j++)
+        overhead += dictRehashingOverhead(db->dicts[j]);
+    return overhead;
+}
+
+/* Write the stats of the keyspace tables in 'buf', see dictGetStats(). With
+ * multiple tables only a summary is reported. */
+void dbGetDictsStats(char *buf, size_t bufsize, redisDb *db) {
+    int j, nonempty = 0;
+
+    if (db->numdicts == 1) {
+        dictGetStats(buf,bufsize,db->dicts[0]);
+        return;
+    }
+    for (j = 0; j < db->numdicts; j++)
+        if (dictSize(db->dicts[j])) nonempty++;
+    snprintf(buf,bufsize,
+        "Hash table per slot: %d tables, %d not empty\n"
+        " number of elements: %llu\n"
+        " number of buckets: %llu\n",
+        db->numdicts, nonempty, dbSize(db), dbBuckets(db));
+}
+
 /*-----------------------------------------------------------------------------
  * C-level DB API
  *----------------------------------------------------------------------------*/
@@ -49,27 +291,33 @@ void updateLFU(robj *val) {
     val->lru = (LFUGetTimeInMinutes()<<8) | counter;
 }
 
+/* Update the access time of the value 'val' of a key that was looked up,
+ * according to the lookup flags. */
+static void touchValue(robj *val, int flags) {
+    /* Update the access time for the ageing algorithm.
+     * Don't do it if we have a saving child, as this will trigger
+     * a copy on write madness. */
+    if (server.rdb_child_pid == -1 &&
+        server.aof_child_pid == -1 &&
+        !(flags & LOOKUP_NOTOUCH))
+    {
+        if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
+            updateLFU(val);
+        } else {
+            val->lru = LRU_CLOCK();
+        }
+    }
+}
+
 /* Low level key lookup API, not actually called directly from commands
  * implementations that should instead rely on lookupKeyRead(),
  * lookupKeyWrite() and lookupKeyReadWithFlags(). */
 robj *lookupKey(redisDb *db, robj *key, int flags) {
-    dictEntry *de = dictFind(db->dict,key->ptr);
+    dictEntry *de = dictFind(dbDictForKey(db,key->ptr),key->ptr);
     if (de) {
         robj *val = dictGetVal(de);
 
-        /* Update the access time for the ageing algorithm.
-         * Don't do it if we have a saving child, as this will trigger
-         * a copy on write madness. */
-        if (server.rdb_child_pid == -1 &&
-            server.aof_child_pid == -1 &&
-            !(flags & LOOKUP_NOTOUCH))
-        {
-            if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
-                updateLFU(val);
-            } else {
-                val->lru = LRU_CLOCK();
-            }
-        }
+        touchValue(val,flags);
         return val;
     } else {
         return NULL;
@@ -98,9 +346,14 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
  * correctly report a key is expired on slaves even if the master is lagging
  * expiring our key via DELs in the replication link. */
 robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags) {
-    robj *val;
+    dict *d = dbDictForKey(db,key->ptr);
+    dictEntry *de = dictFind(d,key->ptr);
 
-    if (expireIfNeeded(db,key) == 1) {
+    /* The expire time is stored with the key name, so there is no need for
+     * another lookup unless the key is actually expired. */
+    if (de && expireTimeReached(keyGetExpire((sds)dictGetKey(de))) &&
+        expireIfNeeded(db,key) == 1)
+    {
         /* Key expired. If we are in the context of a master, expireIfNeeded()
          * returns 0 only when the key does not exist at all, so it's safe
          * to return NULL ASAP. */
@@ -129,12 +382,27 @@ robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags) {
             server.stat_keyspace_misses++;
             return NULL;
         }
+
+        /* expireIfNeeded() looked up the key again, and the rehashing step
+         * of that lookup may have moved the entry: find it again. */
+        de = dictFind(d,key->ptr);
     }
-    val = lookupKey(db,key,flags);
-    if (val == NULL)
+    if (de == NULL) {
         server.stat_keyspace_misses++;
-    else
-        server.stat_keyspace_hits++;
+        return NULL;
+    }
+
+    /* Expire the fields of the hash that reached their TTL. The hash itself
+     * is deleted if no field is left. */
+    robj *val = dictGetVal(de);
+    if (val->type == OBJ_HASH && dictSize(db->hexpires) &&
+        hashTypeExpireFields(db,key,val))
+    {
+        server.stat_keyspace_misses++;
+        return NULL;
+    }
+    server.stat_keyspace_hits++;
+    touchValue(val,flags);
     return val;
 }
 
@@ -150,8 +418,21 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
  * Returns the linked value object if the key exists or NULL if the key
  * does not exist in the specified DB. */
 robj *lookupKeyWrite(redisDb *db, robj *key) {
-    expireIfNeeded(db,key);
-    return lookupKey(db,key,LOOKUP_NONE);
+    dict *d = dbDictForKey(db,key->ptr);
+    dictEntry *de = dictFind(d,key->ptr);
+
+    if (de == NULL) return NULL;
+    if (expireTimeReached(keyGetExpire((sds)dictGetKey(de))) &&
+        expireIfNeeded(db,key) == 1)
+    {
+        /* Deleted, unless we are a slave. */
+        if ((de = dictFind(d,key->ptr)) == NULL) return NULL;
+    }
+    robj *val = dictGetVal(de);
+    if (val->type == OBJ_HASH && dictSize(db->hexpires) &&
+        hashTypeExpireFields(db,key,val)) return NULL;
+    touchValue(val,LOOKUP_NONE);
+    return val;
 }
 
 robj *lookupKeyReadOrReply(client *c, robj *key, robj *reply) {
@@ -166,19 +447,125 @@ robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply) {
     return o;
 }
 
-/* Add the key to the DB. It's up to the caller to increment the reference
- * counter of the value if needed.
+/* Called by dictPrefetch() with the values of the main dictionary: for
+ * raw strings the payload lives in a separate allocation. */
+static void dbPrefetchValue(const void *val) {
+    const robj *o = val;
+
+    if (o->type == OBJ_STRING && o->encoding == OBJ_ENCODING_RAW)
+        redis_prefetch(o->ptr);
+}
+
+/* Prefetch the memory needed to look up the keys 'keys' of length 'lens',
+ * including their values. The expires are stored with the key names, so
+ * they are prefetched as well. See dictPrefetch() for more information. */
+void dbPrefetchKeys(redisDb *db, char **keys, size_t *lens, int count) {
+    dict *dicts[CONFIG_PREFETCH_BATCH_MAX];
+    uint64_t hashes[CONFIG_PREFETCH_BATCH_MAX];
+    int j;
+
+    for (j = 0; j < count; j++) {
+        dicts[j] = db->numdicts == 1 ? db->dicts[0] :
+                   db->dicts[keyHashSlot(keys[j],lens[j])];
+        hashes[j] = dictGenDataHashFunction(keys[j],lens[j]);
+    }
+    dictPrefetch(dicts,hashes,count,dbPrefetchValue);
+}
+
+/* Commands accessing many keys call this function for every key argument
+ * 'j', where 'first' is the index of the first key and 'step' the distance
+ * between two keys. Every prefetch-batch-max-size keys the next batch is
+ * prefetched, so that the lookups performed by the command hit the cache. */
+void prefetchCommandKeys(client *c, int first, int j, int step) {
+    char *keys[CONFIG_PREFETCH_BATCH_MAX];
+    size_t lens[CONFIG_PREFETCH_BATCH_MAX];
+    int batch = server.prefetch_batch_max_size, count = 0;
+
+    if (batch == 0 || ((j-first)/step) % batch != 0) return;
+    for (; j < c->argc && count < batch; j += step) {
+        keys[count] = c->argv[j]->ptr;
+        lens[count++] = sdslen(c->argv[j]->ptr);
+    }
+    if (count > 1) dbPrefetchKeys(c->db,keys,lens,count);
+}
+
+/* Create a copy of the key name 'key' with a keyExpire header, to be used
+ * as key of an entry of the main dict. The key has no expire set. */
+static sds createKeyWithExpire(sds key) {
+    sds copy = sdsnewprefixed(sizeof(keyExpire),key,sdslen(key));
+    keyExpire *ke = keyExpireHeader(copy);
+
+    copy[-1] |= KEY_EXPIRE_SDS_FLAG;
+    ke->when = -1;
+    ke->pos = 0;
+    return copy;
+}
+
+/* Return the key name to use for the entry of 'key' in the main dict when
+ * its value is 'val': the name embedded in the value if it is the same key,
+ * otherwise a copy of the key name. If 'expiring' is true the name must
+ * have a keyExpire header, see setExpire(). */
+static sds dbEntryKey(robj *key, robj *val, int expiring) {
+    sds embkey = objectEmbeddedKey(val);
+
+    if (embkey && (!expiring || val->embexpire) &&
+        sdscmp(embkey,key->ptr) == 0)
+    {
+        if (val->embexpire) keyExpireHeader(embkey)->when = -1;
+        return embkey;
+    }
+    return expiring ? createKeyWithExpire(key->ptr) : sdsdup(key->ptr);
+}
+
+/* When keyspace-compact-entries is enabled, return a compact copy of the
+ * string 'val' having 'key' embedded (see createCompactObject()), to be
+ * used as value of 'key', and release the reference of the caller to 'val'.
+ * Otherwise, or if the value is not small enough, 'val' is returned as it
+ * is. Shared integers are returned as they are too: they take no memory at
+ * all, while embedding the key would need an object header. Used by the
+ * commands creating string values, like:
  *
- * The program is aborted if the key already exists. */
-void dbAdd(redisDb *db, robj *key, robj *val) {
-    sds copy = sdsdup(key->ptr);
-    int retval = dictAdd(db->dict, copy, val);
+ *    val = dbCompactValue(key,val,0);
+ *    dbAdd(db,key,val);
+ *
+ * 'withexpire' should be true if the key is going to have an expire set,
+ * so that the embedded key name has room for it. */
+robj *dbCompactValue(robj *key, robj *val, int withexpire) {
+    robj *o;
+
+    if (!server.keyspace_compact_entries ||
+        val->refcount == OBJ_SHARED_REFCOUNT) return val;
+    if ((o = createCompactObject(key->ptr,val,withexpire)) == NULL)
+        return val;
+    decrRefCount(val);
+    return o;
+}
+
+static void dbAddGeneric(redisDb *db, robj *key, robj *val, int expiring) {
+    sds copy = dbEntryKey(key,val,expiring);
+    int didx = dbDictIndex(db,key->ptr);
+    int retval = dictAdd(db->dicts[didx], copy, val);
 
     serverAssertWithInfo(NULL,key,retval == DICT_OK);
+    dbUpdateDictSize(db,didx,1);
     if (val->type == OBJ_LIST ||
         val->type == OBJ_ZSET)
         signalKeyAsReady(db, key);
-    if (server.cluster_enabled) slotToKeyAdd(key);
+}
+
+/* Add the key to the DB. It's up to the caller to increment the reference
+ * counter of the value if needed.
+ *
+ * The program is aborted if the key already exists. */
+void dbAdd(redisDb *db, robj *key, robj *val) {
+    dbAddGeneric(db,key,val,0);
+}
+
+/* Like dbAdd(), for keys the caller is going to set an expire on right
+ * after: the key name is created with room for it, so that setExpire()
+ * does not need to move it. */
+void dbAddExpiring(redisDb *db, robj *key, robj *val) {
+    dbAddGeneric(db,key,val,1);
 }
 
 /* Overwrite an existing key with a new value. Incrementing the reference
@@ -187,45 +574,77 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
  *
  * The program is aborted if the key was not already present. */
 void dbOverwrite(redisDb *db, robj *key, robj *val) {
-    dictEntry *de = dictFind(db->dict,key->ptr);
+    dict *d = dbDictForKey(db,key->ptr);
+    dictEntry *de = dictFind(d,key->ptr);
 
     serverAssertWithInfo(NULL,key,de != NULL);
-    dictEntry auxentry = *de;
+    dictEntry auxentry;
     robj *old = dictGetVal(de);
+    sds oldkey = dictGetKey(de), newkey = oldkey, embkey = objectEmbeddedKey(val);
+    long long when = keyGetExpire(oldkey);
+    /* Entries of open addressing dicts only have room for the key and the
+     * value, so don't copy the whole dictEntry. */
+    auxentry.v.val = old;
+    if (old->type == OBJ_HASH) hashTypeDeleteFieldExpires(db,key->ptr);
     if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
         val->lru = old->lru;
     }
-    dictSetVal(db->dict, de, val);
+
+    /* The key name may be embedded in the old value, or the new value may
+     * carry its own copy: in both cases the entry of the main dict and the
+     * expire index must reference the new name, that takes the expire of
+     * the key, before the old value is released. */
+    if (embkey && (when == -1 || val->embexpire) &&
+        sdscmp(embkey,key->ptr) == 0)
+        newkey = embkey;
+    else if (isEmbeddedKey(oldkey))
+        newkey = when == -1 ? sdsdup(key->ptr) : createKeyWithExpire(key->ptr);
+    if (newkey != oldkey) {
+        dictSetKey(d, de, newkey);
+        if (keyHasExpireHeader(newkey)) keyExpireHeader(newkey)->when = when;
+        if (when != -1) expireIndexReplace(db->expires,oldkey,newkey);
+        dictKeyspaceKeyDestructor(NULL,oldkey);
+    }
+    dictSetVal(d, de, val);
 
     if (server.lazyfree_lazy_server_del) {
         freeObjAsync(old);
-        dictSetVal(db->dict, &auxentry, NULL);
+        dictSetVal(d, &auxentry, NULL);
     }
 
-    dictFreeVal(db->dict, &auxentry);
+    dictFreeVal(d, &auxentry);
 }
 
 /* High level Set operation. This function can be used in order to set
  * a key, whatever it was existing or not, to a new object.
  *
- * 1) The ref count of the value object is incremented.
+ * 1) The ref count of the value object is incremented, unless a compact
+ *    copy of it is stored instead (see dbCompactValue()).
  * 2) clients WATCHing for the destination key notified.
  * 3) The expire time of the key is reset (the key is made persistent).
  *
- * All the new keys in the database should be created via this interface. */
-void setKey(redisDb *db, robj *key, robj *val) {
+ * All the new keys in the database should be created via this interface.
+ *
+ * When 'expiring' is true the caller is going to set an expire on the key
+ * right after, so the key name is created with room for it. */
+void genericSetKey(redisDb *db, robj *key, robj *val, int expiring) {
+    incrRefCount(val);
+    val = dbCompactValue(key,val,expiring);
     if (lookupKeyWrite(db,key) == NULL) {
-        dbAdd(db,key,val);
+        dbAddGeneric(db,key,val,expiring);
     } else {
         dbOverwrite(db,key,val);
+        removeExpire(db,key);
     }
-    incrRefCount(val);
-    removeExpire(db,key);
     signalModifiedKey(db,key);
 }
 
+void setKey(redisDb *db, robj *key, robj *val) {
+    genericSetKey(db,key,val,0);
+}
+
 int dbExists(redisDb *db, robj *key) {
-    return dictFind(db->dict,key->ptr) != NULL;
+    return dictFind(dbDictForKey(db,key->ptr),key->ptr) != NULL;
 }
 
 /* Return a random key, in form of a Redis object.
@@ -235,18 +654,18 @@ int dbExists(redisDb *db, robj *key) {
 robj *dbRandomKey(redisDb *db) {
     dictEntry *de;
     int maxtries = 100;
-    int allvolatile = dictSize(db->dict) == dictSize(db->expires);
+    int allvolatile = dbSize(db) == expireIndexSize(db->expires);
 
     while(1) {
         sds key;
         robj *keyobj;
 
-        de = dictGetRandomKey(db->dict);
+        de = dbRandomEntry(db);
         if (de == NULL) return NULL;
 
         key = dictGetKey(de);
         keyobj = createStringObject(key,sdslen(key));
-        if (dictFind(db->expires,key)) {
+        if (keyGetExpire(key) != -1) {
             if (allvolatile && server.masterhost && --maxtries == 0) {
                 /* If the DB is composed only of keys with an expire set,
                  * it could happen that all the keys are already logically
@@ -269,11 +688,16 @@ robj *dbRandomKey(redisDb *db) {
 
 /* Delete a key, value, and associated expiration entry if any, from the DB */
 int dbSyncDelete(redisDb *db, robj *key) {
-    /* Deleting an entry from the expires dict will not free the sds of
-     * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
-    if (dictDelete(db->dict,key->ptr) == DICT_OK) {
-        if (server.cluster_enabled) slotToKeyDel(key);
+    int didx = dbDictIndex(db,key->ptr);
+    dictEntry *de = dictUnlink(db->dicts[didx],key->ptr);
+
+    if (de) {
+        robj *val = dictGetVal(de);
+
+        if (val->type == OBJ_HASH) hashTypeDeleteFieldExpires(db,key->ptr);
+        dbUpdateDictSize(db,didx,-1);
+        dbRemoveKeyExpire(db,dictGetKey(de));
+        dictFreeUnlinkedEntry(db->dicts[didx],de);
         return 1;
     } else {
         return 0;
@@ -357,19 +781,13 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
     }
 
     for (int j = startdb; j <= enddb; j++) {
-        removed += dictSize(server.db[j].dict);
+        removed += dbSize(&server.db[j]);
         if (async) {
             emptyDbAsync(&server.db[j]);
         } else {
-            dictEmpty(server.db[j].dict,callback);
-            dictEmpty(server.db[j].expires,callback);
-        }
-    }
-    if (server.cluster_enabled) {
-        if (async) {
-            slotToKeyFlushAsync();
-        } else {
-            slotToKeyFlush();
+            expireIndexEmpty(server.db[j].expires);
+            hashTypeEmptyFieldExpires(&server.db[j]);
+            dbEmptyDicts(&server.db[j],callback);
         }
     }
     if (dbnum == -1) flushSlaveKeysWithExpireList();
@@ -498,6 +916,7 @@ void existsCommand(client *c) {
     int j;
 
     for (j = 1; j < c->argc; j++) {
+        prefetchCommandKeys(c,1,j,1);
         if (lookupKeyRead(c->db,c->argv[j])) count++;
     }
     addReplyLongLong(c,count);
@@ -534,16 +953,16 @@ void randomkeyCommand(client *c) {
 }
 
 void keysCommand(client *c) {
-    dictIterator *di;
+    dbIterator *di;
     dictEntry *de;
     sds pattern = c->argv[1]->ptr;
     int plen = sdslen(pattern), allkeys;
     unsigned long numkeys = 0;
     void *replylen = addDeferredMultiBulkLength(c);
 
-    di = dictGetSafeIterator(c->db->dict);
+    di = dbGetSafeIterator(c->db);
     allkeys = (pattern[0] == '*' && plen == 1);
-    while((de = dictNext(di)) != NULL) {
+    while((de = dbIteratorNext(di)) != NULL) {
         sds key = dictGetKey(de);
         robj *keyobj;
 
@@ -556,7 +975,7 @@ void keysCommand(client *c) {
             decrRefCount(keyobj);
         }
     }
-    dictReleaseIterator(di);
+    dbReleaseIterator(di);
     setDeferredMultiBulkLength(c,replylen,numkeys);
 }
 
@@ -671,16 +1090,16 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
 
     /* Step 2: Iterate the collection.
      *
-     * Note that if the object is encoded with a ziplist, intset, or any other
+     * Note that if the object is encoded with a listpack, intset, or any other
      * representation that is not a hash table, we are sure that it is also
      * composed of a small number of elements. So to avoid taking state we
      * just return everything inside the object in a single call, setting the
      * cursor to zero to signal the end of the iteration. */
 
-    /* Handle the case of a hash table. */
+    /* Handle the case of a hash table, or of the keyspace. */
     ht = NULL;
     if (o == NULL) {
-        ht = c->db->dict;
+        /* The keyspace may be made of many tables, see dbScan(). */
     } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_HT) {
         ht = o->ptr;
     } else if (o->type == OBJ_HASH && o->encoding == OBJ_ENCODING_HT) {
@@ -692,7 +1111,7 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         count *= 2; /* We return key / value for this type. */
     }
 
-    if (ht) {
+    if (o == NULL || ht) {
         void *privdata[2];
         /* We set the max number of iterations to ten times the specified
          * COUNT, so if the hash table is in a pathological state (very
@@ -706,7 +1125,10 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         privdata[0] = keys;
         privdata[1] = o;
         do {
-            cursor = dictScan(ht, cursor, scanCallback, NULL, privdata);
+            if (o == NULL)
+                cursor = dbScan(c->db, cursor, scanCallback, NULL, privdata);
+            else
+                cursor = dictScan(ht, cursor, scanCallback, NULL, privdata);
         } while (cursor &&
               maxiterations-- &&
               listLength(keys) < (unsigned long)count);
@@ -718,17 +1140,17 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
             listAddNodeTail(keys,createStringObjectFromLongLong(ll));
         cursor = 0;
     } else if (o->type == OBJ_HASH || o->type == OBJ_ZSET) {
-        unsigned char *p = ziplistIndex(o->ptr,0);
+        unsigned char *p = lpFirst(o->ptr);
         unsigned char *vstr;
         unsigned int vlen;
         long long vll;
 
         while(p) {
-            ziplistGet(p,&vstr,&vlen,&vll);
+            vstr = lpGetValue(p,&vlen,&vll);
             listAddNodeTail(keys,
                 (vstr != NULL) ? createStringObject((char*)vstr,vlen) :
                                  createStringObjectFromLongLong(vll));
-            p = ziplistNext(o->ptr,p);
+            p = lpNext(o->ptr,p);
         }
         cursor = 0;
     } else {
@@ -760,6 +1182,17 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         /* Filter element if it is an expired key. */
         if (!filter && o == NULL && expireIfNeeded(c->db, kobj)) filter = 1;
 
+        /* Filter element if it is an expired field of a hash, that slaves
+         * don't delete on their own. */
+        if (!filter && o && o->type == OBJ_HASH &&
+            dictSize(c->db->hexpires))
+        {
+            robj *field = getDecodedObject(kobj);
+            if (hashTypeFieldIsExpired(c->db,c->argv[1]->ptr,field->ptr))
+                filter = 1;
+            decrRefCount(field);
+        }
+
         /* Remove the element and its associted value if needed. */
         if (filter) {
             decrRefCount(kobj);
@@ -806,7 +1239,7 @@ void scanCommand(client *c) {
 }
 
 void dbsizeCommand(client *c) {
-    addReplyLongLong(c,dictSize(c->db->dict));
+    addReplyLongLong(c,dbSize(c->db));
 }
 
 void lastsaveCommand(client *c) {
@@ -869,6 +1302,7 @@ void shutdownCommand(client *c) {
 void renameGenericCommand(client *c, int nx) {
     robj *o;
     long long expire;
+    hashFieldExpires *hfe = NULL;
     int samekey = 0;
 
     /* When source and dest key is the same, no operation is performed,
@@ -895,8 +1329,24 @@ void renameGenericCommand(client *c, int nx) {
          * with the same name. */
         dbDelete(c->db,c->argv[2]);
     }
-    dbAdd(c->db,c->argv[2],o);
-    if (expire != -1) setExpire(c,c->db,c->argv[2],expire);
+    /* The expires of the fields of a hash follow it. */
+    if (o->type == OBJ_HASH)
+        hfe = hashTypeDetachFieldExpires(c->db,c->argv[1]->ptr);
+    /* A value having the source key name embedded is copied, so that the
+     * destination key is stored in the compact format as well. */
+    if (o->embkey) {
+        unsigned lru = o->lru;
+
+        o = dbCompactValue(c->argv[2],o,expire != -1);
+        o->lru = lru;
+    }
+    if (expire != -1) {
+        dbAddExpiring(c->db,c->argv[2],o);
+        setExpire(c,c->db,c->argv[2],expire);
+    } else {
+        dbAdd(c->db,c->argv[2],o);
+    }
+    if (hfe) hashTypeAttachFieldExpires(c->db,c->argv[2]->ptr,hfe);
     dbDelete(c->db,c->argv[1]);
     signalModifiedKey(c->db,c->argv[1]);
     signalModifiedKey(c->db,c->argv[2]);
@@ -921,6 +1371,7 @@ void moveCommand(client *c) {
     redisDb *src, *dst;
     int srcid;
     long long dbid, expire;
+    hashFieldExpires *hfe = NULL;
 
     if (server.cluster_enabled) {
         addReplyError(c,"MOVE is not allowed in cluster mode");
@@ -961,12 +1412,22 @@ void moveCommand(client *c) {
         addReply(c,shared.czero);
         return;
     }
-    dbAdd(dst,c->argv[1],o);
-    if (expire != -1) setExpire(c,dst,c->argv[1],expire);
+    /* Free the entry in the source DB first: the key name may be embedded
+     * in the value, and it can't be in both the DBs at the same time when
+     * it holds the expire of the key. */
     incrRefCount(o);
-
-    /* OK! key moved, free the entry in the source DB */
+    if (o->type == OBJ_HASH)
+        hfe = hashTypeDetachFieldExpires(src,c->argv[1]->ptr);
     dbDelete(src,c->argv[1]);
+    if (expire != -1) {
+        dbAddExpiring(dst,c->argv[1],o);
+        setExpire(c,dst,c->argv[1],expire);
+    } else {
+        dbAdd(dst,c->argv[1],o);
+    }
+    if (hfe) hashTypeAttachFieldExpires(dst,c->argv[1]->ptr,hfe);
+
+    /* OK! key moved. */
     server.dirty++;
     addReply(c,shared.cone);
 }
@@ -1007,12 +1468,28 @@ int dbSwapDatabases(int id1, int id2) {
     /* Swap hash tables. Note that we don't swap blocking_keys,
      * ready_keys and watched_keys, since we want clients to
      * remain in the same DB they were. */
-    db1->dict = db2->dict;
+    db1->dicts = db2->dicts;
+    db1->numdicts = db2->numdicts;
+    db1->dicts_index = db2->dicts_index;
+    db1->dicts_pending = db2->dicts_pending;
+    db1->numpending = db2->numpending;
+    db1->dicts_queued = db2->dicts_queued;
+    db1->rehash_cursor = db2->rehash_cursor;
     db1->expires = db2->expires;
+    db1->hexpires = db2->hexpires;
+    db1->hexpires_order = db2->hexpires_order;
     db1->avg_ttl = db2->avg_ttl;
 
-    db2->dict = aux.dict;
+    db2->dicts = aux.dicts;
+    db2->numdicts = aux.numdicts;
+    db2->dicts_index = aux.dicts_index;
+    db2->dicts_pending = aux.dicts_pending;
+    db2->numpending = aux.numpending;
+    db2->dicts_queued = aux.dicts_queued;
+    db2->rehash_cursor = aux.rehash_cursor;
     db2->expires = aux.expires;
+    db2->hexpires = aux.hexpires;
+    db2->hexpires_order = aux.hexpires_order;
     db2->avg_ttl = aux.avg_ttl;
 
     /* Now we need to handle clients blocked on lists: as an effect
@@ -1062,25 +1539,52 @@ void swapdbCommand(client *c) {
  * Expires API
  *----------------------------------------------------------------------------*/
 
+/* Remove the expire of 'key', that is the name of a key as stored in the
+ * main dict, if any. Returns 1 if the key had an expire, otherwise 0. The
+ * keyExpire header of the name, if any, is kept. */
+int dbRemoveKeyExpire(redisDb *db, sds key) {
+    keyExpire *ke;
+
+    if (!keyHasExpireHeader(key)) return 0;
+    ke = keyExpireHeader(key);
+    if (ke->when == -1) return 0;
+    expireIndexDelete(db->expires,key);
+    ke->when = -1;
+    return 1;
+}
+
 int removeExpire(redisDb *db, robj *key) {
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
-    serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictDelete(db->expires,key->ptr) == DICT_OK;
+    dictEntry *de = dictFind(dbDictForKey(db,key->ptr),key->ptr);
+
+    serverAssertWithInfo(NULL,key,de != NULL);
+    return dbRemoveKeyExpire(db,dictGetKey(de));
 }
 
 /* Set an expire to the specified key. If the expire is set in the context
  * of an user calling a command 'c' is the client, otherwise 'c' is set
  * to NULL. The 'when' parameter is the absolute unix time in milliseconds
- * after which the key will no longer be considered valid. */
+ * after which the key will no longer be considered valid.
+ *
+ * The expire is stored in the keyExpire header of the key name: if the
+ * name has no such header, it is replaced by a copy having one. */
 void setExpire(client *c, redisDb *db, robj *key, long long when) {
-    dictEntry *kde, *de;
+    dict *d = dbDictForKey(db,key->ptr);
+    dictEntry *de;
+    sds name;
 
-    /* Reuse the sds from the main dict in the expire dict */
-    kde = dictFind(db->dict,key->ptr);
-    serverAssertWithInfo(NULL,key,kde != NULL);
-    de = dictAddOrFind(db->expires,dictGetKey(kde));
-    dictSetSignedIntegerVal(de,when);
+    de = dictFind(d,key->ptr);
+    serverAssertWithInfo(NULL,key,de != NULL);
+    name = dictGetKey(de);
+    if (!keyHasExpireHeader(name)) {
+        sds copy = createKeyWithExpire(name);
+
+        dictSetKey(d,de,copy);
+        dictKeyspaceKeyDestructor(NULL,name);
+        name = copy;
+    }
+    expireIndexSetExpire(db->expires,name,when);
 
     int writable_slave = server.masterhost && server.repl_slave_ro == 0;
     if (c && writable_slave && !(c->flags & CLIENT_MASTER))
@@ -1093,13 +1597,10 @@ long long getExpire(redisDb *db, robj *key) {
     dictEntry *de;
 
     /* No expire? return ASAP */
-    if (dictSize(db->expires) == 0 ||
-       (de = dictFind(db->expires,key->ptr)) == NULL) return -1;
+    if (expireIndexSize(db->expires) == 0 ||
+       (de = dictFind(dbDictForKey(db,key->ptr),key->ptr)) == NULL) return -1;
 
-    /* The entry was found in the expire dict, this means it should also
-     * be present in the main dict (safety check). */
-    serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictGetSignedIntegerVal(de);
+    return keyGetExpire((sds)dictGetKey(de));
 }
 
 /* Propagate expires into slaves and the AOF file.
@@ -1126,9 +1627,8 @@ void propagateExpire(redisDb *db, robj *key, int lazy) {
     decrRefCount(argv[1]);
 }
 
-/* Check if the key is expired. */
-int keyIsExpired(redisDb *db, robj *key) {
-    mstime_t when = getExpire(db,key);
+/* Check if the expire time 'when' of a key was reached. */
+int expireTimeReached(mstime_t when) {
     mstime_t now;
 
     if (when < 0) return 0; /* No expire for this key */
@@ -1164,6 +1664,11 @@ int keyIsExpired(redisDb *db, robj *key) {
     return now > when;
 }
 
+/* Check if the key is expired. */
+int keyIsExpired(redisDb *db, robj *key) {
+    return expireTimeReached(getExpire(db,key));
+}
+
 /* This function is called when we are going to perform some operation
  * in a given key, but such key may be already logically expired even if
  * it still exists in the database. The main way this function is called
@@ -1485,84 +1990,47 @@ int *xreadGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys)
 /* Slot to Key API. This is used by Redis Cluster in order to obtain in
  * a fast way a key that belongs to a specified hash slot. This is useful
  * while rehashing the cluster and in other conditions when we need to
- * understand if we have keys for a given hash slot. */
-void slotToKeyUpdateKey(robj *key, int add) {
-    unsigned int hashslot = keyHashSlot(key->ptr,sdslen(key->ptr));
-    unsigned char buf[64];
-    unsigned char *indexed = buf;
-    size_t keylen = sdslen(key->ptr);
-
-    server.cluster->slots_keys_count[hashslot] += add ? 1 : -1;
-    if (keylen+2 > 64) indexed = zmalloc(keylen+2);
-    indexed[0] = (hashslot >> 8) & 0xff;
-    indexed[1] = hashslot & 0xff;
-    memcpy(indexed+2,key->ptr,keylen);
-    if (add) {
-        raxInsert(server.cluster->slots_to_keys,indexed,keylen+2,NULL,NULL);
-    } else {
-        raxRemove(server.cluster->slots_to_keys,indexed,keylen+2,NULL);
-    }
-    if (indexed != buf) zfree(indexed);
-}
-
-void slotToKeyAdd(robj *key) {
-    slotToKeyUpdateKey(key,1);
-}
-
-void slotToKeyDel(robj *key) {
-    slotToKeyUpdateKey(key,0);
-}
-
-void slotToKeyFlush(void) {
-    raxFree(server.cluster->slots_to_keys);
-    server.cluster->slots_to_keys = raxNew();
-    memset(server.cluster->slots_keys_count,0,
-           sizeof(server.cluster->slots_keys_count));
-}
+ * understand if we have keys for a given hash slot. In cluster mode the
+ * keyspace of DB 0 has a table per hash slot, so this is just a matter of
+ * accessing the table of the slot. */
 
 /* Pupulate the specified array of objects with keys in the specified slot.
  * New objects are returned to represent keys, it's up to the caller to
  * decrement the reference count to release the keys names. */
 unsigned int getKeysInSlot(unsigned int hashslot, robj **keys, unsigned int count) {
-    raxIterator iter;
+    dictIterator *di;
+    dictEntry *de;
     int j = 0;
-    unsigned char indexed[2];
 
-    indexed[0] = (hashslot >> 8) & 0xff;
-    indexed[1] = hashslot & 0xff;
-    raxStart(&iter,server.cluster->slots_to_keys);
-    raxSeek(&iter,">=",indexed,2);
-    while(count-- && raxNext(&iter)) {
-        if (iter.key[0] != indexed[0] || iter.key[1] != indexed[1]) break;
-        keys[j++] = createStringObject((char*)iter.key+2,iter.key_len-2);
+    di = dictGetIterator(server.db[0].dicts[hashslot]);
+    while(count-- && (de = dictNext(di)) != NULL) {
+        sds key = dictGetKey(de);
+        keys[j++] = createStringObject(key,sdslen(key));
     }
-    raxStop(&iter);
+    dictReleaseIterator(di);
     return j;
 }
 
 /* Remove all the keys in the specified hash slot.
  * The number of removed items is returned. */
 unsigned int delKeysInSlot(unsigned int hashslot) {
-    raxIterator iter;
+    dictIterator *di;
+    dictEntry *de;
     int j = 0;
-    unsigned char indexed[2];
 
-    indexed[0] = (hashslot >> 8) & 0xff;
-    indexed[1] = hashslot & 0xff;
-    raxStart(&iter,server.cluster->slots_to_keys);
-    while(server.cluster->slots_keys_count[hashslot]) {
-        raxSeek(&iter,">=",indexed,2);
-        raxNext(&iter);
+    di = dictGetSafeIterator(server.db[0].dicts[hashslot]);
+    while((de = dictNext(di)) != NULL) {
+        sds sdskey = dictGetKey(de);
+        robj *key = createStringObject(sdskey,sdslen(sdskey));
 
-        robj *key = createStringObject((char*)iter.key+2,iter.key_len-2);
         dbDelete(&server.db[0],key);
         decrRefCount(key);
         j++;
     }
-    raxStop(&iter);
+    dictReleaseIterator(di);
     return j;
 }
 
 unsigned int countKeysInSlot(unsigned int hashslot) {
-    return server.cluster->slots_keys_count[hashslot];
+    return dictSize(server.db[0].dicts[hashslot]);
 }
@@ -393,6 +393,14 @@ long activeDefragSdsListAndDict(list *l, dict *d, int dict_val_type) {
  * NOTE: this is very ugly code, but it let's us avoid the complication of
  * doing a scan on another dict. */
 dictEntry* replaceSateliteDictKeyPtrAndOrDefragDictEntry(dict *d, sds oldkey, sds newkey, uint64_t hash, long *defragged) {
+    /* Open addressing dicts have no dictEntry allocations to defrag. */
+    if (dictIsOpenAddressing(d)) {
+        dictEntry *de = dictFindEntryByPtrAndHash(d, oldkey, hash);
+        if (de && newkey)
+            de->key = newkey;
+        return de;
+    }
+
     dictEntry **deref = dictFindEntryRefByPtrAndHash(d, oldkey, hash);
     if (deref) {
         dictEntry *de = *deref;
@@ -424,6 +432,7 @@ long activeDefragQuickListNodes(quicklist *ql) {
                 ql->tail = newnode;
             node = newnode;
             defragged++;
+            quicklistNodeIndexInvalidate(ql);
         }
         if ((newzl = activeDefragAlloc(node->zl)))
             defragged++, node->zl = newzl;
@@ -762,21 +771,25 @@ long defragStream(redisDb *db, dictEntry *kde) {
  * moved. */
 long defragKey(redisDb *db, dictEntry *de) {
     sds keysds = dictGetKey(de);
+    int embkey = isEmbeddedKey(keysds);
     robj *newob, *ob;
     unsigned char *newzl;
     long defragged = 0;
-    sds newsds;
+    sds newsds = NULL;
 
-    /* Try to defrag the key name. */
-    newsds = activeDefragSds(keysds);
-    if (newsds)
-        defragged++, de->key = newsds;
-    if (dictSize(db->expires)) {
-         /* Dirty code:
-          * I can't search in db->expires for that key after i already released
-          * the pointer it holds it won't be able to do the string compare */
-        uint64_t hash = dictGetHash(db->dict, de->key);
-        replaceSateliteDictKeyPtrAndOrDefragDictEntry(db->expires, keysds, newsds, hash, &defragged);
+    /* Try to defrag the key name. Key names embedded in the value (see
+     * createCompactObject()) are moved together with the object, while the
+     * ones having a keyExpire header are moved together with it. */
+    if (!embkey) {
+        if (keyHasExpireHeader(keysds)) {
+            keyExpire *ke = keyExpireHeader(keysds), *newke;
+
+            if ((newke = activeDefragAlloc(ke)))
+                newsds = (char*)newke+((char*)keysds-(char*)ke);
+        } else {
+            newsds = activeDefragSds(keysds);
+        }
+        if (newsds) defragged++, de->key = newsds;
     }
 
     /* Try to defrag robj and / or string value. */
@@ -784,16 +797,18 @@ long defragKey(redisDb *db, dictEntry *de) {
     if ((newob = activeDefragStringOb(ob, &defragged))) {
         de->v.val = newob;
         ob = newob;
+        if (embkey) de->key = newsds = objectEmbeddedKey(ob);
     }
 
+    /* The expire index references the key name by its address. */
+    if (newsds && keyGetExpire(newsds) != -1)
+        expireIndexUpdate(db->expires, newsds);
+
     if (ob->type == OBJ_STRING) {
         /* Already handled in activeDefragStringOb. */
     } else if (ob->type == OBJ_LIST) {
         if (ob->encoding == OBJ_ENCODING_QUICKLIST) {
             defragged += defragQuicklist(db, de);
-        } else if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
-            if ((newzl = activeDefragAlloc(ob->ptr)))
-                defragged++, ob->ptr = newzl;
         } else {
             serverPanic("Unknown list encoding");
         }
@@ -808,7 +823,7 @@ long defragKey(redisDb *db, dictEntry *de) {
             serverPanic("Unknown set encoding");
         }
     } else if (ob->type == OBJ_ZSET) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
         } else if (ob->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -817,7 +832,7 @@ long defragKey(redisDb *db, dictEntry *de) {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (ob->type == OBJ_HASH) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
         } else if (ob->encoding == OBJ_ENCODING_HT) {
@@ -953,7 +968,7 @@ int defragLaterStep(redisDb *db, long long endtime) {
         }
 
         /* each time we enter this function we need to fetch the key from the dict again (if it still exists) */
-        dictEntry *de = dictFind(db->dict, current_key);
+        dictEntry *de = dictFind(dbDictForKey(db,current_key), current_key);
         key_defragged = server.stat_active_defrag_hits;
         do {
             int quit = 0;
@@ -1106,7 +1121,7 @@ void activeDefragCycle(void) {
                 break; /* this will exit the function and we'll continue on the next cycle */
             }
 
-            cursor = dictScan(db->dict, cursor, defragScanCallback, defragDictBucketCallback, db);
+            cursor = dbScan(db, cursor, defragScanCallback, defragDictBucketCallback, db);
 
             /* Once in 16 scan iterations, 512 pointer reallocations. or 64 keys
              * (if we have a lot of pointers in one hash bucket or rehasing),
@@ -3,7 +3,8 @@
  * This file implements in memory hash tables with insert/del/replace/find/
  * get-random-element operations. Hash tables will auto resize if needed
  * tables of power of two in size are used, collisions are handled by
- * chaining. See the source code for more information... :)
+ * chaining, or by open addressing for the dict types requesting it.
+ * See the source code for more information... :)
  *
  * Copyright (c) 2006-2012, Salvatore Sanfilippo <antirez at gmail dot com>
  * All rights reserved.
@@ -36,6 +37,7 @@
 #include "fmacros.h"
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
@@ -45,6 +47,7 @@
 
 #include "dict.h"
 #include "zmalloc.h"
+#include "config.h"
 #ifndef DICT_BENCHMARK_MAIN
 #include "redisassert.h"
 #else
@@ -72,9 +75,15 @@ static int _dictInit(dict *ht, dictType *type, void *privDataPtr);
 /* -------------------------- hash functions -------------------------------- */
 
 static uint8_t dict_hash_function_seed[16];
+static uint64_t dict_wyhash_seed;
+static int dict_data_hash_function = DICT_HASH_SIPHASH;
+
+uint64_t wyhashSeed(const uint8_t *k);
+uint64_t wyhash(const uint8_t *in, const size_t inlen, uint64_t seed);
 
 void dictSetHashFunctionSeed(uint8_t *seed) {
     memcpy(dict_hash_function_seed,seed,sizeof(dict_hash_function_seed));
+    dict_wyhash_seed = wyhashSeed(dict_hash_function_seed);
 }
 
 uint8_t *dictGetHashFunctionSeed(void) {
@@ -95,6 +104,356 @@ uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len) {
     return siphash_nocase(buf,len,dict_hash_function_seed);
 }
 
+/* The hash function for the dictionaries holding data that clients control,
+ * like the keyspace and the elements of sets and hashes. SipHash is used by
+ * default since it resists hash flooding attacks, but when the clients are
+ * trusted the faster wyhash (see wyhash.c) may be selected with
+ * dictSetDataHashFunction(), before populating any dictionary using it. */
+uint64_t dictGenDataHashFunction(const void *key, int len) {
+    if (dict_data_hash_function == DICT_HASH_WYHASH)
+        return wyhash(key,len,dict_wyhash_seed);
+    return siphash(key,len,dict_hash_function_seed);
+}
+
+void dictSetDataHashFunction(int type) {
+    dict_data_hash_function = type;
+}
+
+/* ------------------------- open addressing tables ------------------------- */
+
+/* Dictionaries whose type sets 'openAddressing' don't allocate a dictEntry
+ * for every element: the hash table is an array of buckets, each holding
+ * DICT_BUCKET_SLOTS key/value pairs inline, plus one control byte per slot.
+ * The control byte of a full slot stores 7 bits of the hash of its key, so
+ * that a lookup only compares the keys of the slots with a matching tag,
+ * and only touches the bucket metadata and a single slot in the common case.
+ *
+ * Collisions are resolved by linear probing across buckets: a key is stored
+ * in the first free slot found starting from its "home" bucket (the hash
+ * masked with the number of buckets minus one), and a lookup stops at the
+ * first bucket having an empty slot. For this reason deleted slots become
+ * tombstones, unless their bucket has an empty slot already (so no probe
+ * sequence goes past it). Tombstones are reused by insertions and dropped
+ * when the table is rehashed.
+ *
+ * The 'size' of the table is the number of slots, so dictSlots() and the
+ * fill ratio computed by the callers keep their meaning. Incremental
+ * rehashing works like for chained tables, moving one bucket of ht[0] at a
+ * time into ht[1]: lookups in ht[0] simply skip the buckets below rehashidx.
+ *
+ * A slot only has room for the key and the value, so the dictEntry pointers
+ * returned by the API point inside the table: the 'next' field can't be
+ * used, and since rehashing moves the slots, the pointers should not be
+ * retained across other operations on the same dictionary. */
+
+#define DICT_SLOT_SIZE offsetof(dictEntry,next)
+#define DICT_CTRL_EMPTY 0
+#define DICT_CTRL_DELETED 1
+#define DICT_CTRL_FULL 0x80     /* Set for full slots, with 7 bits of hash. */
+
+typedef struct dictBucket {
+    uint8_t ctrl[DICT_BUCKET_SLOTS];
+    unsigned char slots[DICT_BUCKET_SLOTS*DICT_SLOT_SIZE];
+} dictBucket;
+
+typedef struct dictOpenTable {
+    unsigned long deleted;      /* Number of tombstones. */
+    dictBucket buckets[];
+} dictOpenTable;
+
+#define dictOpenTableOf(ht) ((dictOpenTable*)(ht)->table)
+#define dictOpenDeleted(ht) ((ht)->table ? dictOpenTableOf(ht)->deleted : 0)
+#define dictBuckets(ht) (dictOpenTableOf(ht)->buckets)
+#define dictBucketMask(ht) ((ht)->sizemask/DICT_BUCKET_SLOTS)
+#define dictBucketSlot(b,j) ((dictEntry*)((b)->slots+(j)*DICT_SLOT_SIZE))
+#define dictCtrlIsFull(c) ((c) & DICT_CTRL_FULL)
+#define dictHashTag(h) ((uint8_t)(DICT_CTRL_FULL|((h)>>57)))
+
+static int _dictBucketHasEmpty(dictBucket *b) {
+    int j;
+
+    for (j = 0; j < DICT_BUCKET_SLOTS; j++)
+        if (b->ctrl[j] == DICT_CTRL_EMPTY) return 1;
+    return 0;
+}
+
+static int _dictBucketHasFull(dictBucket *b) {
+    int j;
+
+    for (j = 0; j < DICT_BUCKET_SLOTS; j++)
+        if (dictCtrlIsFull(b->ctrl[j])) return 1;
+    return 0;
+}
+
+/* Return the number of slots needed to store 'size' elements without
+ * exceeding the maximum fill ratio of 7/8. */
+static unsigned long _dictOpenCapacity(unsigned long size) {
+    unsigned long i = DICT_BUCKET_SLOTS;
+
+    if (size >= LONG_MAX/2) return LONG_MAX + 1LU;
+    while (i - i/8 < size) i *= 2;
+    return i;
+}
+
+/* Return the number of used slots (elements plus tombstones) that triggers
+ * a rehash. When resizing is disabled we tolerate a fuller table, but we
+ * still need free slots to terminate the probe sequences. */
+static unsigned long _dictOpenMaxFill(unsigned long size, int can_resize) {
+    return can_resize ? size - size/8 : size - size/16 - 1;
+}
+
+/* Return true if one more element can be stored in the table 'table' of
+ * 'd'. The buckets of ht[0] below rehashidx were moved to ht[1] and can't
+ * be used anymore, so while rehashing only the remaining ones count. */
+static int _dictOpenHasRoom(dict *d, int table) {
+    dictht *ht = &d->ht[table];
+    unsigned long size = ht->size;
+
+    if (table == 0 && dictIsRehashing(d))
+        size -= d->rehashidx*DICT_BUCKET_SLOTS;
+    if (size == 0) return 0;
+    return ht->used + dictOpenDeleted(ht) < _dictOpenMaxFill(size,0);
+}
+
+/* Return true if ht[1] has room for all the elements of the dictionary,
+ * including the ones still to move from ht[0], while rehashing. */
+static int _dictOpenRehashFits(dict *d) {
+    dictht *ht1 = &d->ht[1];
+
+    return ht1->used + dictOpenDeleted(ht1) + d->ht[0].used <
+           _dictOpenMaxFill(ht1->size,0);
+}
+
+/* Return the number of elements the new table should be sized for when the
+ * table 'ht' is rehashed: twice the elements, but never more than the
+ * current number of slots, so that the table at most doubles, like chained
+ * tables do, and the memory needed by every expansion step is predictable
+ * (see _dictExpandAllowed()). With many tombstones this may also just drop
+ * them, or even shrink the table. */
+static unsigned long _dictOpenExpandSize(dictht *ht) {
+    return ht->used*2 < ht->size ? ht->used*2 : ht->size;
+}
+
+/* Search 'key' in the table 'table', returning the slot holding it, or NULL
+ * if it is not there. If 'byptr' is true keys are compared by pointer only.
+ *
+ * If 'freeb' is not NULL, it is set to the bucket containing the first free
+ * slot (empty or tombstone) of the probe sequence, and 'freej' to its index,
+ * that is, where the key should be inserted if it's missing. */
+static dictEntry *_dictOpenFind(dict *d, int table, const void *key,
+                                uint64_t h, int byptr,
+                                dictBucket **freeb, int *freej)
+{
+    dictht *ht = &d->ht[table];
+    unsigned long mask, idx, probes;
+    uint8_t tag = dictHashTag(h);
+
+    if (freeb) *freeb = NULL;
+    if (ht->size == 0) return NULL;
+    mask = dictBucketMask(ht);
+    idx = h & mask;
+    for (probes = 0; probes <= mask; probes++) {
+        dictBucket *b;
+        int j, empty = 0;
+
+        /* The buckets of ht[0] below rehashidx were moved to ht[1]. */
+        if (table == 0 && dictIsRehashing(d) &&
+            idx < (unsigned long) d->rehashidx) idx = d->rehashidx;
+        b = dictBuckets(ht)+idx;
+        for (j = 0; j < DICT_BUCKET_SLOTS; j++) {
+            uint8_t c = b->ctrl[j];
+
+            if (c == tag) {
+                dictEntry *he = dictBucketSlot(b,j);
+                if (key == he->key ||
+                    (!byptr && dictCompareKeys(d, key, he->key))) return he;
+            } else if (!dictCtrlIsFull(c)) {
+                if (c == DICT_CTRL_EMPTY) empty = 1;
+                if (freeb && *freeb == NULL) {
+                    *freeb = b;
+                    *freej = j;
+                }
+            }
+        }
+        if (empty) break;
+        idx = (idx+1) & mask;
+    }
+    return NULL;
+}
+
+/* Mark the free slot 'j' of bucket 'b' as used by an element with hash 'h'
+ * and return it. */
+static dictEntry *_dictOpenFillSlot(dictht *ht, dictBucket *b, int j,
+                                    uint64_t h)
+{
+    if (b->ctrl[j] == DICT_CTRL_DELETED) dictOpenTableOf(ht)->deleted--;
+    b->ctrl[j] = dictHashTag(h);
+    ht->used++;
+    return dictBucketSlot(b,j);
+}
+
+/* Return a free slot for an element with hash 'h' that is known not to be
+ * in the table, used when rehashing. */
+static dictEntry *_dictOpenNewSlot(dictht *ht, uint64_t h) {
+    unsigned long mask = dictBucketMask(ht), idx = h & mask, probes;
+
+    for (probes = 0; probes <= mask; probes++) {
+        dictBucket *b = dictBuckets(ht)+idx;
+        int j;
+
+        for (j = 0; j < DICT_BUCKET_SLOTS; j++) {
+            if (!dictCtrlIsFull(b->ctrl[j]))
+                return _dictOpenFillSlot(ht,b,j,h);
+        }
+        idx = (idx+1) & mask;
+    }
+    assert(0); /* The fill ratio guarantees there are free slots. */
+    return NULL;
+}
+
+/* Free the slot 'he' of the table 'ht'. */
+static void _dictOpenDeleteSlot(dictht *ht, dictEntry *he) {
+    size_t offset = (unsigned char*)he - (unsigned char*)dictBuckets(ht);
+    dictBucket *b = dictBuckets(ht) + offset/sizeof(dictBucket);
+    int j = (offset%sizeof(dictBucket) - offsetof(dictBucket,slots)) /
+            DICT_SLOT_SIZE;
+
+    if (_dictBucketHasEmpty(b)) {
+        b->ctrl[j] = DICT_CTRL_EMPTY;
+    } else {
+        b->ctrl[j] = DICT_CTRL_DELETED;
+        dictOpenTableOf(ht)->deleted++;
+    }
+    ht->used--;
+}
+
+/* Replace ht[1] of a rehashing dictionary with a bigger table, sized for
+ * all the elements of the dictionary, moving there the elements of ht[1].
+ * This is needed when elements were added while the rehashing was paused
+ * by safe iterators, so that ht[1] has no longer room for the elements
+ * still in ht[0]. The elements of ht[0] are not touched. */
+static void _dictOpenGrowRehashTarget(dict *d) {
+    dictht *ht1 = &d->ht[1], n;
+    unsigned long realsize, idx;
+    int j;
+
+    realsize = _dictOpenCapacity((d->ht[0].used+ht1->used)*2);
+    n.table = zcalloc(sizeof(dictOpenTable) +
+                      realsize/DICT_BUCKET_SLOTS*sizeof(dictBucket));
+    n.size = realsize;
+    n.sizemask = realsize-1;
+    n.used = 0;
+    for (idx = 0; idx <= dictBucketMask(ht1); idx++) {
+        dictBucket *b = dictBuckets(ht1)+idx;
+
+        for (j = 0; j < DICT_BUCKET_SLOTS; j++) {
+            dictEntry *he;
+
+            if (!dictCtrlIsFull(b->ctrl[j])) continue;
+            he = dictBucketSlot(b,j);
+            memcpy(_dictOpenNewSlot(&n,dictHashKey(d,he->key)),he,
+                   DICT_SLOT_SIZE);
+        }
+    }
+    zfree(ht1->table);
+    *ht1 = n;
+}
+
+/* ---------------------------- segmented tables ---------------------------- */
+
+/* Dictionaries whose type sets 'segmented' are chained tables whose array of
+ * buckets is not allocated as a single block: the table is a directory of
+ * pointers to segments of DICT_SEGMENT_SIZE buckets (or a single smaller
+ * segment for small tables), allocated only when the first element is stored
+ * in them.
+ *
+ * The size of the table still doubles, so the rehashing algorithm and the
+ * guarantees of dictScan() are the same, but the memory is allocated and
+ * released a segment at a time as the rehashing progresses: the segments of
+ * ht[0] are released as soon as rehashidx moves past them, and while
+ * rehashing new elements are added to ht[1] only if their ht[0] bucket was
+ * already rehashed, otherwise they are added to ht[0] and moved later. So
+ * instead of allocating the whole new table while the old one is still
+ * there, a resize uses memory gradually, and at any time the table takes
+ * about the memory of the old table plus the part of the new one already
+ * rehashed.
+ *
+ * Segments that are not allocated are just empty: the code accessing the
+ * buckets of chained tables uses _dictChainRef() and _dictChainHead() that
+ * take care of this. */
+
+#define DICT_SEGMENT_BITS 10
+#define DICT_SEGMENT_SIZE (1UL<<DICT_SEGMENT_BITS)
+#define DICT_SEGMENT_MASK (DICT_SEGMENT_SIZE-1)
+
+/* The 'table' of a segmented dictht points to this structure. */
+typedef struct dictSegmentDir {
+    unsigned long allocated;    /* Number of segments allocated. */
+    dictEntry **segments[];
+} dictSegmentDir;
+
+#define dictSegmentDirOf(ht) ((dictSegmentDir*)(ht)->table)
+#define dictSegmentsOf(ht) (dictSegmentDirOf(ht)->segments)
+#define dictSegmentCount(size) (((size)+DICT_SEGMENT_MASK)>>DICT_SEGMENT_BITS)
+#define dictSegmentLen(size) \
+    ((size) < DICT_SEGMENT_SIZE ? (size) : DICT_SEGMENT_SIZE)
+
+/* Return a pointer to the bucket 'idx' of the segmented table 'ht'. If the
+ * segment of the bucket is not allocated, NULL is returned, unless 'create'
+ * is true: in this case the segment is allocated. */
+static dictEntry **_dictSegmentRef(dictht *ht, unsigned long idx, int create) {
+    dictEntry ***seg = dictSegmentsOf(ht) + (idx >> DICT_SEGMENT_BITS);
+
+    if (*seg == NULL) {
+        if (!create) return NULL;
+        *seg = zcalloc(dictSegmentLen(ht->size)*sizeof(dictEntry*));
+        dictSegmentDirOf(ht)->allocated++;
+    }
+    return *seg + (idx & DICT_SEGMENT_MASK);
+}
+
+/* Return a pointer to the bucket 'idx' of the chained table 'ht', or NULL if
+ * the bucket is in a segment that is not allocated. */
+static inline dictEntry **_dictChainRef(dict *d, dictht *ht, unsigned long idx) {
+    if (dictIsSegmented(d)) return _dictSegmentRef(ht,idx,0);
+    return ht->table+idx;
+}
+
+/* Return the first entry of the bucket 'idx' of the chained table 'ht'. */
+static inline dictEntry *_dictChainHead(dict *d, dictht *ht, unsigned long idx) {
+    dictEntry **ref = _dictChainRef(d,ht,idx);
+    return ref ? *ref : NULL;
+}
+
+/* Release the array of buckets of the chained table 'ht'. */
+static void _dictFreeChainTable(dict *d, dictht *ht) {
+    if (dictIsSegmented(d) && ht->table) {
+        unsigned long j;
+
+        for (j = 0; j < dictSegmentCount(ht->size); j++)
+            zfree(dictSegmentsOf(ht)[j]);
+    }
+    zfree(ht->table);
+}
+
+/* Release the segment 's' of the segmented table 'ht', if allocated. */
+static void _dictFreeSegment(dictht *ht, unsigned long s) {
+    if (dictSegmentsOf(ht)[s] == NULL) return;
+    zfree(dictSegmentsOf(ht)[s]);
+    dictSegmentsOf(ht)[s] = NULL;
+    dictSegmentDirOf(ht)->allocated--;
+}
+
+/* Return the memory used by the array of buckets of the chained table 'ht'. */
+static size_t _dictChainTableMem(const dict *d, const dictht *ht) {
+    if (ht->table == NULL) return 0;
+    if (!dictIsSegmented(d)) return ht->size*sizeof(dictEntry*);
+    return sizeof(dictSegmentDir) +
+           dictSegmentCount(ht->size)*sizeof(dictEntry**) +
+           dictSegmentDirOf(ht)->allocated*
+           dictSegmentLen(ht->size)*sizeof(dictEntry*);
+}
+
 /* ----------------------------- API implementation ------------------------- */
 
 /* Reset a hash table already initialized with ht_init().
@@ -152,15 +511,35 @@ int dictExpand(dict *d, unsigned long size)
         return DICT_ERR;
 
     dictht n; /* the new hash table */
-    unsigned long realsize = _dictNextPower(size);
+    unsigned long realsize;
 
-    /* Rehashing to the same table size is not useful. */
-    if (realsize == d->ht[0].size) return DICT_ERR;
+    if (dictIsOpenAddressing(d)) {
+        realsize = _dictOpenCapacity(size);
 
-    /* Allocate the new hash table and initialize all pointers to NULL */
+        /* Rehashing to the same table size is only useful in order to
+         * drop the tombstones. */
+        if (realsize == d->ht[0].size && dictOpenDeleted(&d->ht[0]) == 0)
+            return DICT_ERR;
+        n.table = zcalloc(sizeof(dictOpenTable) +
+                          realsize/DICT_BUCKET_SLOTS*sizeof(dictBucket));
+    } else {
+        realsize = _dictNextPower(size);
+
+        /* Rehashing to the same table size is not useful. */
+        if (realsize == d->ht[0].size) return DICT_ERR;
+
+        /* Allocate the new hash table and initialize all pointers to NULL.
+         * Segmented tables just allocate the directory: the segments are
+         * allocated on demand. */
+        if (dictIsSegmented(d)) {
+            n.table = zcalloc(sizeof(dictSegmentDir) +
+                              dictSegmentCount(realsize)*sizeof(dictEntry**));
+        } else {
+            n.table = zcalloc(realsize*sizeof(dictEntry*));
+        }
+    }
     n.size = realsize;
     n.sizemask = realsize-1;
-    n.table = zcalloc(realsize*sizeof(dictEntry*));
     n.used = 0;
 
     /* Is this the first initialization? If so it's not really a rehashing
@@ -185,9 +564,20 @@ int dictExpand(dict *d, unsigned long size)
  * guaranteed that this function will rehash even a single bucket, since it
  * will visit at max N*10 empty buckets in total, otherwise the amount of
  * work it does would be unbound and the function may block for a long time. */
+static int _dictOpenRehash(dict *d, int n);
+
+/* Move rehashidx past the current bucket of ht[0]. Segmented tables release
+ * the segments of ht[0] as soon as they are completely rehashed. */
+static void _dictRehashNextBucket(dict *d) {
+    d->rehashidx++;
+    if (dictIsSegmented(d) && (d->rehashidx & DICT_SEGMENT_MASK) == 0)
+        _dictFreeSegment(&d->ht[0],(d->rehashidx >> DICT_SEGMENT_BITS)-1);
+}
+
 int dictRehash(dict *d, int n) {
     int empty_visits = n*10; /* Max number of empty buckets to visit. */
     if (!dictIsRehashing(d)) return 0;
+    if (dictIsOpenAddressing(d)) return _dictOpenRehash(d,n);
 
     while(n-- && d->ht[0].used != 0) {
         dictEntry *de, *nextde;
@@ -195,31 +585,33 @@ int dictRehash(dict *d, int n) {
         /* Note that rehashidx can't overflow as we are sure there are more
          * elements because ht[0].used != 0 */
         assert(d->ht[0].size > (unsigned long)d->rehashidx);
-        while(d->ht[0].table[d->rehashidx] == NULL) {
-            d->rehashidx++;
+        while((de = _dictChainHead(d,&d->ht[0],d->rehashidx)) == NULL) {
+            _dictRehashNextBucket(d);
             if (--empty_visits == 0) return 1;
         }
-        de = d->ht[0].table[d->rehashidx];
         /* Move all the keys in this bucket from the old to the new hash HT */
         while(de) {
             uint64_t h;
+            dictEntry **ref;
 
             nextde = de->next;
             /* Get the index in the new hash table */
             h = dictHashKey(d, de->key) & d->ht[1].sizemask;
-            de->next = d->ht[1].table[h];
-            d->ht[1].table[h] = de;
+            ref = dictIsSegmented(d) ? _dictSegmentRef(&d->ht[1],h,1) :
+                                       d->ht[1].table+h;
+            de->next = *ref;
+            *ref = de;
             d->ht[0].used--;
             d->ht[1].used++;
             de = nextde;
         }
-        d->ht[0].table[d->rehashidx] = NULL;
-        d->rehashidx++;
+        *_dictChainRef(d,&d->ht[0],d->rehashidx) = NULL;
+        _dictRehashNextBucket(d);
     }
 
     /* Check if we already rehashed the whole table... */
     if (d->ht[0].used == 0) {
-        zfree(d->ht[0].table);
+        _dictFreeChainTable(d,&d->ht[0]);
         d->ht[0] = d->ht[1];
         _dictReset(&d->ht[1]);
         d->rehashidx = -1;
@@ -230,6 +622,52 @@ int dictRehash(dict *d, int n) {
     return 1;
 }
 
+/* dictRehash() for open addressing tables: a step moves all the elements
+ * of a bucket of ht[0] into ht[1]. */
+static int _dictOpenRehash(dict *d, int n) {
+    int empty_visits = n*10; /* Max number of empty buckets to visit. */
+    dictht *ht0 = &d->ht[0], *ht1 = &d->ht[1];
+
+    if (!_dictOpenRehashFits(d)) _dictOpenGrowRehashTarget(d);
+    while(n-- && ht0->used != 0) {
+        dictBucket *b;
+        int j;
+
+        /* Note that rehashidx can't overflow as we are sure there are more
+         * elements because ht[0].used != 0. The tombstones of the skipped
+         * buckets don't need to be cleared, since lookups ignore them. */
+        assert(dictBucketMask(ht0) >= (unsigned long)d->rehashidx);
+        while(!_dictBucketHasFull(dictBuckets(ht0)+d->rehashidx)) {
+            d->rehashidx++;
+            if (--empty_visits == 0) return 1;
+        }
+        b = dictBuckets(ht0)+d->rehashidx;
+        for (j = 0; j < DICT_BUCKET_SLOTS; j++) {
+            dictEntry *he;
+
+            if (!dictCtrlIsFull(b->ctrl[j])) continue;
+            he = dictBucketSlot(b,j);
+            memcpy(_dictOpenNewSlot(ht1,dictHashKey(d,he->key)),he,
+                   DICT_SLOT_SIZE);
+            ht0->used--;
+        }
+        memset(b->ctrl,DICT_CTRL_EMPTY,sizeof(b->ctrl));
+        d->rehashidx++;
+    }
+
+    /* Check if we already rehashed the whole table... */
+    if (ht0->used == 0) {
+        zfree(ht0->table);
+        *ht0 = *ht1;
+        _dictReset(ht1);
+        d->rehashidx = -1;
+        return 0;
+    }
+
+    /* More to rehash... */
+    return 1;
+}
+
 long long timeInMilliseconds(void) {
     struct timeval tv;
 
@@ -261,6 +699,42 @@ static void _dictRehashStep(dict *d) {
     if (d->iterators == 0) dictRehash(d,1);
 }
 
+/* dictAddRaw() for open addressing tables. */
+static dictEntry *_dictOpenAddRaw(dict *d, void *key, dictEntry **existing) {
+    uint64_t h = dictHashKey(d,key);
+    dictEntry *entry;
+    dictBucket *b;
+    int j, table;
+
+    if (existing) *existing = NULL;
+
+    /* Expand the hash table if needed */
+    if (_dictExpandIfNeeded(d) == DICT_ERR) return NULL;
+
+    /* While rehashing new elements are added to ht[1], but the key may
+     * still be in ht[0]. If ht[1] is full because the rehashing is paused
+     * by safe iterators, the element is added to the buckets of ht[0] not
+     * yet rehashed instead, see _dictOpenExpandIfNeeded(). */
+    table = 0;
+    if (dictIsRehashing(d)) {
+        table = _dictOpenHasRoom(d,1) ? 1 : 0;
+        entry = _dictOpenFind(d,!table,key,h,0,NULL,NULL);
+        if (entry) {
+            if (existing) *existing = entry;
+            return NULL;
+        }
+    }
+    entry = _dictOpenFind(d,table,key,h,0,&b,&j);
+    if (entry) {
+        if (existing) *existing = entry;
+        return NULL;
+    }
+    assert(b != NULL);
+    entry = _dictOpenFillSlot(&d->ht[table],b,j,h);
+    dictSetKey(d, entry, key);
+    return entry;
+}
+
 /* Add an element to the target hash table */
 int dictAdd(dict *d, void *key, void *val)
 {
@@ -292,14 +766,17 @@ int dictAdd(dict *d, void *key, void *val)
 dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
 {
     long index;
-    dictEntry *entry;
+    uint64_t h;
+    dictEntry *entry, **ref;
     dictht *ht;
 
     if (dictIsRehashing(d)) _dictRehashStep(d);
+    if (dictIsOpenAddressing(d)) return _dictOpenAddRaw(d,key,existing);
 
     /* Get the index of the new element, or -1 if
      * the element already exists. */
-    if ((index = _dictKeyIndex(d, key, dictHashKey(d,key), existing)) == -1)
+    h = dictHashKey(d,key);
+    if ((index = _dictKeyIndex(d, key, h, existing)) == -1)
         return NULL;
 
     /* Allocate the memory and store the new entry.
@@ -307,9 +784,22 @@ dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
      * system it is more likely that recently added entries are accessed
      * more frequently. */
     ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
+    if (dictIsSegmented(d)) {
+        /* Don't allocate segments of ht[1] ahead of the rehashing: if the
+         * ht[0] bucket of the element was not rehashed yet, add it there. */
+        if (dictIsRehashing(d) &&
+            (h & d->ht[0].sizemask) >= (unsigned long)d->rehashidx)
+        {
+            ht = &d->ht[0];
+            index = h & ht->sizemask;
+        }
+        ref = _dictSegmentRef(ht,index,1);
+    } else {
+        ref = ht->table+index;
+    }
     entry = zmalloc(sizeof(*entry));
-    entry->next = ht->table[index];
-    ht->table[index] = entry;
+    entry->next = *ref;
+    *ref = entry;
     ht->used++;
 
     /* Set the hash entry fields. */
@@ -339,7 +829,7 @@ int dictReplace(dict *d, void *key, void *val)
      * as the previous one. In this context, think to reference counting,
      * you want to increment (set), and then decrement (free), and not the
      * reverse. */
-    auxentry = *existing;
+    auxentry.v = existing->v;
     dictSetVal(d, existing, val);
     dictFreeVal(d, &auxentry);
     return 0;
@@ -372,8 +862,29 @@ static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree) {
     h = dictHashKey(d, key);
 
     for (table = 0; table <= 1; table++) {
+        if (dictIsOpenAddressing(d)) {
+            he = _dictOpenFind(d,table,key,h,0,NULL,NULL);
+            if (he) {
+                dictEntry *unlinked = he;
+
+                /* The slot may be reused by the next insertion, so the
+                 * caller of dictUnlink() gets a copy of the entry. */
+                if (nofree) {
+                    unlinked = zmalloc(sizeof(*unlinked));
+                    memcpy(unlinked,he,DICT_SLOT_SIZE);
+                    unlinked->next = NULL;
+                } else {
+                    dictFreeKey(d, he);
+                    dictFreeVal(d, he);
+                }
+                _dictOpenDeleteSlot(&d->ht[table],he);
+                return unlinked;
+            }
+            if (!dictIsRehashing(d)) break;
+            continue;
+        }
         idx = h & d->ht[table].sizemask;
-        he = d->ht[table].table[idx];
+        he = _dictChainHead(d,&d->ht[table],idx);
         prevHe = NULL;
         while(he) {
             if (key==he->key || dictCompareKeys(d, key, he->key)) {
@@ -381,7 +892,7 @@ static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree) {
                 if (prevHe)
                     prevHe->next = he->next;
                 else
-                    d->ht[table].table[idx] = he->next;
+                    *_dictChainRef(d,&d->ht[table],idx) = he->next;
                 if (!nofree) {
                     dictFreeKey(d, he);
                     dictFreeVal(d, he);
@@ -438,17 +949,36 @@ void dictFreeUnlinkedEntry(dict *d, dictEntry *he) {
     zfree(he);
 }
 
+/* Free all the elements of an open addressing table. */
+static void _dictOpenClearElements(dict *d, dictht *ht, void(callback)(void *)) {
+    unsigned long i;
+
+    for (i = 0; i < ht->size/DICT_BUCKET_SLOTS && ht->used > 0; i++) {
+        dictBucket *b = dictBuckets(ht)+i;
+        int j;
+
+        if (callback && (i & 8191) == 0) callback(d->privdata);
+        for (j = 0; j < DICT_BUCKET_SLOTS; j++) {
+            if (!dictCtrlIsFull(b->ctrl[j])) continue;
+            dictFreeKey(d, dictBucketSlot(b,j));
+            dictFreeVal(d, dictBucketSlot(b,j));
+            ht->used--;
+        }
+    }
+}
+
 /* Destroy an entire dictionary */
 int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
     unsigned long i;
 
     /* Free all the elements */
+    if (dictIsOpenAddressing(d)) _dictOpenClearElements(d,ht,callback);
     for (i = 0; i < ht->size && ht->used > 0; i++) {
         dictEntry *he, *nextHe;
 
         if (callback && (i & 65535) == 0) callback(d->privdata);
 
-        if ((he = ht->table[i]) == NULL) continue;
+        if ((he = _dictChainHead(d,ht,i)) == NULL) continue;
         while(he) {
             nextHe = he->next;
             dictFreeKey(d, he);
@@ -459,7 +989,10 @@ int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
         }
     }
     /* Free the table and the allocated cache structure */
-    zfree(ht->table);
+    if (dictIsOpenAddressing(d))
+        zfree(ht->table);
+    else
+        _dictFreeChainTable(d,ht);
     /* Re-initialize the table */
     _dictReset(ht);
     return DICT_OK; /* never fails */
@@ -482,8 +1015,13 @@ dictEntry *dictFind(dict *d, const void *key)
     if (dictIsRehashing(d)) _dictRehashStep(d);
     h = dictHashKey(d, key);
     for (table = 0; table <= 1; table++) {
+        if (dictIsOpenAddressing(d)) {
+            he = _dictOpenFind(d,table,key,h,0,NULL,NULL);
+            if (he || !dictIsRehashing(d)) return he;
+            continue;
+        }
         idx = h & d->ht[table].sizemask;
-        he = d->ht[table].table[idx];
+        he = _dictChainHead(d,&d->ht[table],idx);
         while(he) {
             if (key==he->key || dictCompareKeys(d, key, he->key))
                 return he;
@@ -559,8 +1097,39 @@ dictIterator *dictGetSafeIterator(dict *d) {
     return i;
 }
 
+/* dictNext() for open addressing tables: 'index' is the slot index. */
+static dictEntry *_dictOpenNext(dictIterator *iter) {
+    while (1) {
+        dictht *ht = &iter->d->ht[iter->table];
+        dictBucket *b;
+        int j;
+
+        if (iter->index == -1 && iter->table == 0) {
+            if (iter->safe)
+                iter->d->iterators++;
+            else
+                iter->fingerprint = dictFingerprint(iter->d);
+        }
+        iter->index++;
+        if (iter->index >= (long) ht->size) {
+            if (dictIsRehashing(iter->d) && iter->table == 0) {
+                iter->table++;
+                iter->index = 0;
+                ht = &iter->d->ht[1];
+            } else {
+                break;
+            }
+        }
+        b = dictBuckets(ht) + iter->index/DICT_BUCKET_SLOTS;
+        j = iter->index % DICT_BUCKET_SLOTS;
+        if (dictCtrlIsFull(b->ctrl[j])) return dictBucketSlot(b,j);
+    }
+    return NULL;
+}
+
 dictEntry *dictNext(dictIterator *iter)
 {
+    if (dictIsOpenAddressing(iter->d)) return _dictOpenNext(iter);
     while (1) {
         if (iter->entry == NULL) {
             dictht *ht = &iter->d->ht[iter->table];
@@ -580,7 +1149,7 @@ dictEntry *dictNext(dictIterator *iter)
                     break;
                 }
             }
-            iter->entry = ht->table[iter->index];
+            iter->entry = _dictChainHead(iter->d,ht,iter->index);
         } else {
             iter->entry = iter->nextEntry;
         }
@@ -605,6 +1174,36 @@ void dictReleaseIterator(dictIterator *iter)
     zfree(iter);
 }
 
+/* dictGetRandomKey() for open addressing tables: every element is in its
+ * own slot, so we just need to pick random slots until a full one is
+ * found. */
+static dictEntry *_dictOpenGetRandomKey(dict *d) {
+    dictht *ht;
+    dictBucket *b;
+    unsigned long h;
+
+    do {
+        if (dictIsRehashing(d)) {
+            /* We are sure there are no elements in the buckets from 0
+             * to rehashidx-1 */
+            unsigned long first = d->rehashidx*DICT_BUCKET_SLOTS;
+
+            h = first + (random() % (d->ht[0].size + d->ht[1].size - first));
+            if (h >= d->ht[0].size) {
+                ht = &d->ht[1];
+                h -= d->ht[0].size;
+            } else {
+                ht = &d->ht[0];
+            }
+        } else {
+            ht = &d->ht[0];
+            h = random() & ht->sizemask;
+        }
+        b = dictBuckets(ht) + h/DICT_BUCKET_SLOTS;
+    } while(!dictCtrlIsFull(b->ctrl[h % DICT_BUCKET_SLOTS]));
+    return dictBucketSlot(b, h % DICT_BUCKET_SLOTS);
+}
+
 /* Return a random entry from the hash table. Useful to
  * implement randomized algorithms */
 dictEntry *dictGetRandomKey(dict *d)
@@ -615,6 +1214,7 @@ dictEntry *dictGetRandomKey(dict *d)
 
     if (dictSize(d) == 0) return NULL;
     if (dictIsRehashing(d)) _dictRehashStep(d);
+    if (dictIsOpenAddressing(d)) return _dictOpenGetRandomKey(d);
     if (dictIsRehashing(d)) {
         do {
             /* We are sure there are no elements in indexes from 0
@@ -622,13 +1222,14 @@ dictEntry *dictGetRandomKey(dict *d)
             h = d->rehashidx + (random() % (d->ht[0].size +
                                             d->ht[1].size -
                                             d->rehashidx));
-            he = (h >= d->ht[0].size) ? d->ht[1].table[h - d->ht[0].size] :
-                                      d->ht[0].table[h];
+            he = (h >= d->ht[0].size) ?
+                 _dictChainHead(d,&d->ht[1],h - d->ht[0].size) :
+                 _dictChainHead(d,&d->ht[0],h);
         } while(he == NULL);
     } else {
         do {
             h = random() & d->ht[0].sizemask;
-            he = d->ht[0].table[h];
+            he = _dictChainHead(d,&d->ht[0],h);
         } while(he == NULL);
     }
 
@@ -670,6 +1271,64 @@ dictEntry *dictGetRandomKey(dict *d)
  * of continuous elements to run some kind of algorithm or to produce
  * statistics. However the function is much faster than dictGetRandomKey()
  * at producing N elements. */
+/* dictGetSomeKeys() for open addressing tables, once the rehashing work
+ * is done: the same algorithm, visiting buckets instead of chains. */
+static unsigned int _dictOpenGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
+    unsigned long j; /* internal hash table id, 0 or 1. */
+    unsigned long tables; /* 1 or 2 tables? */
+    unsigned long stored = 0, maxmask;
+    unsigned long maxsteps = count*10;
+
+    tables = dictIsRehashing(d) ? 2 : 1;
+    maxmask = dictBucketMask(&d->ht[0]);
+    if (tables > 1 && maxmask < dictBucketMask(&d->ht[1]))
+        maxmask = dictBucketMask(&d->ht[1]);
+
+    /* Pick a random bucket inside the larger table. */
+    unsigned long i = random() & maxmask;
+    unsigned long emptylen = 0; /* Continuous empty buckets so far. */
+    while(stored < count && maxsteps--) {
+        for (j = 0; j < tables; j++) {
+            unsigned long buckets = d->ht[j].size/DICT_BUCKET_SLOTS;
+            dictBucket *b;
+            int k, found = 0;
+
+            /* Buckets below rehashidx in ht[0] are empty, see
+             * dictGetSomeKeys(). */
+            if (tables == 2 && j == 0 && i < (unsigned long) d->rehashidx) {
+                if (i >= d->ht[1].size/DICT_BUCKET_SLOTS)
+                    i = d->rehashidx;
+                else
+                    continue;
+            }
+            if (i >= buckets) continue; /* Out of range for this table. */
+            b = dictBuckets(&d->ht[j])+i;
+            for (k = 0; k < DICT_BUCKET_SLOTS; k++) {
+                if (!dictCtrlIsFull(b->ctrl[k])) continue;
+                found = 1;
+                *des = dictBucketSlot(b,k);
+                des++;
+                stored++;
+                if (stored == count) return stored;
+            }
+
+            /* Count contiguous empty buckets, and jump to other
+             * locations if they reach 'count' (with a minimum of 5). */
+            if (!found) {
+                emptylen++;
+                if (emptylen >= 5 && emptylen > count) {
+                    i = random() & maxmask;
+                    emptylen = 0;
+                }
+            } else {
+                emptylen = 0;
+            }
+        }
+        i = (i+1) & maxmask;
+    }
+    return stored;
+}
+
 unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
     unsigned long j; /* internal hash table id, 0 or 1. */
     unsigned long tables; /* 1 or 2 tables? */
@@ -687,6 +1346,8 @@ unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
             break;
     }
 
+    if (dictIsOpenAddressing(d)) return _dictOpenGetSomeKeys(d,des,count);
+
     tables = dictIsRehashing(d) ? 2 : 1;
     maxsizemask = d->ht[0].sizemask;
     if (tables > 1 && maxsizemask < d->ht[1].sizemask)
@@ -711,7 +1372,7 @@ unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
                     continue;
             }
             if (i >= d->ht[j].size) continue; /* Out of range for this table. */
-            dictEntry *he = d->ht[j].table[i];
+            dictEntry *he = _dictChainHead(d,&d->ht[j],i);
 
             /* Count contiguous empty buckets, and jump to other
              * locations if they reach 'count' (with a minimum of 5). */
@@ -834,7 +1495,94 @@ static unsigned long rev(unsigned long v) {
  *    we are sure we don't miss keys moving during rehashing.
  * 3) The reverse cursor is somewhat hard to understand at first, but this
  *    comment is supposed to help.
+ *
+ * OPEN ADDRESSING TABLES
+ *
+ * With open addressing an element is not always stored in the bucket
+ * given by its hash, but it is always in the probe sequence starting from
+ * it. So the cursor refers to the "home" bucket of the elements: we visit
+ * the probe sequence of the bucket, emitting the elements that hash to
+ * it, and the algorithm above works unchanged. The bucket callback is not
+ * called for these tables, since there are no chained entries.
  */
+static void _dictOpenScanBucket(dict *d, int table, unsigned long home,
+                                dictScanFunction *fn, void *privdata)
+{
+    dictht *ht = &d->ht[table];
+    unsigned long mask = dictBucketMask(ht), idx = home, probes;
+
+    for (probes = 0; probes <= mask; probes++) {
+        dictBucket *b;
+        int j, empty = 0;
+
+        if (table == 0 && dictIsRehashing(d) &&
+            idx < (unsigned long) d->rehashidx) idx = d->rehashidx;
+        b = dictBuckets(ht)+idx;
+        for (j = 0; j < DICT_BUCKET_SLOTS; j++) {
+            uint8_t c = b->ctrl[j];
+
+            if (dictCtrlIsFull(c)) {
+                dictEntry *de = dictBucketSlot(b,j);
+                if ((dictHashKey(d, de->key) & mask) == home) fn(privdata, de);
+            } else if (c == DICT_CTRL_EMPTY) {
+                empty = 1;
+            }
+        }
+        if (empty) break;
+        idx = (idx+1) & mask;
+    }
+}
+
+/* dictScan() for open addressing tables, with the cursor referring to
+ * buckets. */
+static unsigned long _dictOpenScan(dict *d, unsigned long v,
+                                   dictScanFunction *fn, void *privdata)
+{
+    int t0, t1;
+    unsigned long m0, m1;
+
+    if (!dictIsRehashing(d)) {
+        m0 = dictBucketMask(&d->ht[0]);
+
+        /* Emit entries at cursor */
+        _dictOpenScanBucket(d,0,v & m0,fn,privdata);
+
+        /* Set unmasked bits so incrementing the reversed cursor
+         * operates on the masked bits */
+        v |= ~m0;
+
+        /* Increment the reverse cursor */
+        v = rev(v);
+        v++;
+        v = rev(v);
+    } else {
+        /* Make sure t0 is the smaller and t1 is the bigger table */
+        t0 = d->ht[0].size > d->ht[1].size;
+        t1 = !t0;
+        m0 = dictBucketMask(&d->ht[t0]);
+        m1 = dictBucketMask(&d->ht[t1]);
+
+        /* Emit entries at cursor */
+        _dictOpenScanBucket(d,t0,v & m0,fn,privdata);
+
+        /* Iterate over indices in larger table that are the expansion
+         * of the index pointed to by the cursor in the smaller table */
+        do {
+            /* Emit entries at cursor */
+            _dictOpenScanBucket(d,t1,v & m1,fn,privdata);
+
+            /* Increment the reverse cursor not covered by the smaller mask.*/
+            v |= ~m1;
+            v = rev(v);
+            v++;
+            v = rev(v);
+
+            /* Continue while bits covered by mask difference is non-zero */
+        } while (v & (m0 ^ m1));
+    }
+    return v;
+}
+
 unsigned long dictScan(dict *d,
                        unsigned long v,
                        dictScanFunction *fn,
@@ -843,17 +1591,20 @@ unsigned long dictScan(dict *d,
 {
     dictht *t0, *t1;
     const dictEntry *de, *next;
+    dictEntry **ref;
     unsigned long m0, m1;
 
     if (dictSize(d) == 0) return 0;
+    if (dictIsOpenAddressing(d)) return _dictOpenScan(d,v,fn,privdata);
 
     if (!dictIsRehashing(d)) {
         t0 = &(d->ht[0]);
         m0 = t0->sizemask;
 
         /* Emit entries at cursor */
-        if (bucketfn) bucketfn(privdata, &t0->table[v & m0]);
-        de = t0->table[v & m0];
+        ref = _dictChainRef(d,t0,v & m0);
+        if (ref && bucketfn) bucketfn(privdata, ref);
+        de = ref ? *ref : NULL;
         while (de) {
             next = de->next;
             fn(privdata, de);
@@ -883,8 +1634,9 @@ unsigned long dictScan(dict *d,
         m1 = t1->sizemask;
 
         /* Emit entries at cursor */
-        if (bucketfn) bucketfn(privdata, &t0->table[v & m0]);
-        de = t0->table[v & m0];
+        ref = _dictChainRef(d,t0,v & m0);
+        if (ref && bucketfn) bucketfn(privdata, ref);
+        de = ref ? *ref : NULL;
         while (de) {
             next = de->next;
             fn(privdata, de);
@@ -895,8 +1647,9 @@ unsigned long dictScan(dict *d,
          * of the index pointed to by the cursor in the smaller table */
         do {
             /* Emit entries at cursor */
-            if (bucketfn) bucketfn(privdata, &t1->table[v & m1]);
-            de = t1->table[v & m1];
+            ref = _dictChainRef(d,t1,v & m1);
+            if (ref && bucketfn) bucketfn(privdata, ref);
+            de = ref ? *ref : NULL;
             while (de) {
                 next = de->next;
                 fn(privdata, de);
@@ -918,9 +1671,74 @@ unsigned long dictScan(dict *d,
 
 /* ------------------------- private functions ------------------------------ */
 
+/* Return true if the type of the dictionary allows to allocate 'moreMem'
+ * bytes in order to expand the table. This is only checked when the
+ * expansion is not mandatory yet: if it is refused, chained tables keep
+ * growing their chains up to dict_force_resize_ratio, and open addressing
+ * tables fill their slots up to the hard limit of _dictOpenMaxFill(). */
+static int _dictExpandAllowed(dict *d, size_t moreMem) {
+    return d->type->expandAllowed == NULL || d->type->expandAllowed(moreMem);
+}
+
+/* Return the additional memory needed to resize the chained table of 'd'
+ * to 'size' buckets. A segmented table releases the old table while the new
+ * one is allocated, so it only needs the difference. */
+static size_t _dictChainResizeMem(dict *d, unsigned long size) {
+    size_t mem = size*sizeof(dictEntry*);
+    size_t old = d->ht[0].size*sizeof(dictEntry*);
+
+    if (!dictIsSegmented(d)) return mem;
+    return mem > old ? mem-old : 0;
+}
+
+/* _dictExpandIfNeeded() for open addressing tables, that can't store more
+ * elements than slots: the table is rehashed when elements and tombstones
+ * reach 7/8 of the slots. This usually doubles the size, but it may also
+ * just drop the tombstones, or even shrink the table if most of the used
+ * slots are tombstones (see _dictOpenExpandSize()). */
+static int _dictOpenExpandIfNeeded(dict *d)
+{
+    dictht *ht;
+
+    /* While rehashing new elements go to ht[1], and each step moves a few
+     * more: ht[1] is sized so that this normally never fills it. However
+     * while there are safe iterators the rehashing is paused, and moving
+     * elements would make them miss or return twice some element. So if
+     * ht[1] can't take the new element and the ones still in ht[0], the
+     * new elements are just added to ht[1] while it has free slots, then
+     * to the buckets of ht[0] not rehashed yet, and ht[1] is replaced by a
+     * bigger table once there are no safe iterators. Only if both tables
+     * are full, that requires to add many more elements than the table had
+     * when the rehashing started while it is paused, ht[1] is replaced
+     * anyway: the iterators still visiting ht[0] are not affected. */
+    if (dictIsRehashing(d)) {
+        if (_dictOpenRehashFits(d)) return DICT_OK;
+        if (d->iterators &&
+            (_dictOpenHasRoom(d,1) || _dictOpenHasRoom(d,0))) return DICT_OK;
+        _dictOpenGrowRehashTarget(d);
+        return DICT_OK;
+    }
+
+    /* If the hash table is empty expand it to the initial size. */
+    ht = &d->ht[0];
+    if (ht->size == 0) return dictExpand(d, DICT_HT_INITIAL_SIZE);
+    if (ht->used + dictOpenDeleted(ht) >= _dictOpenMaxFill(ht->size,0) ||
+        (ht->used + dictOpenDeleted(ht) >= _dictOpenMaxFill(ht->size,1) &&
+         dict_can_resize &&
+         _dictExpandAllowed(d,sizeof(dictOpenTable) +
+            _dictOpenCapacity(_dictOpenExpandSize(ht))/DICT_BUCKET_SLOTS*
+            sizeof(dictBucket))))
+    {
+        return dictExpand(d, _dictOpenExpandSize(ht));
+    }
+    return DICT_OK;
+}
+
 /* Expand the hash table if needed */
 static int _dictExpandIfNeeded(dict *d)
 {
+    if (dictIsOpenAddressing(d)) return _dictOpenExpandIfNeeded(d);
+
     /* Incremental rehashing already in progress. Return. */
     if (dictIsRehashing(d)) return DICT_OK;
 
@@ -928,11 +1746,12 @@ static int _dictExpandIfNeeded(dict *d)
     if (d->ht[0].size == 0) return dictExpand(d, DICT_HT_INITIAL_SIZE);
 
     /* If we reached the 1:1 ratio, and we are allowed to resize the hash
-     * table (global setting) or we should avoid it but the ratio between
-     * elements/buckets is over the "safe" threshold, we resize doubling
-     * the number of buckets. */
+     * table (global setting and dictionary type) or we should avoid it but
+     * the ratio between elements/buckets is over the "safe" threshold, we
+     * resize doubling the number of buckets. */
     if (d->ht[0].used >= d->ht[0].size &&
-        (dict_can_resize ||
+        ((dict_can_resize && _dictExpandAllowed(d,
+            _dictChainResizeMem(d,_dictNextPower(d->ht[0].used*2)))) ||
          d->ht[0].used/d->ht[0].size > dict_force_resize_ratio))
     {
         return dictExpand(d, d->ht[0].used*2);
@@ -972,7 +1791,7 @@ static long _dictKeyIndex(dict *d, const void *key, uint64_t hash, dictEntry **e
     for (table = 0; table <= 1; table++) {
         idx = hash & d->ht[table].sizemask;
         /* Search if this slot does not already contain the given key */
-        he = d->ht[table].table[idx];
+        he = _dictChainHead(d,&d->ht[table],idx);
         while(he) {
             if (key==he->key || dictCompareKeys(d, key, he->key)) {
                 if (existing) *existing = he;
@@ -1013,11 +1832,14 @@ dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t h
     dictEntry *he, **heref;
     unsigned long idx, table;
 
+    /* Open addressing tables have no references to entries: use
+     * dictFindEntryByPtrAndHash() instead. */
+    if (dictIsOpenAddressing(d)) return NULL;
     if (d->ht[0].used + d->ht[1].used == 0) return NULL; /* dict is empty */
     for (table = 0; table <= 1; table++) {
         idx = hash & d->ht[table].sizemask;
-        heref = &d->ht[table].table[idx];
-        he = *heref;
+        heref = _dictChainRef(d,&d->ht[table],idx);
+        he = heref ? *heref : NULL;
         while(he) {
             if (oldptr==he->key)
                 return heref;
@@ -1029,10 +1851,148 @@ dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t h
     return NULL;
 }
 
+/* Number of keys dictPrefetch() works on at the same time. */
+#define DICT_PREFETCH_BATCH 16
+
+/* Prefetch the memory needed to look up 'count' keys, given their hashes as
+ * returned by dictGetHash() and the dictionary of every key (usually the
+ * same for all of them), so that the cache misses of the lookups that
+ * follow overlap instead of stalling one after the other. This is done in
+ * stages, every stage touching memory prefetched by the previous one for all
+ * the keys: first the buckets, then the entries they point to (the head of
+ * the chain, or the slot with a matching hash tag), and finally the keys.
+ *
+ * If 'valfn' is not NULL the values are prefetched as well, and once they
+ * are in the cache 'valfn' is called with every value, so that the caller
+ * can prefetch the memory the value points to. Nothing is modified, so it is
+ * not a problem if the dictionary changes before the actual lookups: at
+ * worst we prefetched memory that will not be used. */
+void dictPrefetch(dict **dicts, const uint64_t *hashes, int count,
+                  dictPrefetchValFunction *valfn)
+{
+    void *buckets[DICT_PREFETCH_BATCH];
+    dictEntry *des[DICT_PREFETCH_BATCH];
+    int i, j, n;
+
+    for (; count > 0; count -= n, hashes += n, dicts += n) {
+        n = count < DICT_PREFETCH_BATCH ? count : DICT_PREFETCH_BATCH;
+
+        /* Stage 1: prefetch the buckets. While rehashing, the elements of
+         * the buckets below rehashidx are in the new table. */
+        for (i = 0; i < n; i++) {
+            dict *d = dicts[i];
+            dictht *ht = &d->ht[0];
+            unsigned long idx;
+
+            if (dictSize(d) == 0) {
+                buckets[i] = NULL;
+                continue;
+            }
+            if (dictIsOpenAddressing(d)) {
+                idx = hashes[i] & dictBucketMask(ht);
+                if (dictIsRehashing(d) && idx < (unsigned long) d->rehashidx) {
+                    ht = &d->ht[1];
+                    idx = hashes[i] & dictBucketMask(ht);
+                }
+                buckets[i] = dictBuckets(ht)+idx;
+            } else {
+                idx = hashes[i] & ht->sizemask;
+                if (dictIsRehashing(d) && idx < (unsigned long) d->rehashidx) {
+                    ht = &d->ht[1];
+                    idx = hashes[i] & ht->sizemask;
+                }
+                buckets[i] = _dictChainRef(d,ht,idx);
+            }
+            redis_prefetch(buckets[i]);
+        }
+
+        /* Stage 2: prefetch the entries. */
+        for (i = 0; i < n; i++) {
+            if (buckets[i] && dictIsOpenAddressing(dicts[i])) {
+                dictBucket *b = buckets[i];
+                uint8_t tag = dictHashTag(hashes[i]);
+
+                des[i] = NULL;
+                for (j = 0; j < DICT_BUCKET_SLOTS; j++) {
+                    if (b->ctrl[j] == tag) {
+                        des[i] = dictBucketSlot(b,j);
+                        break;
+                    }
+                }
+            } else {
+                des[i] = buckets[i] ? *(dictEntry**)buckets[i] : NULL;
+            }
+            if (des[i]) redis_prefetch(des[i]);
+        }
+
+        /* Stage 3: prefetch the keys and the values. */
+        for (i = 0; i < n; i++) {
+            if (des[i] == NULL) continue;
+            redis_prefetch(des[i]->key);
+            if (valfn) redis_prefetch(des[i]->v.val);
+        }
+
+        /* Stage 4: let the caller prefetch what the values point to. */
+        if (valfn) {
+            for (i = 0; i < n; i++)
+                if (des[i]) valfn(des[i]->v.val);
+        }
+    }
+}
+
+/* Like dictFindEntryRefByPtrAndHash() but returns the entry itself, and
+ * works with both kind of tables. */
+dictEntry *dictFindEntryByPtrAndHash(dict *d, const void *oldptr, uint64_t hash) {
+    dictEntry *he = NULL, **heref;
+    int table;
+
+    if (!dictIsOpenAddressing(d)) {
+        heref = dictFindEntryRefByPtrAndHash(d,oldptr,hash);
+        return heref ? *heref : NULL;
+    }
+    for (table = 0; table <= 1; table++) {
+        he = _dictOpenFind(d,table,oldptr,hash,1,NULL,NULL);
+        if (he || !dictIsRehashing(d)) break;
+    }
+    return he;
+}
+
+/* Return the memory used by the tables and the entries of the dictionary,
+ * not including the dict structure itself, the keys and the values. */
+size_t dictMemUsage(const dict *d) {
+    size_t usage = 0;
+    int table;
+
+    for (table = 0; table <= 1; table++) {
+        const dictht *ht = &d->ht[table];
+
+        if (ht->size == 0) continue;
+        if (dictIsOpenAddressing(d)) {
+            usage += sizeof(dictOpenTable) +
+                     ht->size/DICT_BUCKET_SLOTS*sizeof(dictBucket);
+        } else {
+            usage += _dictChainTableMem(d,ht) + ht->used*sizeof(dictEntry);
+        }
+    }
+    return usage;
+}
+
+/* Return the memory used by the old table of a dictionary being rehashed,
+ * that will be released once the rehashing is completed, or 0 if the
+ * dictionary is not rehashing. */
+size_t dictRehashingOverhead(const dict *d) {
+    if (!dictIsRehashing(d)) return 0;
+    if (dictIsOpenAddressing(d)) {
+        return sizeof(dictOpenTable) +
+               d->ht[0].size/DICT_BUCKET_SLOTS*sizeof(dictBucket);
+    }
+    return _dictChainTableMem(d,&d->ht[0]);
+}
+
 /* ------------------------------- Debugging ---------------------------------*/
 
 #define DICT_STATS_VECTLEN 50
-size_t _dictGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
+size_t _dictGetStatsHt(char *buf, size_t bufsize, dict *d, dictht *ht, int tableid) {
     unsigned long i, slots = 0, chainlen, maxchainlen = 0;
     unsigned long totchainlen = 0;
     unsigned long clvector[DICT_STATS_VECTLEN];
@@ -1048,14 +2008,13 @@ size_t _dictGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
     for (i = 0; i < ht->size; i++) {
         dictEntry *he;
 
-        if (ht->table[i] == NULL) {
+        if ((he = _dictChainHead(d,ht,i)) == NULL) {
             clvector[0]++;
             continue;
         }
         slots++;
         /* For each hash entry on this slot... */
         chainlen = 0;
-        he = ht->table[i];
         while(he) {
             chainlen++;
             he = he->next;
@@ -1093,16 +2052,83 @@ size_t _dictGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
     return strlen(buf);
 }
 
+/* Stats of open addressing tables: instead of the chain lengths we report
+ * the distance in buckets of the elements from their home bucket. */
+size_t _dictOpenGetStatsHt(char *buf, size_t bufsize, dict *d, int tableid) {
+    dictht *ht = &d->ht[tableid];
+    unsigned long i, mask, dist, maxdist = 0, totdist = 0;
+    unsigned long clvector[DICT_STATS_VECTLEN];
+    size_t l = 0;
+    int j;
+
+    if (ht->used == 0) {
+        return snprintf(buf,bufsize,
+            "No stats available for empty dictionaries\n");
+    }
+
+    /* Compute stats. */
+    for (i = 0; i < DICT_STATS_VECTLEN; i++) clvector[i] = 0;
+    mask = dictBucketMask(ht);
+    for (i = 0; i <= mask; i++) {
+        dictBucket *b = dictBuckets(ht)+i;
+
+        for (j = 0; j < DICT_BUCKET_SLOTS; j++) {
+            if (!dictCtrlIsFull(b->ctrl[j])) continue;
+            dist = (i - dictHashKey(d, dictBucketSlot(b,j)->key)) & mask;
+            clvector[(dist < DICT_STATS_VECTLEN) ? dist : (DICT_STATS_VECTLEN-1)]++;
+            if (dist > maxdist) maxdist = dist;
+            totdist += dist;
+        }
+    }
+
+    /* Generate human readable stats. */
+    l += snprintf(buf+l,bufsize-l,
+        "Hash table %d stats (%s):\n"
+        " table size: %ld\n"
+        " number of elements: %ld\n"
+        " buckets: %ld\n"
+        " tombstones: %ld\n"
+        " max probe length: %ld\n"
+        " avg probe length: %.02f\n"
+        " Probe length distribution:\n",
+        tableid, (tableid == 0) ? "main hash table" : "rehashing target",
+        ht->size, ht->used, mask+1, dictOpenDeleted(ht), maxdist,
+        (float)totdist/ht->used);
+
+    for (i = 0; i < DICT_STATS_VECTLEN; i++) {
+        if (clvector[i] == 0) continue;
+        if (l >= bufsize) break;
+        l += snprintf(buf+l,bufsize-l,
+            "   %s%ld: %ld (%.02f%%)\n",
+            (i == DICT_STATS_VECTLEN-1)?">= ":"",
+            i, clvector[i], ((float)clvector[i]/ht->used)*100);
+    }
+
+    /* Unlike snprintf(), return the number of characters actually written. */
+    if (bufsize) buf[bufsize-1] = '\0';
+    return strlen(buf);
+}
+
 void dictGetStats(char *buf, size_t bufsize, dict *d) {
     size_t l;
     char *orig_buf = buf;
     size_t orig_bufsize = bufsize;
 
-    l = _dictGetStatsHt(buf,bufsize,&d->ht[0],0);
+    if (dictIsOpenAddressing(d)) {
+        l = _dictOpenGetStatsHt(buf,bufsize,d,0);
+        buf += l;
+        bufsize -= l;
+        if (dictIsRehashing(d) && bufsize > 0)
+            _dictOpenGetStatsHt(buf,bufsize,d,1);
+        if (orig_bufsize) orig_buf[orig_bufsize-1] = '\0';
+        return;
+    }
+
+    l = _dictGetStatsHt(buf,bufsize,d,&d->ht[0],0);
     buf += l;
     bufsize -= l;
     if (dictIsRehashing(d) && bufsize > 0) {
-        _dictGetStatsHt(buf,bufsize,&d->ht[1],1);
+        _dictGetStatsHt(buf,bufsize,d,&d->ht[1],1);
     }
     /* Make sure there is a NULL term at the end. */
     if (orig_bufsize) orig_buf[orig_bufsize-1] = '\0';
@@ -1110,12 +2136,12 @@ void dictGetStats(char *buf, size_t bufsize, dict *d) {
 
 /* ------------------------------- Benchmark ---------------------------------*/
 
-#ifdef DICT_BENCHMARK_MAIN
+#if defined(DICT_BENCHMARK_MAIN) || defined(REDIS_TEST)
 
 #include "sds.h"
 
 uint64_t hashCallback(const void *key) {
-    return dictGenHashFunction((unsigned char*)key, sdslen((char*)key));
+    return dictGenDataHashFunction((unsigned char*)key, sdslen((char*)key));
 }
 
 int compareCallback(void *privdata, const void *key1, const void *key2) {
@@ -1143,24 +2169,111 @@ dictType BenchmarkDictType = {
     NULL
 };
 
+dictType BenchmarkOpenDictType = {
+    hashCallback,
+    NULL,
+    NULL,
+    compareCallback,
+    freeCallback,
+    NULL,
+    1
+};
+
+dictType BenchmarkSegmentedDictType = {
+    hashCallback,
+    NULL,
+    NULL,
+    compareCallback,
+    freeCallback,
+    NULL,
+    0,
+    1
+};
+#endif
+
+#ifdef DICT_BENCHMARK_MAIN
+
+#include <math.h>
+
 #define start_benchmark() start = timeInMilliseconds()
 #define end_benchmark(msg) do { \
     elapsed = timeInMilliseconds()-start; \
     printf(msg ": %ld items in %lld ms\n", count, elapsed); \
 } while(0);
 
-/* dict-benchmark [count] */
+static const char *hashFunctionName[] = {"siphash","wyhash"};
+
+/* Compare the throughput of the data hash functions with keys of different
+ * lengths, and how they distribute 'count' keys of the form "key:<number>"
+ * in a table of as many buckets, compared to a perfectly random function. */
+static void benchmarkHashFunctions(long count) {
+    static const int lens[] = {4,8,16,32,64,256};
+    unsigned char buf[256];
+    long long start, elapsed;
+    long j;
+    int type, l;
+
+    for (j = 0; j < (long)sizeof(buf); j++) buf[j] = rand();
+    for (type = DICT_HASH_SIPHASH; type <= DICT_HASH_WYHASH; type++) {
+        unsigned long size = _dictNextPower(count), used = 0, maxchain = 0;
+        unsigned int *buckets = zcalloc(size*sizeof(unsigned int));
+
+        dictSetDataHashFunction(type);
+        for (l = 0; l < (int)(sizeof(lens)/sizeof(lens[0])); l++) {
+            start = timeInMilliseconds();
+            for (j = 0; j < count; j++) {
+                buf[0] = j;
+                dictGenDataHashFunction(buf,lens[l]);
+            }
+            elapsed = timeInMilliseconds()-start;
+            printf("%s, %d bytes keys: %ld hashes in %lld ms (%.2f ns/hash)\n",
+                hashFunctionName[type], lens[l], count, elapsed,
+                (double)elapsed*1000000/count);
+        }
+        for (j = 0; j < count; j++) {
+            char key[32];
+            int len = snprintf(key,sizeof(key),"key:%ld",j);
+            unsigned long idx = dictGenDataHashFunction(key,len) & (size-1);
+
+            if (buckets[idx]++ == 0) used++;
+            if (buckets[idx] > maxchain) maxchain = buckets[idx];
+        }
+        printf("%s, %ld keys in %lu buckets: %.2f%% buckets used "
+               "(random function: %.2f%%), max chain length %lu\n",
+            hashFunctionName[type], count, size, (double)used*100/size,
+            (1-pow(1-1.0/size,count))*100, maxchain);
+        zfree(buckets);
+    }
+}
+
+/* dict-benchmark [count] [chained|open|segmented] [siphash|wyhash]
+ * dict-benchmark hash [count] */
 int main(int argc, char **argv) {
     long j;
     long long start, elapsed;
-    dict *dict = dictCreate(&BenchmarkDictType,NULL);
+    dict *dict;
     long count = 0;
+    uint8_t seed[16];
 
-    if (argc == 2) {
+    for (j = 0; j < (long)sizeof(seed); j++) seed[j] = rand();
+    dictSetHashFunctionSeed(seed);
+    if (argc >= 2 && !strcmp(argv[1],"hash")) {
+        benchmarkHashFunctions(argc >= 3 ? strtol(argv[2],NULL,10) : 10000000);
+        return 0;
+    }
+    if (argc >= 2) {
         count = strtol(argv[1],NULL,10);
     } else {
         count = 5000000;
     }
+    if (argc >= 4 && !strcmp(argv[3],"wyhash"))
+        dictSetDataHashFunction(DICT_HASH_WYHASH);
+    if (argc >= 3 && !strcmp(argv[2],"open"))
+        dict = dictCreate(&BenchmarkOpenDictType,NULL);
+    else if (argc >= 3 && !strcmp(argv[2],"segmented"))
+        dict = dictCreate(&BenchmarkSegmentedDictType,NULL);
+    else
+        dict = dictCreate(&BenchmarkDictType,NULL);
 
     start_benchmark();
     for (j = 0; j < count; j++) {
@@ -1224,3 +2337,331 @@ int main(int argc, char **argv) {
     end_benchmark("Removing and adding");
 }
 #endif
+
+/* ---------------------------------- Tests ----------------------------------*/
+
+#ifdef REDIS_TEST
+
+static void dictTestScanCallback(void *privdata, const dictEntry *de) {
+    unsigned char *seen = privdata;
+    seen[(long)dictGetVal(de)] = 1;
+}
+
+/* Checks dictionaries of the given type: every check is performed while
+ * the table is rehashing too, since count is not a power of two. */
+static int dictTestRefuseExpand(size_t moreMem) {
+    DICT_NOTUSED(moreMem);
+    return 0;
+}
+
+static void dictTestType(dictType *type, long count) {
+    dict *d = dictCreate(type,NULL);
+    dictIterator *di;
+    dictEntry *de, *des[16];
+    unsigned char *seen;
+    unsigned long cursor;
+    long j, found;
+
+    printf("Add and find %ld elements: ", count);
+    for (j = 0; j < count; j++)
+        assert(dictAdd(d,sdsfromlonglong(j),(void*)j) == DICT_OK);
+    assert((long)dictSize(d) == count);
+    for (j = 0; j < count; j++) {
+        sds key = sdsfromlonglong(j);
+        de = dictFind(d,key);
+        assert(de != NULL && (long)dictGetVal(de) == j);
+        assert(dictAdd(d,key,NULL) == DICT_ERR);
+        key[0] = 'X';
+        assert(dictFind(d,key) == NULL);
+        sdsfree(key);
+    }
+    printf("OK\n");
+
+    printf("Delete and reinsert: ");
+    for (j = 0; j < count; j += 2) {
+        sds key = sdsfromlonglong(j);
+        assert(dictDelete(d,key) == DICT_OK);
+        assert(dictDelete(d,key) == DICT_ERR);
+        sdsfree(key);
+    }
+    assert((long)dictSize(d) == count/2);
+    for (j = 0; j < count; j++) {
+        sds key = sdsfromlonglong(j);
+        assert((dictFind(d,key) != NULL) == (j % 2 == 1));
+        sdsfree(key);
+    }
+    for (j = 0; j < count; j += 2)
+        assert(dictAdd(d,sdsfromlonglong(j),(void*)j) == DICT_OK);
+    assert((long)dictSize(d) == count);
+    printf("OK\n");
+
+    printf("Replace and unlink: ");
+    {
+        sds key = sdsfromlonglong(7);
+        assert(dictReplace(d,key,(void*)70L) == 0);
+        assert((long)dictFetchValue(d,key) == 70);
+        assert(dictReplace(d,key,(void*)7L) == 0);
+        de = dictUnlink(d,key);
+        assert(de != NULL && (long)dictGetVal(de) == 7);
+        assert(dictFind(d,key) == NULL);
+        /* The unlinked entry must survive insertions. */
+        assert(dictAdd(d,sdsfromlonglong(-1),NULL) == DICT_OK);
+        assert(sdscmp(dictGetKey(de),key) == 0);
+        dictFreeUnlinkedEntry(d,de);
+        assert(dictAdd(d,key,(void*)7L) == DICT_OK);
+        key = sdsfromlonglong(-1);
+        assert(dictDelete(d,key) == DICT_OK);
+        sdsfree(key);
+    }
+    printf("OK\n");
+
+    printf("Safe iterator with deletions: ");
+    found = 0;
+    di = dictGetSafeIterator(d);
+    while((de = dictNext(di)) != NULL) {
+        found++;
+        if ((long)dictGetVal(de) % 3 == 0)
+            assert(dictDelete(d,dictGetKey(de)) == DICT_OK);
+    }
+    dictReleaseIterator(di);
+    assert(found == count);
+    assert((long)dictSize(d) == count - (count+2)/3);
+    for (j = 0; j < count; j += 3)
+        assert(dictAdd(d,sdsfromlonglong(j),(void*)j) == DICT_OK);
+    printf("OK\n");
+
+    printf("Scan returns every element while the table grows: ");
+    seen = zcalloc(count*2);
+    cursor = 0;
+    j = count;
+    do {
+        cursor = dictScan(d,cursor,dictTestScanCallback,NULL,seen);
+        if (j < count*2) {
+            assert(dictAdd(d,sdsfromlonglong(j),(void*)j) == DICT_OK);
+            j++;
+        }
+    } while(cursor);
+    for (found = j, j = 0; j < count; j++) assert(seen[j]);
+    printf("OK\n");
+
+    printf("Scan returns every element while the table shrinks: ");
+    for (j = count; j < found; j++) {
+        sds key = sdsfromlonglong(j);
+        assert(dictDelete(d,key) == DICT_OK);
+        sdsfree(key);
+    }
+    memset(seen,0,count*2);
+    cursor = 0;
+    j = count/2;
+    do {
+        cursor = dictScan(d,cursor,dictTestScanCallback,NULL,seen);
+        if (j < count) {
+            sds key = sdsfromlonglong(j);
+            assert(dictDelete(d,key) == DICT_OK);
+            sdsfree(key);
+            j++;
+        }
+        if (!dictIsRehashing(d)) dictResize(d);
+    } while(cursor);
+    for (; j < count; j++) {
+        sds key = sdsfromlonglong(j);
+        assert(dictDelete(d,key) == DICT_OK);
+        sdsfree(key);
+    }
+    for (j = 0; j < count/2; j++) assert(seen[j]);
+    zfree(seen);
+    printf("OK\n");
+
+    printf("Random elements: ");
+    for (j = 0; j < 1000; j++) {
+        de = dictGetRandomKey(d);
+        assert(de != NULL && (long)dictGetVal(de) < count/2);
+    }
+    found = dictGetSomeKeys(d,des,16);
+    assert(found > 0);
+    while(found--) assert((long)dictGetVal(des[found]) < count/2);
+    printf("OK\n");
+
+    printf("Empty and release: ");
+    dictEmpty(d,NULL);
+    assert(dictSize(d) == 0 && dictSlots(d) == 0);
+    assert(dictAdd(d,sdsfromlonglong(1),NULL) == DICT_OK);
+    dictRelease(d);
+    printf("OK\n");
+}
+
+int dictTest(int argc, char **argv) {
+    DICT_NOTUSED(argc);
+    DICT_NOTUSED(argv);
+
+    printf("[chained]\n");
+    dictTestType(&BenchmarkDictType,30000);
+    printf("[open addressing]\n");
+    dictTestType(&BenchmarkOpenDictType,30000);
+    printf("[segmented]\n");
+    dictTestType(&BenchmarkSegmentedDictType,30000);
+
+    printf("Data hash functions: ");
+    {
+        uint8_t seed[16], buf[64];
+        uint64_t h[65];
+        int type, j, k;
+
+        for (j = 0; j < 16; j++) seed[j] = j;
+        for (j = 0; j < 64; j++) buf[j] = j*7;
+        dictSetHashFunctionSeed(seed);
+        for (type = DICT_HASH_SIPHASH; type <= DICT_HASH_WYHASH; type++) {
+            dictSetDataHashFunction(type);
+            /* Every length and every bit of the key matters. */
+            for (j = 0; j <= 64; j++) {
+                h[j] = dictGenDataHashFunction(buf,j);
+                for (k = 0; k < j; k++) assert(h[j] != h[k]);
+            }
+            for (j = 0; j < 64*8; j++) {
+                buf[j/8] ^= 1<<(j%8);
+                assert(dictGenDataHashFunction(buf,64) != h[64]);
+                buf[j/8] ^= 1<<(j%8);
+            }
+            assert(dictGenDataHashFunction(buf,64) == h[64]);
+            /* And so does the seed. */
+            seed[15] ^= 1;
+            dictSetHashFunctionSeed(seed);
+            assert(dictGenDataHashFunction(buf,64) != h[64]);
+            seed[15] ^= 1;
+            dictSetHashFunctionSeed(seed);
+        }
+        dictSetDataHashFunction(DICT_HASH_SIPHASH);
+    }
+    printf("OK\n");
+
+    printf("[chained, wyhash]\n");
+    dictSetDataHashFunction(DICT_HASH_WYHASH);
+    dictTestType(&BenchmarkDictType,30000);
+    dictSetDataHashFunction(DICT_HASH_SIPHASH);
+
+    printf("Segmented tables allocate memory while rehashing: ");
+    {
+        dict *d = dictCreate(&BenchmarkSegmentedDictType,NULL);
+        size_t mem, maxmem = 0;
+        long j = 0;
+
+        while(!dictIsRehashing(d) || dictSlots(d) < 3*DICT_SEGMENT_SIZE*8) {
+            assert(dictAdd(d,sdsfromlonglong(j),(void*)j) == DICT_OK);
+            j++;
+        }
+        assert(dictRehashingOverhead(d) == _dictChainTableMem(d,&d->ht[0]));
+        while(dictIsRehashing(d)) {
+            mem = _dictChainTableMem(d,&d->ht[0]) +
+                  _dictChainTableMem(d,&d->ht[1]);
+            if (mem > maxmem) maxmem = mem;
+            assert(dictAdd(d,sdsfromlonglong(j),(void*)j) == DICT_OK);
+            j++;
+            dictRehash(d,10);
+        }
+        assert(dictRehashingOverhead(d) == 0);
+        /* The old table was released while the new one was allocated. */
+        mem = _dictChainTableMem(d,&d->ht[0]);
+        assert(mem == sizeof(dictSegmentDir) +
+                      dictSlots(d)/DICT_SEGMENT_SIZE*sizeof(dictEntry**) +
+                      dictSlots(d)*sizeof(dictEntry*));
+        assert(maxmem <= mem + 4*DICT_SEGMENT_SIZE*sizeof(dictEntry*));
+        while(j--) {
+            sds key = sdsfromlonglong(j);
+            assert(dictFind(d,key) != NULL);
+            sdsfree(key);
+        }
+        dictRelease(d);
+    }
+    printf("OK\n");
+
+    printf("Expansion refused by the dictionary type: ");
+    {
+        dictType type = BenchmarkDictType;
+        dict *d;
+        long j;
+
+        type.expandAllowed = dictTestRefuseExpand;
+        d = dictCreate(&type,NULL);
+        for (j = 0; j < 300; j++) {
+            assert(dictAdd(d,sdsfromlonglong(j),(void*)j) == DICT_OK);
+            assert(dictSize(d) <= dictSlots(d)*(dict_force_resize_ratio+1));
+        }
+        /* The table was only expanded when the ratio was over the limit. */
+        assert(dictSlots(d) < dictSize(d));
+        dictRelease(d);
+    }
+    printf("OK\n");
+
+    printf("Open addressing tables keep the fill ratio: ");
+    {
+        dict *d = dictCreate(&BenchmarkOpenDictType,NULL);
+        long j;
+
+        /* Delete and add again, so that tombstones accumulate. */
+        for (j = 0; j < 100000; j++) {
+            assert(dictAdd(d,sdsfromlonglong(j),(void*)j) == DICT_OK);
+            if (j >= 100) {
+                sds key = sdsfromlonglong(j-100);
+                assert(dictDelete(d,key) == DICT_OK);
+                sdsfree(key);
+            }
+            assert(dictSlots(d) <= 1024);
+        }
+        assert(dictSize(d) == 100);
+        while(dictIsRehashing(d)) dictRehash(d,100);
+        assert(dictSlots(d) <= 256);
+        assert(dictMemUsage(d) == sizeof(dictOpenTable) +
+                                  dictSlots(d)/DICT_BUCKET_SLOTS*sizeof(dictBucket));
+        dictRelease(d);
+    }
+    printf("OK\n");
+
+    printf("Open addressing tables grow while a safe iterator is active: ");
+    {
+        dict *d = dictCreate(&BenchmarkOpenDictType,NULL);
+        dictIterator *di;
+        dictEntry *de;
+        unsigned char *seen;
+        long j, count, extra;
+
+        for (j = 0; !dictIsRehashing(d) || j < 1000; j++)
+            assert(dictAdd(d,sdsfromlonglong(j),(void*)j) == DICT_OK);
+        count = j;
+        /* Fill ht[1] while the rehashing is paused, so that the last
+         * elements have to be added to ht[0]. */
+        extra = _dictOpenMaxFill(d->ht[1].size,0) - d->ht[1].used + 8;
+        seen = zcalloc(count);
+        di = dictGetSafeIterator(d);
+        while((de = dictNext(di)) != NULL) {
+            long v = (long)dictGetVal(de);
+
+            if (v == 0) {
+                long rehashidx = d->rehashidx;
+                unsigned long size = d->ht[1].size;
+                for (j = count; j < count+extra; j++)
+                    assert(dictAdd(d,sdsfromlonglong(j),(void*)j) == DICT_OK);
+                /* Nothing was moved under the iterator. */
+                assert(d->rehashidx == rehashidx && d->ht[1].size == size);
+            }
+            if (v < count) {
+                assert(!seen[v]);
+                seen[v] = 1;
+            }
+        }
+        dictReleaseIterator(di);
+        for (j = 0; j < count; j++) assert(seen[j]);
+        assert((long)dictSize(d) == count+extra);
+        while(dictIsRehashing(d)) dictRehash(d,100);
+        for (j = 0; j < count+extra; j++) {
+            sds key = sdsfromlonglong(j);
+            de = dictFind(d,key);
+            assert(de != NULL && (long)dictGetVal(de) == j);
+            sdsfree(key);
+        }
+        zfree(seen);
+        dictRelease(d);
+    }
+    printf("OK\n");
+    return 0;
+}
+#endif
@@ -62,6 +62,12 @@ typedef struct dictType {
     int (*keyCompare)(void *privdata, const void *key1, const void *key2);
     void (*keyDestructor)(void *privdata, void *key);
     void (*valDestructor)(void *privdata, void *obj);
+    int openAddressing; /* Use an open addressing table, see dict.c. */
+    int segmented;      /* Chained table allocated in segments, see dict.c. */
+    /* Called before expanding the table when the expansion is not mandatory
+     * yet, with the memory it needs: if 0 is returned the table is not
+     * expanded for now. */
+    int (*expandAllowed)(size_t moreMem);
 } dictType;
 
 /* This is our hash table structure. Every dictionary has two of this as we
@@ -96,10 +102,18 @@ typedef struct dictIterator {
 
 typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
 typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
+typedef void (dictPrefetchValFunction)(const void *val);
 
 /* This is the initial size of every hash table */
 #define DICT_HT_INITIAL_SIZE     4
 
+/* Functions available for dictGenDataHashFunction(). */
+#define DICT_HASH_SIPHASH        0
+#define DICT_HASH_WYHASH         1
+
+/* Open addressing tables are made of buckets of DICT_BUCKET_SLOTS slots. */
+#define DICT_BUCKET_SLOTS        8
+
 /* ------------------------------- Macros ------------------------------------*/
 #define dictFreeVal(d, entry) \
     if ((d)->type->valDestructor) \
@@ -146,6 +160,8 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 #define dictSlots(d) ((d)->ht[0].size+(d)->ht[1].size)
 #define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
 #define dictIsRehashing(d) ((d)->rehashidx != -1)
+#define dictIsOpenAddressing(d) ((d)->type->openAddressing)
+#define dictIsSegmented(d) ((d)->type->segmented)
 
 /* API */
 dict *dictCreate(dictType *type, void *privDataPtr);
@@ -170,6 +186,8 @@ unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count);
 void dictGetStats(char *buf, size_t bufsize, dict *d);
 uint64_t dictGenHashFunction(const void *key, int len);
 uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len);
+uint64_t dictGenDataHashFunction(const void *key, int len);
+void dictSetDataHashFunction(int type);
 void dictEmpty(dict *d, void(callback)(void*));
 void dictEnableResize(void);
 void dictDisableResize(void);
@@ -180,6 +198,14 @@ uint8_t *dictGetHashFunctionSeed(void);
 unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, dictScanBucketFunction *bucketfn, void *privdata);
 uint64_t dictGetHash(dict *d, const void *key);
 dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t hash);
+dictEntry *dictFindEntryByPtrAndHash(dict *d, const void *oldptr, uint64_t hash);
+void dictPrefetch(dict **dicts, const uint64_t *hashes, int count, dictPrefetchValFunction *valfn);
+size_t dictMemUsage(const dict *d);
+size_t dictRehashingOverhead(const dict *d);
+
+#ifdef REDIS_TEST
+int dictTest(int argc, char **argv);
+#endif
 
 /* Hash table types */
 extern dictType dictTypeHeapStringCopyKey;
@@ -51,8 +51,10 @@
  * Empty entries have the key pointer set to NULL. */
 #define EVPOOL_SIZE 16
 #define EVPOOL_CACHED_SDS_SIZE 255
+#define EVPOOL_GDSF_SCORE_SCALE 1024 /* Resolution of the GDSF score. */
 struct evictionPoolEntry {
-    unsigned long long idle;    /* Object idle time (inverse frequency for LFU) */
+    unsigned long long idle;    /* Object idle time (inverse frequency for LFU,
+                                   bytes per access for GDSF) */
     sds key;                    /* Key name. */
     sds cached;                 /* Cached SDS object for key name. */
     int dbid;                   /* Key DB number. */
@@ -157,34 +159,53 @@ void evictionPoolAlloc(void) {
  *
  * We insert keys on place in ascending order, so keys with the smaller
  * idle time are on the left, and keys with the higher idle time on the
- * right. */
+ * right.
+ *
+ * The keys are sampled from the main dictionary of the DB when 'allkeys' is
+ * true, otherwise from its expire index. */
 
-void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evictionPoolEntry *pool) {
+void evictionPoolPopulate(int dbid, redisDb *db, int allkeys, struct evictionPoolEntry *pool) {
     int j, k, count;
     dictEntry *samples[server.maxmemory_samples];
+    sds keys[server.maxmemory_samples];
 
-    count = dictGetSomeKeys(sampledict,samples,server.maxmemory_samples);
+    if (allkeys) {
+        count = dbGetSomeEntries(db,samples,server.maxmemory_samples);
+        for (j = 0; j < count; j++) keys[j] = dictGetKey(samples[j]);
+    } else {
+        count = expireIndexGetSomeKeys(db->expires,keys,
+                                       server.maxmemory_samples);
+    }
     for (j = 0; j < count; j++) {
         unsigned long long idle;
-        sds key;
+        sds key = keys[j];
         robj *o;
-        dictEntry *de;
 
-        de = samples[j];
-        key = dictGetKey(de);
-
-        /* If the dictionary we are sampling from is not the main
-         * dictionary (but the expires one) we need to lookup the key
-         * again in the key dictionary to obtain the value object. */
+        /* If we are sampling the expire index we need to lookup the key in
+         * the main dictionary to obtain the value object. The expire time
+         * is stored with the key name itself. */
         if (server.maxmemory_policy != MAXMEMORY_VOLATILE_TTL) {
-            if (sampledict != keydict) de = dictFind(keydict, key);
-            o = dictGetVal(de);
+            o = allkeys ? dictGetVal(samples[j]) :
+                          dictGetVal(dictFind(dbDictForKey(db,key),key));
         }
 
         /* Calculate the idle time according to the policy. This is called
          * idle just because the code initially handled LRU, but is in fact
          * just a score where an higher score means better candidate. */
-        if (server.maxmemory_policy & MAXMEMORY_FLAG_LRU) {
+        if (server.maxmemory_policy & MAXMEMORY_FLAG_SIZE) {
+            /* GDSF policies rank the keys by frequency relatively to the
+             * memory they use, so we evict first the keys using more bytes
+             * per access: in order to reclaim a given amount of memory it is
+             * better to evict a big key than many small keys that together
+             * are accessed more often. The inflation term of the original
+             * algorithm is not needed since the LFU counter decays with
+             * time already. Only one element of aggregate values is
+             * sampled, since this is done for every key we sample. */
+            double accesses = LFUEstimateAccesses(LFUDecrAndReturn(o));
+            double bytes = keyComputeSize(key,o,1);
+
+            idle = bytes*EVPOOL_GDSF_SCORE_SCALE/accesses;
+        } else if (server.maxmemory_policy & MAXMEMORY_FLAG_LRU) {
             idle = estimateObjectIdleTime(o);
         } else if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
             /* When we use an LRU policy, we sort the keys by idle time
@@ -197,7 +218,7 @@ void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evic
             idle = 255-LFUDecrAndReturn(o);
         } else if (server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL) {
             /* In this case the sooner the expire the better. */
-            idle = ULLONG_MAX - (long)dictGetVal(de);
+            idle = ULLONG_MAX - keyExpireHeader(key)->when;
         } else {
             serverPanic("Unknown eviction policy in evictionPoolPopulate()");
         }
@@ -341,6 +362,20 @@ unsigned long LFUDecrAndReturn(robj *o) {
     return counter;
 }
 
+/* Return an estimation of the number of times an object was accessed, given
+ * its LFU counter, inverting LFULogIncr(): from a counter of LFU_INIT_VAL+N
+ * it takes on average N*lfu_log_factor+1 accesses to increment it. Counters
+ * under LFU_INIT_VAL, that are only obtained by decrementing the counter of
+ * objects not accessed for some time, are mapped to a fraction of access. */
+double LFUEstimateAccesses(unsigned long counter) {
+    double base;
+
+    if (counter <= LFU_INIT_VAL)
+        return (double)(counter+1)/(LFU_INIT_VAL+1);
+    base = counter-LFU_INIT_VAL;
+    return 1+base+server.lfu_log_factor*base*(base-1)/2;
+}
+
 /* ----------------------------------------------------------------------------
  * The external API for eviction: freeMemroyIfNeeded() is called by the
  * server when there is data to add in order to make space if needed.
@@ -348,10 +383,22 @@ unsigned long LFUDecrAndReturn(robj *o) {
 
 /* We don't want to count AOF buffers and slaves output buffers as
  * used memory: the eviction should use mostly data size. This function
- * returns the sum of AOF and slaves buffer. */
+ * returns the sum of AOF and slaves buffer.
+ *
+ * The same is true for the old tables of the keyspace dictionaries being
+ * rehashed: this memory is released as soon as the rehashing completes, so
+ * evicting keys because of it would free memory that we are going to get
+ * back anyway. Note that the expansion of the keyspace tables is refused
+ * in the first place when the new table would not fit in the memory limit,
+ * see dictExpandAllowed(). */
 size_t freeMemoryGetNotCountedMemory(void) {
     size_t overhead = 0;
     int slaves = listLength(server.slaves);
+    int j;
+
+    for (j = 0; j < server.dbnum; j++) {
+        overhead += dbDictsRehashingOverhead(server.db+j);
+    }
 
     if (slaves) {
         listIter li;
@@ -369,10 +416,23 @@ size_t freeMemoryGetNotCountedMemory(void) {
     return overhead;
 }
 
-/* Get the memory status from the point of view of the maxmemory directive:
- * if the memory used is under the maxmemory setting then C_OK is returned.
- * Otherwise, if we are over the memory limit, the function returns
- * C_ERR.
+/* Return true if allocating 'moremem' bytes would take the memory used,
+ * from the point of view of the maxmemory directive, over the limit. */
+int overMaxmemoryAfterAlloc(size_t moremem) {
+    size_t mem_used, overhead;
+
+    if (!server.maxmemory) return 0;
+    mem_used = zmalloc_used_memory();
+    if (mem_used + moremem <= server.maxmemory) return 0;
+    overhead = freeMemoryGetNotCountedMemory();
+    mem_used = (mem_used > overhead) ? mem_used-overhead : 0;
+    return mem_used + moremem > server.maxmemory;
+}
+
+/* Get the memory status from the point of view of a memory limit of
+ * 'limit' bytes, computed like the maxmemory directive does: if the memory
+ * used is under the limit then C_OK is returned. Otherwise, if we are over
+ * the limit, the function returns C_ERR.
  *
  * The function may return additional info via reference, only if the
  * pointers to the respective arguments is not NULL. Certain fields are
@@ -389,11 +449,14 @@ size_t freeMemoryGetNotCountedMemory(void) {
  *              (Populated when C_ERR is returned)
  *
  *  'level'     this usually ranges from 0 to 1, and reports the amount of
- *              memory currently used. May be > 1 if we are over the memory
- *              limit.
+ *              memory currently used relatively to the maxmemory setting.
+ *              May be > 1 if we are over the maxmemory limit.
  *              (Populated both for C_ERR and C_OK)
  */
-int getMaxmemoryState(size_t *total, size_t *logical, size_t *tofree, float *level) {
+static int getMemoryStateForLimit(size_t limit, size_t *total,
+                                  size_t *logical, size_t *tofree,
+                                  float *level)
+{
     size_t mem_reported, mem_used, mem_tofree;
 
     /* Check if we are over the memory usage limit. If we are not, no need
@@ -402,7 +465,7 @@ int getMaxmemoryState(size_t *total, size_t *logical, size_t *tofree, float *lev
     if (total) *total = mem_reported;
 
     /* We may return ASAP if there is no need to compute the level. */
-    int return_ok_asap = !server.maxmemory || mem_reported <= server.maxmemory;
+    int return_ok_asap = !limit || mem_reported <= limit;
     if (return_ok_asap && !level) return C_OK;
 
     /* Remove the size of slaves output buffers and AOF buffer from the
@@ -423,10 +486,10 @@ int getMaxmemoryState(size_t *total, size_t *logical, size_t *tofree, float *lev
     if (return_ok_asap) return C_OK;
 
     /* Check if we are still over the memory limit. */
-    if (mem_used <= server.maxmemory) return C_OK;
+    if (mem_used <= limit) return C_OK;
 
     /* Compute how much memory we need to free. */
-    mem_tofree = mem_used - server.maxmemory;
+    mem_tofree = mem_used - limit;
 
     if (logical) *logical = mem_used;
     if (tofree) *tofree = mem_tofree;
@@ -434,31 +497,37 @@ int getMaxmemoryState(size_t *total, size_t *logical, size_t *tofree, float *lev
     return C_ERR;
 }
 
-/* This function is periodically called to see if there is memory to free
- * according to the current "maxmemory" settings. In case we are over the
- * memory limit, the function will try to free some memory to return back
- * under the limit.
- *
- * The function returns C_OK if we are under the memory limit or if we
- * were over the limit, but the attempt to free memory was successful.
- * Otehrwise if we are over the memory limit, but not enough memory
- * was freed to return back under the limit, the function returns C_ERR. */
-int freeMemoryIfNeeded(void) {
-    /* By default replicas should ignore maxmemory
-     * and just be masters exact copies. */
-    if (server.masterhost && server.repl_slave_ignore_maxmemory) return C_OK;
+/* Get the memory status from the point of view of the maxmemory directive,
+ * see getMemoryStateForLimit(). */
+int getMaxmemoryState(size_t *total, size_t *logical, size_t *tofree, float *level) {
+    return getMemoryStateForLimit(server.maxmemory,total,logical,tofree,level);
+}
 
+/* Evict keys accordingly to the maxmemory policy until the memory used is
+ * under 'limit' bytes.
+ *
+ * When 'timelimit' is zero the function is called in the context of a
+ * command that needs memory: keys are evicted until enough memory is freed,
+ * and their values are released by the lazyfree thread only if
+ * lazyfree-lazy-eviction is set. Otherwise the function is called by
+ * activeEvictionCycle(): the values are always released by the lazyfree
+ * thread, and the function returns after 'timelimit' microseconds even if
+ * the memory used is still over the limit.
+ *
+ * The function returns C_OK if we are under the limit or if we were over
+ * the limit, but the attempt to free memory was successful. Otherwise
+ * C_ERR is returned. */
+static int performEvictions(size_t limit, long long timelimit) {
     size_t mem_reported, mem_tofree, mem_freed;
     mstime_t latency, eviction_latency;
-    long long delta;
+    int background = timelimit != 0;
+    long long delta, start = background ? ustime() : 0;
     int slaves = listLength(server.slaves);
+    int lazy = background || server.lazyfree_lazy_eviction;
+    unsigned long evicted = 0;
 
-    /* When clients are paused the dataset should be static not just from the
-     * POV of clients not being able to write, but also from the POV of
-     * expires and evictions of keys not being performed. */
-    if (clientsArePaused()) return C_OK;
-    if (getMaxmemoryState(&mem_reported,NULL,&mem_tofree,NULL) == C_OK)
-        return C_OK;
+    if (getMemoryStateForLimit(limit,&mem_reported,NULL,&mem_tofree,NULL) ==
+        C_OK) return C_OK;
 
     mem_freed = 0;
 
@@ -472,7 +541,6 @@ int freeMemoryIfNeeded(void) {
         sds bestkey = NULL;
         int bestdbid;
         redisDb *db;
-        dict *dict;
         dictEntry *de;
 
         if (server.maxmemory_policy & (MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_LFU) ||
@@ -482,16 +550,17 @@ int freeMemoryIfNeeded(void) {
 
             while(bestkey == NULL) {
                 unsigned long total_keys = 0, keys;
+                int allkeys = server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS;
 
                 /* We don't want to make local-db choices when expiring keys,
                  * so to start populate the eviction pool sampling keys from
                  * every DB. */
                 for (i = 0; i < server.dbnum; i++) {
                     db = server.db+i;
-                    dict = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
-                            db->dict : db->expires;
-                    if ((keys = dictSize(dict)) != 0) {
-                        evictionPoolPopulate(i, dict, db->dict, pool);
+                    keys = allkeys ? dbSize(db) :
+                                     expireIndexSize(db->expires);
+                    if (keys != 0) {
+                        evictionPoolPopulate(i, db, allkeys, pool);
                         total_keys += keys;
                     }
                 }
@@ -502,13 +571,11 @@ int freeMemoryIfNeeded(void) {
                     if (pool[k].key == NULL) continue;
                     bestdbid = pool[k].dbid;
 
-                    if (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) {
-                        de = dictFind(server.db[pool[k].dbid].dict,
-                            pool[k].key);
-                    } else {
-                        de = dictFind(server.db[pool[k].dbid].expires,
-                            pool[k].key);
-                    }
+                    db = server.db+pool[k].dbid;
+                    de = dictFind(dbDictForKey(db,pool[k].key),pool[k].key);
+                    /* Volatile policies only evict keys with an expire. */
+                    if (de && !allkeys &&
+                        keyGetExpire((sds)dictGetKey(de)) == -1) de = NULL;
 
                     /* Remove the entry from the pool. */
                     if (pool[k].key != pool[k].cached)
@@ -538,11 +605,13 @@ int freeMemoryIfNeeded(void) {
             for (i = 0; i < server.dbnum; i++) {
                 j = (++next_db) % server.dbnum;
                 db = server.db+j;
-                dict = (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM) ?
-                        db->dict : db->expires;
-                if (dictSize(dict) != 0) {
-                    de = dictGetRandomKey(dict);
-                    bestkey = dictGetKey(de);
+                if (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM) {
+                    if ((de = dbRandomEntry(db)) != NULL)
+                        bestkey = dictGetKey(de);
+                } else {
+                    bestkey = expireIndexRandomKey(db->expires);
+                }
+                if (bestkey) {
                     bestdbid = j;
                     break;
                 }
@@ -553,7 +622,7 @@ int freeMemoryIfNeeded(void) {
         if (bestkey) {
             db = server.db+bestdbid;
             robj *keyobj = createStringObject(bestkey,sdslen(bestkey));
-            propagateExpire(db,keyobj,server.lazyfree_lazy_eviction);
+            propagateExpire(db,keyobj,lazy);
             /* We compute the amount of memory freed by db*Delete() alone.
              * It is possible that actually the memory needed to propagate
              * the DEL in AOF and replication link is greater than the one
@@ -564,7 +633,7 @@ int freeMemoryIfNeeded(void) {
              * we only care about memory used by the key space. */
             delta = (long long) zmalloc_used_memory();
             latencyStartMonitor(eviction_latency);
-            if (server.lazyfree_lazy_eviction)
+            if (lazy)
                 dbAsyncDelete(db,keyobj);
             else
                 dbSyncDelete(db,keyobj);
@@ -578,6 +647,7 @@ int freeMemoryIfNeeded(void) {
                 keyobj, db->id);
             decrRefCount(keyobj);
             keys_freed++;
+            evicted++;
 
             /* When the memory to free starts to be big enough, we may
              * start spending so much time here that is impossible to
@@ -592,25 +662,31 @@ int freeMemoryIfNeeded(void) {
              * memory, since the "mem_freed" amount is computed only
              * across the dbAsyncDelete() call, while the thread can
              * release the memory all the time. */
-            if (server.lazyfree_lazy_eviction && !(keys_freed % 16)) {
-                if (getMaxmemoryState(NULL,NULL,NULL,NULL) == C_OK) {
+            if (lazy && !(evicted % 16)) {
+                if (getMemoryStateForLimit(limit,NULL,NULL,NULL,NULL) ==
+                    C_OK)
+                {
                     /* Let's satisfy our stop condition. */
                     mem_freed = mem_tofree;
                 }
             }
-        }
 
-        if (!keys_freed) {
-            latencyEndMonitor(latency);
-            latencyAddSampleIfNeeded("eviction-cycle",latency);
-            goto cant_free; /* nothing to free... */
+            /* In the background we only evict for a small amount of time,
+             * the next step will continue the work. */
+            if (background && !(evicted % 16) &&
+                ustime()-start > timelimit) break;
         }
+
+        if (!keys_freed) break; /* nothing to free... */
     }
     latencyEndMonitor(latency);
-    latencyAddSampleIfNeeded("eviction-cycle",latency);
-    return C_OK;
+    latencyAddSampleIfNeeded(background ? "eviction-background" :
+                                          "eviction-cycle",latency);
+    if (mem_freed >= mem_tofree) return C_OK;
 
 cant_free:
+    if (background) return C_ERR;
+
     /* We are here if we are not able to reclaim memory. There is only one
      * last thing we can try: check if the lazyfree thread has jobs in queue
      * and wait... */
@@ -622,6 +698,27 @@ cant_free:
     return C_ERR;
 }
 
+/* This function is periodically called to see if there is memory to free
+ * according to the current "maxmemory" settings. In case we are over the
+ * memory limit, the function will try to free some memory to return back
+ * under the limit.
+ *
+ * The function returns C_OK if we are under the memory limit or if we
+ * were over the limit, but the attempt to free memory was successful.
+ * Otehrwise if we are over the memory limit, but not enough memory
+ * was freed to return back under the limit, the function returns C_ERR. */
+int freeMemoryIfNeeded(void) {
+    /* By default replicas should ignore maxmemory
+     * and just be masters exact copies. */
+    if (server.masterhost && server.repl_slave_ignore_maxmemory) return C_OK;
+
+    /* When clients are paused the dataset should be static not just from the
+     * POV of clients not being able to write, but also from the POV of
+     * expires and evictions of keys not being performed. */
+    if (clientsArePaused()) return C_OK;
+    return performEvictions(server.maxmemory,0);
+}
+
 /* This is a wrapper for freeMemoryIfNeeded() that only really calls the
  * function if right now there are the conditions to do so safely:
  *
@@ -633,3 +730,51 @@ int freeMemoryIfNeededAndSafe(void) {
     if (server.lua_timedout || server.loading) return C_OK;
     return freeMemoryIfNeeded();
 }
+
+/* This function is called when the maxmemory-eviction-headroom option is
+ * set, in order to keep the memory used under maxmemory minus the
+ * configured headroom. Keys are evicted in time bounded steps with their
+ * values released by the lazyfree thread, so that commands rarely need to
+ * evict keys themselves, evicting and freeing a big amount of memory before
+ * being executed.
+ *
+ * Like activeExpireCycle() there are two kinds of cycles: the fast one is
+ * called at every event loop iteration and runs for at most
+ * ACTIVE_EVICTION_CYCLE_FAST_DURATION microseconds. The slow one is called
+ * by serverCron(), so that keys are evicted at a good pace even when the
+ * server is idle or busy serving other clients, and it can use up to
+ * ACTIVE_EVICTION_CYCLE_SLOW_TIME_PERC percent of the CPU time between two
+ * calls, in proportion to how much of the headroom is used. */
+void activeEvictionCycle(int type) {
+    size_t limit, tofree, headroom;
+    long long timelimit = ACTIVE_EVICTION_CYCLE_FAST_DURATION;
+
+    if (!server.maxmemory || !server.maxmemory_eviction_headroom ||
+        server.maxmemory_policy == MAXMEMORY_NO_EVICTION) return;
+
+    /* Same conditions of freeMemoryIfNeeded() and
+     * freeMemoryIfNeededAndSafe(). */
+    if (server.masterhost && server.repl_slave_ignore_maxmemory) return;
+    if (clientsArePaused() || server.lua_timedout || server.loading) return;
+
+    /* Wait for the lazyfree thread to release the values of the keys
+     * already evicted, otherwise we would evict more keys than needed. */
+    if (bioPendingJobsOfType(BIO_LAZY_FREE)) return;
+
+    limit = server.maxmemory/100*(100-server.maxmemory_eviction_headroom);
+    if (getMemoryStateForLimit(limit,NULL,NULL,&tofree,NULL) == C_OK) return;
+
+    if (type == ACTIVE_EVICTION_CYCLE_SLOW) {
+        long long maxtime = 1000000*ACTIVE_EVICTION_CYCLE_SLOW_TIME_PERC/
+                            server.hz/100;
+
+        headroom = server.maxmemory-limit;
+        if (tofree < headroom)
+            timelimit = (long long)(maxtime*((double)tofree/headroom));
+        else
+            timelimit = maxtime;
+        if (timelimit < ACTIVE_EVICTION_CYCLE_FAST_DURATION)
+            timelimit = ACTIVE_EVICTION_CYCLE_FAST_DURATION;
+    }
+    performEvictions(limit,timelimit);
+}
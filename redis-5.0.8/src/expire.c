@@ -32,6 +32,222 @@
 
 #include "server.h"
 
+/*-----------------------------------------------------------------------------
+ * Expire index, see the expireIndex structure in server.h.
+ *----------------------------------------------------------------------------*/
+
+#define expireIndexSlot(idx,pos) \
+    ((idx)->segments[(pos)/EXPIRE_INDEX_SEGMENT_LEN]+ \
+     (pos)%EXPIRE_INDEX_SEGMENT_LEN)
+
+expireIndex *expireIndexCreate(void) {
+    expireIndex *idx = zmalloc(sizeof(*idx));
+
+    idx->segments = NULL;
+    idx->numsegments = 0;
+    idx->dirsize = 0;
+    idx->size = 0;
+    return idx;
+}
+
+/* Remove all the keys from the index. The key names are owned by the
+ * keyspace, so they are not released. */
+void expireIndexEmpty(expireIndex *idx) {
+    unsigned long j;
+
+    for (j = 0; j < idx->numsegments; j++) zfree(idx->segments[j]);
+    zfree(idx->segments);
+    idx->segments = NULL;
+    idx->numsegments = 0;
+    idx->dirsize = 0;
+    idx->size = 0;
+}
+
+void expireIndexRelease(expireIndex *idx) {
+    expireIndexEmpty(idx);
+    zfree(idx);
+}
+
+/* Store the key name 'key' at the position 'pos' of the index. */
+static inline void expireIndexStore(expireIndex *idx, unsigned long pos,
+                                    sds key)
+{
+    *expireIndexSlot(idx,pos) = key;
+    keyExpireHeader(key)->pos = pos;
+}
+
+/* Move the key at position 'pos' up or down the heap, until it is at the
+ * place its expire time belongs to. */
+static void expireIndexSift(expireIndex *idx, unsigned long pos) {
+    sds key = *expireIndexSlot(idx,pos), other;
+    long long when = keyExpireHeader(key)->when;
+    unsigned long child;
+
+    /* Up, while the parent expires later. */
+    while (pos > 0) {
+        other = *expireIndexSlot(idx,(pos-1)/2);
+        if (keyExpireHeader(other)->when <= when) break;
+        expireIndexStore(idx,pos,other);
+        pos = (pos-1)/2;
+    }
+
+    /* Down, while the child expiring first expires earlier. */
+    while ((child = pos*2+1) < idx->size) {
+        other = *expireIndexSlot(idx,child);
+        if (child+1 < idx->size) {
+            sds right = *expireIndexSlot(idx,child+1);
+
+            if (keyExpireHeader(right)->when < keyExpireHeader(other)->when) {
+                other = right;
+                child++;
+            }
+        }
+        if (keyExpireHeader(other)->when >= when) break;
+        expireIndexStore(idx,pos,other);
+        pos = child;
+    }
+    expireIndexStore(idx,pos,key);
+}
+
+/* Add the key name 'key', that must have a keyExpire header with the expire
+ * time already set, to the index. */
+static void expireIndexAdd(expireIndex *idx, sds key) {
+    if (idx->size == idx->numsegments*EXPIRE_INDEX_SEGMENT_LEN) {
+        if (idx->numsegments == idx->dirsize) {
+            idx->dirsize = idx->dirsize ? idx->dirsize*2 : 1;
+            idx->segments = zrealloc(idx->segments,
+                                     sizeof(sds*)*idx->dirsize);
+        }
+        idx->segments[idx->numsegments++] =
+            zmalloc(sizeof(sds)*EXPIRE_INDEX_SEGMENT_LEN);
+    }
+    expireIndexStore(idx,idx->size,key);
+    idx->size++;
+    expireIndexSift(idx,idx->size-1);
+}
+
+/* Set the expire time of the key name 'key', that must have a keyExpire
+ * header, to 'when'. The key is added to the index if it had no expire,
+ * otherwise it is moved to its new place. */
+void expireIndexSetExpire(expireIndex *idx, sds key, long long when) {
+    keyExpire *ke = keyExpireHeader(key);
+
+    if (ke->when == -1) {
+        ke->when = when;
+        expireIndexAdd(idx,key);
+    } else {
+        serverAssert(ke->pos < idx->size &&
+                     *expireIndexSlot(idx,ke->pos) == key);
+        ke->when = when;
+        expireIndexSift(idx,ke->pos);
+    }
+}
+
+/* Remove the key name 'key' from the index. The last key of the index is
+ * moved in its place, and then to the place its expire time belongs to. */
+void expireIndexDelete(expireIndex *idx, sds key) {
+    unsigned long pos = keyExpireHeader(key)->pos;
+
+    serverAssert(pos < idx->size && *expireIndexSlot(idx,pos) == key);
+    idx->size--;
+    if (pos != idx->size) {
+        expireIndexStore(idx,pos,*expireIndexSlot(idx,idx->size));
+        expireIndexSift(idx,pos);
+    }
+
+    /* Release the last segment only when the one before it is unused as
+     * well, so that adding and removing a key at the boundary of a segment
+     * does not allocate and release a segment every time. The directory
+     * is never shrunk: it takes a pointer every EXPIRE_INDEX_SEGMENT_LEN
+     * keys. */
+    if ((idx->numsegments-1)*EXPIRE_INDEX_SEGMENT_LEN >=
+        idx->size+EXPIRE_INDEX_SEGMENT_LEN)
+    {
+        zfree(idx->segments[--idx->numsegments]);
+    }
+}
+
+/* Make the index reference 'newkey' instead of 'oldkey', at the same
+ * position. Used when the name of a key with an expire is moved to a new
+ * allocation: the caller is responsible of copying the expire time before
+ * calling this function. */
+void expireIndexReplace(expireIndex *idx, sds oldkey, sds newkey) {
+    unsigned long pos = keyExpireHeader(oldkey)->pos;
+
+    serverAssert(pos < idx->size && *expireIndexSlot(idx,pos) == oldkey);
+    *expireIndexSlot(idx,pos) = newkey;
+    keyExpireHeader(newkey)->pos = pos;
+}
+
+/* Make the index reference the key name 'key' at the position stored in its
+ * keyExpire header, after the name was moved to a new address (for instance
+ * by the active defragmentation). */
+void expireIndexUpdate(expireIndex *idx, sds key) {
+    unsigned long pos = keyExpireHeader(key)->pos;
+
+    serverAssert(pos < idx->size);
+    *expireIndexSlot(idx,pos) = key;
+}
+
+/* Return the key name expiring first, or NULL if the index is empty. */
+sds expireIndexFirstKey(expireIndex *idx) {
+    return idx->size ? *expireIndexSlot(idx,0) : NULL;
+}
+
+/* Return a random position of the index, that must not be empty. */
+static unsigned long expireIndexRandomPos(expireIndex *idx) {
+    unsigned long r = random();
+
+    if (idx->size > RAND_MAX) r = (r << 31) | random();
+    return r % idx->size;
+}
+
+/* Return a random key name of the index, or NULL if the index is empty. */
+sds expireIndexRandomKey(expireIndex *idx) {
+    unsigned long pos;
+
+    if (idx->size == 0) return NULL;
+    pos = expireIndexRandomPos(idx);
+    return *expireIndexSlot(idx,pos);
+}
+
+/* Store in 'keys' up to 'count' key names sampled at random, and return
+ * the number of names stored. When the index has no more than 'count' keys
+ * all of them are returned, otherwise the same key may be returned more
+ * than once, like dictGetSomeKeys() does. */
+unsigned int expireIndexGetSomeKeys(expireIndex *idx, sds *keys,
+                                    unsigned int count)
+{
+    unsigned int j;
+
+    if (idx->size <= count) {
+        for (j = 0; j < idx->size; j++) keys[j] = *expireIndexSlot(idx,j);
+        return idx->size;
+    }
+    for (j = 0; j < count; j++) {
+        unsigned long pos = expireIndexRandomPos(idx);
+
+        keys[j] = *expireIndexSlot(idx,pos);
+    }
+    return count;
+}
+
+/* Return the memory used by the index, not counting the key names. */
+size_t expireIndexMemUsage(expireIndex *idx) {
+    return sizeof(*idx)+
+           idx->dirsize*sizeof(sds*)+
+           idx->numsegments*EXPIRE_INDEX_SEGMENT_LEN*sizeof(sds);
+}
+
+/* Write a description of the index in 'buf', for DEBUG HTSTATS. */
+void expireIndexGetStats(char *buf, size_t bufsize, expireIndex *idx) {
+    snprintf(buf,bufsize,
+        " number of keys: %lu\n"
+        " segments: %lu of %d slots\n"
+        " directory size: %lu\n",
+        idx->size, idx->numsegments, EXPIRE_INDEX_SEGMENT_LEN, idx->dirsize);
+}
+
 /*-----------------------------------------------------------------------------
  * Incremental collection of expired keys.
  *
@@ -41,8 +257,8 @@
  *----------------------------------------------------------------------------*/
 
 /* Helper function for the activeExpireCycle() function.
- * This function will try to expire the key that is stored in the hash table
- * entry 'de' of the 'expires' hash table of a Redis database.
+ * This function will try to expire the key 'key' of a Redis database, that
+ * is the name of the key in the keyspace and must have an expire set.
  *
  * If the key is found to be expired, it is removed from the database and
  * 1 is returned. Otherwise no operation is performed and 0 is returned.
@@ -51,10 +267,9 @@
  *
  * The parameter 'now' is the current time in milliseconds as is passed
  * to the function to avoid too many gettimeofday() syscalls. */
-int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
-    long long t = dictGetSignedIntegerVal(de);
+int activeExpireCycleTryExpire(redisDb *db, sds key, long long now) {
+    long long t = keyExpireHeader(key)->when;
     if (now > t) {
-        sds key = dictGetKey(de);
         robj *keyobj = createStringObject(key,sdslen(key));
 
         propagateExpire(db,keyobj,server.lazyfree_lazy_expire);
@@ -72,10 +287,14 @@ int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
     }
 }
 
-/* Try to expire a few timed out keys. The algorithm used is adaptive and
- * will use few CPU cycles if there are few expiring keys, otherwise
- * it will get more aggressive to avoid that too much memory is used by
- * keys that can be removed from the keyspace.
+/* Try to expire a few timed out keys. Since the index of the keys with an
+ * expire keeps the key expiring first at its head, the keys already expired
+ * are reclaimed in order, stopping as soon as a key not yet expired is
+ * found: no CPU is spent on keys that are not expired yet, and keys are
+ * reclaimed as soon as possible regardless of how many other keys with
+ * a longer TTL are in the database. A few random keys are still sampled
+ * for every database in order to estimate the average TTL and the number
+ * of keys that are already logically expired but still existing.
  *
  * No more than CRON_DBS_PER_CALL databases are tested at every
  * iteration.
@@ -101,7 +320,8 @@ void activeExpireCycle(int type) {
     static int timelimit_exit = 0;      /* Time limit hit in previous call? */
     static long long last_fast_cycle = 0; /* When last fast cycle ran. */
 
-    int j, iteration = 0;
+    int j;
+    unsigned long expired = 0;
     int dbs_per_call = CRON_DBS_PER_CALL;
     long long start = ustime(), timelimit, elapsed;
 
@@ -140,83 +360,83 @@ void activeExpireCycle(int type) {
     if (type == ACTIVE_EXPIRE_CYCLE_FAST)
         timelimit = ACTIVE_EXPIRE_CYCLE_FAST_DURATION; /* in microseconds. */
 
-    /* Accumulate some global stats as we expire keys, to have some idea
+    /* Accumulate some global stats as we sample keys, to have some idea
      * about the number of keys that are already logically expired, but still
      * existing inside the database. */
     long total_sampled = 0;
-    long total_expired = 0;
+    long total_stale = 0;
 
     for (j = 0; j < dbs_per_call && timelimit_exit == 0; j++) {
-        int expired;
         redisDb *db = server.db+(current_db % server.dbnum);
+        sds keys[ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP], key;
+        unsigned int num, k;
+        long long now, ttl_sum = 0;
+        int ttl_samples = 0;
 
         /* Increment the DB now so we are sure if we run out of time
          * in the current DB we'll restart from the next. This allows to
          * distribute the time evenly across DBs. */
         current_db++;
 
-        /* Continue to expire if at the end of the cycle more than 25%
-         * of the keys were expired. */
-        do {
-            unsigned long num, slots;
-            long long now, ttl_sum;
-            int ttl_samples;
-            iteration++;
-
-            /* If there is nothing to expire try next DB ASAP. */
-            if ((num = dictSize(db->expires)) == 0) {
-                db->avg_ttl = 0;
+        /* Reclaim the expired fields of hashes, a hash at a time starting
+         * from the one with the field expiring first. */
+        while (raxSize(db->hexpires_order)) {
+            unsigned long fields = hashTypeActiveExpire(db);
+
+            if (fields == 0) break;
+            expired += fields;
+            if (ustime()-start > timelimit) {
+                timelimit_exit = 1;
+                server.stat_expired_time_cap_reached_count++;
                 break;
             }
-            slots = dictSlots(db->expires);
-            now = mstime();
-
-            /* When there are less than 1% filled slots getting random
-             * keys is expensive, so stop here waiting for better times...
-             * The dictionary will be resized asap. */
-            if (num && slots > DICT_HT_INITIAL_SIZE &&
-                (num*100/slots < 1)) break;
-
-            /* The main collection cycle. Sample random keys among keys
-             * with an expire set, checking for expired ones. */
-            expired = 0;
-            ttl_sum = 0;
-            ttl_samples = 0;
-
-            if (num > ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP)
-                num = ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP;
-
-            while (num--) {
-                dictEntry *de;
-                long long ttl;
-
-                if ((de = dictGetRandomKey(db->expires)) == NULL) break;
-                ttl = dictGetSignedIntegerVal(de)-now;
-                if (activeExpireCycleTryExpire(db,de,now)) expired++;
-                if (ttl > 0) {
-                    /* We want the average TTL of keys yet not expired. */
-                    ttl_sum += ttl;
-                    ttl_samples++;
-                }
-                total_sampled++;
+        }
+        if (timelimit_exit) break;
+
+        /* If there is nothing to expire try next DB ASAP. */
+        if (expireIndexSize(db->expires) == 0) {
+            db->avg_ttl = 0;
+            continue;
+        }
+        now = mstime();
+
+        /* Sample a few random keys for the stats, before expiring anything
+         * so that the sample is not biased by the keys reclaimed below. */
+        num = expireIndexGetSomeKeys(db->expires,keys,
+                                     ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP);
+        for (k = 0; k < num; k++) {
+            long long ttl = keyExpireHeader(keys[k])->when-now;
+
+            if (ttl > 0) {
+                /* We want the average TTL of keys yet not expired. */
+                ttl_sum += ttl;
+                ttl_samples++;
+            } else if (ttl < 0) {
+                total_stale++;
             }
-            total_expired += expired;
+            total_sampled++;
+        }
 
-            /* Update the average TTL stats for this database. */
-            if (ttl_samples) {
-                long long avg_ttl = ttl_sum/ttl_samples;
+        /* Update the average TTL stats for this database. */
+        if (ttl_samples) {
+            long long avg_ttl = ttl_sum/ttl_samples;
 
-                /* Do a simple running average with a few samples.
-                 * We just use the current estimate with a weight of 2%
-                 * and the previous estimate with a weight of 98%. */
-                if (db->avg_ttl == 0) db->avg_ttl = avg_ttl;
-                db->avg_ttl = (db->avg_ttl/50)*49 + (avg_ttl/50);
-            }
+            /* Do a simple running average with a few samples.
+             * We just use the current estimate with a weight of 2%
+             * and the previous estimate with a weight of 98%. */
+            if (db->avg_ttl == 0) db->avg_ttl = avg_ttl;
+            db->avg_ttl = (db->avg_ttl/50)*49 + (avg_ttl/50);
+        }
 
+        /* The main collection cycle. Reclaim the keys at the head of the
+         * index while they are expired. */
+        while ((key = expireIndexFirstKey(db->expires)) != NULL &&
+               activeExpireCycleTryExpire(db,key,now))
+        {
             /* We can't block forever here even if there are many keys to
              * expire. So after a given amount of milliseconds return to the
              * caller waiting for the other active expire cycle. */
-            if ((iteration & 0xf) == 0) { /* check once every 16 iterations. */
+            if ((++expired & 0xf) == 0) { /* check once every 16 keys. */
                 elapsed = ustime()-start;
                 if (elapsed > timelimit) {
                     timelimit_exit = 1;
@@ -224,9 +444,7 @@ void activeExpireCycle(int type) {
                     break;
                 }
             }
-            /* We don't repeat the cycle if there are less than 25% of keys
-             * found expired in the current DB. */
-        } while (expired > ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP/4);
+        }
     }
 
     elapsed = ustime()-start;
@@ -236,7 +454,7 @@ void activeExpireCycle(int type) {
      * Running average with this sample accounting for 5%. */
     double current_perc;
     if (total_sampled) {
-        current_perc = (double)total_expired/total_sampled;
+        current_perc = (double)total_stale/total_sampled;
     } else
         current_perc = 0;
     server.stat_expired_stale_perc = (current_perc*0.05)+
@@ -300,11 +518,12 @@ void expireSlaveKeys(void) {
         while(dbids && dbid < server.dbnum) {
             if ((dbids & 1) != 0) {
                 redisDb *db = server.db+dbid;
-                dictEntry *expire = dictFind(db->expires,keyname);
-                int expired = 0;
+                dictEntry *de = dictFind(dbDictForKey(db,keyname),keyname);
+                sds key = de ? dictGetKey(de) : NULL;
+                int expire = key && keyGetExpire(key) != -1, expired = 0;
 
                 if (expire &&
-                    activeExpireCycleTryExpire(server.db+dbid,expire,start))
+                    activeExpireCycleTryExpire(server.db+dbid,key,start))
                 {
                     expired = 1;
                 }
@@ -376,6 +376,11 @@ sds createLatencyReport(void) {
             advices++;
         }
 
+        if (!strcasecmp(event,"eviction-background")) {
+            advise_large_objects = 1;
+            advices++;
+        }
+
         report = sdscatlen(report,"\n",1);
     }
     dictReleaseIterator(di);
@@ -52,16 +52,16 @@ size_t lazyfreeGetFreeEffort(robj *obj) {
  * will be reclaimed in a different bio.c thread. */
 #define LAZYFREE_THRESHOLD 64
 int dbAsyncDelete(redisDb *db, robj *key) {
-    /* Deleting an entry from the expires dict will not free the sds of
-     * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
-
     /* If the value is composed of a few allocations, to free in a lazy way
      * is actually just slower... So under a certain limit we just free
      * the object synchronously. */
-    dictEntry *de = dictUnlink(db->dict,key->ptr);
+    int didx = dbDictIndex(db,key->ptr);
+    dictEntry *de = dictUnlink(db->dicts[didx],key->ptr);
     if (de) {
         robj *val = dictGetVal(de);
+        if (val->type == OBJ_HASH) hashTypeDeleteFieldExpires(db,key->ptr);
+        dbUpdateDictSize(db,didx,-1);
+        dbRemoveKeyExpire(db,dictGetKey(de));
         size_t free_effort = lazyfreeGetFreeEffort(val);
 
         /* If releasing the object is too much work, do it in the background
@@ -75,15 +75,14 @@ int dbAsyncDelete(redisDb *db, robj *key) {
         if (free_effort > LAZYFREE_THRESHOLD && val->refcount == 1) {
             atomicIncr(lazyfree_objects,1);
             bioCreateBackgroundJob(BIO_LAZY_FREE,val,NULL,NULL);
-            dictSetVal(db->dict,de,NULL);
+            dictSetVal(db->dicts[didx],de,NULL);
         }
     }
 
     /* Release the key-val pair, or just the key if we set the val
      * field to NULL in order to lazy free it later. */
     if (de) {
-        dictFreeUnlinkedEntry(db->dict,de);
-        if (server.cluster_enabled) slotToKeyDel(key);
+        dictFreeUnlinkedEntry(db->dicts[didx],de);
         return 1;
     } else {
         return 0;
@@ -105,23 +104,20 @@ void freeObjAsync(robj *o) {
  * create a new empty set of hash tables and scheduling the old ones for
  * lazy freeing. */
 void emptyDbAsync(redisDb *db) {
-    dict *oldht1 = db->dict, *oldht2 = db->expires;
-    db->dict = dictCreate(&dbDictType,NULL);
-    db->expires = dictCreate(&keyptrDictType,NULL);
-    atomicIncr(lazyfree_objects,dictSize(oldht1));
-    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,oldht1,oldht2);
-}
-
-/* Empty the slots-keys map of Redis CLuster by creating a new empty one
- * and scheduiling the old for lazy freeing. */
-void slotToKeyFlushAsync(void) {
-    rax *old = server.cluster->slots_to_keys;
+    redisDb *old = zmalloc(sizeof(*old));
 
-    server.cluster->slots_to_keys = raxNew();
-    memset(server.cluster->slots_keys_count,0,
-           sizeof(server.cluster->slots_keys_count));
-    atomicIncr(lazyfree_objects,old->numele);
-    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,NULL,old);
+    /* The bio thread will decrement the reference count of the values
+     * concurrently with the main thread: make sure no client output buffer
+     * is still referencing any of them. */
+    unreferenceClientsReplyObjects();
+    /* The field expires of the hashes are only referenced by the main
+     * thread, so they are released right now. */
+    hashTypeEmptyFieldExpires(db);
+    *old = *db;
+    dbCreateDicts(db,old->dicts[0]->type,old->numdicts);
+    db->expires = expireIndexCreate();
+    atomicIncr(lazyfree_objects,dbSize(old));
+    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,old,NULL);
 }
 
 /* Release objects from the lazyfree thread. It's just decrRefCount()
@@ -131,22 +127,20 @@ void lazyfreeFreeObjectFromBioThread(robj *o) {
     atomicDecr(lazyfree_objects,1);
 }
 
-/* Release a database from the lazyfree thread. The 'db' pointer is the
- * database which was substitutied with a fresh one in the main thread
- * when the database was logically deleted. 'sl' is a skiplist used by
- * Redis Cluster in order to take the hash slots -> keys mapping. This
- * may be NULL if Redis Cluster is disabled. */
-void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2) {
-    size_t numkeys = dictSize(ht1);
-    dictRelease(ht1);
-    dictRelease(ht2);
-    atomicDecr(lazyfree_objects,numkeys);
-}
+/* Release a database from the lazyfree thread. The 'db' pointer is a copy
+ * of the database which was substitutied with a fresh one in the main thread
+ * when the database was logically deleted: its keyspace tables and expire
+ * index are released, together with the copy itself. */
+void lazyfreeFreeDatabaseFromBioThread(redisDb *db) {
+    size_t numkeys = dbSize(db);
+    int j;
 
-/* Release the skiplist mapping Redis Cluster keys to slots in the
- * lazyfree thread. */
-void lazyfreeFreeSlotsMapFromBioThread(rax *rt) {
-    size_t len = rt->numele;
-    raxFree(rt);
-    atomicDecr(lazyfree_objects,len);
+    expireIndexRelease(db->expires);
+    for (j = 0; j < db->numdicts; j++) dictRelease(db->dicts[j]);
+    zfree(db->dicts);
+    zfree(db->dicts_index);
+    zfree(db->dicts_pending);
+    zfree(db->dicts_queued);
+    zfree(db);
+    atomicDecr(lazyfree_objects,numkeys);
 }
@@ -801,3 +801,501 @@ unsigned char *lpSeek(unsigned char *lp, long index) {
     }
 }
 
+
+/* Insert the element 'ele' of length 'size' at the head of the listpack. It
+ * is implemented in terms of lpInsert(), so the return value is the same as
+ * lpInsert(). */
+unsigned char *lpPrepend(unsigned char *lp, unsigned char *ele, uint32_t size) {
+    unsigned char *p = lp+LP_HDR_SIZE; /* First element, or EOF. */
+    return lpInsert(lp,ele,size,p,LP_BEFORE,NULL);
+}
+
+/* Replace the element pointed by '*p' with the element 'ele' of length
+ * 'size', and return the resulting listpack. '*p' is updated to point to the
+ * new element. */
+unsigned char *lpReplace(unsigned char *lp, unsigned char **p, unsigned char *ele, uint32_t size) {
+    return lpInsert(lp,ele,size,*p,LP_REPLACE,p);
+}
+
+/* Return the listpack element pointed by 'p' like the ziplistGet() API does:
+ * if the element is a string the function returns a pointer to the string,
+ * with its length stored in '*slen'. Otherwise the element is an integer,
+ * NULL is returned and the integer is stored in '*lval'. */
+unsigned char *lpGetValue(unsigned char *p, unsigned int *slen, long long *lval) {
+    unsigned char *vstr;
+    int64_t ele_len;
+
+    vstr = lpGet(p,&ele_len,NULL);
+    if (vstr) {
+        *slen = ele_len;
+    } else {
+        *lval = ele_len;
+    }
+    return vstr;
+}
+
+/* Return 1 if the element pointed by 'p' is equal to the string 's' of
+ * length 'slen', otherwise 0 is returned. Since strings representing an
+ * integer are always stored as integers, only those strings can match an
+ * integer element. */
+int lpCompare(unsigned char *p, unsigned char *s, uint32_t slen) {
+    unsigned char *value;
+    int64_t len, sval;
+
+    value = lpGet(p,&len,NULL);
+    if (value) return len == slen && memcmp(value,s,slen) == 0;
+    return lpStringToInt64((const char*)s,slen,&sval) && sval == len;
+}
+
+/* Find the element equal to the string 's' of length 'slen', starting the
+ * search from the element pointed by 'p' and comparing one element every
+ * 'skip'+1 elements (so that with 'skip' set to 1 only the fields of a
+ * listpack of field-value pairs are compared). Returns the pointer to the
+ * element found, or NULL if there is no such element.
+ *
+ * Since every element is stored with the smallest encoding that can
+ * represent it, 's' has a single possible encoding: it is computed once,
+ * so that the elements are compared as raw bytes without decoding them.
+ * The first byte of the encoding (that for strings shorter than 64 bytes
+ * is also the length) rejects almost all the elements that don't match,
+ * so most elements are just skipped. */
+unsigned char *lpFind(unsigned char *lp, unsigned char *p, unsigned char *s, uint32_t slen, unsigned int skip) {
+    unsigned char hdr[LP_MAX_INT_ENCODING_LEN];
+    uint32_t hdrlen, paylen;
+    uint64_t enclen;
+    unsigned int skipcnt = 0;
+    unsigned char last;
+
+    ((void) lp);
+    if (lpEncodeGetType(s,slen,hdr,&enclen) == LP_ENCODING_INT) {
+        hdrlen = enclen;
+        paylen = 0;
+    } else {
+        /* Only the header of the string is encoded, the payload is
+         * compared directly against 's'. */
+        if (slen < 64) {
+            hdr[0] = slen | LP_ENCODING_6BIT_STR;
+        } else if (slen < 4096) {
+            hdr[0] = (slen >> 8) | LP_ENCODING_12BIT_STR;
+            hdr[1] = slen & 0xff;
+        } else {
+            hdr[0] = LP_ENCODING_32BIT_STR;
+            hdr[1] = slen & 0xff;
+            hdr[2] = (slen >> 8) & 0xff;
+            hdr[3] = (slen >> 16) & 0xff;
+            hdr[4] = (slen >> 24) & 0xff;
+        }
+        hdrlen = enclen-slen;
+        paylen = slen;
+    }
+
+    /* Fields often share a prefix, so the last byte is checked before
+     * comparing the whole payload. This must happen only after the whole
+     * header matched: strings of 64 bytes or more don't have their length
+     * in the first byte, and p[enclen-1] could be past a shorter element
+     * and even past the end of the listpack. */
+    last = paylen ? s[paylen-1] : hdr[hdrlen-1];
+
+    while (p && p[0] != LP_EOF) {
+        uint32_t entrylen;
+
+        if (skipcnt == 0) {
+            if (p[0] == hdr[0] &&
+                memcmp(p+1,hdr+1,hdrlen-1) == 0 &&
+                p[enclen-1] == last &&
+                memcmp(p+hdrlen,s,paylen) == 0) return p;
+            skipcnt = skip;
+        } else {
+            skipcnt--;
+        }
+
+        /* Fast path for the common small strings and integers, whose
+         * backlen is always a single byte. */
+        if (LP_ENCODING_IS_6BIT_STR(p[0])) {
+            p += 2+LP_ENCODING_6BIT_STR_LEN(p);
+        } else if (LP_ENCODING_IS_7BIT_UINT(p[0])) {
+            p += 2;
+        } else {
+            entrylen = lpCurrentEncodedSize(p);
+            p += entrylen+lpEncodeBacklen(NULL,entrylen);
+        }
+    }
+    return NULL;
+}
+
+/* Delete up to 'num' elements starting from the element pointed by 'p',
+ * and return the resulting listpack. '*p' is updated to point to the element
+ * following the deleted ones, or to NULL if there is no such element. */
+unsigned char *lpDeleteRangeWithEntry(unsigned char *lp, unsigned char **p, unsigned long num) {
+    unsigned char *first = *p, *tail = *p;
+    unsigned long deleted = 0;
+    uint32_t bytes = lpGetTotalBytes(lp), numele = lpGetNumElements(lp);
+    unsigned long poff = first-lp;
+
+    while (deleted < num && tail[0] != LP_EOF) {
+        tail = lpSkip(tail);
+        deleted++;
+    }
+    if (deleted == 0) return lp;
+
+    /* Move the elements after the deleted ones, and the EOF element. */
+    memmove(first,tail,bytes-(tail-lp));
+    bytes -= tail-first;
+    lpSetTotalBytes(lp,bytes);
+    if (numele != LP_HDR_NUMELE_UNKNOWN)
+        lpSetNumElements(lp,numele-deleted);
+    lp = lp_realloc(lp,bytes);
+    *p = lp[poff] == LP_EOF ? NULL : lp+poff;
+    return lp;
+}
+
+/* Delete up to 'num' elements starting from the element at 'index' (see
+ * lpSeek() for the meaning of negative indexes), and return the resulting
+ * listpack. */
+unsigned char *lpDeleteRange(unsigned char *lp, long index, unsigned long num) {
+    unsigned char *p = lpSeek(lp,index);
+
+    if (p == NULL || num == 0) return lp;
+    return lpDeleteRangeWithEntry(lp,&p,num);
+}
+
+/* Merge the listpacks 'first' and 'second' appending 'second' to 'first',
+ * like ziplistMerge() does: the larger listpack is reallocated to contain
+ * the merged listpack, the other one is freed, and the two arguments are
+ * set to the merged listpack and to NULL accordingly.
+ *
+ * Since the elements of a listpack only reference themselves, the elements
+ * of the listpacks are moved around as a whole, without scanning them.
+ *
+ * Returns the merged listpack, or NULL if the merge is not possible. */
+unsigned char *lpMerge(unsigned char **first, unsigned char **second) {
+    if (first == NULL || *first == NULL || second == NULL || *second == NULL)
+        return NULL;
+    if (*first == *second) return NULL; /* Can't merge a listpack with itself. */
+
+    unsigned char *lp1 = *first, *lp2 = *second, *target;
+    uint64_t bytes1 = lpGetTotalBytes(lp1), bytes2 = lpGetTotalBytes(lp2);
+    uint32_t numele1 = lpGetNumElements(lp1), numele2 = lpGetNumElements(lp2);
+    uint64_t bytes = bytes1+bytes2-LP_HDR_SIZE-1;
+    uint64_t numele;
+    int append = bytes1 >= bytes2; /* Reallocate the larger listpack. */
+
+    if (bytes > UINT32_MAX) return NULL;
+    if (numele1 == LP_HDR_NUMELE_UNKNOWN || numele2 == LP_HDR_NUMELE_UNKNOWN)
+        numele = LP_HDR_NUMELE_UNKNOWN;
+    else
+        numele = (uint64_t)numele1+numele2;
+    if (numele > LP_HDR_NUMELE_UNKNOWN) numele = LP_HDR_NUMELE_UNKNOWN;
+
+    if (append) {
+        /* Copy the elements of 'second' and its EOF over the EOF of
+         * 'first'. */
+        target = lp_realloc(lp1,bytes);
+        memcpy(target+bytes1-1,lp2+LP_HDR_SIZE,bytes2-LP_HDR_SIZE);
+        lp_free(lp2);
+        *first = target;
+        *second = NULL;
+    } else {
+        /* Make room for the elements of 'first' before the elements of
+         * 'second'. */
+        target = lp_realloc(lp2,bytes);
+        memmove(target+bytes1-1,target+LP_HDR_SIZE,bytes2-LP_HDR_SIZE);
+        memcpy(target+LP_HDR_SIZE,lp1+LP_HDR_SIZE,bytes1-LP_HDR_SIZE-1);
+        lp_free(lp1);
+        *first = NULL;
+        *second = target;
+    }
+    lpSetTotalBytes(target,bytes);
+    lpSetNumElements(target,numele);
+    return target;
+}
+
+/* Print a description of the listpack on the standard output, for
+ * debugging purposes. */
+void lpRepr(unsigned char *lp) {
+    unsigned char *p, *vstr;
+    int64_t vlen;
+    int index = 0;
+
+    printf("{total bytes %u} {num entries %u}\n",
+        lpGetTotalBytes(lp), lpLength(lp));
+    p = lpFirst(lp);
+    while (p) {
+        uint32_t encoded = lpCurrentEncodedSize(p);
+        unsigned long backlen = lpEncodeBacklen(NULL,encoded);
+
+        printf("{\n"
+               "\taddr 0x%08lx,\n"
+               "\tindex %2d,\n"
+               "\toffset %5lu,\n"
+               "\thdr+entry len: %5u,\n"
+               "\tbacklen len: %2lu,\n",
+            (unsigned long)p, index, (unsigned long)(p-lp), encoded, backlen);
+        vstr = lpGet(p,&vlen,NULL);
+        if (vstr) {
+            printf("\t[str]");
+            if (vlen > 40) {
+                if (fwrite(vstr,40,1,stdout) == 0) perror("fwrite");
+                printf("...");
+            } else {
+                if (vlen && fwrite(vstr,vlen,1,stdout) == 0) perror("fwrite");
+            }
+        } else {
+            printf("\t[int]%lld", (long long)vlen);
+        }
+        printf("\n}\n");
+        p = lpNext(lp,p);
+        index++;
+    }
+    printf("{end}\n\n");
+}
+
+#ifdef REDIS_TEST
+#include <sys/time.h>
+
+#define assert(_e) ((_e)?(void)0:(_assert(#_e,__FILE__,__LINE__),exit(1)))
+static void _assert(char *estr, char *file, int line) {
+    printf("\n\n=== ASSERTION FAILED ===\n");
+    printf("==> %s:%d '%s' is not true\n",file,line,estr);
+}
+
+static void ok(void) {
+    printf("OK\n");
+}
+
+/* Return 1 if the element at 'index' has the string representation 's'. */
+static int lpElementIs(unsigned char *lp, long index, char *s) {
+    unsigned char buf[LP_INTBUF_SIZE], *p, *ele;
+    int64_t len;
+
+    if ((p = lpSeek(lp,index)) == NULL) return 0;
+    ele = lpGet(p,&len,buf);
+    return len == (int64_t)strlen(s) && memcmp(ele,s,len) == 0;
+}
+
+/* Create a listpack with the elements "<prefix>0" ... "<prefix>count-1". */
+static unsigned char *createList(char *prefix, int count) {
+    unsigned char *lp = lpNew();
+    char buf[32];
+
+    for (int j = 0; j < count; j++) {
+        int len = snprintf(buf,sizeof(buf),"%s%d",prefix,j);
+        lp = lpAppend(lp,(unsigned char*)buf,len);
+    }
+    return lp;
+}
+
+/* Reference lpFind() that decodes every compared element. */
+static unsigned char *lpFindDecoding(unsigned char *p, unsigned char *s, uint32_t slen, unsigned int skip) {
+    unsigned int skipcnt = 0;
+    unsigned char buf[LP_INTBUF_SIZE], *value;
+    int64_t len;
+
+    while (p && p[0] != LP_EOF) {
+        if (skipcnt == 0) {
+            value = lpGet(p,&len,buf);
+            if (len == slen && memcmp(value,s,slen) == 0) return p;
+            skipcnt = skip;
+        } else {
+            skipcnt--;
+        }
+        p = lpSkip(p);
+    }
+    return NULL;
+}
+
+/* Create a listpack of 'count' field-value pairs with fields "field:<n>". */
+static unsigned char *createHash(int count) {
+    unsigned char *lp = lpNew();
+    char buf[32];
+
+    for (int j = 0; j < count; j++) {
+        int len = snprintf(buf,sizeof(buf),"field:%d",j);
+        lp = lpAppend(lp,(unsigned char*)buf,len);
+        len = snprintf(buf,sizeof(buf),"value:%d",j);
+        lp = lpAppend(lp,(unsigned char*)buf,len);
+    }
+    return lp;
+}
+
+static long long usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+int listpackTest(int argc, char *argv[]) {
+    unsigned char *lp, *lp2, *p;
+    char buf[32];
+
+    ((void) argc);
+    ((void) argv);
+
+    printf("Prepend and replace: "); {
+        lp = lpNew();
+        lp = lpAppend(lp,(unsigned char*)"b",1);
+        lp = lpPrepend(lp,(unsigned char*)"a",1);
+        lp = lpAppend(lp,(unsigned char*)"1024",4);
+        assert(lpLength(lp) == 3);
+        assert(lpElementIs(lp,0,"a"));
+        assert(lpElementIs(lp,-1,"1024"));
+        p = lpSeek(lp,1);
+        lp = lpReplace(lp,&p,(unsigned char*)"hello world",11);
+        assert(p == lpSeek(lp,1));
+        assert(lpElementIs(lp,1,"hello world"));
+        assert(lpLength(lp) == 3);
+        lpFree(lp);
+        ok();
+    }
+
+    printf("Find with skip: "); {
+        unsigned int vlen;
+        long long vll;
+        unsigned char *vstr;
+
+        lp = lpNew();
+        for (int j = 0; j < 100; j++) {
+            int len = snprintf(buf,sizeof(buf),"%d",j);
+            lp = lpAppend(lp,(unsigned char*)buf,len); /* Field. */
+            len = snprintf(buf,sizeof(buf),"value:%d",j);
+            lp = lpAppend(lp,(unsigned char*)buf,len); /* Value. */
+        }
+        p = lpFind(lp,lpFirst(lp),(unsigned char*)"42",2,1);
+        assert(p != NULL && p == lpSeek(lp,84));
+        vstr = lpGetValue(lpNext(lp,p),&vlen,&vll);
+        assert(vstr && vlen == 8 && memcmp(vstr,"value:42",8) == 0);
+        /* Values must be skipped. */
+        assert(lpFind(lp,lpFirst(lp),(unsigned char*)"value:1",7,1) == NULL);
+        assert(lpFind(lp,lpFirst(lp),(unsigned char*)"value:1",7,0) != NULL);
+        /* Strings that are not integers never match integers. */
+        assert(lpFind(lp,lpFirst(lp),(unsigned char*)"042",3,1) == NULL);
+        assert(lpFind(lp,lpFirst(lp),(unsigned char*)"100",3,1) == NULL);
+        assert(lpCompare(lpFirst(lp),(unsigned char*)"0",1));
+        assert(!lpCompare(lpFirst(lp),(unsigned char*)"00",2));
+        lpFree(lp);
+        ok();
+    }
+
+    printf("Find elements of every encoding: "); {
+        static unsigned char big[5000];
+        char *samples[] = {"0","127","128","-1","4095","-4096","4096",
+            "32767","-32768","8388607","-8388608","2147483647","-2147483648",
+            "9223372036854775807","-9223372036854775808","","a","01","1.5",
+            "9223372036854775808"};
+        int nsamples = sizeof(samples)/sizeof(samples[0]);
+        uint32_t sizes[] = {63,64,4095,4096,5000};
+
+        memset(big,'x',sizeof(big));
+        lp = lpNew();
+        for (int j = 0; j < nsamples; j++)
+            lp = lpAppend(lp,(unsigned char*)samples[j],strlen(samples[j]));
+        for (int j = 0; j < 5; j++) lp = lpAppend(lp,big,sizes[j]);
+        for (int j = 0; j < nsamples; j++) {
+            unsigned char *s = (unsigned char*)samples[j];
+            p = lpFind(lp,lpFirst(lp),s,strlen(samples[j]),0);
+            assert(p == lpSeek(lp,j));
+            assert(p == lpFindDecoding(lpFirst(lp),s,strlen(samples[j]),0));
+        }
+        for (int j = 0; j < 5; j++) {
+            assert(lpFind(lp,lpFirst(lp),big,sizes[j],0) ==
+                   lpSeek(lp,nsamples+j));
+        }
+        assert(lpFind(lp,lpFirst(lp),big,100,0) == NULL);
+        /* A search string much longer than the last element must not
+         * read past the end of the listpack. */
+        unsigned char *huge = lp_malloc(1<<20);
+        memset(huge,'x',1<<20);
+        assert(lpFind(lp,lpFirst(lp),huge,1<<20,0) == NULL);
+        assert(lpFind(lp,lpFirst(lp),huge,5001,0) == NULL);
+        assert(lpFind(lp,lpFirst(lp),huge,200,0) == NULL);
+        lp_free(huge);
+        big[4094] = 'y';
+        assert(lpFind(lp,lpFirst(lp),big,4095,0) == NULL);
+        lpFree(lp);
+        ok();
+    }
+
+    printf("Benchmark field lookup in field-value listpacks:\n"); {
+        int counts[] = {8,32,128,512};
+
+        for (int j = 0; j < 4; j++) {
+            int count = counts[j], lookups = 2000000/count;
+            long long start, elapsed[2];
+
+            lp = createHash(count);
+            for (int impl = 0; impl < 2; impl++) {
+                start = usec();
+                for (int i = 0; i < lookups; i++) {
+                    int len = snprintf(buf,sizeof(buf),"field:%d",i%count);
+                    unsigned char *s = (unsigned char*)buf;
+                    if (impl == 0)
+                        p = lpFind(lp,lpFirst(lp),s,len,1);
+                    else
+                        p = lpFindDecoding(lpFirst(lp),s,len,1);
+                    assert(p != NULL);
+                }
+                elapsed[impl] = usec()-start;
+            }
+            printf("  %4d fields: lpFind %7.1f ns/lookup, "
+                   "decoding every field %7.1f ns/lookup\n", count,
+                   (double)elapsed[0]*1000/lookups,
+                   (double)elapsed[1]*1000/lookups);
+            lpFree(lp);
+        }
+    }
+
+    printf("Delete range: "); {
+        lp = createList("e",10);
+        lp = lpDeleteRange(lp,2,3);
+        assert(lpLength(lp) == 7);
+        assert(lpElementIs(lp,1,"e1") && lpElementIs(lp,2,"e5"));
+        lp = lpDeleteRange(lp,-2,100);
+        assert(lpLength(lp) == 5);
+        assert(lpElementIs(lp,-1,"e7"));
+        lp = lpDeleteRange(lp,10,1);
+        assert(lpLength(lp) == 5);
+        p = lpSeek(lp,4);
+        lp = lpDeleteRangeWithEntry(lp,&p,1);
+        assert(p == NULL && lpLength(lp) == 4);
+        p = lpFirst(lp);
+        lp = lpDeleteRangeWithEntry(lp,&p,2);
+        assert(lpLength(lp) == 2 && lpElementIs(lp,0,"e5"));
+        assert(p == lpFirst(lp));
+        lpFree(lp);
+        ok();
+    }
+
+    printf("Merge: "); {
+        /* The first listpack is the larger one, so it is reallocated. */
+        lp = createList("first",20);
+        lp2 = createList("second",5);
+        assert(lpMerge(&lp,&lp2) != NULL);
+        assert(lp2 == NULL && lpLength(lp) == 25);
+        assert(lpElementIs(lp,19,"first19") && lpElementIs(lp,20,"second0"));
+        assert(lpElementIs(lp,-1,"second4"));
+        assert(lpPrev(lp,lpSeek(lp,20)) == lpSeek(lp,19));
+        lpFree(lp);
+
+        /* The second listpack is the larger one. */
+        lp = createList("first",5);
+        lp2 = createList("second",20);
+        assert(lpMerge(&lp,&lp2) != NULL);
+        assert(lp == NULL && lpLength(lp2) == 25);
+        assert(lpElementIs(lp2,0,"first0") && lpElementIs(lp2,5,"second0"));
+        assert(lpElementIs(lp2,-1,"second19"));
+        assert(lpBytes(lp2) == (uint32_t)(lpSkip(lpLast(lp2))-lp2+1));
+        lpFree(lp2);
+
+        /* Merging with an empty listpack. */
+        lp = lpNew();
+        lp2 = createList("x",3);
+        assert(lpMerge(&lp,&lp2) != NULL);
+        assert(lp == NULL && lpLength(lp2) == 3);
+        assert(lpMerge(&lp2,&lp2) == NULL);
+        lpFree(lp2);
+        ok();
+    }
+
+    return 0;
+}
+#endif
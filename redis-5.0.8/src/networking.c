@@ -35,6 +35,38 @@
 #include <ctype.h>
 
 static void setProtocolError(const char *errstr, client *c);
+int postponeClientRead(client *c);
+
+/* Set while processEventsWhileBlocked() re-enters the event loop: in that
+ * context beforeSleep() is not called, so reads can't be postponed to the
+ * I/O threads. */
+int ProcessingEventsWhileBlocked = 0;
+
+/* I/O threads operation currently in progress, see the threaded I/O section
+ * at the end of this file. While it is not IO_THREADS_OP_IDLE the clients
+ * handled by the I/O threads (main thread included) must never be freed
+ * synchronously, nor can they touch global state other than what is
+ * protected by atomics or mutexes. */
+#define IO_THREADS_OP_IDLE 0
+#define IO_THREADS_OP_READ 1
+#define IO_THREADS_OP_WRITE 2
+static int io_threads_op = IO_THREADS_OP_IDLE;
+
+/* Query buffer shared by the clients read by the main thread that have no
+ * pending partial command, see readQueryFromClient(). While a client is
+ * using it, sharedQueryBufInUse is set, so that clients read re-entrantly
+ * by processEventsWhileBlocked() fall back to their private buffer. */
+static sds sharedQueryBuf = NULL;
+static int sharedQueryBufInUse = 0;
+
+/* Free the client synchronously, unless we are inside a threaded I/O
+ * section, in which case it is scheduled for asynchronous release. */
+static void freeClientFromIO(client *c) {
+    if (io_threads_op != IO_THREADS_OP_IDLE)
+        freeClientAsync(c);
+    else
+        freeClient(c);
+}
 
 /* Return the size consumed from the allocator, for the specified SDS string,
  * including internal fragmentation. This function is used in order to compute
@@ -58,15 +90,25 @@ size_t getStringObjectSdsUsedMemory(robj *o) {
 /* Client.reply list dup and free methods. */
 void *dupClientReplyValue(void *o) {
     clientReplyBlock *old = o;
-    clientReplyBlock *buf = zmalloc(sizeof(clientReplyBlock) + old->size);
-    memcpy(buf, o, sizeof(clientReplyBlock) + old->size);
+    size_t bufsize = old->obj ? 0 : old->size;
+    clientReplyBlock *buf = zmalloc(sizeof(clientReplyBlock) + bufsize);
+    memcpy(buf, o, sizeof(clientReplyBlock) + bufsize);
+    if (buf->obj) incrRefCount(buf->obj);
     return buf;
 }
 
 void freeClientReplyValue(void *o) {
+    clientReplyBlock *block = o;
+    /* Note that 'o' may be the NULL placeholder of a deferred length. */
+    if (block && block->obj) decrRefCount(block->obj);
     zfree(o);
 }
 
+/* Return the pointer to the data of a reply block. */
+static char *clientReplyBlockData(clientReplyBlock *o) {
+    return o->obj ? (char*)o->obj->ptr : o->buf;
+}
+
 int listMatchObjects(void *a, void *b) {
     return equalStringObjects(a,b);
 }
@@ -83,15 +125,83 @@ void linkClient(client *c) {
     raxInsert(server.clients_index,(unsigned char*)&id,sizeof(id),c,NULL);
 }
 
+/* Take a client structure from the pool of released clients, or return
+ * NULL if the pool is empty. Pooled clients keep their reply buffer, an
+ * empty reply list and empty query buffers, see clientPoolRelease(). */
+static client *clientPoolGet(void) {
+    if (server.client_pool_count == 0) {
+        server.stat_client_pool_misses++;
+        return NULL;
+    }
+    server.stat_client_pool_hits++;
+    return server.client_pool[--server.client_pool_count];
+}
+
+/* Free the client structure together with the buffers it still owns after
+ * freeClient(), or that a pooled client kept. */
+static void freeClientStructure(client *c) {
+    sdsfree(c->querybuf);
+    sdsfree(c->pending_querybuf);
+    listRelease(c->reply);
+    zfree(c->buf);
+    zfree(c);
+}
+
+/* Put the client that freeClient() is releasing into the pool, so that the
+ * next accepted connection can reuse its structure and buffers. Returns 0
+ * if the pool is full: in this case the caller frees the client. */
+static int clientPoolRelease(client *c) {
+    if (server.client_pool_count >= server.client_pool_size) return 0;
+    if (server.client_pool_alloc < server.client_pool_size) {
+        server.client_pool = zrealloc(server.client_pool,
+            sizeof(client*)*server.client_pool_size);
+        server.client_pool_alloc = server.client_pool_size;
+    }
+
+    /* Don't keep big buffers around: a new client would shrink them in
+     * clientsCron() anyway. */
+    sdsclear(c->querybuf);
+    if (sdsavail(c->querybuf)) c->querybuf = sdsRemoveFreeSpace(c->querybuf);
+    sdsclear(c->pending_querybuf);
+    if (sdsavail(c->pending_querybuf))
+        c->pending_querybuf = sdsRemoveFreeSpace(c->pending_querybuf);
+    if (c->buf_usable_size != PROTO_REPLY_MIN_BYTES) {
+        zfree(c->buf);
+        c->buf_usable_size = PROTO_REPLY_MIN_BYTES;
+        c->buf = zmalloc(c->buf_usable_size);
+    }
+    server.client_pool[server.client_pool_count++] = c;
+    return 1;
+}
+
+/* Free the pooled clients exceeding the configured pool size. Called when
+ * client-pool-size is changed at runtime. */
+void trimClientPool(void) {
+    while (server.client_pool_count > server.client_pool_size)
+        freeClientStructure(server.client_pool[--server.client_pool_count]);
+    if (server.client_pool_size == 0) {
+        zfree(server.client_pool);
+        server.client_pool = NULL;
+        server.client_pool_alloc = 0;
+    }
+}
+
 client *createClient(int fd) {
-    client *c = zmalloc(sizeof(client));
+    /* Connected clients are taken from the pool of released clients when
+     * possible, see clientPoolRelease(). */
+    client *c = fd != -1 ? clientPoolGet() : NULL;
+    int pooled = c != NULL;
+
+    if (!pooled) c = zmalloc(sizeof(client));
 
     /* passing -1 as fd it is possible to create a non connected client.
      * This is useful since all the commands needs to be executed
      * in the context of a client. When commands are executed in other
-     * contexts (for instance a Lua script) we need a non connected client. */
+     * contexts (for instance a Lua script) we need a non connected client.
+     *
+     * The socket must already be in non blocking mode, as the ones returned
+     * by anetTcpAccept() and anetUnixAccept() are. */
     if (fd != -1) {
-        anetNonBlock(NULL,fd);
         anetEnableTcpNoDelay(NULL,fd);
         if (server.tcpkeepalive)
             anetKeepAlive(NULL,fd,server.tcpkeepalive);
@@ -99,7 +209,10 @@ client *createClient(int fd) {
             readQueryFromClient, c) == AE_ERR)
         {
             close(fd);
-            zfree(c);
+            if (pooled)
+                server.client_pool[server.client_pool_count++] = c;
+            else
+                zfree(c);
             return NULL;
         }
     }
@@ -111,9 +224,21 @@ client *createClient(int fd) {
     c->fd = fd;
     c->name = NULL;
     c->bufpos = 0;
+    if (!pooled) {
+        /* Non connected clients are not served by clientsCron(), so their
+         * buffer is never resized: give them the maximum size. */
+        c->buf_usable_size = fd == -1 ? PROTO_REPLY_CHUNK_BYTES :
+                                        PROTO_REPLY_MIN_BYTES;
+        c->buf = zmalloc(c->buf_usable_size);
+        c->querybuf = sdsempty();
+        c->pending_querybuf = sdsempty();
+        c->reply = listCreate();
+        listSetFreeMethod(c->reply,freeClientReplyValue);
+        listSetDupMethod(c->reply,dupClientReplyValue);
+    }
+    c->buf_peak = 0;
+    c->buf_peak_last_reset_time = server.mstime;
     c->qb_pos = 0;
-    c->querybuf = sdsempty();
-    c->pending_querybuf = sdsempty();
     c->querybuf_peak = 0;
     c->reqtype = 0;
     c->argc = 0;
@@ -134,14 +259,14 @@ client *createClient(int fd) {
     c->slave_listening_port = 0;
     c->slave_ip[0] = '\0';
     c->slave_capa = SLAVE_CAPA_NONE;
-    c->reply = listCreate();
     c->reply_bytes = 0;
+    c->reply_obj_refs = 0;
     c->obuf_soft_limit_reached_time = 0;
-    listSetFreeMethod(c->reply,freeClientReplyValue);
-    listSetDupMethod(c->reply,dupClientReplyValue);
     c->btype = BLOCKED_NONE;
     c->bpop.timeout = 0;
-    c->bpop.keys = dictCreate(&objectKeyHeapPointerValueDictType,NULL);
+    /* The structures used for blocking operations, WATCH and Pub/Sub are
+     * only created when the client first uses them. */
+    c->bpop.keys = NULL;
     c->bpop.target = NULL;
     c->bpop.xread_group = NULL;
     c->bpop.xread_consumer = NULL;
@@ -149,13 +274,11 @@ client *createClient(int fd) {
     c->bpop.numreplicas = 0;
     c->bpop.reploffset = 0;
     c->woff = 0;
-    c->watched_keys = listCreate();
-    c->pubsub_channels = dictCreate(&objectKeyPointerValueDictType,NULL);
-    c->pubsub_patterns = listCreate();
+    c->watched_keys = NULL;
+    c->pubsub_channels = NULL;
+    c->pubsub_patterns = NULL;
     c->peerid = NULL;
     c->client_list_node = NULL;
-    listSetFreeMethod(c->pubsub_patterns,decrRefCountVoid);
-    listSetMatchMethod(c->pubsub_patterns,listMatchObjects);
     if (fd != -1) linkClient(c);
     initClientMultiState(c);
     return c;
@@ -225,8 +348,14 @@ int prepareClientToWrite(client *c) {
     if (c->fd <= 0) return C_ERR; /* Fake client for AOF loading. */
 
     /* Schedule the client to write the output buffers to the socket, unless
-     * it should already be setup to do so (it has already pending data). */
-    if (!clientHasPendingReplies(c)) clientInstallWriteHandler(c);
+     * it should already be setup to do so (it has already pending data).
+     *
+     * If CLIENT_PENDING_READ is set, we're in an I/O thread and should
+     * not install a write handler. Instead, it will be done by
+     * handleClientsWithPendingReadsUsingThreads() upon return.
+     */
+    if (!clientHasPendingReplies(c) && !(c->flags & CLIENT_PENDING_READ))
+        clientInstallWriteHandler(c);
 
     /* Authorize the caller to queue in the output buffer of this client. */
     return C_OK;
@@ -237,7 +366,7 @@ int prepareClientToWrite(client *c) {
  * -------------------------------------------------------------------------- */
 
 int _addReplyToBuffer(client *c, const char *s, size_t len) {
-    size_t available = sizeof(c->buf)-c->bufpos;
+    size_t available = c->buf_usable_size-c->bufpos;
 
     if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return C_OK;
 
@@ -245,11 +374,17 @@ int _addReplyToBuffer(client *c, const char *s, size_t len) {
      * add anything more to the static buffer. */
     if (listLength(c->reply) > 0) return C_ERR;
 
-    /* Check that the buffer has enough space available for this string. */
-    if (len > available) return C_ERR;
+    /* Check that the buffer has enough space available for this string.
+     * If not, mark the buffer as full so that clientsCron() will consider
+     * growing it. */
+    if (len > available) {
+        c->buf_peak = c->buf_usable_size;
+        return C_ERR;
+    }
 
     memcpy(c->buf+c->bufpos,s,len);
     c->bufpos+=len;
+    if ((size_t)c->bufpos > c->buf_peak) c->buf_peak = c->bufpos;
     return C_OK;
 }
 
@@ -264,7 +399,7 @@ void _addReplyStringToList(client *c, const char *s, size_t len) {
      * fo fill it later, when the size of the bulk length is set. */
 
     /* Append to tail string when possible. */
-    if (tail) {
+    if (tail && !tail->obj) {
         /* Copy the part we can fit into the tail, and leave the rest for a
          * new node */
         size_t avail = tail->size - tail->used;
@@ -282,6 +417,7 @@ void _addReplyStringToList(client *c, const char *s, size_t len) {
         /* take over the allocation's internal fragmentation */
         tail->size = zmalloc_usable(tail) - sizeof(clientReplyBlock);
         tail->used = len;
+        tail->obj = NULL;
         memcpy(tail->buf, s, len);
         listAddNodeTail(c->reply, tail);
         c->reply_bytes += tail->size;
@@ -289,6 +425,63 @@ void _addReplyStringToList(client *c, const char *s, size_t len) {
     asyncCloseClientOnOutputBufferLimitReached(c);
 }
 
+/* Add a reference to the string object 'obj' at the tail of the reply list,
+ * instead of copying its content, so that big values are written to the
+ * socket directly from the object. */
+void _addReplyObjectToList(client *c, robj *obj) {
+    if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
+
+    clientReplyBlock *ref = zmalloc(sizeof(clientReplyBlock));
+    ref->obj = obj;
+    incrRefCount(obj);
+    ref->size = ref->used = sdslen(obj->ptr);
+    listAddNodeTail(c->reply, ref);
+    c->reply_bytes += ref->size;
+    c->reply_obj_refs++;
+    asyncCloseClientOnOutputBufferLimitReached(c);
+}
+
+/* Return true if big string objects can be referenced, instead of copied,
+ * in the output buffer of the client. This is not the case for slaves, whose
+ * output buffers are not counted in the used memory and may be copied to
+ * other slaves, and for fake clients, whose replies are directly accessed
+ * by the caller. */
+static int clientCanReferenceReplyObjects(client *c) {
+    return !(c->flags & (CLIENT_LUA|CLIENT_MODULE|CLIENT_SLAVE|CLIENT_MASTER));
+}
+
+/* Replace the object references in the output buffers of all the clients
+ * with a copy of the referenced data. This must be called before handing
+ * objects that may be referenced to a different thread, that could
+ * otherwise release them concurrently with the main thread. */
+void unreferenceClientsReplyObjects(void) {
+    listIter li, bi;
+    listNode *ln, *bn;
+
+    listRewind(server.clients,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        client *c = listNodeValue(ln);
+        if (c->reply_obj_refs == 0) continue;
+
+        listRewind(c->reply,&bi);
+        while ((bn = listNext(&bi)) != NULL) {
+            clientReplyBlock *o = listNodeValue(bn);
+            if (o == NULL || o->obj == NULL) continue;
+
+            clientReplyBlock *copy = zmalloc(sizeof(clientReplyBlock)+o->used);
+            copy->size = zmalloc_usable(copy) - sizeof(clientReplyBlock);
+            copy->used = o->used;
+            copy->obj = NULL;
+            memcpy(copy->buf,o->obj->ptr,o->used);
+            c->reply_bytes += copy->size;
+            c->reply_bytes -= o->size;
+            listNodeValue(bn) = copy;
+            freeClientReplyValue(o);
+        }
+        c->reply_obj_refs = 0;
+    }
+}
+
 /* -----------------------------------------------------------------------------
  * Higher level functions to queue data on the client output buffer.
  * The following functions are the ones that commands implementations will call.
@@ -299,8 +492,18 @@ void addReply(client *c, robj *obj) {
     if (prepareClientToWrite(c) != C_OK) return;
 
     if (sdsEncodedObject(obj)) {
-        if (_addReplyToBuffer(c,obj->ptr,sdslen(obj->ptr)) != C_OK)
-            _addReplyStringToList(c,obj->ptr,sdslen(obj->ptr));
+        size_t len = sdslen(obj->ptr);
+
+        /* Big strings are referenced instead of being copied, so that
+         * they are transferred to the socket directly from the object. */
+        if (len >= PROTO_REPLY_REF_MIN_BYTES &&
+            obj->encoding == OBJ_ENCODING_RAW &&
+            clientCanReferenceReplyObjects(c))
+        {
+            _addReplyObjectToList(c,obj);
+        } else if (_addReplyToBuffer(c,obj->ptr,len) != C_OK) {
+            _addReplyStringToList(c,obj->ptr,len);
+        }
     } else if (obj->encoding == OBJ_ENCODING_INT) {
         /* For integer encoded strings we just convert it into a string
          * using our optimized function, and attach the resulting string
@@ -449,6 +652,7 @@ void setDeferredMultiBulkLength(client *c, void *node, long length) {
      * - It has enough room already allocated
      * - And not too large (avoid large memmove) */
     if (ln->next != NULL && (next = listNodeValue(ln->next)) &&
+        next->obj == NULL &&
         next->size - next->used >= lenstr_len &&
         next->used < PROTO_REPLY_CHUNK_BYTES * 4) {
         memmove(next->buf + lenstr_len, next->buf, next->used);
@@ -461,6 +665,7 @@ void setDeferredMultiBulkLength(client *c, void *node, long length) {
         /* Take over the allocation's internal fragmentation */
         buf->size = zmalloc_usable(buf) - sizeof(clientReplyBlock);
         buf->used = lenstr_len;
+        buf->obj = NULL;
         memcpy(buf->buf, lenstr, lenstr_len);
         listNodeValue(ln) = buf;
         c->reply_bytes += buf->size;
@@ -638,7 +843,9 @@ void AddReplyFromClient(client *dst, client *src) {
     if (listLength(src->reply))
         listJoin(dst->reply,src->reply);
     dst->reply_bytes += src->reply_bytes;
+    dst->reply_obj_refs += src->reply_obj_refs;
     src->reply_bytes = 0;
+    src->reply_obj_refs = 0;
     src->bufpos = 0;
 }
 
@@ -649,9 +856,15 @@ void copyClientOutputBuffer(client *dst, client *src) {
     listRelease(dst->reply);
     dst->sentlen = 0;
     dst->reply = listDup(src->reply);
+    if (dst->buf_usable_size < (size_t)src->bufpos) {
+        zfree(dst->buf);
+        dst->buf = zmalloc(src->buf_usable_size);
+        dst->buf_usable_size = src->buf_usable_size;
+    }
     memcpy(dst->buf,src->buf,src->bufpos);
     dst->bufpos = src->bufpos;
     dst->reply_bytes = src->reply_bytes;
+    dst->reply_obj_refs = src->reply_obj_refs;
 }
 
 /* Return true if the specified client has pending reply buffers to write to
@@ -834,6 +1047,14 @@ void unlinkClient(client *c) {
         c->flags &= ~CLIENT_PENDING_WRITE;
     }
 
+    /* Remove from the list of pending reads if needed. */
+    if (c->flags & CLIENT_PENDING_READ) {
+        ln = listSearchKey(server.clients_pending_read,c);
+        serverAssert(ln != NULL);
+        listDelNode(server.clients_pending_read,ln);
+        c->flags &= ~CLIENT_PENDING_READ;
+    }
+
     /* When client was just unblocked because of a blocking operation,
      * remove it from the list of unblocked clients. */
     if (c->flags & CLIENT_UNBLOCKED) {
@@ -846,6 +1067,7 @@ void unlinkClient(client *c) {
 
 void freeClient(client *c) {
     listNode *ln;
+    int connected = c->fd != -1;
 
     /* If a client is protected, yet we need to free it right now, make sure
      * to at least use asynchronous freeing. */
@@ -876,27 +1098,27 @@ void freeClient(client *c) {
             replicationGetSlaveName(c));
     }
 
-    /* Free the query buffer */
-    sdsfree(c->querybuf);
-    sdsfree(c->pending_querybuf);
-    c->querybuf = NULL;
+    /* Give the client its own query buffer back if it's using the shared
+     * one: this happens if the client is freed while executing the commands
+     * it sent. */
+    if (c->querybuf == sharedQueryBuf) c->querybuf = sdsempty();
 
     /* Deallocate structures used to block on blocking ops. */
     if (c->flags & CLIENT_BLOCKED) unblockClient(c);
-    dictRelease(c->bpop.keys);
+    if (c->bpop.keys) dictRelease(c->bpop.keys);
 
     /* UNWATCH all the keys */
     unwatchAllKeys(c);
-    listRelease(c->watched_keys);
+    if (c->watched_keys) listRelease(c->watched_keys);
 
     /* Unsubscribe from all the pubsub channels */
     pubsubUnsubscribeAllChannels(c,0);
     pubsubUnsubscribeAllPatterns(c,0);
-    dictRelease(c->pubsub_channels);
-    listRelease(c->pubsub_patterns);
+    if (c->pubsub_channels) dictRelease(c->pubsub_channels);
+    if (c->pubsub_patterns) listRelease(c->pubsub_patterns);
 
     /* Free data structures. */
-    listRelease(c->reply);
+    listEmpty(c->reply);
     freeClientArgv(c);
 
     /* Unlink the client: this will close the socket, remove the I/O
@@ -941,7 +1163,10 @@ void freeClient(client *c) {
     zfree(c->argv);
     freeClientMultiState(c);
     sdsfree(c->peerid);
-    zfree(c);
+
+    /* Finally put the client structure, with the buffers it still owns, in
+     * the pool of released clients, or free it. */
+    if (!connected || !clientPoolRelease(c)) freeClientStructure(c);
 }
 
 /* Schedule a client to free it at a safe time in the serverCron() function.
@@ -949,16 +1174,37 @@ void freeClient(client *c) {
  * a context where calling freeClient() is not possible, because the client
  * should be valid for the continuation of the flow of the program. */
 void freeClientAsync(client *c) {
+    /* We need to handle concurrent access to the server.clients_to_close list
+     * only in the freeClientAsync() function, since it's the only function
+     * that may access the list while Redis uses I/O threads. All the other
+     * accesses are in the context of the main thread while the other threads
+     * are idle. */
+    static pthread_mutex_t async_free_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+
     if (c->flags & CLIENT_CLOSE_ASAP || c->flags & CLIENT_LUA) return;
     c->flags |= CLIENT_CLOSE_ASAP;
+    if (server.io_threads_num == 1) {
+        /* No need to bother with locking if there's just one thread. */
+        listAddNodeTail(server.clients_to_close,c);
+        return;
+    }
+    pthread_mutex_lock(&async_free_queue_mutex);
     listAddNodeTail(server.clients_to_close,c);
+    pthread_mutex_unlock(&async_free_queue_mutex);
 }
 
 void freeClientsInAsyncFreeQueue(void) {
-    while (listLength(server.clients_to_close)) {
-        listNode *ln = listFirst(server.clients_to_close);
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.clients_to_close,&li);
+    while ((ln = listNext(&li)) != NULL) {
         client *c = listNodeValue(ln);
 
+        /* Protected clients would just be queued again by freeClient(),
+         * leave them in the queue for a later call. */
+        if (c->flags & CLIENT_PROTECTED) continue;
+
         c->flags &= ~CLIENT_CLOSE_ASAP;
         freeClient(c);
         listDelNode(server.clients_to_close,ln);
@@ -974,15 +1220,113 @@ client *lookupClientByID(uint64_t id) {
     return (c == raxNotFound) ? NULL : c;
 }
 
+/* Some platforms (or libc versions) don't define IOV_MAX: in that case use
+ * the minimum value required by POSIX. */
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
+/* This function gathers the static reply buffer (if not empty) and the nodes
+ * of the reply list into an iovec array, and sends them with a single
+ * writev(2) call. The amount of data gathered in a single call is limited
+ * to IOV_MAX vectors and to about NET_MAX_WRITES_PER_EVENT bytes. On
+ * success the sent data is consumed, updating c->bufpos, c->sentlen and the
+ * reply list accordingly.
+ *
+ * Returns the number of bytes written, 0 if there was nothing to write,
+ * or -1 on error (with errno set by writev). */
+static ssize_t _writevToClient(int fd, client *c) {
+    struct iovec iov[IOV_MAX];
+    int iovcnt = 0;
+    size_t iov_bytes_len = 0;
+    ssize_t nwritten, remaining;
+    listIter li;
+    listNode *ln;
+    clientReplyBlock *o;
+
+    /* If the static reply buffer is not empty, add it to the iov array
+     * for writev() as well: it always precedes the reply list. */
+    if (c->bufpos > 0) {
+        iov[iovcnt].iov_base = c->buf + c->sentlen;
+        iov[iovcnt].iov_len = c->bufpos - c->sentlen;
+        iov_bytes_len += iov[iovcnt++].iov_len;
+    }
+
+    /* The first node of the reply list may be partially sent by a previous
+     * call, in that case c->sentlen refers to it and not to the static
+     * buffer, and we need to skip the part already transferred. */
+    size_t offset = c->bufpos > 0 ? 0 : c->sentlen;
+    listRewind(c->reply,&li);
+    while((ln = listNext(&li)) && iovcnt < IOV_MAX &&
+          iov_bytes_len < NET_MAX_WRITES_PER_EVENT)
+    {
+        o = listNodeValue(ln);
+        if (o->used == 0) { /* Empty node, just release it and skip. */
+            c->reply_bytes -= o->size;
+            if (o->obj) c->reply_obj_refs--;
+            listDelNode(c->reply,ln);
+            offset = 0;
+            continue;
+        }
+        iov[iovcnt].iov_base = clientReplyBlockData(o) + offset;
+        iov[iovcnt].iov_len = o->used - offset;
+        iov_bytes_len += iov[iovcnt++].iov_len;
+        offset = 0;
+    }
+    if (iovcnt == 0) return 0;
+
+    nwritten = writev(fd,iov,iovcnt);
+    if (nwritten <= 0) return nwritten;
+
+    /* Consume the static buffer first, then release all the reply list
+     * nodes fully sent, remembering the offset in the partially sent one. */
+    remaining = nwritten;
+    if (c->bufpos > 0) {
+        ssize_t buf_len = c->bufpos - c->sentlen;
+        if (remaining < buf_len) {
+            c->sentlen += remaining;
+            return nwritten;
+        }
+        /* The buffer was sent, set bufpos to zero to continue with
+         * the remainder of the reply. */
+        c->bufpos = 0;
+        c->sentlen = 0;
+        remaining -= buf_len;
+    }
+    while(remaining > 0) {
+        ln = listFirst(c->reply);
+        o = listNodeValue(ln);
+        if (remaining < (ssize_t)(o->used - c->sentlen)) {
+            c->sentlen += remaining;
+            break;
+        }
+        remaining -= o->used - c->sentlen;
+        c->reply_bytes -= o->size;
+        if (o->obj) c->reply_obj_refs--;
+        listDelNode(c->reply,ln);
+        c->sentlen = 0;
+    }
+    /* If there are no longer objects in the list, we expect
+     * the count of reply bytes to be exactly zero. */
+    if (listLength(c->reply) == 0) serverAssert(c->reply_bytes == 0);
+    return nwritten;
+}
+
 /* Write data in output buffers to client. Return C_OK if the client
- * is still valid after the call, C_ERR if it was freed. */
+ * is still valid after the call, C_ERR if it was freed (or, when called
+ * from the I/O threads, scheduled to be freed). */
 int writeToClient(int fd, client *c, int handler_installed) {
     ssize_t nwritten = 0, totwritten = 0;
-    size_t objlen;
-    clientReplyBlock *o;
 
     while(clientHasPendingReplies(c)) {
-        if (c->bufpos > 0) {
+        if (listLength(c->reply) > 0) {
+            /* When the reply list is not empty, send the static buffer
+             * together with as many list nodes as possible, using a
+             * single writev(2) call instead of one write(2) per block. */
+            nwritten = _writevToClient(fd,c);
+            if (nwritten <= 0) break;
+            totwritten += nwritten;
+        } else {
             nwritten = write(fd,c->buf+c->sentlen,c->bufpos-c->sentlen);
             if (nwritten <= 0) break;
             c->sentlen += nwritten;
@@ -994,31 +1338,6 @@ int writeToClient(int fd, client *c, int handler_installed) {
                 c->bufpos = 0;
                 c->sentlen = 0;
             }
-        } else {
-            o = listNodeValue(listFirst(c->reply));
-            objlen = o->used;
-
-            if (objlen == 0) {
-                c->reply_bytes -= o->size;
-                listDelNode(c->reply,listFirst(c->reply));
-                continue;
-            }
-
-            nwritten = write(fd, o->buf + c->sentlen, objlen - c->sentlen);
-            if (nwritten <= 0) break;
-            c->sentlen += nwritten;
-            totwritten += nwritten;
-
-            /* If we fully sent the object on head go to the next one */
-            if (c->sentlen == objlen) {
-                c->reply_bytes -= o->size;
-                listDelNode(c->reply,listFirst(c->reply));
-                c->sentlen = 0;
-                /* If there are no longer objects in the list, we expect
-                 * the count of reply bytes to be exactly zero. */
-                if (listLength(c->reply) == 0)
-                    serverAssert(c->reply_bytes == 0);
-            }
         }
         /* Note that we avoid to send more than NET_MAX_WRITES_PER_EVENT
          * bytes, in a single threaded server it's a good idea to serve
@@ -1037,14 +1356,14 @@ int writeToClient(int fd, client *c, int handler_installed) {
              zmalloc_used_memory() < server.maxmemory) &&
             !(c->flags & CLIENT_SLAVE)) break;
     }
-    server.stat_net_output_bytes += totwritten;
+    atomicIncr(server.stat_net_output_bytes,totwritten);
     if (nwritten == -1) {
         if (errno == EAGAIN) {
             nwritten = 0;
         } else {
             serverLog(LL_VERBOSE,
                 "Error writing to client: %s", strerror(errno));
-            freeClient(c);
+            freeClientFromIO(c);
             return C_ERR;
         }
     }
@@ -1061,13 +1380,35 @@ int writeToClient(int fd, client *c, int handler_installed) {
 
         /* Close connection after entire reply has been sent. */
         if (c->flags & CLIENT_CLOSE_AFTER_REPLY) {
-            freeClient(c);
+            freeClientFromIO(c);
             return C_ERR;
         }
     }
     return C_OK;
 }
 
+/* Install the writable event handler for a client that still has data to
+ * send after a synchronous write attempt, freeing the client asynchronously
+ * if this is not possible. */
+static void installClientWriteHandler(client *c) {
+    int ae_flags = AE_WRITABLE;
+    /* For the fsync=always policy, we want that a given FD is never
+     * served for reading and writing in the same event loop iteration,
+     * so that in the middle of receiving the query, and serving it
+     * to the client, we'll call beforeSleep() that will do the
+     * actual fsync of AOF to disk. AE_BARRIER ensures that. */
+    if (server.aof_state == AOF_ON &&
+        server.aof_fsync == AOF_FSYNC_ALWAYS)
+    {
+        ae_flags |= AE_BARRIER;
+    }
+    if (aeCreateFileEvent(server.el, c->fd, ae_flags,
+        sendReplyToClient, c) == AE_ERR)
+    {
+            freeClientAsync(c);
+    }
+}
+
 /* Write event handler. Just send data to the client. */
 void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
     UNUSED(el);
@@ -1099,24 +1440,7 @@ int handleClientsWithPendingWrites(void) {
 
         /* If after the synchronous writes above we still have data to
          * output to the client, we need to install the writable handler. */
-        if (clientHasPendingReplies(c)) {
-            int ae_flags = AE_WRITABLE;
-            /* For the fsync=always policy, we want that a given FD is never
-             * served for reading and writing in the same event loop iteration,
-             * so that in the middle of receiving the query, and serving it
-             * to the client, we'll call beforeSleep() that will do the
-             * actual fsync of AOF to disk. AE_BARRIER ensures that. */
-            if (server.aof_state == AOF_ON &&
-                server.aof_fsync == AOF_FSYNC_ALWAYS)
-            {
-                ae_flags |= AE_BARRIER;
-            }
-            if (aeCreateFileEvent(server.el, c->fd, ae_flags,
-                sendReplyToClient, c) == AE_ERR)
-            {
-                    freeClientAsync(c);
-            }
-        }
+        if (clientHasPendingReplies(c)) installClientWriteHandler(c);
     }
     return processed;
 }
@@ -1267,6 +1591,36 @@ static void setProtocolError(const char *errstr, client *c) {
     c->flags |= CLIENT_CLOSE_AFTER_REPLY;
 }
 
+/* Parse the protocol length line ("*<count>\r\n" or "$<len>\r\n") at 'p',
+ * having 'avail' bytes of buffer. The type byte at p[0] is not checked.
+ *
+ * This only handles the common case of a complete line holding a canonical
+ * non negative number of at most 18 digits, parsing it in a single pass
+ * without searching for the \r first: in this case 1 is returned, the
+ * number is stored in '*len' and the length of the line, \r\n included, in
+ * '*linelen'. Otherwise 0 is returned, and the caller should use the
+ * generic code path, that also takes care of protocol errors. */
+static inline int parseProtoLength(const char *p, size_t avail,
+                                   long long *len, size_t *linelen)
+{
+    unsigned long long v;
+    size_t i = 2;
+
+    /* The shortest line is "$0\r\n". */
+    if (avail < 4 || p[1] < '0' || p[1] > '9') return 0;
+    v = p[1]-'0';
+    if (v != 0) {
+        while (i < avail && i <= 18 && p[i] >= '0' && p[i] <= '9') {
+            v = v*10+(p[i]-'0');
+            i++;
+        }
+    }
+    if (i+1 >= avail || p[i] != '\r' || p[i+1] != '\n') return 0;
+    *len = v;
+    *linelen = i+2;
+    return 1;
+}
+
 /* Process the query buffer for client 'c', setting up the client argument
  * vector for command execution. Returns C_OK if after running the function
  * the client has a well-formed ready to be processed command, otherwise
@@ -1282,29 +1636,37 @@ int processMultibulkBuffer(client *c) {
     char *newline = NULL;
     int ok;
     long long ll;
+    size_t linelen;
 
     if (c->multibulklen == 0) {
         /* The client should have been reset */
         serverAssertWithInfo(c,NULL,c->argc == 0);
 
-        /* Multi bulk length cannot be read without a \r\n */
-        newline = strchr(c->querybuf+c->qb_pos,'\r');
-        if (newline == NULL) {
-            if (sdslen(c->querybuf)-c->qb_pos > PROTO_INLINE_MAX_SIZE) {
-                addReplyError(c,"Protocol error: too big mbulk count string");
-                setProtocolError("too big mbulk count string",c);
+        serverAssertWithInfo(c,NULL,c->querybuf[c->qb_pos] == '*');
+        if (parseProtoLength(c->querybuf+c->qb_pos,
+                             sdslen(c->querybuf)-c->qb_pos,&ll,&linelen))
+        {
+            newline = c->querybuf+c->qb_pos+linelen-2;
+            ok = 1;
+        } else {
+            /* Multi bulk length cannot be read without a \r\n */
+            newline = strchr(c->querybuf+c->qb_pos,'\r');
+            if (newline == NULL) {
+                if (sdslen(c->querybuf)-c->qb_pos > PROTO_INLINE_MAX_SIZE) {
+                    addReplyError(c,"Protocol error: too big mbulk count string");
+                    setProtocolError("too big mbulk count string",c);
+                }
+                return C_ERR;
             }
-            return C_ERR;
-        }
 
-        /* Buffer should also contain \n */
-        if (newline-(c->querybuf+c->qb_pos) > (ssize_t)(sdslen(c->querybuf)-c->qb_pos-2))
-            return C_ERR;
+            /* Buffer should also contain \n */
+            if (newline-(c->querybuf+c->qb_pos) > (ssize_t)(sdslen(c->querybuf)-c->qb_pos-2))
+                return C_ERR;
 
-        /* We know for sure there is a whole line since newline != NULL,
-         * so go ahead and find out the multi bulk length. */
-        serverAssertWithInfo(c,NULL,c->querybuf[c->qb_pos] == '*');
-        ok = string2ll(c->querybuf+1+c->qb_pos,newline-(c->querybuf+1+c->qb_pos),&ll);
+            /* We know for sure there is a whole line since newline != NULL,
+             * so go ahead and find out the multi bulk length. */
+            ok = string2ll(c->querybuf+1+c->qb_pos,newline-(c->querybuf+1+c->qb_pos),&ll);
+        }
         if (!ok || ll > 1024*1024) {
             addReplyError(c,"Protocol error: invalid multibulk length");
             setProtocolError("invalid mbulk count",c);
@@ -1324,6 +1686,27 @@ int processMultibulkBuffer(client *c) {
 
     serverAssertWithInfo(c,NULL,c->multibulklen > 0);
     while(c->multibulklen) {
+        /* Fast path: the whole bulk, length line included, is already in
+         * the buffer and is not a big argument. This is the common case
+         * with pipelines of commands with small arguments, where we can
+         * create the arguments in a tight loop, without searching for the
+         * end of the length lines and without updating c->bulklen. */
+        if (c->bulklen == -1 && c->querybuf[c->qb_pos] == '$') {
+            size_t avail = sdslen(c->querybuf)-c->qb_pos;
+            char *p = c->querybuf+c->qb_pos;
+
+            if (parseProtoLength(p,avail,&ll,&linelen) &&
+                ll < PROTO_MBULK_BIG_ARG &&
+                ll <= server.proto_max_bulk_len &&
+                linelen+ll+2 <= avail)
+            {
+                c->argv[c->argc++] = createStringObject(p+linelen,ll);
+                c->qb_pos += linelen+ll+2;
+                c->multibulklen--;
+                continue;
+            }
+        }
+
         /* Read bulk length if unknown */
         if (c->bulklen == -1) {
             newline = strchr(c->querybuf+c->qb_pos,'\r');
@@ -1367,7 +1750,9 @@ int processMultibulkBuffer(client *c) {
                  * or equal to ll+2. If the data length is greater than
                  * ll+2, trimming querybuf is just a waste of time, because
                  * at this time the querybuf contains not only our bulk. */
-                if (sdslen(c->querybuf)-c->qb_pos <= (size_t)ll+2) {
+                if (c->querybuf != sharedQueryBuf &&
+                    sdslen(c->querybuf)-c->qb_pos <= (size_t)ll+2)
+                {
                     sdsrange(c->querybuf,c->qb_pos,-1);
                     c->qb_pos = 0;
                     /* Hint the sds library about the amount of bytes this string is
@@ -1387,6 +1772,7 @@ int processMultibulkBuffer(client *c) {
              * instead of creating a new object by *copying* the sds we
              * just use the current sds string. */
             if (c->qb_pos == 0 &&
+                c->querybuf != sharedQueryBuf &&
                 c->bulklen >= PROTO_MBULK_BIG_ARG &&
                 sdslen(c->querybuf) == (size_t)(c->bulklen+2))
             {
@@ -1413,17 +1799,107 @@ int processMultibulkBuffer(client *c) {
     return C_ERR;
 }
 
+/* Execute the command that was just parsed into the client argument vector
+ * and reset the client for the next one. Returns C_ERR if the client was
+ * freed as a side effect of the command execution, otherwise C_OK. */
+static int processCommandAndResetClient(client *c) {
+    int deadclient = 0;
+    client *old_client = server.current_client;
+
+    server.current_client = c;
+    /* Only reset the client when the command was executed. */
+    if (processCommand(c) == C_OK) {
+        if (c->flags & CLIENT_MASTER && !(c->flags & CLIENT_MULTI)) {
+            /* Update the applied replication offset of our master. */
+            c->reploff = c->read_reploff - sdslen(c->querybuf) + c->qb_pos;
+        }
+
+        /* Don't reset the client structure for clients blocked in a
+         * module blocking command, so that the reply callback will
+         * still be able to access the client argv and argc field.
+         * The client will be reset in unblockClientFromModule(). */
+        if (!(c->flags & CLIENT_BLOCKED) || c->btype != BLOCKED_MODULE)
+            resetClient(c);
+    }
+    /* freeMemoryIfNeeded may flush slave output buffers. This may
+     * result into a slave, that may be the active client, to be
+     * freed. */
+    if (server.current_client == NULL) deadclient = 1;
+    /* Restore the client of the outer command, if we are executing commands
+     * of other clients from processEventsWhileBlocked(), otherwise the outer
+     * client would be mistaken for a freed one. */
+    server.current_client = old_client;
+    return deadclient ? C_ERR : C_OK;
+}
+
+/* Scan the query buffer of the client 'c' from the current position, looking
+ * for up to prefetch-batch-max-size complete multibulk commands, and prefetch
+ * the keys they access, so that the cache misses of the lookups performed by
+ * the pipelined commands overlap. Without parsing the commands we can't know
+ * where their keys are: the second argument is used, that is the key of the
+ * vast majority of the commands sent in pipelines (GET, SET, INCR, ...). A
+ * wrong guess is harmless, it just prefetches memory that will not be used.
+ *
+ * Returns the offset in the query buffer of the end of the last command
+ * scanned, so that the caller can avoid scanning again the same commands. */
+static size_t prefetchPipelinedKeys(client *c) {
+    char *keys[CONFIG_PREFETCH_BATCH_MAX];
+    size_t lens[CONFIG_PREFETCH_BATCH_MAX];
+    int count = 0, commands = 0;
+    size_t pos = c->qb_pos, end = sdslen(c->querybuf), scanned = pos;
+
+    while (commands < server.prefetch_batch_max_size && pos < end) {
+        char *key = NULL;
+        long long argc, j, len;
+        size_t linelen, keylen = 0;
+
+        if (c->querybuf[pos] != '*' ||
+            !parseProtoLength(c->querybuf+pos,end-pos,&argc,&linelen)) break;
+        pos += linelen;
+        for (j = 0; j < argc; j++) {
+            if (pos >= end || c->querybuf[pos] != '$' ||
+                !parseProtoLength(c->querybuf+pos,end-pos,&len,&linelen) ||
+                (size_t)len+2 > end-pos-linelen) break;
+            if (j == 1) {
+                key = c->querybuf+pos+linelen;
+                keylen = len;
+            }
+            pos += linelen+len+2;
+        }
+        if (j != argc) break; /* Incomplete command. */
+        if (key) {
+            keys[count] = key;
+            lens[count++] = keylen;
+        }
+        commands++;
+        scanned = pos;
+    }
+    if (count > 1) dbPrefetchKeys(c->db,keys,lens,count);
+    return scanned;
+}
+
 /* This function is called every time, in the client structure 'c', there is
  * more query buffer to process, because we read more data from the socket
  * or because a client was blocked and later reactivated, so there could be
- * pending query buffer, already representing a full command, to process. */
-void processInputBuffer(client *c) {
-    server.current_client = c;
+ * pending query buffer, already representing a full command, to process.
+ *
+ * When called from an I/O thread (the client is flagged with
+ * CLIENT_PENDING_READ) commands are only parsed: the first complete command
+ * is left in the argument vector, flagged with CLIENT_PENDING_COMMAND, and
+ * executed later by the main thread.
+ *
+ * Returns C_ERR if the client was freed while executing a command, so that
+ * the caller must not touch it anymore, otherwise C_OK. */
+int processInputBuffer(client *c) {
+    size_t prefetched = 0;
 
     /* Keep processing while there is something in the input buffer */
     while(c->qb_pos < sdslen(c->querybuf)) {
-        /* Return if clients are paused. */
-        if (!(c->flags & CLIENT_SLAVE) && clientsArePaused()) break;
+        /* Return if clients are paused. The pause state belongs to the main
+         * thread, and reads are never handed to the I/O threads while
+         * clients are paused, see postponeClientRead(). */
+        if (!(c->flags & (CLIENT_SLAVE|CLIENT_PENDING_READ)) &&
+            clientsArePaused()) break;
 
         /* Immediately abort if the client is in the middle of something. */
         if (c->flags & CLIENT_BLOCKED) break;
@@ -1450,6 +1926,15 @@ void processInputBuffer(client *c) {
             }
         }
 
+        /* Prefetch the keys of the next pipelined commands, unless we
+         * already did it for the command about to be parsed. */
+        if (c->reqtype == PROTO_REQ_MULTIBULK && c->multibulklen == 0 &&
+            c->qb_pos >= prefetched && server.prefetch_batch_max_size &&
+            !(c->flags & CLIENT_PENDING_READ))
+        {
+            prefetched = prefetchPipelinedKeys(c);
+        }
+
         if (c->reqtype == PROTO_REQ_INLINE) {
             if (processInlineBuffer(c) != C_OK) break;
         } else if (c->reqtype == PROTO_REQ_MULTIBULK) {
@@ -1462,46 +1947,43 @@ void processInputBuffer(client *c) {
         if (c->argc == 0) {
             resetClient(c);
         } else {
-            /* Only reset the client when the command was executed. */
-            if (processCommand(c) == C_OK) {
-                if (c->flags & CLIENT_MASTER && !(c->flags & CLIENT_MULTI)) {
-                    /* Update the applied replication offset of our master. */
-                    c->reploff = c->read_reploff - sdslen(c->querybuf) + c->qb_pos;
-                }
+            /* If we are in the context of an I/O thread, we can't really
+             * execute the command here. All we can do is to flag the client
+             * as one that needs to process the command. */
+            if (c->flags & CLIENT_PENDING_READ) {
+                c->flags |= CLIENT_PENDING_COMMAND;
+                break;
+            }
 
-                /* Don't reset the client structure for clients blocked in a
-                 * module blocking command, so that the reply callback will
-                 * still be able to access the client argv and argc field.
-                 * The client will be reset in unblockClientFromModule(). */
-                if (!(c->flags & CLIENT_BLOCKED) || c->btype != BLOCKED_MODULE)
-                    resetClient(c);
+            /* We are finally ready to execute the command. */
+            if (processCommandAndResetClient(c) == C_ERR) {
+                /* If the client is no longer valid, we avoid exiting this
+                 * loop and trimming the client buffer later. So we return
+                 * ASAP in that case. */
+                return C_ERR;
             }
-            /* freeMemoryIfNeeded may flush slave output buffers. This may
-             * result into a slave, that may be the active client, to be
-             * freed. */
-            if (server.current_client == NULL) break;
         }
     }
 
     /* Trim to pos */
-    if (server.current_client != NULL && c->qb_pos) {
+    if (c->qb_pos) {
         sdsrange(c->querybuf,c->qb_pos,-1);
         c->qb_pos = 0;
     }
-
-    server.current_client = NULL;
+    return C_OK;
 }
 
 /* This is a wrapper for processInputBuffer that also cares about handling
  * the replication forwarding to the sub-slaves, in case the client 'c'
  * is flagged as master. Usually you want to call this instead of the
- * raw processInputBuffer(). */
-void processInputBufferAndReplicate(client *c) {
+ * raw processInputBuffer(). Like processInputBuffer() returns C_ERR if the
+ * client was freed. */
+int processInputBufferAndReplicate(client *c) {
     if (!(c->flags & CLIENT_MASTER)) {
-        processInputBuffer(c);
+        return processInputBuffer(c);
     } else {
         size_t prev_offset = c->reploff;
-        processInputBuffer(c);
+        if (processInputBuffer(c) == C_ERR) return C_ERR;
         size_t applied = c->reploff - prev_offset;
         if (applied) {
             replicationFeedSlavesFromMasterStream(server.slaves,
@@ -1509,15 +1991,61 @@ void processInputBufferAndReplicate(client *c) {
             sdsrange(c->pending_querybuf,applied,-1);
         }
     }
+    return C_OK;
+}
+
+/* Return true if the next read of the client 'c' can use the shared query
+ * buffer: this is the case when the main thread is reading a normal client
+ * that has nothing pending in its private query buffer. Masters are
+ * excluded since their query buffer is also used to compute the replication
+ * offset, and so are clients in the middle of a big argument, whose private
+ * buffer was already sized to receive it. */
+static int clientCanUseSharedQueryBuffer(client *c) {
+    return server.shared_query_buffer &&
+           !sharedQueryBufInUse &&
+           io_threads_op == IO_THREADS_OP_IDLE &&
+           !(c->flags & CLIENT_MASTER) &&
+           sdslen(c->querybuf) == 0 &&
+           c->bulklen < PROTO_MBULK_BIG_ARG;
+}
+
+/* Give the client back its private query buffer after its data was read
+ * into the shared one and processed, copying the part of the buffer that
+ * was not consumed, if any. The shared buffer is then cleared for the next
+ * client. */
+static void clientReleaseSharedQueryBuffer(client *c, sds private) {
+    size_t remaining = sdslen(c->querybuf) - c->qb_pos;
+
+    if (remaining) {
+        private = sdscatlen(private,c->querybuf+c->qb_pos,remaining);
+        /* Like processMultibulkBuffer() does for the private buffer, make
+         * room for a big argument that started in the shared buffer. */
+        if (c->bulklen >= PROTO_MBULK_BIG_ARG)
+            private = sdsMakeRoomFor(private,c->bulklen+2-remaining);
+    }
+    c->querybuf = private;
+    c->qb_pos = 0;
+    sdsclear(sharedQueryBuf);
+    sharedQueryBufInUse = 0;
 }
 
 void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
     client *c = (client*) privdata;
     int nread, readlen;
     size_t qblen;
+    sds private = NULL;
     UNUSED(el);
     UNUSED(mask);
 
+    /* Check if we want to read from the client later when exiting from
+     * the event loop. This is the case if threaded I/O is enabled. */
+    if (postponeClientRead(c)) return;
+
+    /* The client is already reading from the shared query buffer in a
+     * command that re-entered the event loop, see processEventsWhileBlocked():
+     * the new data will be read when the outer read handler returns. */
+    if (c->querybuf == sharedQueryBuf) return;
+
     readlen = PROTO_IOBUF_LEN;
     /* If this is a multi bulk request, and we are processing a bulk reply
      * that is large enough, try to maximize the probability that the query
@@ -1537,19 +2065,32 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
 
     qblen = sdslen(c->querybuf);
     if (c->querybuf_peak < qblen) c->querybuf_peak = qblen;
-    c->querybuf = sdsMakeRoomFor(c->querybuf, readlen);
+
+    /* If the client has nothing pending, read into the shared query buffer
+     * instead of growing the private one, that is left untouched. */
+    if (clientCanUseSharedQueryBuffer(c)) {
+        if (sharedQueryBuf == NULL)
+            sharedQueryBuf = sdsnewlen(SDS_NOINIT,PROTO_IOBUF_LEN);
+        sdsclear(sharedQueryBuf);
+        private = c->querybuf;
+        c->querybuf = sharedQueryBuf;
+        sharedQueryBufInUse = 1;
+    } else {
+        c->querybuf = sdsMakeRoomFor(c->querybuf, readlen);
+    }
     nread = read(fd, c->querybuf+qblen, readlen);
+    if (nread <= 0 && private) clientReleaseSharedQueryBuffer(c,private);
     if (nread == -1) {
         if (errno == EAGAIN) {
             return;
         } else {
             serverLog(LL_VERBOSE, "Reading from client: %s",strerror(errno));
-            freeClient(c);
+            freeClientFromIO(c);
             return;
         }
     } else if (nread == 0) {
         serverLog(LL_VERBOSE, "Client closed connection");
-        freeClient(c);
+        freeClientFromIO(c);
         return;
     } else if (c->flags & CLIENT_MASTER) {
         /* Append the query buffer to the pending (not applied) buffer
@@ -1562,7 +2103,7 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
     sdsIncrLen(c->querybuf,nread);
     c->lastinteraction = server.unixtime;
     if (c->flags & CLIENT_MASTER) c->read_reploff += nread;
-    server.stat_net_input_bytes += nread;
+    atomicIncr(server.stat_net_input_bytes,nread);
     if (sdslen(c->querybuf) > server.client_max_querybuf_len) {
         sds ci = catClientInfoString(sdsempty(),c), bytes = sdsempty();
 
@@ -1570,7 +2111,8 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
         serverLog(LL_WARNING,"Closing client that reached max query buffer length: %s (qbuf initial bytes: %s)", ci, bytes);
         sdsfree(ci);
         sdsfree(bytes);
-        freeClient(c);
+        if (private) clientReleaseSharedQueryBuffer(c,private);
+        freeClientFromIO(c);
         return;
     }
 
@@ -1580,7 +2122,16 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
      * was actually applied to the master state: this quantity, and its
      * corresponding part of the replication stream, will be propagated to
      * the sub-slaves and to the replication backlog. */
-    processInputBufferAndReplicate(c);
+    if (processInputBufferAndReplicate(c) == C_ERR) {
+        /* The client was freed: its private buffer is all that's left. */
+        if (private) {
+            sdsfree(private);
+            sdsclear(sharedQueryBuf);
+            sharedQueryBufInUse = 0;
+        }
+        return;
+    }
+    if (private) clientReleaseSharedQueryBuffer(c,private);
 }
 
 void getClientsMaxBuffers(unsigned long *longest_output_list,
@@ -1669,7 +2220,7 @@ sds catClientInfoString(sds s, client *client) {
     if (emask & AE_WRITABLE) *p++ = 'w';
     *p = '\0';
     return sdscatfmt(s,
-        "id=%U addr=%s fd=%i name=%s age=%I idle=%I flags=%s db=%i sub=%i psub=%i multi=%i qbuf=%U qbuf-free=%U obl=%U oll=%U omem=%U events=%s cmd=%s",
+        "id=%U addr=%s fd=%i name=%s age=%I idle=%I flags=%s db=%i sub=%i psub=%i multi=%i qbuf=%U qbuf-free=%U obl=%U oll=%U omem=%U events=%s cmd=%s rbs=%U rbp=%U",
         (unsigned long long) client->id,
         getClientPeerId(client),
         client->fd,
@@ -1678,8 +2229,8 @@ sds catClientInfoString(sds s, client *client) {
         (long long)(server.unixtime - client->lastinteraction),
         flags,
         client->db->id,
-        (int) dictSize(client->pubsub_channels),
-        (int) listLength(client->pubsub_patterns),
+        client->pubsub_channels ? (int) dictSize(client->pubsub_channels) : 0,
+        client->pubsub_patterns ? (int) listLength(client->pubsub_patterns) : 0,
         (client->flags & CLIENT_MULTI) ? client->mstate.count : -1,
         (unsigned long long) sdslen(client->querybuf),
         (unsigned long long) sdsavail(client->querybuf),
@@ -1687,7 +2238,9 @@ sds catClientInfoString(sds s, client *client) {
         (unsigned long long) listLength(client->reply),
         (unsigned long long) getClientOutputBufferMemoryUsage(client),
         events,
-        client->lastcmd ? client->lastcmd->name : "NULL");
+        client->lastcmd ? client->lastcmd->name : "NULL",
+        (unsigned long long) client->buf_usable_size,
+        (unsigned long long) client->buf_peak);
 }
 
 sds getAllClientsInfoString(int type) {
@@ -2234,6 +2787,13 @@ int clientsArePaused(void) {
 int processEventsWhileBlocked(void) {
     int iterations = 4; /* See the function top-comment. */
     int count = 0;
+
+    /* Note: when we are processing events while blocked (for instance during
+     * busy Lua scripts), we set a global flag. When such flag is set, we
+     * avoid handling the read part of clients using threaded I/O, since
+     * beforeSleep() is not called in this context and the postponed reads
+     * would not be served until the blocking operation terminates. */
+    ProcessingEventsWhileBlocked = 1;
     while (iterations--) {
         int events = 0;
         events += aeProcessEvents(server.el, AE_FILE_EVENTS|AE_DONT_WAIT);
@@ -2241,5 +2801,430 @@ int processEventsWhileBlocked(void) {
         if (!events) break;
         count += events;
     }
+    ProcessingEventsWhileBlocked = 0;
+    return count;
+}
+
+/* ==========================================================================
+ * Threaded I/O
+ *
+ * When io-threads is greater than one, the socket reads and writes (and
+ * optionally the parsing of the query buffer) of the clients with pending
+ * I/O are split among the main thread and io-threads minus one additional
+ * threads, in the final part of every event loop iteration. Commands are
+ * always executed in the main thread, after all the threads are done.
+ * ========================================================================== */
+
+pthread_t io_threads[IO_THREADS_MAX_NUM];
+pthread_mutex_t io_threads_mutex[IO_THREADS_MAX_NUM];
+unsigned long io_threads_pending[IO_THREADS_MAX_NUM];
+int io_threads_active;  /* Are the threads currently spinning waiting I/O? */
+
+/* This is the list of clients each thread will serve when threaded I/O is
+ * used. We spawn io_threads_num-1 threads, since one is the main thread
+ * itself. */
+list *io_threads_list[IO_THREADS_MAX_NUM];
+
+static unsigned long getIOPendingCount(int i) {
+    unsigned long count;
+    atomicGetWithSync(io_threads_pending[i],count);
     return count;
 }
+
+static void setIOPendingCount(int i, unsigned long count) {
+    atomicSetWithSync(io_threads_pending[i],count);
+}
+
+/* Perform the current I/O operation on every client of the specified
+ * list, and empty it. */
+static void processIOThreadsList(list *clients) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(clients,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+        if (io_threads_op == IO_THREADS_OP_WRITE) {
+            writeToClient(c->fd,c,0);
+        } else if (io_threads_op == IO_THREADS_OP_READ) {
+            readQueryFromClient(server.el,c->fd,c,AE_READABLE);
+        } else {
+            serverPanic("io_threads_op value is unknown");
+        }
+    }
+    listEmpty(clients);
+}
+
+void *IOThreadMain(void *myid) {
+    /* The ID is the thread number (from 0 to server.io_threads_num-1), and is
+     * used by the thread to just manipulate a single sub-array of clients. */
+    long id = (unsigned long)myid;
+
+    while(1) {
+        /* Wait for start */
+        for (int j = 0; j < 1000000; j++) {
+            if (getIOPendingCount(id) != 0) break;
+        }
+
+        /* Give the main thread a chance to stop this thread. */
+        if (getIOPendingCount(id) == 0) {
+            pthread_mutex_lock(&io_threads_mutex[id]);
+            pthread_mutex_unlock(&io_threads_mutex[id]);
+            continue;
+        }
+
+        /* Process: note that the main thread will never touch our list
+         * before we drop the pending count to 0. */
+        processIOThreadsList(io_threads_list[id]);
+        setIOPendingCount(id,0);
+    }
+}
+
+/* Initialize the data structures needed for threaded I/O. */
+void initThreadedIO(void) {
+    io_threads_active = 0; /* We start with threads not active. */
+
+    /* Don't spawn any thread if the user selected a single thread:
+     * we'll handle I/O directly from the main thread. */
+    if (server.io_threads_num == 1) return;
+
+    if (server.io_threads_num > IO_THREADS_MAX_NUM) {
+        serverLog(LL_WARNING,"Fatal: too many I/O threads configured. "
+                             "The maximum number is %d.", IO_THREADS_MAX_NUM);
+        exit(1);
+    }
+
+    /* Spawn and initialize the I/O threads. */
+    for (int i = 0; i < server.io_threads_num; i++) {
+        /* Things we do for all the threads including the main thread. */
+        io_threads_list[i] = listCreate();
+        if (i == 0) continue; /* Thread 0 is the main thread. */
+
+        /* Things we do only for the additional threads. */
+        pthread_t tid;
+        pthread_mutex_init(&io_threads_mutex[i],NULL);
+        setIOPendingCount(i,0);
+        pthread_mutex_lock(&io_threads_mutex[i]); /* Thread will be stopped. */
+        if (pthread_create(&tid,NULL,IOThreadMain,(void*)(long)i) != 0) {
+            serverLog(LL_WARNING,"Fatal: Can't initialize IO thread.");
+            exit(1);
+        }
+        io_threads[i] = tid;
+    }
+}
+
+/* Kill the I/O threads in an unclean way. Like bioKillThreads() this is
+ * only used on crash, before performing the fast memory test. */
+void killIOThreads(void) {
+    int err, j;
+
+    for (j = 1; j < server.io_threads_num; j++) {
+        if (io_threads_list[j] == NULL) continue; /* Not spawned. */
+        if (pthread_cancel(io_threads[j]) == 0) {
+            if ((err = pthread_join(io_threads[j],NULL)) != 0) {
+                serverLog(LL_WARNING,
+                    "IO thread(tid:%lu) can not be joined: %s",
+                        (unsigned long)io_threads[j], strerror(err));
+            } else {
+                serverLog(LL_WARNING,
+                    "IO thread(tid:%lu) terminated",
+                        (unsigned long)io_threads[j]);
+            }
+        }
+    }
+}
+
+/* Return true if the I/O threads are currently spinning to serve clients. */
+int ioThreadsActive(void) {
+    return io_threads_active;
+}
+
+static void startThreadedIO(void) {
+    serverAssert(io_threads_active == 0);
+    for (int j = 1; j < server.io_threads_num; j++)
+        pthread_mutex_unlock(&io_threads_mutex[j]);
+    io_threads_active = 1;
+}
+
+static void stopThreadedIO(void) {
+    /* We may have still clients with pending reads when this function
+     * is called: handle them before stopping the threads. */
+    handleClientsWithPendingReadsUsingThreads();
+    serverAssert(io_threads_active == 1);
+    for (int j = 1; j < server.io_threads_num; j++)
+        pthread_mutex_lock(&io_threads_mutex[j]);
+    io_threads_active = 0;
+}
+
+/* This function checks if there are not enough pending clients to justify
+ * taking the I/O threads active: in that case I/O threads are stopped if
+ * currently active. We track the pending writes as a measure of clients
+ * we need to handle in parallel, however the I/O threading is disabled
+ * globally for reads as well if we have too little pending clients.
+ *
+ * The function returns 0 if the I/O threading should be used because there
+ * are enough active threads, otherwise 1 is returned and the I/O threads
+ * could be possibly stopped (if already active) as a side effect. */
+int stopThreadedIOIfNeeded(void) {
+    int pending = listLength(server.clients_pending_write);
+
+    /* Return ASAP if IO threads are disabled (single threaded mode). */
+    if (server.io_threads_num == 1) return 1;
+
+    if (pending < (server.io_threads_num*2)) {
+        if (io_threads_active) stopThreadedIO();
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+/* Split the clients in the specified list among the I/O threads, run the
+ * operation 'op' on all of them (the main thread serves the first slice),
+ * and wait for all the threads to finish. */
+static void runThreadedIO(list *clients, int op) {
+    listIter li;
+    listNode *ln;
+    int item_id = 0;
+
+    /* Distribute the clients across N different lists. Clients with
+     * output buffers referencing objects are always served by the main
+     * thread, since releasing the references is not thread safe: the same
+     * object may be referenced by clients served by different threads. */
+    listRewind(clients,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+        int target_id = item_id % server.io_threads_num;
+        if (op == IO_THREADS_OP_WRITE && c->reply_obj_refs) target_id = 0;
+        listAddNodeTail(io_threads_list[target_id],c);
+        item_id++;
+    }
+
+    /* Give the start condition to the waiting threads, by setting the
+     * start condition atomic var. */
+    io_threads_op = op;
+    for (int j = 1; j < server.io_threads_num; j++) {
+        int count = listLength(io_threads_list[j]);
+        setIOPendingCount(j,count);
+    }
+
+    /* Also use the main thread to process a slice of clients. */
+    processIOThreadsList(io_threads_list[0]);
+
+    /* Wait for all the other threads to end their work. */
+    while(1) {
+        unsigned long pending = 0;
+        for (int j = 1; j < server.io_threads_num; j++)
+            pending += getIOPendingCount(j);
+        if (pending == 0) break;
+    }
+    io_threads_op = IO_THREADS_OP_IDLE;
+}
+
+int handleClientsWithPendingWritesUsingThreads(void) {
+    listIter li;
+    listNode *ln;
+    int processed = listLength(server.clients_pending_write);
+    if (processed == 0) return 0; /* Return ASAP if there are no clients. */
+
+    /* If we have just a few clients to serve, don't use I/O threads, but the
+     * boring synchronous code. */
+    if (stopThreadedIOIfNeeded()) {
+        return handleClientsWithPendingWrites();
+    }
+
+    /* Start threads if needed. */
+    if (!io_threads_active) startThreadedIO();
+
+    /* Protected clients are not served at all, like in the synchronous
+     * code path, so that no write error or handler is triggered. */
+    listRewind(server.clients_pending_write,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+        c->flags &= ~CLIENT_PENDING_WRITE;
+        if (c->flags & CLIENT_PROTECTED)
+            listDelNode(server.clients_pending_write,ln);
+    }
+    runThreadedIO(server.clients_pending_write,IO_THREADS_OP_WRITE);
+    server.stat_io_writes_processed += processed;
+
+    /* Run the list of clients again to install the write handler where
+     * needed. */
+    listRewind(server.clients_pending_write,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+
+        /* Clients that failed, or that were flagged to be closed after the
+         * reply was sent, were just scheduled to be freed. */
+        if (c->flags & CLIENT_CLOSE_ASAP) continue;
+
+        /* Install the write handler if there are pending writes in some
+         * of the clients. */
+        if (clientHasPendingReplies(c)) installClientWriteHandler(c);
+    }
+    listEmpty(server.clients_pending_write);
+
+    /* Release the clients the threads could not free synchronously. */
+    freeClientsInAsyncFreeQueue();
+    return processed;
+}
+
+/* Return 1 if we want to handle the client read later using threaded I/O.
+ * This is called by the readable handler of the event loop.
+ * As a side effect of calling this function the client is put in the
+ * pending read clients and flagged as such. */
+int postponeClientRead(client *c) {
+    if (io_threads_active &&
+        server.io_threads_do_reads &&
+        io_threads_op == IO_THREADS_OP_IDLE &&
+        !ProcessingEventsWhileBlocked &&
+        !clientsArePaused() &&
+        !(c->flags & (CLIENT_MASTER|CLIENT_SLAVE|CLIENT_PENDING_READ|
+                      CLIENT_BLOCKED|CLIENT_PROTECTED)))
+    {
+        c->flags |= CLIENT_PENDING_READ;
+        listAddNodeHead(server.clients_pending_read,c);
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+/* When threaded I/O is also enabled for the reading + parsing side, the
+ * readable handler will just put normal clients into a queue of clients to
+ * process (instead of serving them synchronously). This function runs
+ * the queue using the I/O threads, and process them in order to accumulate
+ * the reads in the buffers, and also parse the first command available
+ * rendering it in the client structures. */
+int handleClientsWithPendingReadsUsingThreads(void) {
+    listNode *ln;
+
+    if (!io_threads_active || !server.io_threads_do_reads) return 0;
+    int processed = listLength(server.clients_pending_read);
+    if (processed == 0) return 0;
+
+    runThreadedIO(server.clients_pending_read,IO_THREADS_OP_READ);
+    server.stat_io_reads_processed += processed;
+
+    /* Run the list of clients again to process the new buffers. */
+    while(listLength(server.clients_pending_read)) {
+        ln = listFirst(server.clients_pending_read);
+        client *c = listNodeValue(ln);
+        c->flags &= ~CLIENT_PENDING_READ;
+        listDelNode(server.clients_pending_read,ln);
+
+        /* The client was scheduled to be freed by the thread. */
+        if (c->flags & CLIENT_CLOSE_ASAP) continue;
+
+        if (c->flags & CLIENT_PENDING_COMMAND) {
+            c->flags &= ~CLIENT_PENDING_COMMAND;
+            if (processCommandAndResetClient(c) == C_ERR) {
+                /* If the client is no longer valid, we avoid
+                 * processing the client later. So we just go
+                 * to the next. */
+                continue;
+            }
+        }
+        processInputBuffer(c);
+
+        /* We may have pending replies if a thread readQueryFromClient()
+         * produced replies and did not install a write handler (it can't). */
+        if (!(c->flags & CLIENT_PENDING_WRITE) && clientHasPendingReplies(c))
+            clientInstallWriteHandler(c);
+    }
+
+    /* Release the clients the threads could not free synchronously. */
+    freeClientsInAsyncFreeQueue();
+    return processed;
+}
+
+#ifdef REDIS_TEST
+#include <sys/time.h>
+#include <assert.h>
+
+#define PARSER_TEST_COMMANDS 1000
+#define PARSER_TEST_PAIRS 100
+
+static long long parserTestUsec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+/* Parse the whole query buffer of the fake client 'c', returning the number
+ * of commands parsed, and freeing the arguments as we go. */
+static long long parserTestParse(client *c) {
+    long long commands = 0;
+    int j;
+
+    c->qb_pos = 0;
+    while (c->qb_pos < sdslen(c->querybuf)) {
+        if (processMultibulkBuffer(c) != C_OK) break;
+        for (j = 0; j < c->argc; j++) decrRefCount(c->argv[j]);
+        c->argc = 0;
+        c->bulklen = -1;
+        commands++;
+    }
+    return commands;
+}
+
+int networkingTest(int argc, char **argv) {
+    client *c = zcalloc(sizeof(*c));
+    long long ll, start, elapsed, args = 0;
+    size_t linelen;
+    int j, k;
+    UNUSED(argc);
+    UNUSED(argv);
+
+    /* Objects creation needs the LRU clock, that depends on server.hz. */
+    server.hz = CONFIG_DEFAULT_HZ;
+    server.proto_max_bulk_len = CONFIG_DEFAULT_PROTO_MAX_BULK_LEN;
+
+    printf("Protocol length lines fast path: ");
+    assert(parseProtoLength("$0\r\n",4,&ll,&linelen) && ll == 0 && linelen == 4);
+    assert(parseProtoLength("*12\r\n",5,&ll,&linelen) && ll == 12 && linelen == 5);
+    assert(parseProtoLength("$999999999999999999\r\n",21,&ll,&linelen) &&
+           ll == 999999999999999999LL);
+    /* Left to the generic code path. */
+    assert(!parseProtoLength("$12\r",4,&ll,&linelen));
+    assert(!parseProtoLength("$12\rX",5,&ll,&linelen));
+    assert(!parseProtoLength("$012\r\n",6,&ll,&linelen));
+    assert(!parseProtoLength("*-1\r\n",5,&ll,&linelen));
+    assert(!parseProtoLength("$1a\r\n",5,&ll,&linelen));
+    assert(!parseProtoLength("$1000000000000000000\r\n",22,&ll,&linelen));
+    printf("OK\n");
+
+    /* A pipeline of MSET commands with short keys and values. */
+    c->querybuf = sdsempty();
+    c->bulklen = -1;
+    for (j = 0; j < PARSER_TEST_COMMANDS; j++) {
+        c->querybuf = sdscatprintf(c->querybuf,"*%d\r\n$4\r\nMSET\r\n",
+                                   1+PARSER_TEST_PAIRS*2);
+        for (k = 0; k < PARSER_TEST_PAIRS; k++) {
+            c->querybuf = sdscatprintf(c->querybuf,
+                "$%d\r\nkey:%d\r\n$1\r\n%d\r\n",
+                4+(int)digits10(k),k,k%10);
+        }
+    }
+
+    printf("Parse the MSET pipeline: ");
+    assert(parserTestParse(c) == PARSER_TEST_COMMANDS);
+    assert(c->qb_pos == sdslen(c->querybuf));
+    printf("OK\n");
+
+    printf("Parse %d MSET commands with %d pairs (%zu bytes): ",
+        PARSER_TEST_COMMANDS, PARSER_TEST_PAIRS, sdslen(c->querybuf));
+    start = parserTestUsec();
+    for (j = 0; j < 20; j++) {
+        parserTestParse(c);
+        args += PARSER_TEST_COMMANDS*(1+PARSER_TEST_PAIRS*2);
+    }
+    elapsed = parserTestUsec()-start;
+    printf("%.1f nsec per argument\n", (double)elapsed*1000/args);
+
+    sdsfree(c->querybuf);
+    zfree(c->argv);
+    zfree(c);
+    return 0;
+}
+#endif
@@ -43,6 +43,8 @@ robj *createObject(int type, void *ptr) {
     o->type = type;
     o->encoding = OBJ_ENCODING_RAW;
     o->ptr = ptr;
+    o->embkey = 0;
+    o->embexpire = 0;
     o->refcount = 1;
 
     /* Set the LRU to the current lruclock (minutes resolution), or
@@ -88,6 +90,8 @@ robj *createEmbeddedStringObject(const char *ptr, size_t len) {
     o->type = OBJ_STRING;
     o->encoding = OBJ_ENCODING_EMBSTR;
     o->ptr = sh+1;
+    o->embkey = 0;
+    o->embexpire = 0;
     o->refcount = 1;
     if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
         o->lru = (LFUGetTimeInMinutes()<<8) | LFU_INIT_VAL;
@@ -123,6 +127,97 @@ robj *createStringObject(const char *ptr, size_t len) {
         return createRawStringObject(ptr,len);
 }
 
+/* Create a copy of the string object 'val' having the key name 'key'
+ * embedded in the same allocation, right after the object header:
+ *
+ * +------+-----------------------+-------------------------+
+ * | robj | sdshdr8 key name '\0' | sdshdr8 string value '\0'|
+ * +------+-----------------------+-------------------------+
+ *
+ * If 'withexpire' is true the key name is preceded by a keyExpire header,
+ * so that an expire can be set on the key without moving its name out of
+ * the object (see setExpire()):
+ *
+ * +------+-----------+-----------------------+-----------------------+
+ * | robj | keyExpire | sdshdr8 key name '\0' | sdshdr8 value '\0'    |
+ * +------+-----------+-----------------------+-----------------------+
+ *
+ * Integer encoded values are stored in the 'ptr' field as usual and have
+ * no string part, otherwise the object has the EMBSTR encoding. When such
+ * an object is stored in the keyspace, the dict uses the embedded key name
+ * as the key of the entry, so that a key and a small string value need a
+ * single allocation besides the hash table entry (see dbAdd()).
+ *
+ * The embedded key name is flagged with OBJ_EMBKEY_SDS_FLAG: it is
+ * released together with the object, never by sdsfree().
+ *
+ * NULL is returned if the key name or the value are too big for this
+ * format, or if the value is not a string. */
+robj *createCompactObject(const sds key, const robj *val, int withexpire) {
+    size_t keylen = sdslen(key), vallen = 0, size;
+    size_t expirelen = withexpire ? sizeof(keyExpire) : 0;
+    struct sdshdr8 *kh;
+    robj *o;
+
+    if (val->type != OBJ_STRING || keylen > UINT8_MAX) return NULL;
+    size = sizeof(robj)+expirelen+sizeof(struct sdshdr8)+keylen+1;
+    if (val->encoding != OBJ_ENCODING_INT) {
+        vallen = sdslen(val->ptr);
+        if (vallen > OBJ_ENCODING_EMBSTR_SIZE_LIMIT) return NULL;
+        size += sizeof(struct sdshdr8)+vallen+1;
+    }
+
+    o = zmalloc(size);
+    o->type = OBJ_STRING;
+    o->embkey = 1;
+    o->embexpire = withexpire != 0;
+    o->refcount = 1;
+    if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
+        o->lru = (LFUGetTimeInMinutes()<<8) | LFU_INIT_VAL;
+    } else {
+        o->lru = LRU_CLOCK();
+    }
+
+    kh = (void*)((char*)(o+1)+expirelen);
+    kh->len = keylen;
+    kh->alloc = keylen;
+    kh->flags = SDS_TYPE_8|OBJ_EMBKEY_SDS_FLAG;
+    if (withexpire) {
+        keyExpire *ke = (keyExpire*)kh-1;
+
+        kh->flags |= KEY_EXPIRE_SDS_FLAG;
+        ke->when = -1;
+        ke->pos = 0;
+    }
+    memcpy(kh->buf,key,keylen);
+    kh->buf[keylen] = '\0';
+
+    if (val->encoding == OBJ_ENCODING_INT) {
+        o->encoding = OBJ_ENCODING_INT;
+        o->ptr = val->ptr;
+    } else {
+        struct sdshdr8 *vh = (void*)(kh->buf+keylen+1);
+
+        o->encoding = OBJ_ENCODING_EMBSTR;
+        o->ptr = vh+1;
+        vh->len = vallen;
+        vh->alloc = vallen;
+        vh->flags = SDS_TYPE_8;
+        memcpy(vh->buf,val->ptr,vallen);
+        vh->buf[vallen] = '\0';
+    }
+    return o;
+}
+
+/* Return the key name embedded in the object 'o' by createCompactObject(),
+ * or NULL if the object has no embedded key. */
+sds objectEmbeddedKey(const robj *o) {
+    if (!o->embkey) return NULL;
+    if (o->embexpire)
+        return (sds)((struct sdshdr8*)((keyExpire*)(o+1)+1))->buf;
+    return (sds)((struct sdshdr8*)(o+1))->buf;
+}
+
 /* Create a string object from a long long value. When possible returns a
  * shared integer object, or at least an integer encoded one.
  *
@@ -218,13 +313,6 @@ robj *createQuicklistObject(void) {
     return o;
 }
 
-robj *createZiplistObject(void) {
-    unsigned char *zl = ziplistNew();
-    robj *o = createObject(OBJ_LIST,zl);
-    o->encoding = OBJ_ENCODING_ZIPLIST;
-    return o;
-}
-
 robj *createSetObject(void) {
     dict *d = dictCreate(&setDictType,NULL);
     robj *o = createObject(OBJ_SET,d);
@@ -240,9 +328,9 @@ robj *createIntsetObject(void) {
 }
 
 robj *createHashObject(void) {
-    unsigned char *zl = ziplistNew();
+    unsigned char *zl = lpNew();
     robj *o = createObject(OBJ_HASH, zl);
-    o->encoding = OBJ_ENCODING_ZIPLIST;
+    o->encoding = OBJ_ENCODING_LISTPACK;
     return o;
 }
 
@@ -257,10 +345,10 @@ robj *createZsetObject(void) {
     return o;
 }
 
-robj *createZsetZiplistObject(void) {
-    unsigned char *zl = ziplistNew();
+robj *createZsetListpackObject(void) {
+    unsigned char *zl = lpNew();
     robj *o = createObject(OBJ_ZSET,zl);
-    o->encoding = OBJ_ENCODING_ZIPLIST;
+    o->encoding = OBJ_ENCODING_LISTPACK;
     return o;
 }
 
@@ -314,8 +402,8 @@ void freeZsetObject(robj *o) {
         zslFree(zs->zsl);
         zfree(zs);
         break;
-    case OBJ_ENCODING_ZIPLIST:
-        zfree(o->ptr);
+    case OBJ_ENCODING_LISTPACK:
+        lpFree(o->ptr);
         break;
     default:
         serverPanic("Unknown sorted set encoding");
@@ -327,8 +415,8 @@ void freeHashObject(robj *o) {
     case OBJ_ENCODING_HT:
         dictRelease((dict*) o->ptr);
         break;
-    case OBJ_ENCODING_ZIPLIST:
-        zfree(o->ptr);
+    case OBJ_ENCODING_LISTPACK:
+        lpFree(o->ptr);
         break;
     default:
         serverPanic("Unknown hash encoding type");
@@ -743,7 +831,7 @@ char *strEncoding(int encoding) {
     case OBJ_ENCODING_INT: return "int";
     case OBJ_ENCODING_HT: return "hashtable";
     case OBJ_ENCODING_QUICKLIST: return "quicklist";
-    case OBJ_ENCODING_ZIPLIST: return "ziplist";
+    case OBJ_ENCODING_LISTPACK: return "listpack";
     case OBJ_ENCODING_INTSET: return "intset";
     case OBJ_ENCODING_SKIPLIST: return "skiplist";
     case OBJ_ENCODING_EMBSTR: return "embstr";
@@ -799,18 +887,20 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
         } else {
             serverPanic("Unknown string encoding");
         }
+        if (o->embkey)
+            asize += sizeof(struct sdshdr8)+sdslen(objectEmbeddedKey(o))+1;
+        if (o->embexpire) asize += sizeof(keyExpire);
     } else if (o->type == OBJ_LIST) {
         if (o->encoding == OBJ_ENCODING_QUICKLIST) {
             quicklist *ql = o->ptr;
             quicklistNode *node = ql->head;
             asize = sizeof(*o)+sizeof(quicklist);
             do {
-                elesize += sizeof(quicklistNode)+ziplistBlobLen(node->zl);
+                elesize += sizeof(quicklistNode)+lpBytes(node->zl);
                 samples++;
             } while ((node = node->next) && samples < sample_size);
             asize += (double)elesize/samples*ql->len;
-        } else if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+ziplistBlobLen(o->ptr);
+            asize += quicklistNodeIndexBytes(ql);
         } else {
             serverPanic("Unknown list encoding");
         }
@@ -833,8 +923,8 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             serverPanic("Unknown set encoding");
         }
     } else if (o->type == OBJ_ZSET) {
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+(ziplistBlobLen(o->ptr));
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+(lpBytes(o->ptr));
         } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
             d = ((zset*)o->ptr)->dict;
             zskiplist *zsl = ((zset*)o->ptr)->zsl;
@@ -853,8 +943,8 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (o->type == OBJ_HASH) {
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+(ziplistBlobLen(o->ptr));
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+(lpBytes(o->ptr));
         } else if (o->encoding == OBJ_ENCODING_HT) {
             d = o->ptr;
             di = dictGetIterator(d);
@@ -946,6 +1036,20 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
     return asize;
 }
 
+/* Returns the size in bytes consumed in RAM by the key named 'key', that is
+ * the name of the key as stored in the main dict, and its value 'val'. See
+ * objectComputeSize() for the meaning of 'sample_size'. */
+size_t keyComputeSize(sds key, robj *val, size_t sample_size) {
+    size_t size = objectComputeSize(val,sample_size);
+
+    /* Embedded key names are accounted by objectComputeSize(). */
+    if (!isEmbeddedKey(key)) {
+        size += sdsAllocSize(key);
+        if (keyHasExpireHeader(key)) size += sizeof(keyExpire);
+    }
+    return size+sizeof(dictEntry);
+}
+
 /* Release data obtained with getMemoryOverheadData(). */
 void freeMemoryOverheadData(struct redisMemOverhead *mh) {
     zfree(mh->db);
@@ -1000,6 +1104,7 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
             client *c = listNodeValue(ln);
             mem += getClientOutputBufferMemoryUsage(c);
             mem += sdsAllocSize(c->querybuf);
+            mem += c->buf_usable_size;
             mem += sizeof(client);
         }
     }
@@ -1007,6 +1112,8 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
     mem_total+=mem;
 
     mem = 0;
+    mh->clients_query_buffers = 0;
+    mh->clients_reply_buffers = 0;
     if (listLength(server.clients)) {
         listIter li;
         listNode *ln;
@@ -1014,10 +1121,18 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
         listRewind(server.clients,&li);
         while((ln = listNext(&li))) {
             client *c = listNodeValue(ln);
+            size_t qbuf = sdsAllocSize(c->querybuf);
+            size_t rbuf = getClientOutputBufferMemoryUsage(c) +
+                          c->buf_usable_size;
+
+            /* Query and reply buffers are reported for all the clients,
+             * slaves included. */
+            mh->clients_query_buffers += qbuf;
+            mh->clients_reply_buffers += rbuf;
             if (c->flags & CLIENT_SLAVE && !(c->flags & CLIENT_MONITOR))
                 continue;
-            mem += getClientOutputBufferMemoryUsage(c);
-            mem += sdsAllocSize(c->querybuf);
+            mem += rbuf;
+            mem += qbuf;
             mem += sizeof(client);
         }
     }
@@ -1046,24 +1161,28 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
 
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
-        long long keyscount = dictSize(db->dict);
+        long long keyscount = dbSize(db);
         if (keyscount==0) continue;
 
         mh->total_keys += keyscount;
         mh->db = zrealloc(mh->db,sizeof(mh->db[0])*(mh->num_dbs+1));
         mh->db[mh->num_dbs].dbid = j;
 
-        mem = dictSize(db->dict) * sizeof(dictEntry) +
-              dictSlots(db->dict) * sizeof(dictEntry*) +
-              dictSize(db->dict) * sizeof(robj);
+        mem = dbDictsMemUsage(db) + keyscount * sizeof(robj);
         mh->db[mh->num_dbs].overhead_ht_main = mem;
         mem_total+=mem;
 
-        mem = dictSize(db->expires) * sizeof(dictEntry) +
-              dictSlots(db->expires) * sizeof(dictEntry*);
+        /* The expire index, and the keyExpire headers of the keys in it. */
+        mem = expireIndexMemUsage(db->expires) +
+              expireIndexSize(db->expires) * sizeof(keyExpire);
         mh->db[mh->num_dbs].overhead_ht_expires = mem;
         mem_total+=mem;
 
+        /* Already included in the above, reported since it is released
+         * once the tables are rehashed. */
+        mh->db[mh->num_dbs].overhead_ht_rehashing =
+            dbDictsRehashingOverhead(db);
+
         mh->num_dbs++;
     }
 
@@ -1241,7 +1360,7 @@ void objectSetLRUOrLFU(robj *val, long long lfu_freq, long long lru_idle,
 robj *objectCommandLookup(client *c, robj *key) {
     dictEntry *de;
 
-    if ((de = dictFind(c->db->dict,key->ptr)) == NULL) return NULL;
+    if ((de = dictFind(dbDictForKey(c->db,key->ptr),key->ptr)) == NULL) return NULL;
     return (robj*) dictGetVal(de);
 }
 
@@ -1334,13 +1453,11 @@ NULL
                 return;
             }
         }
-        if ((de = dictFind(c->db->dict,c->argv[2]->ptr)) == NULL) {
+        if ((de = dictFind(dbDictForKey(c->db,c->argv[2]->ptr),c->argv[2]->ptr)) == NULL) {
             addReply(c, shared.nullbulk);
             return;
         }
-        size_t usage = objectComputeSize(dictGetVal(de),samples);
-        usage += sdsAllocSize(dictGetKey(de));
-        usage += sizeof(dictEntry);
+        size_t usage = keyComputeSize(dictGetKey(de),dictGetVal(de),samples);
         addReplyLongLong(c,usage);
     } else if (!strcasecmp(c->argv[1]->ptr,"stats") && c->argc == 2) {
         struct redisMemOverhead *mh = getMemoryOverheadData();
@@ -1375,13 +1492,16 @@ NULL
             char dbname[32];
             snprintf(dbname,sizeof(dbname),"db.%zd",mh->db[j].dbid);
             addReplyBulkCString(c,dbname);
-            addReplyMultiBulkLen(c,4);
+            addReplyMultiBulkLen(c,6);
 
             addReplyBulkCString(c,"overhead.hashtable.main");
             addReplyLongLong(c,mh->db[j].overhead_ht_main);
 
             addReplyBulkCString(c,"overhead.hashtable.expires");
             addReplyLongLong(c,mh->db[j].overhead_ht_expires);
+
+            addReplyBulkCString(c,"overhead.hashtable.rehashing");
+            addReplyLongLong(c,mh->db[j].overhead_ht_rehashing);
         }
 
         addReplyBulkCString(c,"overhead.total");
@@ -47,10 +47,11 @@ int listMatchPubsubPattern(void *a, void *b) {
            (equalStringObjects(pa->pattern,pb->pattern));
 }
 
-/* Return the number of channels + patterns a client is subscribed to. */
+/* Return the number of channels + patterns a client is subscribed to.
+ * The client structures are created lazily, at the first subscription. */
 int clientSubscriptionsCount(client *c) {
-    return dictSize(c->pubsub_channels)+
-           listLength(c->pubsub_patterns);
+    return (c->pubsub_channels ? dictSize(c->pubsub_channels) : 0)+
+           (c->pubsub_patterns ? listLength(c->pubsub_patterns) : 0);
 }
 
 /* Subscribe a client to a channel. Returns 1 if the operation succeeded, or
@@ -61,6 +62,8 @@ int pubsubSubscribeChannel(client *c, robj *channel) {
     int retval = 0;
 
     /* Add the channel to the client -> channels hash table */
+    if (c->pubsub_channels == NULL)
+        c->pubsub_channels = dictCreate(&objectKeyPointerValueDictType,NULL);
     if (dictAdd(c->pubsub_channels,channel,NULL) == DICT_OK) {
         retval = 1;
         incrRefCount(channel);
@@ -94,7 +97,9 @@ int pubsubUnsubscribeChannel(client *c, robj *channel, int notify) {
     /* Remove the channel from the client -> channels hash table */
     incrRefCount(channel); /* channel may be just a pointer to the same object
                             we have in the hash tables. Protect it... */
-    if (dictDelete(c->pubsub_channels,channel) == DICT_OK) {
+    if (c->pubsub_channels &&
+        dictDelete(c->pubsub_channels,channel) == DICT_OK)
+    {
         retval = 1;
         /* Remove the client from the channel -> clients list hash table */
         de = dictFind(server.pubsub_channels,channel);
@@ -115,8 +120,7 @@ int pubsubUnsubscribeChannel(client *c, robj *channel, int notify) {
         addReply(c,shared.mbulkhdr[3]);
         addReply(c,shared.unsubscribebulk);
         addReplyBulk(c,channel);
-        addReplyLongLong(c,dictSize(c->pubsub_channels)+
-                       listLength(c->pubsub_patterns));
+        addReplyLongLong(c,clientSubscriptionsCount(c));
 
     }
     decrRefCount(channel); /* it is finally safe to release it */
@@ -127,6 +131,11 @@ int pubsubUnsubscribeChannel(client *c, robj *channel, int notify) {
 int pubsubSubscribePattern(client *c, robj *pattern) {
     int retval = 0;
 
+    if (c->pubsub_patterns == NULL) {
+        c->pubsub_patterns = listCreate();
+        listSetFreeMethod(c->pubsub_patterns,decrRefCountVoid);
+        listSetMatchMethod(c->pubsub_patterns,listMatchObjects);
+    }
     if (listSearchKey(c->pubsub_patterns,pattern) == NULL) {
         retval = 1;
         pubsubPattern *pat;
@@ -153,7 +162,9 @@ int pubsubUnsubscribePattern(client *c, robj *pattern, int notify) {
     int retval = 0;
 
     incrRefCount(pattern); /* Protect the object. May be the same we remove */
-    if ((ln = listSearchKey(c->pubsub_patterns,pattern)) != NULL) {
+    if (c->pubsub_patterns &&
+        (ln = listSearchKey(c->pubsub_patterns,pattern)) != NULL)
+    {
         retval = 1;
         listDelNode(c->pubsub_patterns,ln);
         pat.client = c;
@@ -166,8 +177,7 @@ int pubsubUnsubscribePattern(client *c, robj *pattern, int notify) {
         addReply(c,shared.mbulkhdr[3]);
         addReply(c,shared.punsubscribebulk);
         addReplyBulk(c,pattern);
-        addReplyLongLong(c,dictSize(c->pubsub_channels)+
-                       listLength(c->pubsub_patterns));
+        addReplyLongLong(c,clientSubscriptionsCount(c));
     }
     decrRefCount(pattern);
     return retval;
@@ -176,24 +186,26 @@ int pubsubUnsubscribePattern(client *c, robj *pattern, int notify) {
 /* Unsubscribe from all the channels. Return the number of channels the
  * client was subscribed to. */
 int pubsubUnsubscribeAllChannels(client *c, int notify) {
-    dictIterator *di = dictGetSafeIterator(c->pubsub_channels);
+    dictIterator *di;
     dictEntry *de;
     int count = 0;
 
-    while((de = dictNext(di)) != NULL) {
-        robj *channel = dictGetKey(de);
+    if (c->pubsub_channels) {
+        di = dictGetSafeIterator(c->pubsub_channels);
+        while((de = dictNext(di)) != NULL) {
+            robj *channel = dictGetKey(de);
 
-        count += pubsubUnsubscribeChannel(c,channel,notify);
+            count += pubsubUnsubscribeChannel(c,channel,notify);
+        }
+        dictReleaseIterator(di);
     }
     /* We were subscribed to nothing? Still reply to the client. */
     if (notify && count == 0) {
         addReply(c,shared.mbulkhdr[3]);
         addReply(c,shared.unsubscribebulk);
         addReply(c,shared.nullbulk);
-        addReplyLongLong(c,dictSize(c->pubsub_channels)+
-                       listLength(c->pubsub_patterns));
+        addReplyLongLong(c,clientSubscriptionsCount(c));
     }
-    dictReleaseIterator(di);
     return count;
 }
 
@@ -204,19 +216,20 @@ int pubsubUnsubscribeAllPatterns(client *c, int notify) {
     listIter li;
     int count = 0;
 
-    listRewind(c->pubsub_patterns,&li);
-    while ((ln = listNext(&li)) != NULL) {
-        robj *pattern = ln->value;
+    if (c->pubsub_patterns) {
+        listRewind(c->pubsub_patterns,&li);
+        while ((ln = listNext(&li)) != NULL) {
+            robj *pattern = ln->value;
 
-        count += pubsubUnsubscribePattern(c,pattern,notify);
+            count += pubsubUnsubscribePattern(c,pattern,notify);
+        }
     }
     if (notify && count == 0) {
         /* We were subscribed to nothing? Still reply to the client. */
         addReply(c,shared.mbulkhdr[3]);
         addReply(c,shared.punsubscribebulk);
         addReply(c,shared.nullbulk);
-        addReplyLongLong(c,dictSize(c->pubsub_channels)+
-                       listLength(c->pubsub_patterns));
+        addReplyLongLong(c,clientSubscriptionsCount(c));
     }
     return count;
 }
@@ -1,4 +1,4 @@
-/* quicklist.c - A doubly linked list of ziplists
+/* quicklist.c - A doubly linked list of listpacks
  *
  * Copyright (c) 2014, Matt Stancliff <matt@genges.com>
  * All rights reserved.
@@ -32,8 +32,9 @@
 #include "quicklist.h"
 #include "zmalloc.h"
 #include "ziplist.h"
+#include "listpack.h"
 #include "util.h" /* for ll2string */
-#include "lzf.h"
+#include "codec.h"
 
 #if defined(REDIS_TEST) || defined(REDIS_TEST_VERBOSE)
 #include <stdio.h> /* for printf (debug printing), snprintf (genstr) */
@@ -46,11 +47,11 @@
 /* Optimization levels for size-based filling */
 static const size_t optimization_level[] = {4096, 8192, 16384, 32768, 65536};
 
-/* Maximum size in bytes of any multi-element ziplist.
- * Larger values will live in their own isolated ziplists. */
+/* Maximum size in bytes of any multi-element listpack.
+ * Larger values will live in their own isolated listpacks. */
 #define SIZE_SAFETY_LIMIT 8192
 
-/* Minimum ziplist size in bytes for attempting compression. */
+/* Minimum listpack size in bytes for attempting compression. */
 #define MIN_COMPRESS_BYTES 48
 
 /* Minimum size reduction in bytes to store compressed quicklistNode data.
@@ -58,6 +59,10 @@ static const size_t optimization_level[] = {4096, 8192, 16384, 32768, 65536};
  * resulted in a larger size than the original data. */
 #define MIN_COMPRESS_IMPROVE 8
 
+/* Minimum number of nodes for a quicklist to be accessed by index using
+ * the node index. Shorter lists are just walked from the nearest end. */
+#define NODE_INDEX_MIN_NODES 16
+
 /* If not verbose testing, remove all debug printing. */
 #ifndef REDIS_TEST_VERBOSE
 #define D(...)
@@ -100,6 +105,8 @@ quicklist *quicklistCreate(void) {
     quicklist->count = 0;
     quicklist->compress = 0;
     quicklist->fill = -2;
+    quicklist->codec = CODEC_LZF;
+    quicklist->nodeidx = NULL;
     return quicklist;
 }
 
@@ -123,15 +130,24 @@ void quicklistSetFill(quicklist *quicklist, int fill) {
     quicklist->fill = fill;
 }
 
-void quicklistSetOptions(quicklist *quicklist, int fill, int depth) {
+/* Set the codec used to compress nodes from now on. Nodes already
+ * compressed keep their codec. Unavailable codecs are ignored. */
+void quicklistSetCodec(quicklist *quicklist, int codec) {
+    if (codecAvailable(codec))
+        quicklist->codec = codec;
+}
+
+void quicklistSetOptions(quicklist *quicklist, int fill, int depth,
+                         int codec) {
     quicklistSetFill(quicklist, fill);
     quicklistSetCompressDepth(quicklist, depth);
+    quicklistSetCodec(quicklist, codec);
 }
 
 /* Create a new quicklist with some default parameters. */
 quicklist *quicklistNew(int fill, int compress) {
     quicklist *quicklist = quicklistCreate();
-    quicklistSetOptions(quicklist, fill, compress);
+    quicklistSetOptions(quicklist, fill, compress, CODEC_LZF);
     return quicklist;
 }
 
@@ -143,7 +159,7 @@ REDIS_STATIC quicklistNode *quicklistCreateNode(void) {
     node->sz = 0;
     node->next = node->prev = NULL;
     node->encoding = QUICKLIST_NODE_ENCODING_RAW;
-    node->container = QUICKLIST_NODE_CONTAINER_ZIPLIST;
+    node->container = QUICKLIST_NODE_CONTAINER_PACKED;
     node->recompress = 0;
     return node;
 }
@@ -169,13 +185,191 @@ void quicklistRelease(quicklist *quicklist) {
         quicklist->len--;
         current = next;
     }
+    if (quicklist->nodeidx) {
+        zfree(quicklist->nodeidx->entries);
+        zfree(quicklist->nodeidx);
+    }
     zfree(quicklist);
 }
 
-/* Compress the ziplist in 'node' and update encoding details.
- * Returns 1 if ziplist compressed successfully.
- * Returns 0 if compression failed or if ziplist too small to compress. */
-REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
+/* ----------------------------------------------------------------------------
+ * Node index (see the quicklistNodeIndex comment in quicklist.h).
+ *
+ * Adding and removing nodes at the ends of the list, or changing the count
+ * of the head node, keep the index valid in O(1). Changing the count of the
+ * tail node does not need any update at all, since no node follows it.
+ * Every other change just invalidates the index.
+ * -------------------------------------------------------------------------- */
+
+/* Mark the node index as invalid: it will be rebuilt if needed.
+ * Also called by the active defragmentation when it moves the nodes. */
+void quicklistNodeIndexInvalidate(quicklist *quicklist) {
+    quicklistNodeIndex *idx = quicklist->nodeidx;
+
+    if (idx) {
+        idx->valid = 0;
+        idx->stale = 0;
+    }
+}
+
+/* Return the amount of memory used by the node index. */
+size_t quicklistNodeIndexBytes(const quicklist *quicklist) {
+    quicklistNodeIndex *idx = quicklist->nodeidx;
+
+    if (!idx)
+        return 0;
+    return sizeof(*idx) + sizeof(quicklistNodeIndexEntry) * idx->size;
+}
+
+#define quicklistNodeIndexIsValid(_ql) ((_ql)->nodeidx && (_ql)->nodeidx->valid)
+
+/* Reallocate the slots of the index leaving as many free slots as half
+ * the number of nodes at both sides. */
+REDIS_STATIC void _quicklistNodeIndexResize(quicklistNodeIndex *idx) {
+    unsigned long size = idx->len * 2 + 16;
+    quicklistNodeIndexEntry *entries = zmalloc(sizeof(*entries) * size);
+    unsigned long first = (size - idx->len) / 2;
+
+    if (idx->len)
+        memcpy(entries + first, idx->entries + idx->first,
+               sizeof(*entries) * idx->len);
+    zfree(idx->entries);
+    idx->entries = entries;
+    idx->first = first;
+    idx->size = size;
+}
+
+/* Index all the nodes of the list from scratch. */
+REDIS_STATIC void _quicklistNodeIndexBuild(quicklist *quicklist) {
+    quicklistNodeIndex *idx = quicklist->nodeidx;
+    long long start = 0;
+
+    zfree(idx->entries);
+    idx->size = quicklist->len * 2 + 16;
+    idx->entries = zmalloc(sizeof(*idx->entries) * idx->size);
+    idx->first = (idx->size - quicklist->len) / 2;
+    idx->len = 0;
+    idx->shift = 0;
+    for (quicklistNode *node = quicklist->head; node; node = node->next) {
+        quicklistNodeIndexEntry *e = idx->entries + idx->first + idx->len++;
+        e->node = node;
+        e->start = start;
+        start += node->count;
+    }
+    idx->valid = 1;
+    idx->stale = 0;
+}
+
+/* Find the node holding the element at the zero-based head to tail 'index',
+ * populating 'node' with it and 'start' with the index of its first element.
+ * Returns 0 without searching if the index is not valid and the caller
+ * should rather walk the list, otherwise returns 1. */
+REDIS_STATIC int _quicklistNodeIndexFind(quicklist *quicklist,
+                                         unsigned long long index,
+                                         quicklistNode **node,
+                                         unsigned long long *start) {
+    quicklistNodeIndex *idx = quicklist->nodeidx;
+
+    if (!idx)
+        idx = quicklist->nodeidx = zcalloc(sizeof(*idx));
+    if (!idx->valid) {
+        /* Rebuilding costs more than a walk: only do it if the list is
+         * indexed again before being modified in the middle. */
+        if (idx->stale++ == 0)
+            return 0;
+        _quicklistNodeIndexBuild(quicklist);
+    }
+
+    /* Binary search of the last node starting at or before 'index'. */
+    quicklistNodeIndexEntry *entries = idx->entries + idx->first;
+    long long target = (long long)index - idx->shift;
+    unsigned long lo = 0, hi = idx->len - 1;
+    while (lo < hi) {
+        unsigned long mid = lo + (hi - lo + 1) / 2;
+        if (entries[mid].start <= target)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    *node = entries[lo].node;
+    *start = entries[lo].start + idx->shift;
+    return 1;
+}
+
+/* The count of the head node changed by 'delta'. */
+REDIS_STATIC void _quicklistNodeIndexHeadCount(quicklist *quicklist,
+                                               long long delta) {
+    quicklistNodeIndex *idx = quicklist->nodeidx;
+
+    if (!quicklistNodeIndexIsValid(quicklist))
+        return;
+    idx->shift += delta;
+    idx->entries[idx->first].start -= delta;
+}
+
+/* A new head node was added. Must be called after updating its count. */
+REDIS_STATIC void _quicklistNodeIndexAddHead(quicklist *quicklist) {
+    quicklistNodeIndex *idx = quicklist->nodeidx;
+
+    if (!quicklistNodeIndexIsValid(quicklist))
+        return;
+    if (idx->first == 0)
+        _quicklistNodeIndexResize(idx);
+    idx->shift += quicklist->head->count;
+    idx->first--;
+    idx->len++;
+    idx->entries[idx->first].node = quicklist->head;
+    idx->entries[idx->first].start = -idx->shift;
+}
+
+/* A new tail node was added. Must be called after updating its count and
+ * the count of the list. */
+REDIS_STATIC void _quicklistNodeIndexAddTail(quicklist *quicklist) {
+    quicklistNodeIndex *idx = quicklist->nodeidx;
+
+    if (!quicklistNodeIndexIsValid(quicklist))
+        return;
+    if (idx->first + idx->len == idx->size)
+        _quicklistNodeIndexResize(idx);
+    quicklistNodeIndexEntry *e = idx->entries + idx->first + idx->len++;
+    e->node = quicklist->tail;
+    e->start = (long long)(quicklist->count - quicklist->tail->count) -
+               idx->shift;
+}
+
+/* Remove the nodes that are no longer in the list from the head of the
+ * index, after 'deleted' elements were removed from the head of the list. */
+REDIS_STATIC void _quicklistNodeIndexTrimHead(quicklist *quicklist,
+                                              unsigned long deleted) {
+    quicklistNodeIndex *idx = quicklist->nodeidx;
+
+    if (!quicklistNodeIndexIsValid(quicklist))
+        return;
+    while (idx->len && idx->entries[idx->first].node != quicklist->head) {
+        idx->first++;
+        idx->len--;
+    }
+    idx->shift -= deleted;
+    if (idx->len)
+        idx->entries[idx->first].start = -idx->shift;
+}
+
+/* Remove the nodes that are no longer in the list from the tail of the
+ * index, after elements were removed from the tail of the list. */
+REDIS_STATIC void _quicklistNodeIndexTrimTail(quicklist *quicklist) {
+    quicklistNodeIndex *idx = quicklist->nodeidx;
+
+    if (!quicklistNodeIndexIsValid(quicklist))
+        return;
+    while (idx->len &&
+           idx->entries[idx->first + idx->len - 1].node != quicklist->tail)
+        idx->len--;
+}
+
+/* Compress the listpack in 'node' with 'codec' and update encoding details.
+ * Returns 1 if listpack compressed successfully.
+ * Returns 0 if compression failed or if listpack too small to compress. */
+REDIS_STATIC int __quicklistCompressNode(quicklistNode *node, int codec) {
 #ifdef REDIS_TEST
     node->attempted_compress = 1;
 #endif
@@ -187,30 +381,30 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
     quicklistLZF *lzf = zmalloc(sizeof(*lzf) + node->sz);
 
     /* Cancel if compression fails or doesn't compress small enough */
-    if (((lzf->sz = lzf_compress(node->zl, node->sz, lzf->compressed,
-                                 node->sz)) == 0) ||
+    if (((lzf->sz = codecCompress(codec, node->zl, node->sz, lzf->compressed,
+                                  node->sz)) == 0) ||
         lzf->sz + MIN_COMPRESS_IMPROVE >= node->sz) {
-        /* lzf_compress aborts/rejects compression if value not compressable. */
+        /* codecCompress aborts/rejects compression if value not compressable. */
         zfree(lzf);
         return 0;
     }
     lzf = zrealloc(lzf, sizeof(*lzf) + lzf->sz);
     zfree(node->zl);
     node->zl = (unsigned char *)lzf;
-    node->encoding = QUICKLIST_NODE_ENCODING_LZF;
+    node->encoding = QUICKLIST_NODE_ENCODING_CODEC(codec);
     node->recompress = 0;
     return 1;
 }
 
-/* Compress only uncompressed nodes. */
-#define quicklistCompressNode(_node)                                           \
+/* Compress only uncompressed nodes, with the codec of the quicklist. */
+#define quicklistCompressNode(_ql, _node)                                      \
     do {                                                                       \
         if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_RAW) {     \
-            __quicklistCompressNode((_node));                                  \
+            __quicklistCompressNode((_node), (_ql)->codec);                    \
         }                                                                      \
     } while (0)
 
-/* Uncompress the ziplist in 'node' and update encoding details.
+/* Uncompress the listpack in 'node' and update encoding details.
  * Returns 1 on successful decode, 0 on failure to decode. */
 REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 #ifdef REDIS_TEST
@@ -219,7 +413,8 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 
     void *decompressed = zmalloc(node->sz);
     quicklistLZF *lzf = (quicklistLZF *)node->zl;
-    if (lzf_decompress(lzf->compressed, lzf->sz, decompressed, node->sz) == 0) {
+    if (codecDecompress(quicklistNodeCodec(node), lzf->compressed, lzf->sz,
+                        decompressed, node->sz) == 0) {
         /* Someone requested decompress, but we can't decompress.  Not good. */
         zfree(decompressed);
         return 0;
@@ -233,7 +428,7 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 /* Decompress only compressed nodes. */
 #define quicklistDecompressNode(_node)                                         \
     do {                                                                       \
-        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF) {     \
+        if ((_node) && quicklistNodeIsCompressed(_node)) {                     \
             __quicklistDecompressNode((_node));                                \
         }                                                                      \
     } while (0)
@@ -241,16 +436,17 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 /* Force node to not be immediately re-compresable */
 #define quicklistDecompressNodeForUse(_node)                                   \
     do {                                                                       \
-        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF) {     \
+        if ((_node) && quicklistNodeIsCompressed(_node)) {                     \
             __quicklistDecompressNode((_node));                                \
             (_node)->recompress = 1;                                           \
         }                                                                      \
     } while (0)
 
-/* Extract the raw LZF data from this quicklistNode.
- * Pointer to LZF data is assigned to '*data'.
- * Return value is the length of compressed LZF data. */
-size_t quicklistGetLzf(const quicklistNode *node, void **data) {
+/* Extract the raw compressed data from this quicklistNode, compressed with
+ * the codec returned by quicklistNodeCodec().
+ * Pointer to compressed data is assigned to '*data'.
+ * Return value is the length of compressed data. */
+size_t quicklistGetCompressed(const quicklistNode *node, void **data) {
     quicklistLZF *lzf = (quicklistLZF *)node->zl;
     *data = lzf->compressed;
     return lzf->sz;
@@ -277,7 +473,7 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
         quicklistDecompressNode(h);
         quicklistDecompressNode(t);
         if (h != node && t != node)
-            quicklistCompressNode(node);
+            quicklistCompressNode(quicklist, node);
         return;
     } else if (quicklist->compress == 2) {
         quicklistNode *h = quicklist->head, *hn = h->next, *hnn = hn->next;
@@ -287,13 +483,13 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
         quicklistDecompressNode(t);
         quicklistDecompressNode(tp);
         if (h != node && hn != node && t != node && tp != node) {
-            quicklistCompressNode(node);
+            quicklistCompressNode(quicklist, node);
         }
         if (hnn != t) {
-            quicklistCompressNode(hnn);
+            quicklistCompressNode(quicklist, hnn);
         }
         if (tpp != h) {
-            quicklistCompressNode(tpp);
+            quicklistCompressNode(quicklist, tpp);
         }
         return;
     }
@@ -321,19 +517,19 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
     }
 
     if (!in_depth)
-        quicklistCompressNode(node);
+        quicklistCompressNode(quicklist, node);
 
     if (depth > 2) {
         /* At this point, forward and reverse are one node beyond depth */
-        quicklistCompressNode(forward);
-        quicklistCompressNode(reverse);
+        quicklistCompressNode(quicklist, forward);
+        quicklistCompressNode(quicklist, reverse);
     }
 }
 
 #define quicklistCompress(_ql, _node)                                          \
     do {                                                                       \
         if ((_node)->recompress)                                               \
-            quicklistCompressNode((_node));                                    \
+            quicklistCompressNode((_ql), (_node));                             \
         else                                                                   \
             __quicklistCompress((_ql), (_node));                               \
     } while (0)
@@ -342,7 +538,7 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
 #define quicklistRecompressOnly(_ql, _node)                                    \
     do {                                                                       \
         if ((_node)->recompress)                                               \
-            quicklistCompressNode((_node));                                    \
+            quicklistCompressNode((_ql), (_node));                             \
     } while (0)
 
 /* Insert 'new_node' after 'old_node' if 'after' is 1.
@@ -422,23 +618,25 @@ REDIS_STATIC int _quicklistNodeAllowInsert(const quicklistNode *node,
     if (unlikely(!node))
         return 0;
 
-    int ziplist_overhead;
-    /* size of previous offset */
-    if (sz < 254)
-        ziplist_overhead = 1;
+    int listpack_overhead;
+    /* size of the encoding header */
+    if (sz < 64)
+        listpack_overhead = 1;
+    else if (likely(sz < 4096))
+        listpack_overhead = 2;
     else
-        ziplist_overhead = 5;
+        listpack_overhead = 5;
 
-    /* size of forward offset */
-    if (sz < 64)
-        ziplist_overhead += 1;
-    else if (likely(sz < 16384))
-        ziplist_overhead += 2;
+    /* size of the backlen trailer */
+    if (sz < 127)
+        listpack_overhead += 1;
+    else if (likely(sz < 16382))
+        listpack_overhead += 2;
     else
-        ziplist_overhead += 5;
+        listpack_overhead += 5;
 
     /* new_sz overestimates if 'sz' encodes to an integer type */
-    unsigned int new_sz = node->sz + sz + ziplist_overhead;
+    unsigned int new_sz = node->sz + sz + listpack_overhead;
     if (likely(_quicklistNodeSizeMeetsOptimizationRequirement(new_sz, fill)))
         return 1;
     else if (!sizeMeetsSafetyLimit(new_sz))
@@ -455,9 +653,9 @@ REDIS_STATIC int _quicklistNodeAllowMerge(const quicklistNode *a,
     if (!a || !b)
         return 0;
 
-    /* approximate merged ziplist size (- 11 to remove one ziplist
+    /* approximate merged listpack size (- 7 to remove one listpack
      * header/trailer) */
-    unsigned int merge_sz = a->sz + b->sz - 11;
+    unsigned int merge_sz = a->sz + b->sz - 7;
     if (likely(_quicklistNodeSizeMeetsOptimizationRequirement(merge_sz, fill)))
         return 1;
     else if (!sizeMeetsSafetyLimit(merge_sz))
@@ -470,7 +668,7 @@ REDIS_STATIC int _quicklistNodeAllowMerge(const quicklistNode *a,
 
 #define quicklistNodeUpdateSz(node)                                            \
     do {                                                                       \
-        (node)->sz = ziplistBlobLen((node)->zl);                               \
+        (node)->sz = lpBytes((node)->zl);                                      \
     } while (0)
 
 /* Add new entry to head node of quicklist.
@@ -481,18 +679,21 @@ int quicklistPushHead(quicklist *quicklist, void *value, size_t sz) {
     quicklistNode *orig_head = quicklist->head;
     if (likely(
             _quicklistNodeAllowInsert(quicklist->head, quicklist->fill, sz))) {
-        quicklist->head->zl =
-            ziplistPush(quicklist->head->zl, value, sz, ZIPLIST_HEAD);
+        quicklist->head->zl = lpPrepend(quicklist->head->zl, value, sz);
         quicklistNodeUpdateSz(quicklist->head);
     } else {
         quicklistNode *node = quicklistCreateNode();
-        node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        node->zl = lpPrepend(lpNew(), value, sz);
 
         quicklistNodeUpdateSz(node);
         _quicklistInsertNodeBefore(quicklist, quicklist->head, node);
     }
     quicklist->count++;
     quicklist->head->count++;
+    if (orig_head != quicklist->head)
+        _quicklistNodeIndexAddHead(quicklist);
+    else
+        _quicklistNodeIndexHeadCount(quicklist, 1);
     return (orig_head != quicklist->head);
 }
 
@@ -504,39 +705,41 @@ int quicklistPushTail(quicklist *quicklist, void *value, size_t sz) {
     quicklistNode *orig_tail = quicklist->tail;
     if (likely(
             _quicklistNodeAllowInsert(quicklist->tail, quicklist->fill, sz))) {
-        quicklist->tail->zl =
-            ziplistPush(quicklist->tail->zl, value, sz, ZIPLIST_TAIL);
+        quicklist->tail->zl = lpAppend(quicklist->tail->zl, value, sz);
         quicklistNodeUpdateSz(quicklist->tail);
     } else {
         quicklistNode *node = quicklistCreateNode();
-        node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_TAIL);
+        node->zl = lpAppend(lpNew(), value, sz);
 
         quicklistNodeUpdateSz(node);
         _quicklistInsertNodeAfter(quicklist, quicklist->tail, node);
     }
     quicklist->count++;
     quicklist->tail->count++;
+    if (orig_tail != quicklist->tail)
+        _quicklistNodeIndexAddTail(quicklist);
     return (orig_tail != quicklist->tail);
 }
 
-/* Create new node consisting of a pre-formed ziplist.
- * Used for loading RDBs where entire ziplists have been stored
+/* Create new node consisting of a pre-formed listpack.
+ * Used for loading RDBs where entire listpacks have been stored
  * to be retrieved later. */
-void quicklistAppendZiplist(quicklist *quicklist, unsigned char *zl) {
+void quicklistAppendListpack(quicklist *quicklist, unsigned char *zl) {
     quicklistNode *node = quicklistCreateNode();
 
     node->zl = zl;
-    node->count = ziplistLen(node->zl);
-    node->sz = ziplistBlobLen(zl);
+    node->count = lpLength(node->zl);
+    node->sz = lpBytes(zl);
 
     _quicklistInsertNodeAfter(quicklist, quicklist->tail, node);
     quicklist->count += node->count;
+    _quicklistNodeIndexAddTail(quicklist);
 }
 
 /* Append all values of ziplist 'zl' individually into 'quicklist'.
  *
  * This allows us to restore old RDB ziplists into new quicklists
- * with smaller ziplist sizes than the saved RDB ziplist.
+ * of listpacks, with smaller sizes than the saved RDB ziplist.
  *
  * Returns 'quicklist' argument. Frees passed-in ziplist 'zl' */
 quicklist *quicklistAppendValuesFromZiplist(quicklist *quicklist,
@@ -609,12 +812,14 @@ REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
  *       already had to get *p from an uncompressed node somewhere.
  *
  * Returns 1 if the entire node was deleted, 0 if node still exists.
- * Also updates in/out param 'p' with the next offset in the ziplist. */
+ * Also updates in/out param 'p' with the next offset in the listpack. */
 REDIS_STATIC int quicklistDelIndex(quicklist *quicklist, quicklistNode *node,
                                    unsigned char **p) {
     int gone = 0;
+    int at_head = (node == quicklist->head);
+    int at_tail = (node == quicklist->tail);
 
-    node->zl = ziplistDelete(node->zl, p);
+    node->zl = lpDelete(node->zl, *p, p);
     node->count--;
     if (node->count == 0) {
         gone = 1;
@@ -623,6 +828,12 @@ REDIS_STATIC int quicklistDelIndex(quicklist *quicklist, quicklistNode *node,
         quicklistNodeUpdateSz(node);
     }
     quicklist->count--;
+    if (at_head)
+        _quicklistNodeIndexTrimHead(quicklist, 1);
+    else if (at_tail)
+        _quicklistNodeIndexTrimTail(quicklist);
+    else
+        quicklistNodeIndexInvalidate(quicklist);
     /* If we deleted the node, the original node is no longer valid */
     return gone ? 1 : 0;
 }
@@ -630,7 +841,7 @@ REDIS_STATIC int quicklistDelIndex(quicklist *quicklist, quicklistNode *node,
 /* Delete one element represented by 'entry'
  *
  * 'entry' stores enough metadata to delete the proper position in
- * the correct ziplist in the correct quicklist node. */
+ * the correct listpack in the correct quicklist node. */
 void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry) {
     quicklistNode *prev = entry->node->prev;
     quicklistNode *next = entry->node->next;
@@ -656,7 +867,7 @@ void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry) {
      *   - [1, 2, 3] => delete offset 1 => [1, 3]: next element still offset 1
      *   - [1, 2, 3] => delete offset 0 => [2, 3]: next element still offset 0
      *  if we deleted the last element at offet N and now
-     *  length of this ziplist is N-1, the next call into
+     *  length of this listpack is N-1, the next call into
      *  quicklistNext() will jump to the next node. */
 }
 
@@ -669,8 +880,7 @@ int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data,
     quicklistEntry entry;
     if (likely(quicklistIndex(quicklist, index, &entry))) {
         /* quicklistIndex provides an uncompressed node */
-        entry.node->zl = ziplistDelete(entry.node->zl, &entry.zi);
-        entry.node->zl = ziplistInsert(entry.node->zl, entry.zi, data, sz);
+        entry.node->zl = lpReplace(entry.node->zl, &entry.zi, data, sz);
         quicklistNodeUpdateSz(entry.node);
         quicklistCompress(quicklist, entry.node);
         return 1;
@@ -679,9 +889,9 @@ int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data,
     }
 }
 
-/* Given two nodes, try to merge their ziplists.
+/* Given two nodes, try to merge their listpacks.
  *
- * This helps us not have a quicklist with 3 element ziplists if
+ * This helps us not have a quicklist with 3 element listpacks if
  * our fill factor can handle much higher levels.
  *
  * Note: 'a' must be to the LEFT of 'b'.
@@ -692,15 +902,15 @@ int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data,
  *
  * Returns the input node picked to merge against or NULL if
  * merging was not possible. */
-REDIS_STATIC quicklistNode *_quicklistZiplistMerge(quicklist *quicklist,
+REDIS_STATIC quicklistNode *_quicklistListpackMerge(quicklist *quicklist,
                                                    quicklistNode *a,
                                                    quicklistNode *b) {
     D("Requested merge (a,b) (%u, %u)", a->count, b->count);
 
     quicklistDecompressNode(a);
     quicklistDecompressNode(b);
-    if ((ziplistMerge(&a->zl, &b->zl))) {
-        /* We merged ziplists! Now remove the unused quicklistNode. */
+    if ((lpMerge(&a->zl, &b->zl))) {
+        /* We merged listpacks! Now remove the unused quicklistNode. */
         quicklistNode *keep = NULL, *nokeep = NULL;
         if (!a->zl) {
             nokeep = a;
@@ -709,7 +919,7 @@ REDIS_STATIC quicklistNode *_quicklistZiplistMerge(quicklist *quicklist,
             nokeep = b;
             keep = a;
         }
-        keep->count = ziplistLen(keep->zl);
+        keep->count = lpLength(keep->zl);
         quicklistNodeUpdateSz(keep);
 
         nokeep->count = 0;
@@ -722,7 +932,7 @@ REDIS_STATIC quicklistNode *_quicklistZiplistMerge(quicklist *quicklist,
     }
 }
 
-/* Attempt to merge ziplists within two nodes on either side of 'center'.
+/* Attempt to merge listpacks within two nodes on either side of 'center'.
  *
  * We attempt to merge:
  *   - (center->prev->prev, center->prev)
@@ -750,19 +960,19 @@ REDIS_STATIC void _quicklistMergeNodes(quicklist *quicklist,
 
     /* Try to merge prev_prev and prev */
     if (_quicklistNodeAllowMerge(prev, prev_prev, fill)) {
-        _quicklistZiplistMerge(quicklist, prev_prev, prev);
+        _quicklistListpackMerge(quicklist, prev_prev, prev);
         prev_prev = prev = NULL; /* they could have moved, invalidate them. */
     }
 
     /* Try to merge next and next_next */
     if (_quicklistNodeAllowMerge(next, next_next, fill)) {
-        _quicklistZiplistMerge(quicklist, next, next_next);
+        _quicklistListpackMerge(quicklist, next, next_next);
         next = next_next = NULL; /* they could have moved, invalidate them. */
     }
 
     /* Try to merge center node and previous node */
     if (_quicklistNodeAllowMerge(center, center->prev, fill)) {
-        target = _quicklistZiplistMerge(quicklist, center->prev, center);
+        target = _quicklistListpackMerge(quicklist, center->prev, center);
         center = NULL; /* center could have been deleted, invalidate it. */
     } else {
         /* else, we didn't merge here, but target needs to be valid below. */
@@ -771,7 +981,7 @@ REDIS_STATIC void _quicklistMergeNodes(quicklist *quicklist,
 
     /* Use result of center merge (or original) to merge with next node. */
     if (_quicklistNodeAllowMerge(target, target->next, fill)) {
-        _quicklistZiplistMerge(quicklist, target, target->next);
+        _quicklistListpackMerge(quicklist, target, target->next);
     }
 }
 
@@ -801,7 +1011,7 @@ REDIS_STATIC quicklistNode *_quicklistSplitNode(quicklistNode *node, int offset,
     quicklistNode *new_node = quicklistCreateNode();
     new_node->zl = zmalloc(zl_sz);
 
-    /* Copy original ziplist so we can split it */
+    /* Copy original listpack so we can split it */
     memcpy(new_node->zl, node->zl, zl_sz);
 
     /* -1 here means "continue deleting until the list ends" */
@@ -813,12 +1023,12 @@ REDIS_STATIC quicklistNode *_quicklistSplitNode(quicklistNode *node, int offset,
     D("After %d (%d); ranges: [%d, %d], [%d, %d]", after, offset, orig_start,
       orig_extent, new_start, new_extent);
 
-    node->zl = ziplistDeleteRange(node->zl, orig_start, orig_extent);
-    node->count = ziplistLen(node->zl);
+    node->zl = lpDeleteRange(node->zl, orig_start, orig_extent);
+    node->count = lpLength(node->zl);
     quicklistNodeUpdateSz(node);
 
-    new_node->zl = ziplistDeleteRange(new_node->zl, new_start, new_extent);
-    new_node->count = ziplistLen(new_node->zl);
+    new_node->zl = lpDeleteRange(new_node->zl, new_start, new_extent);
+    new_node->count = lpLength(new_node->zl);
     quicklistNodeUpdateSz(new_node);
 
     D("After split lengths: orig (%d), new (%d)", node->count, new_node->count);
@@ -836,11 +1046,13 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
     quicklistNode *node = entry->node;
     quicklistNode *new_node = NULL;
 
+    quicklistNodeIndexInvalidate(quicklist);
+
     if (!node) {
         /* we have no reference node, so let's create only node in the list */
         D("No node given!");
         new_node = quicklistCreateNode();
-        new_node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        new_node->zl = lpPrepend(lpNew(), value, sz);
         __quicklistInsertNode(quicklist, NULL, new_node, after);
         new_node->count++;
         quicklist->count++;
@@ -855,7 +1067,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
     }
 
     if (after && (entry->offset == node->count)) {
-        D("At Tail of current ziplist");
+        D("At Tail of current listpack");
         at_tail = 1;
         if (!_quicklistNodeAllowInsert(node->next, fill, sz)) {
             D("Next node is full too.");
@@ -876,19 +1088,14 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
     if (!full && after) {
         D("Not full, inserting after current position.");
         quicklistDecompressNodeForUse(node);
-        unsigned char *next = ziplistNext(node->zl, entry->zi);
-        if (next == NULL) {
-            node->zl = ziplistPush(node->zl, value, sz, ZIPLIST_TAIL);
-        } else {
-            node->zl = ziplistInsert(node->zl, next, value, sz);
-        }
+        node->zl = lpInsert(node->zl, value, sz, entry->zi, LP_AFTER, NULL);
         node->count++;
         quicklistNodeUpdateSz(node);
         quicklistRecompressOnly(quicklist, node);
     } else if (!full && !after) {
         D("Not full, inserting before current position.");
         quicklistDecompressNodeForUse(node);
-        node->zl = ziplistInsert(node->zl, entry->zi, value, sz);
+        node->zl = lpInsert(node->zl, value, sz, entry->zi, LP_BEFORE, NULL);
         node->count++;
         quicklistNodeUpdateSz(node);
         quicklistRecompressOnly(quicklist, node);
@@ -898,7 +1105,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         D("Full and tail, but next isn't full; inserting next node head");
         new_node = node->next;
         quicklistDecompressNodeForUse(new_node);
-        new_node->zl = ziplistPush(new_node->zl, value, sz, ZIPLIST_HEAD);
+        new_node->zl = lpPrepend(new_node->zl, value, sz);
         new_node->count++;
         quicklistNodeUpdateSz(new_node);
         quicklistRecompressOnly(quicklist, new_node);
@@ -908,7 +1115,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         D("Full and head, but prev isn't full, inserting prev node tail");
         new_node = node->prev;
         quicklistDecompressNodeForUse(new_node);
-        new_node->zl = ziplistPush(new_node->zl, value, sz, ZIPLIST_TAIL);
+        new_node->zl = lpAppend(new_node->zl, value, sz);
         new_node->count++;
         quicklistNodeUpdateSz(new_node);
         quicklistRecompressOnly(quicklist, new_node);
@@ -918,7 +1125,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
          *   - create new node and attach to quicklist */
         D("\tprovisioning new node...");
         new_node = quicklistCreateNode();
-        new_node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        new_node->zl = lpPrepend(lpNew(), value, sz);
         new_node->count++;
         quicklistNodeUpdateSz(new_node);
         __quicklistInsertNode(quicklist, node, new_node, after);
@@ -928,8 +1135,10 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         D("\tsplitting node...");
         quicklistDecompressNodeForUse(node);
         new_node = _quicklistSplitNode(node, entry->offset, after);
-        new_node->zl = ziplistPush(new_node->zl, value, sz,
-                                   after ? ZIPLIST_HEAD : ZIPLIST_TAIL);
+        if (after)
+            new_node->zl = lpPrepend(new_node->zl, value, sz);
+        else
+            new_node->zl = lpAppend(new_node->zl, value, sz);
         new_node->count++;
         quicklistNodeUpdateSz(new_node);
         __quicklistInsertNode(quicklist, node, new_node, after);
@@ -970,6 +1179,14 @@ int quicklistDelRange(quicklist *quicklist, const long start,
         extent = -start; /* c.f. LREM -29 29; just delete until end. */
     }
 
+    /* Deleting at the head or at the tail of the list keeps the node index
+     * valid, as the nodes left just shift by the number of deleted elements. */
+    unsigned long deleted = extent;
+    unsigned long first = start >= 0 ? (unsigned long)start
+                                     : quicklist->count - (unsigned long)(-start);
+    int at_head = (first == 0);
+    int at_tail = (first + extent == quicklist->count);
+
     quicklistEntry entry;
     if (!quicklistIndex(quicklist, start, &entry))
         return 0;
@@ -986,7 +1203,7 @@ int quicklistDelRange(quicklist *quicklist, const long start,
         int delete_entire_node = 0;
         if (entry.offset == 0 && extent >= node->count) {
             /* If we are deleting more than the count of this node, we
-             * can just delete the entire node without ziplist math. */
+             * can just delete the entire node without listpack math. */
             delete_entire_node = 1;
             del = node->count;
         } else if (entry.offset >= 0 && extent >= node->count) {
@@ -1020,7 +1237,7 @@ int quicklistDelRange(quicklist *quicklist, const long start,
             __quicklistDelNode(quicklist, node);
         } else {
             quicklistDecompressNodeForUse(node);
-            node->zl = ziplistDeleteRange(node->zl, entry.offset, del);
+            node->zl = lpDeleteRange(node->zl, entry.offset, del);
             quicklistNodeUpdateSz(node);
             node->count -= del;
             quicklist->count -= del;
@@ -1035,12 +1252,19 @@ int quicklistDelRange(quicklist *quicklist, const long start,
 
         entry.offset = 0;
     }
+
+    if (at_tail)
+        _quicklistNodeIndexTrimTail(quicklist);
+    else if (at_head)
+        _quicklistNodeIndexTrimHead(quicklist, deleted);
+    else
+        quicklistNodeIndexInvalidate(quicklist);
     return 1;
 }
 
-/* Passthrough to ziplistCompare() */
+/* Passthrough to lpCompare() */
 int quicklistCompare(unsigned char *p1, unsigned char *p2, int p2_len) {
-    return ziplistCompare(p1, p2, p2_len);
+    return lpCompare(p1, p2, p2_len);
 }
 
 /* Returns a quicklist iterator 'iter'. After the initialization every
@@ -1136,14 +1360,14 @@ int quicklistNext(quicklistIter *iter, quicklistEntry *entry) {
     if (!iter->zi) {
         /* If !zi, use current index. */
         quicklistDecompressNodeForUse(iter->current);
-        iter->zi = ziplistIndex(iter->current->zl, iter->offset);
+        iter->zi = lpSeek(iter->current->zl, iter->offset);
     } else {
         /* else, use existing iterator offset and get prev/next as necessary. */
         if (iter->direction == AL_START_HEAD) {
-            nextFn = ziplistNext;
+            nextFn = lpNext;
             offset_update = 1;
         } else if (iter->direction == AL_START_TAIL) {
-            nextFn = ziplistPrev;
+            nextFn = lpPrev;
             offset_update = -1;
         }
         iter->zi = nextFn(iter->current->zl, iter->zi);
@@ -1154,11 +1378,11 @@ int quicklistNext(quicklistIter *iter, quicklistEntry *entry) {
     entry->offset = iter->offset;
 
     if (iter->zi) {
-        /* Populate value from existing ziplist position */
-        ziplistGet(entry->zi, &entry->value, &entry->sz, &entry->longval);
+        /* Populate value from existing listpack position */
+        entry->value = lpGetValue(entry->zi, &entry->sz, &entry->longval);
         return 1;
     } else {
-        /* We ran out of ziplist entries.
+        /* We ran out of listpack entries.
          * Pick next node, update offset, then re-run retrieval. */
         quicklistCompress(iter->quicklist, iter->current);
         if (iter->direction == AL_START_HEAD) {
@@ -1187,12 +1411,13 @@ quicklist *quicklistDup(quicklist *orig) {
     quicklist *copy;
 
     copy = quicklistNew(orig->fill, orig->compress);
+    copy->codec = orig->codec;
 
     for (quicklistNode *current = orig->head; current;
          current = current->next) {
         quicklistNode *node = quicklistCreateNode();
 
-        if (current->encoding == QUICKLIST_NODE_ENCODING_LZF) {
+        if (quicklistNodeIsCompressed(current)) {
             quicklistLZF *lzf = (quicklistLZF *)current->zl;
             size_t lzf_sz = sizeof(*lzf) + lzf->sz;
             node->zl = zmalloc(lzf_sz);
@@ -1243,6 +1468,18 @@ int quicklistIndex(const quicklist *quicklist, const long long idx,
     if (index >= quicklist->count)
         return 0;
 
+    /* Long lists are searched with the node index, unless the element is
+     * in the first node we would walk. */
+    quicklistNode *found;
+    unsigned long long start;
+    if (quicklist->len >= NODE_INDEX_MIN_NODES && index >= n->count &&
+        _quicklistNodeIndexFind((struct quicklist *)quicklist,
+                                forward ? index : quicklist->count - 1 - index,
+                                &found, &start)) {
+        n = found;
+        accum = forward ? start : quicklist->count - start - n->count;
+    }
+
     while (likely(n)) {
         if ((accum + n->count) > index) {
             break;
@@ -1271,8 +1508,8 @@ int quicklistIndex(const quicklist *quicklist, const long long idx,
     }
 
     quicklistDecompressNodeForUse(entry->node);
-    entry->zi = ziplistIndex(entry->node->zl, entry->offset);
-    ziplistGet(entry->zi, &entry->value, &entry->sz, &entry->longval);
+    entry->zi = lpSeek(entry->node->zl, entry->offset);
+    entry->value = lpGetValue(entry->zi, &entry->sz, &entry->longval);
     /* The caller will use our result, so we don't re-compress here.
      * The caller can recompress or delete the node as needed. */
     return 1;
@@ -1284,14 +1521,14 @@ void quicklistRotate(quicklist *quicklist) {
         return;
 
     /* First, get the tail entry */
-    unsigned char *p = ziplistIndex(quicklist->tail->zl, -1);
+    unsigned char *p = lpSeek(quicklist->tail->zl, -1);
     unsigned char *value;
     long long longval;
     unsigned int sz;
     char longstr[32] = {0};
-    ziplistGet(p, &value, &sz, &longval);
+    value = lpGetValue(p, &sz, &longval);
 
-    /* If value found is NULL, then ziplistGet populated longval instead */
+    /* If value found is NULL, then lpGetValue populated longval instead */
     if (!value) {
         /* Write the longval as a string so we can re-add it */
         sz = ll2string(longstr, sizeof(longstr), longval);
@@ -1301,11 +1538,11 @@ void quicklistRotate(quicklist *quicklist) {
     /* Add tail entry to head (must happen before tail is deleted). */
     quicklistPushHead(quicklist, value, sz);
 
-    /* If quicklist has only one node, the head ziplist is also the
-     * tail ziplist and PushHead() could have reallocated our single ziplist,
+    /* If quicklist has only one node, the head listpack is also the
+     * tail listpack and PushHead() could have reallocated our single listpack,
      * which would make our pre-existing 'p' unusable. */
     if (quicklist->len == 1) {
-        p = ziplistIndex(quicklist->tail->zl, -1);
+        p = lpSeek(quicklist->tail->zl, -1);
     }
 
     /* Remove tail entry. */
@@ -1349,8 +1586,9 @@ int quicklistPopCustom(quicklist *quicklist, int where, unsigned char **data,
         return 0;
     }
 
-    p = ziplistIndex(node->zl, pos);
-    if (ziplistGet(p, &vstr, &vlen, &vlong)) {
+    p = lpSeek(node->zl, pos);
+    if (p) {
+        vstr = lpGetValue(p, &vlen, &vlong);
         if (vstr) {
             if (data)
                 *data = saver(vstr, vlen);
@@ -1413,6 +1651,7 @@ void quicklistPush(quicklist *quicklist, void *value, const size_t sz,
 /* The rest of this file is test cases and test helpers. */
 #ifdef REDIS_TEST
 #include <stdint.h>
+#include <stdlib.h>
 #include <sys/time.h>
 
 #define assert(_e)                                                             \
@@ -1452,9 +1691,9 @@ static void ql_info(quicklist *ql) {
     printf("Container length: %lu\n", ql->len);
     printf("Container size: %lu\n", ql->count);
     if (ql->head)
-        printf("\t(zsize head: %d)\n", ziplistLen(ql->head->zl));
+        printf("\t(zsize head: %d)\n", lpLength(ql->head->zl));
     if (ql->tail)
-        printf("\t(zsize tail: %d)\n", ziplistLen(ql->tail->zl));
+        printf("\t(zsize tail: %d)\n", lpLength(ql->tail->zl));
     printf("\n");
 #else
     UNUSED(ql);
@@ -1552,18 +1791,18 @@ static int _ql_verify(quicklist *ql, uint32_t len, uint32_t count,
     }
 
     if (ql->head && head_count != ql->head->count &&
-        head_count != ziplistLen(ql->head->zl)) {
+        head_count != lpLength(ql->head->zl)) {
         yell("quicklist head count wrong: expected %d, "
              "got cached %d vs. actual %d",
-             head_count, ql->head->count, ziplistLen(ql->head->zl));
+             head_count, ql->head->count, lpLength(ql->head->zl));
         errors++;
     }
 
     if (ql->tail && tail_count != ql->tail->count &&
-        tail_count != ziplistLen(ql->tail->zl)) {
+        tail_count != lpLength(ql->tail->zl)) {
         yell("quicklist tail count wrong: expected %d, "
              "got cached %u vs. actual %d",
-             tail_count, ql->tail->count, ziplistLen(ql->tail->zl));
+             tail_count, ql->tail->count, lpLength(ql->tail->zl));
         errors++;
     }
 
@@ -1583,7 +1822,7 @@ static int _ql_verify(quicklist *ql, uint32_t len, uint32_t count,
                     errors++;
                 }
             } else {
-                if (node->encoding != QUICKLIST_NODE_ENCODING_LZF &&
+                if (!quicklistNodeIsCompressed(node) &&
                     !node->attempted_compress) {
                     yell("Incorrect non-compression: node %d is NOT "
                          "compressed at depth %d ((%u, %u); total "
@@ -1601,6 +1840,32 @@ static int _ql_verify(quicklist *ql, uint32_t len, uint32_t count,
     return errors;
 }
 
+/* Check the node index, if valid, against the nodes of the list. */
+static int _ql_verify_nodeidx(quicklist *ql) {
+    quicklistNodeIndex *idx = ql->nodeidx;
+    quicklistNode *node = ql->head;
+    unsigned long start = 0;
+    int errors = 0;
+
+    if (!quicklistNodeIndexIsValid(ql))
+        return 0;
+    if (idx->len != ql->len) {
+        yell("node index length wrong: expected %lu, got %lu", ql->len,
+             idx->len);
+        return 1;
+    }
+    for (unsigned long j = 0; j < idx->len; j++, node = node->next) {
+        quicklistNodeIndexEntry *e = idx->entries + idx->first + j;
+        if (e->node != node || e->start + idx->shift != (long long)start) {
+            yell("node index entry %lu wrong: start %lld, expected %lu", j,
+                 e->start + idx->shift, start);
+            errors++;
+        }
+        start += node->count;
+    }
+    return errors;
+}
+
 /* Generate new string concatenating integer i against string 'prefix' */
 static char *genstr(char *prefix, int i) {
     static char result[64] = {0};
@@ -1717,7 +1982,7 @@ int quicklistTest(int argc, char *argv[]) {
                 quicklist *ql = quicklistNew(f, options[_i]);
                 quicklistPushHead(ql, "hello", 6);
                 quicklistRotate(ql);
-                /* Ignore compression verify because ziplist is
+                /* Ignore compression verify because listpack is
                  * too small to compress. */
                 ql_verify(ql, 1, 1, 1, 1);
                 quicklistRelease(ql);
@@ -2554,6 +2819,107 @@ int quicklistTest(int argc, char *argv[]) {
             }
         }
 
+        TEST_DESC("node index with random operations at compress %d",
+                  options[_i]) {
+            quicklist *ql = quicklistNew(4, options[_i]);
+            long long model[4096];
+            long len = 0, errors = 0;
+            int built = 0;
+            char num[32];
+
+            srand(options[_i]);
+            for (int i = 0; i < 20000; i++) {
+                int sz = ll2string(num, sizeof(num), i);
+                long n, at = len ? rand() % len : 0;
+                quicklistEntry entry;
+                unsigned char *data = NULL;
+                unsigned int dsz = 0;
+                long long lv = 0;
+
+                switch (rand() % 32) {
+                case 0: case 1: case 2: case 3: case 4:
+                case 5: case 6: case 7: case 8: case 9:
+                    if (len == 4000)
+                        break;
+                    memmove(model + 1, model, sizeof(*model) * len++);
+                    model[0] = i;
+                    quicklistPushHead(ql, num, sz);
+                    break;
+                case 10: case 11: case 12: case 13: case 14:
+                case 15: case 16: case 17: case 18: case 19:
+                    if (len == 4000)
+                        break;
+                    model[len++] = i;
+                    quicklistPushTail(ql, num, sz);
+                    break;
+                case 20: case 21: case 22: case 23:
+                    if (!len)
+                        break;
+                    quicklistPop(ql, QUICKLIST_HEAD, &data, &dsz, &lv);
+                    memmove(model, model + 1, sizeof(*model) * --len);
+                    break;
+                case 24: case 25: case 26: case 27:
+                    if (!len)
+                        break;
+                    quicklistPop(ql, QUICKLIST_TAIL, &data, &dsz, &lv);
+                    len--;
+                    break;
+                case 28:
+                    n = rand() % 10;
+                    if (n > len)
+                        n = len;
+                    quicklistDelRange(ql, 0, n);
+                    memmove(model, model + n, sizeof(*model) * (len - n));
+                    len -= n;
+                    break;
+                case 29:
+                    n = rand() % 10;
+                    if (n > len)
+                        n = len;
+                    quicklistDelRange(ql, -n, n);
+                    len -= n;
+                    break;
+                case 30:
+                    if (!len || len == 4000 || rand() % 8)
+                        break;
+                    quicklistIndex(ql, at, &entry);
+                    quicklistInsertBefore(ql, &entry, num, sz);
+                    memmove(model + at + 1, model + at,
+                            sizeof(*model) * (len++ - at));
+                    model[at] = i;
+                    break;
+                case 31:
+                    if (!len || rand() % 8)
+                        break;
+                    quicklistDelRange(ql, at, 1);
+                    memmove(model + at, model + at + 1,
+                            sizeof(*model) * (--len - at));
+                    break;
+                }
+
+                if (len) {
+                    at = rand() % len;
+                    if (!quicklistIndex(ql, at, &entry) ||
+                        entry.longval != model[at])
+                        errors++;
+                    if (!quicklistIndex(ql, at - len, &entry) ||
+                        entry.longval != model[at])
+                        errors++;
+                }
+                errors += _ql_verify_nodeidx(ql);
+                built |= quicklistNodeIndexIsValid(ql);
+                if ((long)ql->count != len)
+                    errors++;
+            }
+            if (errors)
+                ERR("Node index lookups failed %ld times", errors);
+            else if (!built)
+                ERR("%s", "Node index was never built");
+            else
+                OK;
+            quicklistRelease(ql);
+        }
+
         for (int f = optimize_start; f < 72; f++) {
             TEST_DESC("create quicklist from ziplist at fill %d at compress %d",
                       f, options[_i]) {
@@ -2618,7 +2984,7 @@ int quicklistTest(int argc, char *argv[]) {
                                     node->sz);
                             }
                         } else {
-                            if (node->encoding != QUICKLIST_NODE_ENCODING_LZF) {
+                            if (!quicklistNodeIsCompressed(node)) {
                                 ERR("Incorrect non-compression: node %d is NOT "
                                     "compressed at depth %d ((%u, %u); total "
                                     "nodes: %u; size: %u; attempted: %d)",
@@ -2632,6 +2998,34 @@ int quicklistTest(int argc, char *argv[]) {
             }
         }
     }
+
+    for (int codec = 0; codec <= CODEC_MAX; codec++) {
+        if (!codecAvailable(codec))
+            continue;
+        TEST_DESC("compress interior nodes with codec %s", codecName(codec)) {
+            quicklist *ql = quicklistNew(-2, 1);
+            quicklistSetCodec(ql, codec);
+            for (int i = 0; i < 5000; i++)
+                quicklistPushTail(ql, genstr("hello compression", i), 32);
+            quicklistNode *node = ql->head->next;
+            while (node != ql->tail) {
+                if (node->encoding != QUICKLIST_NODE_ENCODING_CODEC(codec))
+                    ERR("Node not compressed with %s", codecName(codec));
+                node = node->next;
+            }
+            quicklistEntry entry;
+            quicklistIndex(ql, 2500, &entry);
+            if (strncmp((char *)entry.value, "hello compression2500", 21))
+                ERR("Value: %s", entry.value);
+            quicklist *copy = quicklistDup(ql);
+            quicklistIndex(copy, 2501, &entry);
+            if (strncmp((char *)entry.value, "hello compression2501", 21))
+                ERR("Value: %s", entry.value);
+            quicklistRelease(copy);
+            quicklistRelease(ql);
+            OK;
+        }
+    }
     long long stop = mstime();
 
     printf("\n");
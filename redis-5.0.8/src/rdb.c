@@ -28,7 +28,6 @@
  */
 
 #include "server.h"
-#include "lzf.h"    /* LZF compression library */
 #include "zipmap.h"
 #include "endianconv.h"
 #include "stream.h"
@@ -313,13 +312,16 @@ int rdbTryIntegerEncoding(char *s, size_t len, unsigned char *enc) {
     return rdbEncodeInteger(value,enc);
 }
 
-ssize_t rdbSaveLzfBlob(rio *rdb, void *data, size_t compress_len,
-                       size_t original_len) {
+/* RDB string encodings of the compression codecs of codec.h. */
+static const int rdbCodecEncoding[] = {RDB_ENC_LZF, RDB_ENC_LZ4, RDB_ENC_ZSTD};
+
+ssize_t rdbSaveCompressedBlob(rio *rdb, int codec, void *data,
+                              size_t compress_len, size_t original_len) {
     unsigned char byte;
     ssize_t n, nwritten = 0;
 
     /* Data compressed! Let's save it on disk */
-    byte = (RDB_ENCVAL<<6)|RDB_ENC_LZF;
+    byte = (RDB_ENCVAL<<6)|rdbCodecEncoding[codec];
     if ((n = rdbWriteRaw(rdb,&byte,1)) == -1) goto writeerr;
     nwritten += n;
 
@@ -338,7 +340,10 @@ writeerr:
     return -1;
 }
 
-ssize_t rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
+/* Save the string compressed with the configured codec, if it compresses
+ * by at least four bytes. Returns 0 if the string was not saved. */
+ssize_t rdbSaveCompressedStringObject(rio *rdb, unsigned char *s, size_t len) {
+    int codec = server.rdb_compression_codec;
     size_t comprlen, outlen;
     void *out;
 
@@ -346,20 +351,21 @@ ssize_t rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
     if (len <= 4) return 0;
     outlen = len-4;
     if ((out = zmalloc(outlen+1)) == NULL) return 0;
-    comprlen = lzf_compress(s, len, out, outlen);
+    comprlen = codecCompress(codec, s, len, out, outlen);
     if (comprlen == 0) {
         zfree(out);
         return 0;
     }
-    ssize_t nwritten = rdbSaveLzfBlob(rdb, out, comprlen, len);
+    ssize_t nwritten = rdbSaveCompressedBlob(rdb, codec, out, comprlen, len);
     zfree(out);
     return nwritten;
 }
 
-/* Load an LZF compressed string in RDB format. The returned value
+/* Load a string compressed with 'codec' in RDB format. The returned value
  * changes according to 'flags'. For more info check the
  * rdbGenericLoadStringObject() function. */
-void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
+void *rdbLoadCompressedStringObject(rio *rdb, int codec, int flags,
+                                    size_t *lenptr) {
     int plain = flags & RDB_LOAD_PLAIN;
     int sds = flags & RDB_LOAD_SDS;
     uint64_t len, clen;
@@ -380,8 +386,9 @@ void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
 
     /* Load the compressed representation and uncompress it to target. */
     if (rioRead(rdb,c,clen) == 0) goto err;
-    if (lzf_decompress(c,clen,val,len) == 0) {
-        if (rdbCheckMode) rdbCheckSetError("Invalid LZF compressed string");
+    if (codecDecompress(codec,c,clen,val,len) != len) {
+        if (rdbCheckMode)
+            rdbCheckSetError("Invalid %s compressed string",codecName(codec));
         goto err;
     }
     zfree(c);
@@ -418,7 +425,7 @@ ssize_t rdbSaveRawString(rio *rdb, unsigned char *s, size_t len) {
     /* Try LZF compression - under 20 bytes it's unable to compress even
      * aaaaaaaaaaaaaaaaaa so skip it */
     if (server.rdb_compression && len > 20) {
-        n = rdbSaveLzfStringObject(rdb,s,len);
+        n = rdbSaveCompressedStringObject(rdb,s,len);
         if (n == -1) return -1;
         if (n > 0) return n;
         /* Return value of 0 means data can't be compressed, save the old way */
@@ -493,7 +500,22 @@ void *rdbGenericLoadStringObject(rio *rdb, int flags, size_t *lenptr) {
         case RDB_ENC_INT32:
             return rdbLoadIntegerObject(rdb,len,flags,lenptr);
         case RDB_ENC_LZF:
-            return rdbLoadLzfStringObject(rdb,flags,lenptr);
+            return rdbLoadCompressedStringObject(rdb,CODEC_LZF,flags,lenptr);
+        case RDB_ENC_LZ4:
+        case RDB_ENC_ZSTD: {
+            int codec = (len == RDB_ENC_LZ4) ? CODEC_LZ4 : CODEC_ZSTD;
+            if (!codecAvailable(codec)) {
+                serverLog(LL_WARNING,"RDB string compressed with %s, that is "
+                    "not supported by this build of Redis: build with "
+                    "USE_LZ4=yes and USE_ZSTD=yes to load it.",
+                    codecName(codec));
+                if (rdbCheckMode)
+                    rdbCheckSetError("Unsupported %s compressed string",
+                        codecName(codec));
+                return NULL;
+            }
+            return rdbLoadCompressedStringObject(rdb,codec,flags,lenptr);
+        }
         default:
             rdbExitReportCorruptRDB("Unknown RDB string encoding type %d",len);
         }
@@ -628,7 +650,7 @@ int rdbSaveObjectType(rio *rdb, robj *o) {
         return rdbSaveType(rdb,RDB_TYPE_STRING);
     case OBJ_LIST:
         if (o->encoding == OBJ_ENCODING_QUICKLIST)
-            return rdbSaveType(rdb,RDB_TYPE_LIST_QUICKLIST);
+            return rdbSaveType(rdb,RDB_TYPE_LIST_QUICKLIST_2);
         else
             serverPanic("Unknown list encoding");
     case OBJ_SET:
@@ -639,15 +661,15 @@ int rdbSaveObjectType(rio *rdb, robj *o) {
         else
             serverPanic("Unknown set encoding");
     case OBJ_ZSET:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_ZSET_ZIPLIST);
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_ZSET_LISTPACK);
         else if (o->encoding == OBJ_ENCODING_SKIPLIST)
             return rdbSaveType(rdb,RDB_TYPE_ZSET_2);
         else
             serverPanic("Unknown sorted set encoding");
     case OBJ_HASH:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_HASH_ZIPLIST);
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_HASH_LISTPACK);
         else if (o->encoding == OBJ_ENCODING_HT)
             return rdbSaveType(rdb,RDB_TYPE_HASH);
         else
@@ -768,10 +790,14 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
             nwritten += n;
 
             while(node) {
+                if ((n = rdbSaveLen(rdb,node->container)) == -1) return -1;
+                nwritten += n;
+
                 if (quicklistNodeIsCompressed(node)) {
                     void *data;
-                    size_t compress_len = quicklistGetLzf(node, &data);
-                    if ((n = rdbSaveLzfBlob(rdb,data,compress_len,node->sz)) == -1) return -1;
+                    size_t compress_len = quicklistGetCompressed(node, &data);
+                    if ((n = rdbSaveCompressedBlob(rdb,quicklistNodeCodec(node),
+                        data,compress_len,node->sz)) == -1) return -1;
                     nwritten += n;
                 } else {
                     if ((n = rdbSaveRawString(rdb,node->zl,node->sz)) == -1) return -1;
@@ -816,8 +842,8 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
         }
     } else if (o->type == OBJ_ZSET) {
         /* Save a sorted set value */
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
@@ -852,8 +878,8 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
         }
     } else if (o->type == OBJ_HASH) {
         /* Save a hash value */
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
@@ -1007,7 +1033,9 @@ size_t rdbSavedObjectLen(robj *o) {
  * On error -1 is returned.
  * On success if the key was actually saved 1 is returned, otherwise 0
  * is returned (the key was already expired). */
-int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val, long long expiretime) {
+int rdbSaveKeyValuePair(rio *rdb, redisDb *db, robj *key, robj *val,
+                        long long expiretime)
+{
     int savelru = server.maxmemory_policy & MAXMEMORY_FLAG_LRU;
     int savelfu = server.maxmemory_policy & MAXMEMORY_FLAG_LFU;
 
@@ -1017,6 +1045,10 @@ int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val, long long expiretime) {
         if (rdbSaveMillisecondTime(rdb,expiretime) == -1) return -1;
     }
 
+    /* Save the expires of the fields of a hash. */
+    if (val->type == OBJ_HASH &&
+        rdbSaveHashFieldExpires(rdb,db,key) == -1) return -1;
+
     /* Save the LRU info. */
     if (savelru) {
         uint64_t idletime = estimateObjectIdleTime(val);
@@ -1044,6 +1076,91 @@ int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val, long long expiretime) {
     return 1;
 }
 
+/* Save the expires of the fields of the hash 'key', if any, as the
+ * RDB_OPCODE_HASH_FIELD_EXPIRES opcode followed by the number of fields and
+ * by the name and the unix time in milliseconds of every field. Returns the
+ * number of bytes written, that is zero when no field has an expire, or -1
+ * on error. */
+ssize_t rdbSaveHashFieldExpires(rio *rdb, redisDb *db, robj *key) {
+    hashFieldExpires *hfe;
+    dictIterator *di;
+    dictEntry *de;
+    ssize_t n, nwritten = 0;
+
+    if (dictSize(db->hexpires) == 0 ||
+        (hfe = dictFetchValue(db->hexpires,key->ptr)) == NULL) return 0;
+
+    if ((n = rdbSaveType(rdb,RDB_OPCODE_HASH_FIELD_EXPIRES)) == -1) return -1;
+    nwritten += n;
+    if ((n = rdbSaveLen(rdb,dictSize(hfe->fields))) == -1) return -1;
+    nwritten += n;
+    di = dictGetIterator(hfe->fields);
+    while((de = dictNext(di)) != NULL) {
+        sds field = dictGetKey(de);
+
+        if ((n = rdbSaveRawString(rdb,(unsigned char*)field,
+                                  sdslen(field))) == -1 ||
+            rdbSaveMillisecondTime(rdb,dictGetSignedIntegerVal(de)) == -1)
+        {
+            dictReleaseIterator(di);
+            return -1;
+        }
+        nwritten += n+8;
+    }
+    dictReleaseIterator(di);
+    return nwritten;
+}
+
+/* Load the field expires saved by rdbSaveHashFieldExpires(), after its
+ * opcode, into a dictionary mapping field names to expire times, to pass to
+ * rdbSetHashFieldExpires() once the hash is loaded. Returns NULL on error. */
+dict *rdbLoadHashFieldExpires(rio *rdb) {
+    dict *fields = dictCreate(&hashFieldExpireDictType,NULL);
+    uint64_t len;
+
+    if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) goto err;
+    while (len--) {
+        sds field;
+        int64_t t64;
+
+        if ((field = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
+            == NULL) goto err;
+        if (rioRead(rdb,&t64,8) == 0) {
+            sdsfree(field);
+            goto err;
+        }
+        memrev64ifbe(&t64);
+        dictEntry *de = dictAddRaw(fields,field,NULL);
+        if (de == NULL) {
+            sdsfree(field);
+            goto err;
+        }
+        dictSetSignedIntegerVal(de,t64);
+    }
+    return fields;
+
+err:
+    dictRelease(fields);
+    return NULL;
+}
+
+/* Set the field expires loaded by rdbLoadHashFieldExpires() to the hash
+ * 'val' just added to the DB at 'key', and release them. */
+void rdbSetHashFieldExpires(redisDb *db, robj *key, robj *val, dict *fields) {
+    dictIterator *di = dictGetIterator(fields);
+    dictEntry *de;
+
+    while((de = dictNext(di)) != NULL) {
+        sds field = dictGetKey(de);
+
+        if (hashTypeExists(val,field))
+            hashTypeSetFieldExpire(db,key->ptr,field,
+                                   dictGetSignedIntegerVal(de));
+    }
+    dictReleaseIterator(di);
+    dictRelease(fields);
+}
+
 /* Save an AUX field. */
 ssize_t rdbSaveAuxField(rio *rdb, void *key, size_t keylen, void *val, size_t vallen) {
     ssize_t ret, len = 0;
@@ -1141,6 +1258,7 @@ ssize_t rdbSaveSingleModuleAux(rio *rdb, int when, moduleType *mt) {
  * integer pointed by 'error' is set to the value of errno just after the I/O
  * error. */
 int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
+    dbIterator *dbit = NULL;
     dictIterator *di = NULL;
     dictEntry *de;
     char magic[10];
@@ -1157,9 +1275,8 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
 
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
-        dict *d = db->dict;
-        if (dictSize(d) == 0) continue;
-        di = dictGetSafeIterator(d);
+        if (dbSize(db) == 0) continue;
+        dbit = dbGetSafeIterator(db);
 
         /* Write the SELECT DB opcode */
         if (rdbSaveType(rdb,RDB_OPCODE_SELECTDB) == -1) goto werr;
@@ -1170,21 +1287,21 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
          * However this does not limit the actual size of the DB to load since
          * these sizes are just hints to resize the hash tables. */
         uint64_t db_size, expires_size;
-        db_size = dictSize(db->dict);
-        expires_size = dictSize(db->expires);
+        db_size = dbSize(db);
+        expires_size = expireIndexSize(db->expires);
         if (rdbSaveType(rdb,RDB_OPCODE_RESIZEDB) == -1) goto werr;
         if (rdbSaveLen(rdb,db_size) == -1) goto werr;
         if (rdbSaveLen(rdb,expires_size) == -1) goto werr;
 
         /* Iterate this DB writing every entry */
-        while((de = dictNext(di)) != NULL) {
+        while((de = dbIteratorNext(dbit)) != NULL) {
             sds keystr = dictGetKey(de);
             robj key, *o = dictGetVal(de);
             long long expire;
 
             initStaticStringObject(key,keystr);
-            expire = getExpire(db,&key);
-            if (rdbSaveKeyValuePair(rdb,&key,o,expire) == -1) goto werr;
+            expire = keyGetExpire(keystr);
+            if (rdbSaveKeyValuePair(rdb,db,&key,o,expire) == -1) goto werr;
 
             /* When this RDB is produced as part of an AOF rewrite, move
              * accumulated diff from parent to child while rewriting in
@@ -1196,8 +1313,8 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
                 aofReadDiffFromParent();
             }
         }
-        dictReleaseIterator(di);
-        di = NULL; /* So that we don't release it again on error. */
+        dbReleaseIterator(dbit);
+        dbit = NULL; /* So that we don't release it again on error. */
     }
 
     /* If we are storing the replication information on disk, persist
@@ -1229,6 +1346,7 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
 
 werr:
     if (error) *error = errno;
+    if (dbit) dbReleaseIterator(dbit);
     if (di) dictReleaseIterator(di);
     return C_ERR;
 }
@@ -1422,6 +1540,29 @@ robj *rdbLoadCheckModuleValue(rio *rdb, char *modulename) {
     return createStringObject("module-dummy-value",18);
 }
 
+/* Convert the ziplist 'zl', as saved by older versions for small hashes and
+ * sorted sets, into a listpack with the same elements. The ziplist is freed
+ * and the listpack is returned. */
+static unsigned char *rdbConvertZiplistToListpack(unsigned char *zl) {
+    unsigned char *lp = lpNew();
+    unsigned char *p = ziplistIndex(zl,0);
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vll;
+    char buf[LONG_STR_SIZE];
+
+    while (p && ziplistGet(p,&vstr,&vlen,&vll)) {
+        if (vstr == NULL) {
+            vlen = ll2string(buf,sizeof(buf),vll);
+            vstr = (unsigned char*)buf;
+        }
+        lp = lpAppend(lp,vstr,vlen);
+        p = ziplistNext(zl,p);
+    }
+    zfree(zl);
+    return lp;
+}
+
 /* Load a Redis object of the specified type from the specified file.
  * On success a newly allocated object is returned, otherwise NULL. */
 robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
@@ -1439,7 +1580,8 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
 
         o = createQuicklistObject();
         quicklistSetOptions(o->ptr, server.list_max_ziplist_size,
-                            server.list_compress_depth);
+                            server.list_compress_depth,
+                            server.list_compress_codec);
 
         /* Load every single element of the list */
         while(len--) {
@@ -1529,7 +1671,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
         /* Convert *after* loading, since sorted sets are not stored ordered. */
         if (zsetLength(o) <= server.zset_max_ziplist_entries &&
             maxelelen <= server.zset_max_ziplist_value)
-                zsetConvert(o,OBJ_ENCODING_ZIPLIST);
+                zsetConvert(o,OBJ_ENCODING_LISTPACK);
     } else if (rdbtype == RDB_TYPE_HASH) {
         uint64_t len;
         int ret;
@@ -1544,8 +1686,8 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
         if (len > server.hash_max_ziplist_entries)
             hashTypeConvert(o, OBJ_ENCODING_HT);
 
-        /* Load every field and value into the ziplist */
-        while (o->encoding == OBJ_ENCODING_ZIPLIST && len > 0) {
+        /* Load every field and value into the listpack */
+        while (o->encoding == OBJ_ENCODING_LISTPACK && len > 0) {
             len--;
             /* Load raw strings */
             if ((field = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
@@ -1553,11 +1695,9 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
             if ((value = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
                 == NULL) return NULL;
 
-            /* Add pair to ziplist */
-            o->ptr = ziplistPush(o->ptr, (unsigned char*)field,
-                    sdslen(field), ZIPLIST_TAIL);
-            o->ptr = ziplistPush(o->ptr, (unsigned char*)value,
-                    sdslen(value), ZIPLIST_TAIL);
+            /* Add pair to listpack */
+            o->ptr = lpAppend(o->ptr, (unsigned char*)field, sdslen(field));
+            o->ptr = lpAppend(o->ptr, (unsigned char*)value, sdslen(value));
 
             /* Convert to hash table if size threshold is exceeded */
             if (sdslen(field) > server.hash_max_ziplist_value ||
@@ -1593,23 +1733,41 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
 
         /* All pairs should be read by now */
         serverAssert(len == 0);
-    } else if (rdbtype == RDB_TYPE_LIST_QUICKLIST) {
+    } else if (rdbtype == RDB_TYPE_LIST_QUICKLIST ||
+               rdbtype == RDB_TYPE_LIST_QUICKLIST_2)
+    {
         if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
         o = createQuicklistObject();
         quicklistSetOptions(o->ptr, server.list_max_ziplist_size,
-                            server.list_compress_depth);
+                            server.list_compress_depth,
+                            server.list_compress_codec);
 
         while (len--) {
+            if (rdbtype == RDB_TYPE_LIST_QUICKLIST_2) {
+                uint64_t container = rdbLoadLen(rdb,NULL);
+                if (container == RDB_LENERR) return NULL;
+                if (container != QUICKLIST_NODE_CONTAINER_PACKED)
+                    rdbExitReportCorruptRDB("Unknown quicklist node container "
+                                            "%llu",(unsigned long long)container);
+            }
             unsigned char *zl =
                 rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,NULL);
             if (zl == NULL) return NULL;
-            quicklistAppendZiplist(o->ptr, zl);
+            if (rdbtype == RDB_TYPE_LIST_QUICKLIST_2) {
+                quicklistAppendListpack(o->ptr, zl);
+            } else {
+                /* Nodes saved by older versions are ziplists: add their
+                 * elements one by one to new listpack nodes. */
+                quicklistAppendValuesFromZiplist(o->ptr, zl);
+            }
         }
     } else if (rdbtype == RDB_TYPE_HASH_ZIPMAP  ||
                rdbtype == RDB_TYPE_LIST_ZIPLIST ||
                rdbtype == RDB_TYPE_SET_INTSET   ||
                rdbtype == RDB_TYPE_ZSET_ZIPLIST ||
-               rdbtype == RDB_TYPE_HASH_ZIPLIST)
+               rdbtype == RDB_TYPE_HASH_ZIPLIST ||
+               rdbtype == RDB_TYPE_ZSET_LISTPACK ||
+               rdbtype == RDB_TYPE_HASH_LISTPACK)
     {
         unsigned char *encoded =
             rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,NULL);
@@ -1624,10 +1782,10 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
          * converted. */
         switch(rdbtype) {
             case RDB_TYPE_HASH_ZIPMAP:
-                /* Convert to ziplist encoded hash. This must be deprecated
+                /* Convert to listpack encoded hash. This must be deprecated
                  * when loading dumps created by Redis 2.4 gets deprecated. */
                 {
-                    unsigned char *zl = ziplistNew();
+                    unsigned char *lp = lpNew();
                     unsigned char *zi = zipmapRewind(o->ptr);
                     unsigned char *fstr, *vstr;
                     unsigned int flen, vlen;
@@ -1636,14 +1794,14 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                     while ((zi = zipmapNext(zi, &fstr, &flen, &vstr, &vlen)) != NULL) {
                         if (flen > maxlen) maxlen = flen;
                         if (vlen > maxlen) maxlen = vlen;
-                        zl = ziplistPush(zl, fstr, flen, ZIPLIST_TAIL);
-                        zl = ziplistPush(zl, vstr, vlen, ZIPLIST_TAIL);
+                        lp = lpAppend(lp, fstr, flen);
+                        lp = lpAppend(lp, vstr, vlen);
                     }
 
                     zfree(o->ptr);
-                    o->ptr = zl;
+                    o->ptr = lp;
                     o->type = OBJ_HASH;
-                    o->encoding = OBJ_ENCODING_ZIPLIST;
+                    o->encoding = OBJ_ENCODING_LISTPACK;
 
                     if (hashTypeLength(o) > server.hash_max_ziplist_entries ||
                         maxlen > server.hash_max_ziplist_value)
@@ -1654,8 +1812,10 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                 break;
             case RDB_TYPE_LIST_ZIPLIST:
                 o->type = OBJ_LIST;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
-                listTypeConvert(o,OBJ_ENCODING_QUICKLIST);
+                o->encoding = OBJ_ENCODING_QUICKLIST;
+                o->ptr = quicklistCreateFromZiplist(server.list_max_ziplist_size,
+                                                    server.list_compress_depth,
+                                                    o->ptr);
                 break;
             case RDB_TYPE_SET_INTSET:
                 o->type = OBJ_SET;
@@ -1664,14 +1824,20 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                     setTypeConvert(o,OBJ_ENCODING_HT);
                 break;
             case RDB_TYPE_ZSET_ZIPLIST:
+            case RDB_TYPE_ZSET_LISTPACK:
+                if (rdbtype == RDB_TYPE_ZSET_ZIPLIST)
+                    o->ptr = rdbConvertZiplistToListpack(o->ptr);
                 o->type = OBJ_ZSET;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
+                o->encoding = OBJ_ENCODING_LISTPACK;
                 if (zsetLength(o) > server.zset_max_ziplist_entries)
                     zsetConvert(o,OBJ_ENCODING_SKIPLIST);
                 break;
             case RDB_TYPE_HASH_ZIPLIST:
+            case RDB_TYPE_HASH_LISTPACK:
+                if (rdbtype == RDB_TYPE_HASH_ZIPLIST)
+                    o->ptr = rdbConvertZiplistToListpack(o->ptr);
                 o->type = OBJ_HASH;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
+                o->encoding = OBJ_ENCODING_LISTPACK;
                 if (hashTypeLength(o) > server.hash_max_ziplist_entries)
                     hashTypeConvert(o, OBJ_ENCODING_HT);
                 break;
@@ -1916,6 +2082,7 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi, int loading_aof) {
     /* Key-specific attributes, set by opcodes before the key type. */
     long long lru_idle = -1, lfu_freq = -1, expiretime = -1, now = mstime();
     long long lru_clock = LRU_CLOCK();
+    dict *field_expires = NULL;
     
     while(1) {
         robj *key, *val;
@@ -1948,6 +2115,12 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi, int loading_aof) {
             if ((qword = rdbLoadLen(rdb,NULL)) == RDB_LENERR) goto eoferr;
             lru_idle = qword;
             continue; /* Read next opcode. */
+        } else if (type == RDB_OPCODE_HASH_FIELD_EXPIRES) {
+            /* HASH_FIELD_EXPIRES: expires of the fields of the next hash. */
+            if (field_expires) dictRelease(field_expires);
+            if ((field_expires = rdbLoadHashFieldExpires(rdb)) == NULL)
+                goto eoferr;
+            continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_EOF) {
             /* EOF: End of file, exit the main loop. */
             break;
@@ -1971,8 +2144,7 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi, int loading_aof) {
                 goto eoferr;
             if ((expires_size = rdbLoadLen(rdb,NULL)) == RDB_LENERR)
                 goto eoferr;
-            dictExpand(db->dict,db_size);
-            dictExpand(db->expires,expires_size);
+            dbExpandDicts(db,db_size);
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_AUX) {
             /* AUX: generic string-string fields. Use to add state to RDB
@@ -2082,15 +2254,25 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi, int loading_aof) {
             decrRefCount(key);
             decrRefCount(val);
         } else {
-            /* Add the new object in the hash table */
-            dbAdd(db,key,val);
-
-            /* Set the expire time if needed */
-            if (expiretime != -1) setExpire(NULL,db,key,expiretime);
+            /* Add the new object in the hash table, and set the expire
+             * time if needed. */
+            val = dbCompactValue(key,val,expiretime != -1);
+            if (expiretime != -1) {
+                dbAddExpiring(db,key,val);
+                setExpire(NULL,db,key,expiretime);
+            } else {
+                dbAdd(db,key,val);
+            }
             
             /* Set usage information (for eviction). */
             objectSetLRUOrLFU(val,lfu_freq,lru_idle,lru_clock);
 
+            /* Set the expires of the fields of a hash. */
+            if (field_expires && val->type == OBJ_HASH) {
+                rdbSetHashFieldExpires(db,key,val,field_expires);
+                field_expires = NULL;
+            }
+
             /* Decrement the key refcount since dbAdd() will take its
              * own reference. */
             decrRefCount(key);
@@ -2101,6 +2283,10 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi, int loading_aof) {
         expiretime = -1;
         lfu_freq = -1;
         lru_idle = -1;
+        if (field_expires) {
+            dictRelease(field_expires);
+            field_expires = NULL;
+        }
     }
     /* Verify the checksum if RDB version is >= 5 */
     if (rdbver >= 5) {
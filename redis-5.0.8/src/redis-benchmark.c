@@ -64,6 +64,7 @@ static struct config {
     int randomkeys;
     int randomkeys_keyspacelen;
     int keepalive;
+    int connect_latency; /* Include the connection time in the latency. */
     int pipeline;
     int showerrors;
     long long start;
@@ -88,6 +89,7 @@ typedef struct _client {
     size_t randlen;         /* Number of pointers in client->randptr */
     size_t randfree;        /* Number of unused pointers in client->randptr */
     size_t written;         /* Bytes of 'obuf' already written */
+    long long connstart;    /* Time the connection was started */
     long long start;        /* Start time of a request */
     long long latency;      /* Request latency */
     int pending;            /* Number of pending requests (replies to consume) */
@@ -271,7 +273,7 @@ static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
 
         /* Really initialize: randomize keys and set start time. */
         if (config.randomkeys) randomizeClientKey(c);
-        c->start = ustime();
+        c->start = config.connect_latency ? c->connstart : ustime();
         c->latency = -1;
     }
 
@@ -317,6 +319,7 @@ static client createClient(char *cmd, size_t len, client from) {
     int j;
     client c = zmalloc(sizeof(struct _client));
 
+    c->connstart = ustime();
     if (config.hostsocket == NULL) {
         c->context = redisConnectNonBlock(config.hostip,config.hostport);
     } else {
@@ -589,6 +592,8 @@ usage:
 " -l                 Loop. Run the tests forever\n"
 " -t <tests>         Only run the comma separated list of tests. The test\n"
 "                    names are the same as the ones produced as output.\n"
+"                    The connect test, sending every PING over a new\n"
+"                    connection, only runs if explicitly selected.\n"
 " -I                 Idle mode. Just open N idle connections and wait.\n\n"
 "Examples:\n\n"
 " Run the benchmark with the default configuration against 127.0.0.1:6379:\n"
@@ -662,6 +667,7 @@ int main(int argc, const char **argv) {
     config.el = aeCreateEventLoop(1024*10);
     aeCreateTimeEvent(config.el,1,showThroughput,NULL,NULL);
     config.keepalive = 1;
+    config.connect_latency = 0;
     config.datasize = 3;
     config.pipeline = 1;
     config.showerrors = 0;
@@ -839,6 +845,21 @@ int main(int argc, const char **argv) {
             free(cmd);
         }
 
+        /* Measure how fast the server accepts new connections: every PING
+         * is sent over a new connection, and its latency includes the time
+         * needed to connect. */
+        if (config.tests != NULL && test_is_selected("connect")) {
+            int keepalive = config.keepalive;
+
+            config.keepalive = 0;
+            config.connect_latency = 1;
+            len = redisFormatCommand(&cmd,"PING");
+            benchmark("CONNECT (PING on a new connection)",cmd,len);
+            free(cmd);
+            config.keepalive = keepalive;
+            config.connect_latency = 0;
+        }
+
         if (!config.csv) printf("\n");
     } while(config.loop);
 
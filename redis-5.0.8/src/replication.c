@@ -1101,6 +1101,7 @@ void replicationEmptyDbCallback(void *privdata) {
  * performed, this function materializes the master client we store
  * at server.master, starting from the specified file descriptor. */
 void replicationCreateMasterClient(int fd, int dbid) {
+    anetNonBlock(NULL,fd);
     server.master = createClient(fd);
     server.master->flags |= CLIENT_MASTER;
     server.master->authenticated = 1;
@@ -2209,6 +2210,7 @@ void replicationCacheMaster(client *c) {
     listEmpty(c->reply);
     c->sentlen = 0;
     c->reply_bytes = 0;
+    c->reply_obj_refs = 0;
     c->bufpos = 0;
     resetClient(c);
 
@@ -73,35 +73,25 @@ static inline char sdsReqType(size_t string_size) {
 #endif
 }
 
-/* Create a new sds string with the content specified by the 'init' pointer
- * and 'initlen'.
- * If NULL is used for 'init' the string is initialized with zero bytes.
- * If SDS_NOINIT is used, the buffer is left uninitialized;
- *
- * The string is always null-termined (all the sds strings are, always) so
- * even if you create an sds string with:
- *
- * mystring = sdsnewlen("abc",3);
- *
- * You can print the string with printf() as there is an implicit \0 at the
- * end of the string. However the string is binary safe and can contain
- * \0 characters in the middle, as the length is stored in the sds header. */
-sds sdsnewlen(const void *init, size_t initlen) {
+/* Implementation of sdsnewlen() and sdsnewprefixed(). */
+static inline sds _sdsnewlen(const void *init, size_t initlen, size_t prefixlen) {
     void *sh;
     sds s;
     char type = sdsReqType(initlen);
     /* Empty strings are usually created in order to append. Use type 8
-     * since type 5 is not good at this. */
-    if (type == SDS_TYPE_5 && initlen == 0) type = SDS_TYPE_8;
+     * since type 5 is not good at this. Strings with a prefix never use
+     * type 5, so that the unused bits of the flags are available. */
+    if (type == SDS_TYPE_5 && (initlen == 0 || prefixlen)) type = SDS_TYPE_8;
     int hdrlen = sdsHdrSize(type);
     unsigned char *fp; /* flags pointer. */
 
-    sh = s_malloc(hdrlen+initlen+1);
+    sh = s_malloc(prefixlen+hdrlen+initlen+1);
+    if (sh == NULL) return NULL;
+    sh = (char*)sh+prefixlen;
     if (init==SDS_NOINIT)
         init = NULL;
     else if (!init)
         memset(sh, 0, hdrlen+initlen+1);
-    if (sh == NULL) return NULL;
     s = (char*)sh+hdrlen;
     fp = ((unsigned char*)s)-1;
     switch(type) {
@@ -144,6 +134,34 @@ sds sdsnewlen(const void *init, size_t initlen) {
     return s;
 }
 
+/* Create a new sds string with the content specified by the 'init' pointer
+ * and 'initlen'.
+ * If NULL is used for 'init' the string is initialized with zero bytes.
+ * If SDS_NOINIT is used, the buffer is left uninitialized;
+ *
+ * The string is always null-termined (all the sds strings are, always) so
+ * even if you create an sds string with:
+ *
+ * mystring = sdsnewlen("abc",3);
+ *
+ * You can print the string with printf() as there is an implicit \0 at the
+ * end of the string. However the string is binary safe and can contain
+ * \0 characters in the middle, as the length is stored in the sds header. */
+sds sdsnewlen(const void *init, size_t initlen) {
+    return _sdsnewlen(init,initlen,0);
+}
+
+/* Like sdsnewlen(), but 'prefixlen' bytes are allocated before the header
+ * of the string, for the caller to store some data alongside it, at
+ * sdsAllocPtr(s)-prefixlen. The string must not be resized, and must be
+ * released with s_free() using that same pointer, not with sdsfree().
+ *
+ * The string never uses the SDS_TYPE_5 header, so the bits of the flags
+ * byte not covered by SDS_TYPE_MASK are free for the caller to use. */
+sds sdsnewprefixed(size_t prefixlen, const void *init, size_t initlen) {
+    return _sdsnewlen(init,initlen,prefixlen);
+}
+
 /* Create an empty (zero length) sds string. Even in this case the string
  * always has an implicit null term. */
 sds sdsempty(void) {
@@ -217,6 +217,13 @@ struct redisCommand redisCommandTable[] = {
     {"hgetall",hgetallCommand,2,"rR",0,NULL,1,1,1,0,0},
     {"hexists",hexistsCommand,3,"rF",0,NULL,1,1,1,0,0},
     {"hscan",hscanCommand,-3,"rR",0,NULL,1,1,1,0,0},
+    {"hexpire",hexpireCommand,-6,"wF",0,NULL,1,1,1,0,0},
+    {"hpexpire",hpexpireCommand,-6,"wF",0,NULL,1,1,1,0,0},
+    {"hexpireat",hexpireatCommand,-6,"wF",0,NULL,1,1,1,0,0},
+    {"hpexpireat",hpexpireatCommand,-6,"wF",0,NULL,1,1,1,0,0},
+    {"httl",httlCommand,-5,"rF",0,NULL,1,1,1,0,0},
+    {"hpttl",hpttlCommand,-5,"rF",0,NULL,1,1,1,0,0},
+    {"hpersist",hpersistCommand,-5,"wF",0,NULL,1,1,1,0,0},
     {"incrby",incrbyCommand,3,"wmF",0,NULL,1,1,1,0,0},
     {"decrby",decrbyCommand,3,"wmF",0,NULL,1,1,1,0,0},
     {"incrbyfloat",incrbyfloatCommand,3,"wmF",0,NULL,1,1,1,0,0},
@@ -505,6 +512,19 @@ void dictSdsDestructor(void *privdata, void *val)
     sdsfree(val);
 }
 
+/* Keys of the main dictionary of the DBs may be embedded in their value,
+ * see createCompactObject(): in that case they are released with it. */
+void dictKeyspaceKeyDestructor(void *privdata, void *key)
+{
+    DICT_NOTUSED(privdata);
+
+    if (isEmbeddedKey((sds)key)) return;
+    if (keyHasExpireHeader((sds)key))
+        zfree(keyExpireHeader((sds)key));
+    else
+        sdsfree(key);
+}
+
 int dictObjKeyCompare(void *privdata, const void *key1,
         const void *key2)
 {
@@ -521,6 +541,12 @@ uint64_t dictSdsHash(const void *key) {
     return dictGenHashFunction((unsigned char*)key, sdslen((char*)key));
 }
 
+/* Like dictSdsHash(), for the dictionaries holding the data: the keyspace,
+ * sets, sorted sets and hashes. See the data-hash-function option. */
+uint64_t dictSdsDataHash(const void *key) {
+    return dictGenDataHashFunction((unsigned char*)key, sdslen((char*)key));
+}
+
 uint64_t dictSdsCaseHash(const void *key) {
     return dictGenCaseHashFunction((unsigned char*)key, sdslen((char*)key));
 }
@@ -590,7 +616,7 @@ dictType objectKeyHeapPointerValueDictType = {
 
 /* Set dictionary type. Keys are SDS strings, values are ot used. */
 dictType setDictType = {
-    dictSdsHash,               /* hash function */
+    dictSdsDataHash,           /* hash function */
     NULL,                      /* key dup */
     NULL,                      /* val dup */
     dictSdsKeyCompare,         /* key compare */
@@ -600,7 +626,7 @@ dictType setDictType = {
 
 /* Sorted sets hash (note: a skiplist is used in addition to the hash table) */
 dictType zsetDictType = {
-    dictSdsHash,               /* hash function */
+    dictSdsDataHash,           /* hash function */
     NULL,                      /* key dup */
     NULL,                      /* val dup */
     dictSdsKeyCompare,         /* key compare */
@@ -610,12 +636,41 @@ dictType zsetDictType = {
 
 /* Db->dict, keys are sds strings, vals are Redis objects. */
 dictType dbDictType = {
-    dictSdsHash,                /* hash function */
+    dictSdsDataHash,            /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
-    dictSdsDestructor,          /* key destructor */
-    dictObjectDestructor   /* val destructor */
+    dictKeyspaceKeyDestructor,  /* key destructor */
+    dictObjectDestructor,       /* val destructor */
+    0,                          /* open addressing */
+    0,                          /* segmented */
+    dictExpandAllowed           /* expand allowed */
+};
+
+/* Db->dict with open addressing, see the keyspace-open-addressing option. */
+dictType dbOpenDictType = {
+    dictSdsDataHash,            /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictKeyspaceKeyDestructor,  /* key destructor */
+    dictObjectDestructor,       /* val destructor */
+    1,                          /* open addressing */
+    0,                          /* segmented */
+    dictExpandAllowed           /* expand allowed */
+};
+
+/* Db->dict with a segmented table, see keyspace-segmented-tables. */
+dictType dbSegmentedDictType = {
+    dictSdsDataHash,            /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictKeyspaceKeyDestructor,  /* key destructor */
+    dictObjectDestructor,       /* val destructor */
+    0,                          /* open addressing */
+    1,                          /* segmented */
+    dictExpandAllowed           /* expand allowed */
 };
 
 /* server.lua_scripts sha (as sds string) -> scripts (as robj) cache. */
@@ -628,16 +683,6 @@ dictType shaScriptObjectDictType = {
     dictObjectDestructor        /* val destructor */
 };
 
-/* Db->expires */
-dictType keyptrDictType = {
-    dictSdsHash,                /* hash function */
-    NULL,                       /* key dup */
-    NULL,                       /* val dup */
-    dictSdsKeyCompare,          /* key compare */
-    NULL,                       /* key destructor */
-    NULL                        /* val destructor */
-};
-
 /* Command table. sds string -> command struct pointer. */
 dictType commandTableDictType = {
     dictSdsCaseHash,            /* hash function */
@@ -648,9 +693,9 @@ dictType commandTableDictType = {
     NULL                        /* val destructor */
 };
 
-/* Hash type hash table (note that small hashes are represented with ziplists) */
+/* Hash type hash table (note that small hashes are represented with listpacks) */
 dictType hashDictType = {
-    dictSdsHash,                /* hash function */
+    dictSdsDataHash,            /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
@@ -658,6 +703,28 @@ dictType hashDictType = {
     dictSdsDestructor           /* val destructor */
 };
 
+/* Db->hexpires, names of hashes (owned by the hashFieldExpires value) ->
+ * hashFieldExpires structures. */
+dictType hexpiresDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    NULL,                       /* key destructor */
+    NULL                        /* val destructor */
+};
+
+/* Expire times of the fields of a hash, sds fields -> signed integer
+ * unix times in milliseconds. */
+dictType hashFieldExpireDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    NULL                        /* val destructor */
+};
+
 /* Keylist hash table type has unencoded redis objects as keys and
  * lists as values. It's used for blocking operations (BLPOP) and to
  * map swapped keys to a list of clients waiting for this keys to be loaded. */
@@ -727,6 +794,15 @@ dictType replScriptCacheDictType = {
     NULL                        /* val destructor */
 };
 
+/* The 'expandAllowed' callback of the keyspace dictionaries. Expanding a
+ * big table allocates a lot of memory at once: if this would take us over
+ * maxmemory, and so evict many keys or reject writes, the expansion is
+ * postponed, and the table keeps working with longer chains (see dict.c for
+ * the limits). */
+int dictExpandAllowed(size_t moreMem) {
+    return !overMaxmemoryAfterAlloc(moreMem);
+}
+
 int htNeedsResize(dict *dict) {
     long long size, used;
 
@@ -737,12 +813,32 @@ int htNeedsResize(dict *dict) {
 }
 
 /* If the percentage of used slots in the HT reaches HASHTABLE_MIN_FILL
- * we resize the hash table to save memory */
+ * we resize the hash table to save memory.
+ *
+ * With a table per hash slot only the tables where keys were added or
+ * removed since they were last checked are visited. A table is kept in
+ * the list while it is rehashing, or while it could not be resized yet. */
 void tryResizeHashTables(int dbid) {
-    if (htNeedsResize(server.db[dbid].dict))
-        dictResize(server.db[dbid].dict);
-    if (htNeedsResize(server.db[dbid].expires))
-        dictResize(server.db[dbid].expires);
+    redisDb *db = server.db+dbid;
+    int j, left = 0;
+
+    if (db->numdicts == 1) {
+        if (htNeedsResize(db->dicts[0])) dictResize(db->dicts[0]);
+        return;
+    }
+
+    for (j = 0; j < db->numpending; j++) {
+        int didx = db->dicts_pending[j];
+        dict *d = db->dicts[didx];
+
+        if (htNeedsResize(d)) dictResize(d);
+        if (dictIsRehashing(d) || htNeedsResize(d)) {
+            db->dicts_pending[left++] = didx;
+        } else {
+            db->dicts_queued[didx] = 0;
+        }
+    }
+    db->numpending = left;
 }
 
 /* Our hash table implementation performs rehashing incrementally while
@@ -753,17 +849,33 @@ void tryResizeHashTables(int dbid) {
  * The function returns 1 if some rehashing was performed, otherwise 0
  * is returned. */
 int incrementallyRehash(int dbid) {
-    /* Keys dictionary */
-    if (dictIsRehashing(server.db[dbid].dict)) {
-        dictRehashMilliseconds(server.db[dbid].dict,1);
-        return 1; /* already used our millisecond for this loop... */
+    redisDb *db = server.db+dbid;
+    long long start = 0;
+    int j;
+
+    if (db->numdicts == 1) {
+        if (!dictIsRehashing(db->dicts[0])) return 0;
+        dictRehashMilliseconds(db->dicts[0],1);
+        return 1;
     }
-    /* Expires */
-    if (dictIsRehashing(server.db[dbid].expires)) {
-        dictRehashMilliseconds(server.db[dbid].expires,1);
-        return 1; /* already used our millisecond for this loop... */
+
+    /* Keys dictionaries: with a table per hash slot the millisecond is
+     * shared by the tables being rehashed, among the ones listed by
+     * tryResizeHashTables(). We resume from the table where the previous
+     * call for this DB ran out of time, so that all the tables make
+     * progress. */
+    for (j = 0; j < db->numpending; j++) {
+        if (db->rehash_cursor >= db->numpending) db->rehash_cursor = 0;
+        dict *d = db->dicts[db->dicts_pending[db->rehash_cursor]];
+
+        if (dictIsRehashing(d)) {
+            if (start == 0) start = ustime();
+            while (dictRehash(d,100) && ustime()-start < 1000);
+            if (ustime()-start >= 1000) break;
+        }
+        db->rehash_cursor++;
     }
-    return 0;
+    return start != 0;
 }
 
 /* This function is called once a background process of some kind terminates,
@@ -893,6 +1005,51 @@ int clientsCronResizeQueryBuffer(client *c) {
     return 0;
 }
 
+/* The client static reply buffer (c->buf) is resized according to the peak
+ * usage observed in the latest period: it is halved (but not below the peak
+ * usage) when the peak is less than half of its size, and doubled, up to
+ * PROTO_REPLY_CHUNK_BYTES, when it was filled up. This way the many idle
+ * clients of an instance only use PROTO_REPLY_MIN_BYTES for replies, while
+ * busy clients get a buffer big enough for their replies.
+ *
+ * The function always returns 0 as it never terminates the client. */
+int clientsCronResizeOutputBuffer(client *c, mstime_t now_ms) {
+    size_t newsize = 0;
+    size_t shrink_size = c->buf_usable_size/2;
+    size_t expand_size = c->buf_usable_size*2;
+
+    if (shrink_size >= PROTO_REPLY_MIN_BYTES && c->buf_peak < shrink_size) {
+        newsize = c->buf_peak+1;
+        if (newsize < PROTO_REPLY_MIN_BYTES) newsize = PROTO_REPLY_MIN_BYTES;
+    } else if (c->buf_usable_size < PROTO_REPLY_CHUNK_BYTES &&
+               c->buf_peak == c->buf_usable_size)
+    {
+        newsize = expand_size < PROTO_REPLY_CHUNK_BYTES ?
+                  expand_size : PROTO_REPLY_CHUNK_BYTES;
+    }
+
+    /* Reset the peak from time to time, so that when the client gets idle
+     * its buffer is shrunk at the next calls. */
+    if (now_ms - c->buf_peak_last_reset_time >=
+        server.reply_buffer_peak_reset_time)
+    {
+        c->buf_peak = c->bufpos;
+        c->buf_peak_last_reset_time = now_ms;
+    }
+
+    if (newsize) {
+        char *oldbuf = c->buf;
+
+        /* The peak is never smaller than the buffer content, so the new
+         * buffer, even when shrinking, can always hold it. */
+        c->buf = zmalloc(newsize);
+        c->buf_usable_size = newsize;
+        memcpy(c->buf,oldbuf,c->bufpos);
+        zfree(oldbuf);
+    }
+    return 0;
+}
+
 /* This function is used in order to track clients using the biggest amount
  * of memory in the latest few seconds. This way we can provide such information
  * in the INFO output (clients section), without having to do an O(N) scan for
@@ -995,6 +1152,7 @@ void clientsCron(void) {
          * terminated. */
         if (clientsCronHandleTimeout(c,now)) continue;
         if (clientsCronResizeQueryBuffer(c)) continue;
+        if (clientsCronResizeOutputBuffer(c,now)) continue;
         if (clientsCronTrackExpansiveClients(c)) continue;
     }
 }
@@ -1013,6 +1171,10 @@ void databasesCron(void) {
         }
     }
 
+    /* Evict keys to keep the maxmemory eviction headroom. */
+    if (server.maxmemory_eviction_headroom)
+        activeEvictionCycle(ACTIVE_EVICTION_CYCLE_SLOW);
+
     /* Defrag keys gradually. */
     if (server.active_defrag_enabled)
         activeDefragCycle();
@@ -1199,9 +1361,9 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         for (j = 0; j < server.dbnum; j++) {
             long long size, used, vkeys;
 
-            size = dictSlots(server.db[j].dict);
-            used = dictSize(server.db[j].dict);
-            vkeys = dictSize(server.db[j].expires);
+            size = dbBuckets(server.db+j);
+            used = dbSize(server.db+j);
+            vkeys = expireIndexSize(server.db[j].expires);
             if (used || vkeys) {
                 serverLog(LL_VERBOSE,"DB %d: %lld keys (%lld volatile) in %lld slots HT.",j,used,vkeys,size);
                 /* dictPrintStats(server.dict); */
@@ -1376,6 +1538,11 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
 void beforeSleep(struct aeEventLoop *eventLoop) {
     UNUSED(eventLoop);
 
+    /* Read and parse the query buffers of the clients whose reads were
+     * postponed to the I/O threads in this event loop iteration, and
+     * execute the commands parsed. */
+    handleClientsWithPendingReadsUsingThreads();
+
     /* Call the Redis Cluster before sleep function. Note that this function
      * may change the state of Redis Cluster (from ok to fail or vice versa),
      * so it's a good idea to call it before serving the unblocked clients
@@ -1387,6 +1554,11 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     if (server.active_expire_enabled && server.masterhost == NULL)
         activeExpireCycle(ACTIVE_EXPIRE_CYCLE_FAST);
 
+    /* Evict some key if we are over the maxmemory eviction headroom (the
+     * called function will return ASAP if there is nothing to do). */
+    if (server.maxmemory_eviction_headroom)
+        activeEvictionCycle(ACTIVE_EVICTION_CYCLE_FAST);
+
     /* Send all the slaves an ACK request if at least one client blocked
      * during the previous event loop iteration. */
     if (server.get_ack_from_slaves) {
@@ -1419,7 +1591,7 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     flushAppendOnlyFile(0);
 
     /* Handle writes with pending output buffers. */
-    handleClientsWithPendingWrites();
+    handleClientsWithPendingWritesUsingThreads();
 
     /* Before we are going to sleep, let the threads access the dataset by
      * releasing the GIL. Redis main thread will not touch anything at this
@@ -1552,17 +1724,22 @@ void initServerConfig(void) {
     server.arch_bits = (sizeof(long) == 8) ? 64 : 32;
     server.port = CONFIG_DEFAULT_SERVER_PORT;
     server.tcp_backlog = CONFIG_DEFAULT_TCP_BACKLOG;
+    server.tcp_listeners = CONFIG_DEFAULT_TCP_LISTENERS;
     server.bindaddr_count = 0;
     server.unixsocket = NULL;
     server.unixsocketperm = CONFIG_DEFAULT_UNIX_SOCKET_PERM;
     server.ipfd_count = 0;
     server.sofd = -1;
     server.protected_mode = CONFIG_DEFAULT_PROTECTED_MODE;
+    server.io_threads_num = CONFIG_DEFAULT_IO_THREADS_NUM;
+    server.io_threads_do_reads = CONFIG_DEFAULT_IO_THREADS_DO_READS;
+    server.shared_query_buffer = CONFIG_DEFAULT_SHARED_QUERY_BUFFER;
     server.dbnum = CONFIG_DEFAULT_DBNUM;
     server.verbosity = CONFIG_DEFAULT_VERBOSITY;
     server.maxidletime = CONFIG_DEFAULT_CLIENT_TIMEOUT;
     server.tcpkeepalive = CONFIG_DEFAULT_TCP_KEEPALIVE;
     server.active_expire_enabled = 1;
+    server.reply_buffer_peak_reset_time = PROTO_REPLY_PEAK_RESET_TIME;
     server.active_defrag_enabled = CONFIG_DEFAULT_ACTIVE_DEFRAG;
     server.active_defrag_ignore_bytes = CONFIG_DEFAULT_DEFRAG_IGNORE_BYTES;
     server.active_defrag_threshold_lower = CONFIG_DEFAULT_DEFRAG_THRESHOLD_LOWER;
@@ -1605,24 +1782,33 @@ void initServerConfig(void) {
     server.aof_filename = zstrdup(CONFIG_DEFAULT_AOF_FILENAME);
     server.requirepass = NULL;
     server.rdb_compression = CONFIG_DEFAULT_RDB_COMPRESSION;
+    server.rdb_compression_codec = CONFIG_DEFAULT_RDB_COMPRESSION_CODEC;
     server.rdb_checksum = CONFIG_DEFAULT_RDB_CHECKSUM;
     server.stop_writes_on_bgsave_err = CONFIG_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR;
     server.activerehashing = CONFIG_DEFAULT_ACTIVE_REHASHING;
+    server.keyspace_open_addressing = CONFIG_DEFAULT_KEYSPACE_OPEN_ADDRESSING;
+    server.keyspace_segmented_tables = CONFIG_DEFAULT_KEYSPACE_SEGMENTED_TABLES;
+    server.data_hash_function = CONFIG_DEFAULT_DATA_HASH_FUNCTION;
+    server.keyspace_compact_entries = CONFIG_DEFAULT_KEYSPACE_COMPACT_ENTRIES;
+    server.prefetch_batch_max_size = CONFIG_DEFAULT_PREFETCH_BATCH_MAX_SIZE;
     server.active_defrag_running = 0;
     server.notify_keyspace_events = 0;
     server.maxclients = CONFIG_DEFAULT_MAX_CLIENTS;
+    server.client_pool_size = CONFIG_DEFAULT_CLIENT_POOL_SIZE;
     server.blocked_clients = 0;
     memset(server.blocked_clients_by_type,0,
            sizeof(server.blocked_clients_by_type));
     server.maxmemory = CONFIG_DEFAULT_MAXMEMORY;
     server.maxmemory_policy = CONFIG_DEFAULT_MAXMEMORY_POLICY;
     server.maxmemory_samples = CONFIG_DEFAULT_MAXMEMORY_SAMPLES;
+    server.maxmemory_eviction_headroom = CONFIG_DEFAULT_MAXMEMORY_EVICTION_HEADROOM;
     server.lfu_log_factor = CONFIG_DEFAULT_LFU_LOG_FACTOR;
     server.lfu_decay_time = CONFIG_DEFAULT_LFU_DECAY_TIME;
     server.hash_max_ziplist_entries = OBJ_HASH_MAX_ZIPLIST_ENTRIES;
     server.hash_max_ziplist_value = OBJ_HASH_MAX_ZIPLIST_VALUE;
     server.list_max_ziplist_size = OBJ_LIST_MAX_ZIPLIST_SIZE;
     server.list_compress_depth = OBJ_LIST_COMPRESS_DEPTH;
+    server.list_compress_codec = OBJ_LIST_COMPRESS_CODEC;
     server.set_max_intset_entries = OBJ_SET_MAX_INTSET_ENTRIES;
     server.zset_max_ziplist_entries = OBJ_ZSET_MAX_ZIPLIST_ENTRIES;
     server.zset_max_ziplist_value = OBJ_ZSET_MAX_ZIPLIST_VALUE;
@@ -1722,6 +1908,7 @@ void initServerConfig(void) {
     server.pexpireCommand = lookupCommandByCString("pexpire");
     server.xclaimCommand = lookupCommandByCString("xclaim");
     server.xgroupCommand = lookupCommandByCString("xgroup");
+    server.hdelCommand = lookupCommandByCString("hdel");
 
     /* Slow log */
     server.slowlog_log_slower_than = CONFIG_DEFAULT_SLOWLOG_LOG_SLOWER_THAN;
@@ -1910,26 +2097,24 @@ void checkTcpBacklogSettings(void) {
 #endif
 }
 
-/* Initialize a set of file descriptors to listen to the specified 'port'
- * binding the addresses specified in the Redis server configuration.
- *
- * The listening file descriptors are stored in the integer array 'fds'
- * and their number is set in '*count'.
- *
- * The addresses to bind are specified in the global server.bindaddr array
- * and their number is server.bindaddr_count. If the server configuration
- * contains no specific addresses to bind, this function will try to
- * bind * (all addresses) for both the IPv4 and IPv6 protocols.
- *
- * On success the function returns C_OK.
- *
- * On error the function returns C_ERR. For the function to be on
- * error, at least one of the server.bindaddr addresses was
- * impossible to bind, or no bind addresses were specified in the server
- * configuration but the function is not able to bind * for at least
- * one of the IPv4 or IPv6 protocols. */
-int listenToPort(int port, int *fds, int *count) {
-    int j;
+/* Create a TCP listening socket for 'bindaddr' (NULL means any address),
+ * see listenToPort(). */
+static int createTcpListener(int port, char *bindaddr, int ipv6, int reuseport) {
+    if (reuseport) {
+        return ipv6 ?
+            anetTcp6ReusePortServer(server.neterr,port,bindaddr,server.tcp_backlog) :
+            anetTcpReusePortServer(server.neterr,port,bindaddr,server.tcp_backlog);
+    } else {
+        return ipv6 ?
+            anetTcp6Server(server.neterr,port,bindaddr,server.tcp_backlog) :
+            anetTcpServer(server.neterr,port,bindaddr,server.tcp_backlog);
+    }
+}
+
+/* Create one listening socket for every configured address, appending them
+ * to 'fds' and incrementing '*count'. See listenToPort() for the details. */
+static int listenToPortAddresses(int port, int *fds, int *count, int reuseport) {
+    int j, first = *count;
 
     /* Force binding of 0.0.0.0 if no bind address is specified, always
      * entering the loop if j == 0. */
@@ -1939,8 +2124,7 @@ int listenToPort(int port, int *fds, int *count) {
             int unsupported = 0;
             /* Bind * for both IPv6 and IPv4, we enter here only if
              * server.bindaddr_count == 0. */
-            fds[*count] = anetTcp6Server(server.neterr,port,NULL,
-                server.tcp_backlog);
+            fds[*count] = createTcpListener(port,NULL,1,reuseport);
             if (fds[*count] != ANET_ERR) {
                 anetNonBlock(NULL,fds[*count]);
                 (*count)++;
@@ -1949,10 +2133,9 @@ int listenToPort(int port, int *fds, int *count) {
                 serverLog(LL_WARNING,"Not listening to IPv6: unsupproted");
             }
 
-            if (*count == 1 || unsupported) {
+            if (*count-first == 1 || unsupported) {
                 /* Bind the IPv4 address as well. */
-                fds[*count] = anetTcpServer(server.neterr,port,NULL,
-                    server.tcp_backlog);
+                fds[*count] = createTcpListener(port,NULL,0,reuseport);
                 if (fds[*count] != ANET_ERR) {
                     anetNonBlock(NULL,fds[*count]);
                     (*count)++;
@@ -1964,15 +2147,13 @@ int listenToPort(int port, int *fds, int *count) {
             /* Exit the loop if we were able to bind * on IPv4 and IPv6,
              * otherwise fds[*count] will be ANET_ERR and we'll print an
              * error and return to the caller with an error. */
-            if (*count + unsupported == 2) break;
+            if (*count-first + unsupported == 2) break;
         } else if (strchr(server.bindaddr[j],':')) {
             /* Bind IPv6 address. */
-            fds[*count] = anetTcp6Server(server.neterr,port,server.bindaddr[j],
-                server.tcp_backlog);
+            fds[*count] = createTcpListener(port,server.bindaddr[j],1,reuseport);
         } else {
             /* Bind IPv4 address. */
-            fds[*count] = anetTcpServer(server.neterr,port,server.bindaddr[j],
-                server.tcp_backlog);
+            fds[*count] = createTcpListener(port,server.bindaddr[j],0,reuseport);
         }
         if (fds[*count] == ANET_ERR) {
             serverLog(LL_WARNING,
@@ -1991,6 +2172,38 @@ int listenToPort(int port, int *fds, int *count) {
     return C_OK;
 }
 
+/* Initialize a set of file descriptors to listen to the specified 'port'
+ * binding the addresses specified in the Redis server configuration.
+ *
+ * The listening file descriptors are stored in the integer array 'fds'
+ * and their number is set in '*count'.
+ *
+ * The addresses to bind are specified in the global server.bindaddr array
+ * and their number is server.bindaddr_count. If the server configuration
+ * contains no specific addresses to bind, this function will try to
+ * bind * (all addresses) for both the IPv4 and IPv6 protocols.
+ *
+ * On success the function returns C_OK.
+ *
+ * On error the function returns C_ERR. For the function to be on
+ * error, at least one of the server.bindaddr addresses was
+ * impossible to bind, or no bind addresses were specified in the server
+ * configuration but the function is not able to bind * for at least
+ * one of the IPv4 or IPv6 protocols.
+ *
+ * When 'listeners' is greater than one, that many sockets are created for
+ * every address, using SO_REUSEPORT: the kernel spreads the incoming
+ * connections among their accept queues. */
+int listenToPort(int port, int *fds, int *count, int listeners) {
+    int j;
+
+    for (j = 0; j < listeners; j++) {
+        if (listenToPortAddresses(port,fds,count,listeners > 1) == C_ERR)
+            return C_ERR;
+    }
+    return C_OK;
+}
+
 /* Resets the stats that we expose via INFO or other means that we want
  * to reset via CONFIG RESETSTAT. The function is also used in order to
  * initialize these fields in initServer() at server startup. */
@@ -2000,6 +2213,7 @@ void resetServerStats(void) {
     server.stat_numcommands = 0;
     server.stat_numconnections = 0;
     server.stat_expiredkeys = 0;
+    server.stat_expired_hash_fields = 0;
     server.stat_expired_stale_perc = 0;
     server.stat_expired_time_cap_reached_count = 0;
     server.stat_evictedkeys = 0;
@@ -2013,6 +2227,8 @@ void resetServerStats(void) {
     server.stat_fork_time = 0;
     server.stat_fork_rate = 0;
     server.stat_rejected_conn = 0;
+    server.stat_client_pool_hits = 0;
+    server.stat_client_pool_misses = 0;
     server.stat_sync_full = 0;
     server.stat_sync_partial_ok = 0;
     server.stat_sync_partial_err = 0;
@@ -2025,6 +2241,8 @@ void resetServerStats(void) {
     }
     server.stat_net_input_bytes = 0;
     server.stat_net_output_bytes = 0;
+    server.stat_io_reads_processed = 0;
+    server.stat_io_writes_processed = 0;
     server.aof_delayed_fsync = 0;
 }
 
@@ -2050,6 +2268,10 @@ void initServer(void) {
     server.slaves = listCreate();
     server.monitors = listCreate();
     server.clients_pending_write = listCreate();
+    server.clients_pending_read = listCreate();
+    server.client_pool = NULL;
+    server.client_pool_count = 0;
+    server.client_pool_alloc = 0;
     server.slaveseldb = -1; /* Force to emit the first SELECT command. */
     server.unblocked_clients = listCreate();
     server.ready_keys = listCreate();
@@ -2071,7 +2293,8 @@ void initServer(void) {
 
     /* Open the TCP listening socket for the user commands. */
     if (server.port != 0 &&
-        listenToPort(server.port,server.ipfd,&server.ipfd_count) == C_ERR)
+        listenToPort(server.port,server.ipfd,&server.ipfd_count,
+                     server.tcp_listeners) == C_ERR)
         exit(1);
 
     /* Open the listening Unix domain socket. */
@@ -2093,9 +2316,20 @@ void initServer(void) {
     }
 
     /* Create the Redis databases, and initialize other internal state. */
+    dictSetDataHashFunction(server.data_hash_function);
     for (j = 0; j < server.dbnum; j++) {
-        server.db[j].dict = dictCreate(&dbDictType,NULL);
-        server.db[j].expires = dictCreate(&keyptrDictType,NULL);
+        dictType *type = &dbDictType;
+
+        if (server.keyspace_open_addressing)
+            type = &dbOpenDictType;
+        else if (server.keyspace_segmented_tables)
+            type = &dbSegmentedDictType;
+        /* Only DB 0 can be used in cluster mode. */
+        dbCreateDicts(server.db+j,type,
+            (server.cluster_enabled && j == 0) ? CLUSTER_SLOTS : 1);
+        server.db[j].expires = expireIndexCreate();
+        server.db[j].hexpires = dictCreate(&hexpiresDictType,NULL);
+        server.db[j].hexpires_order = raxNew();
         server.db[j].blocking_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].ready_keys = dictCreate(&objectKeyPointerValueDictType,NULL);
         server.db[j].watched_keys = dictCreate(&keylistDictType,NULL);
@@ -2205,6 +2439,7 @@ void initServer(void) {
  * see: https://sourceware.org/bugzilla/show_bug.cgi?id=19329 */
 void InitServerLast() {
     bioInit();
+    initThreadedIO();
     server.initial_memory_usage = zmalloc_used_memory();
 }
 
@@ -3211,10 +3446,16 @@ sds genRedisInfoString(char *section) {
             "connected_clients:%lu\r\n"
             "client_recent_max_input_buffer:%zu\r\n"
             "client_recent_max_output_buffer:%zu\r\n"
-            "blocked_clients:%d\r\n",
+            "blocked_clients:%d\r\n"
+            "pooled_clients:%d\r\n"
+            "client_pool_hits:%lld\r\n"
+            "client_pool_misses:%lld\r\n",
             listLength(server.clients)-listLength(server.slaves),
             maxin, maxout,
-            server.blocked_clients);
+            server.blocked_clients,
+            server.client_pool_count,
+            server.stat_client_pool_hits,
+            server.stat_client_pool_misses);
     }
 
     /* Memory */
@@ -3286,6 +3527,8 @@ sds genRedisInfoString(char *section) {
             "mem_replication_backlog:%zu\r\n"
             "mem_clients_slaves:%zu\r\n"
             "mem_clients_normal:%zu\r\n"
+            "mem_clients_query_buffers:%zu\r\n"
+            "mem_clients_reply_buffers:%zu\r\n"
             "mem_aof_buffer:%zu\r\n"
             "mem_allocator:%s\r\n"
             "active_defrag_running:%d\r\n"
@@ -3326,6 +3569,8 @@ sds genRedisInfoString(char *section) {
             mh->repl_backlog,
             mh->clients_slaves,
             mh->clients_normal,
+            mh->clients_query_buffers,
+            mh->clients_reply_buffers,
             mh->aof_buffer,
             ZMALLOC_LIB,
             server.active_defrag_running,
@@ -3443,6 +3688,7 @@ sds genRedisInfoString(char *section) {
             "expired_keys:%lld\r\n"
             "expired_stale_perc:%.2f\r\n"
             "expired_time_cap_reached_count:%lld\r\n"
+            "expired_hash_fields:%lld\r\n"
             "evicted_keys:%lld\r\n"
             "keyspace_hits:%lld\r\n"
             "keyspace_misses:%lld\r\n"
@@ -3454,7 +3700,10 @@ sds genRedisInfoString(char *section) {
             "active_defrag_hits:%lld\r\n"
             "active_defrag_misses:%lld\r\n"
             "active_defrag_key_hits:%lld\r\n"
-            "active_defrag_key_misses:%lld\r\n",
+            "active_defrag_key_misses:%lld\r\n"
+            "io_threads_active:%d\r\n"
+            "io_threaded_reads_processed:%lld\r\n"
+            "io_threaded_writes_processed:%lld\r\n",
             server.stat_numconnections,
             server.stat_numcommands,
             getInstantaneousMetric(STATS_METRIC_COMMAND),
@@ -3469,6 +3718,7 @@ sds genRedisInfoString(char *section) {
             server.stat_expiredkeys,
             server.stat_expired_stale_perc*100,
             server.stat_expired_time_cap_reached_count,
+            server.stat_expired_hash_fields,
             server.stat_evictedkeys,
             server.stat_keyspace_hits,
             server.stat_keyspace_misses,
@@ -3480,7 +3730,10 @@ sds genRedisInfoString(char *section) {
             server.stat_active_defrag_hits,
             server.stat_active_defrag_misses,
             server.stat_active_defrag_key_hits,
-            server.stat_active_defrag_key_misses);
+            server.stat_active_defrag_key_misses,
+            ioThreadsActive(),
+            server.stat_io_reads_processed,
+            server.stat_io_writes_processed);
     }
 
     /* Replication */
@@ -3662,8 +3915,8 @@ sds genRedisInfoString(char *section) {
         for (j = 0; j < server.dbnum; j++) {
             long long keys, vkeys;
 
-            keys = dictSize(server.db[j].dict);
-            vkeys = dictSize(server.db[j].expires);
+            keys = dbSize(server.db+j);
+            vkeys = expireIndexSize(server.db[j].expires);
             if (keys || vkeys) {
                 info = sdscatprintf(info,
                     "db%d:keys=%lld,expires=%lld,avg_ttl=%lld\r\n",
@@ -4042,11 +4295,15 @@ int main(int argc, char **argv) {
     int j;
 
 #ifdef REDIS_TEST
-    if (argc == 3 && !strcasecmp(argv[1], "test")) {
+    if (argc >= 3 && !strcasecmp(argv[1], "test")) {
         if (!strcasecmp(argv[2], "ziplist")) {
             return ziplistTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "listpack")) {
+            return listpackTest(argc, argv);
         } else if (!strcasecmp(argv[2], "quicklist")) {
             quicklistTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "codec")) {
+            return codecTest(argc, argv);
         } else if (!strcasecmp(argv[2], "intset")) {
             return intsetTest(argc, argv);
         } else if (!strcasecmp(argv[2], "zipmap")) {
@@ -4061,6 +4318,12 @@ int main(int argc, char **argv) {
             return crc64Test(argc, argv);
         } else if (!strcasecmp(argv[2], "zmalloc")) {
             return zmalloc_test(argc, argv);
+        } else if (!strcasecmp(argv[2], "ae")) {
+            return aeTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "networking")) {
+            return networkingTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "dict")) {
+            return dictTest(argc, argv);
         }
 
         return -1; /* test not found */
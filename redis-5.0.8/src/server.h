@@ -59,6 +59,7 @@ typedef long long ustime_t; /* microsecond time type. */
 #include "zmalloc.h" /* total memory usage aware version of malloc/free */
 #include "anet.h"    /* Networking the easy way */
 #include "ziplist.h" /* Compact list data structure */
+#include "listpack.h" /* Compact list data structure, without cascade updates */
 #include "intset.h"  /* Compact integer set structure */
 #include "version.h" /* Version macro */
 #include "util.h"    /* Misc functions useful in many places */
@@ -67,6 +68,7 @@ typedef long long ustime_t; /* microsecond time type. */
 #include "quicklist.h"  /* Lists are encoded as linked lists of
                            N-elements flat arrays */
 #include "rax.h"     /* Radix tree */
+#include "codec.h"   /* Compression codecs of list nodes and RDB strings */
 
 /* Following includes allow test functions to be called from Redis main() */
 #include "zipmap.h"
@@ -102,6 +104,7 @@ typedef long long ustime_t; /* microsecond time type. */
 #define CONFIG_DEFAULT_SLOWLOG_LOG_SLOWER_THAN 10000
 #define CONFIG_DEFAULT_SLOWLOG_MAX_LEN 128
 #define CONFIG_DEFAULT_MAX_CLIENTS 10000
+#define CONFIG_DEFAULT_CLIENT_POOL_SIZE 1024
 #define CONFIG_AUTHPASS_MAX_LEN 512
 #define CONFIG_DEFAULT_SLAVE_PRIORITY 100
 #define CONFIG_DEFAULT_REPL_TIMEOUT 60
@@ -126,6 +129,7 @@ typedef long long ustime_t; /* microsecond time type. */
 #define CONFIG_DEFAULT_SYSLOG_ENABLED 0
 #define CONFIG_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR 1
 #define CONFIG_DEFAULT_RDB_COMPRESSION 1
+#define CONFIG_DEFAULT_RDB_COMPRESSION_CODEC CODEC_LZF
 #define CONFIG_DEFAULT_RDB_CHECKSUM 1
 #define CONFIG_DEFAULT_RDB_FILENAME "dump.rdb"
 #define CONFIG_DEFAULT_REPL_DISKLESS_SYNC 0
@@ -138,6 +142,7 @@ typedef long long ustime_t; /* microsecond time type. */
 #define CONFIG_DEFAULT_REPL_DISABLE_TCP_NODELAY 0
 #define CONFIG_DEFAULT_MAXMEMORY 0
 #define CONFIG_DEFAULT_MAXMEMORY_SAMPLES 5
+#define CONFIG_DEFAULT_MAXMEMORY_EVICTION_HEADROOM 0
 #define CONFIG_DEFAULT_LFU_LOG_FACTOR 10
 #define CONFIG_DEFAULT_LFU_DECAY_TIME 1
 #define CONFIG_DEFAULT_AOF_FILENAME "appendonly.aof"
@@ -145,6 +150,12 @@ typedef long long ustime_t; /* microsecond time type. */
 #define CONFIG_DEFAULT_AOF_LOAD_TRUNCATED 1
 #define CONFIG_DEFAULT_AOF_USE_RDB_PREAMBLE 1
 #define CONFIG_DEFAULT_ACTIVE_REHASHING 1
+#define CONFIG_DEFAULT_KEYSPACE_OPEN_ADDRESSING 0
+#define CONFIG_DEFAULT_KEYSPACE_SEGMENTED_TABLES 0
+#define CONFIG_DEFAULT_DATA_HASH_FUNCTION DICT_HASH_SIPHASH
+#define CONFIG_DEFAULT_KEYSPACE_COMPACT_ENTRIES 0
+#define CONFIG_DEFAULT_PREFETCH_BATCH_MAX_SIZE 16
+#define CONFIG_PREFETCH_BATCH_MAX 128 /* Max value of prefetch-batch-max-size. */
 #define CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC 1
 #define CONFIG_DEFAULT_RDB_SAVE_INCREMENTAL_FSYNC 1
 #define CONFIG_DEFAULT_MIN_SLAVES_TO_WRITE 0
@@ -152,6 +163,8 @@ typedef long long ustime_t; /* microsecond time type. */
 #define NET_IP_STR_LEN 46 /* INET6_ADDRSTRLEN is 46, but we need to be sure */
 #define NET_PEER_ID_LEN (NET_IP_STR_LEN+32) /* Must be enough for ip:port */
 #define CONFIG_BINDADDR_MAX 16
+#define CONFIG_TCP_LISTENERS_MAX 16 /* Sockets per bind address. */
+#define CONFIG_DEFAULT_TCP_LISTENERS 1
 #define CONFIG_MIN_RESERVED_FDS 32
 #define CONFIG_DEFAULT_LATENCY_MONITOR_THRESHOLD 0
 #define CONFIG_DEFAULT_SLAVE_LAZY_FLUSH 0
@@ -167,13 +180,22 @@ typedef long long ustime_t; /* microsecond time type. */
 #define CONFIG_DEFAULT_DEFRAG_CYCLE_MAX 75 /* 75% CPU max (at upper threshold) */
 #define CONFIG_DEFAULT_DEFRAG_MAX_SCAN_FIELDS 1000 /* keys with more than 1000 fields will be processed separately */
 #define CONFIG_DEFAULT_PROTO_MAX_BULK_LEN (512ll*1024*1024) /* Bulk request max size */
+#define CONFIG_DEFAULT_IO_THREADS_NUM 1 /* Single threaded by default */
+#define CONFIG_DEFAULT_IO_THREADS_DO_READS 0 /* Read + parse from threads? */
+#define CONFIG_DEFAULT_SHARED_QUERY_BUFFER 1
+#define IO_THREADS_MAX_NUM 128
 
-#define ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP 20 /* Loopkups per loop. */
+#define ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP 20 /* Keys sampled for stats. */
 #define ACTIVE_EXPIRE_CYCLE_FAST_DURATION 1000 /* Microseconds */
 #define ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC 25 /* CPU max % for keys collection */
 #define ACTIVE_EXPIRE_CYCLE_SLOW 0
 #define ACTIVE_EXPIRE_CYCLE_FAST 1
 
+#define ACTIVE_EVICTION_CYCLE_FAST_DURATION 1000 /* Microseconds */
+#define ACTIVE_EVICTION_CYCLE_SLOW_TIME_PERC 25 /* CPU max % for evictions */
+#define ACTIVE_EVICTION_CYCLE_SLOW 0
+#define ACTIVE_EVICTION_CYCLE_FAST 1
+
 /* Instantaneous metrics tracking. */
 #define STATS_METRIC_SAMPLES 16     /* Number of samples per metric. */
 #define STATS_METRIC_COMMAND 0      /* Number of commands executed. */
@@ -185,6 +207,12 @@ typedef long long ustime_t; /* microsecond time type. */
 #define PROTO_MAX_QUERYBUF_LEN  (1024*1024*1024) /* 1GB max query buffer. */
 #define PROTO_IOBUF_LEN         (1024*16)  /* Generic I/O buffer size */
 #define PROTO_REPLY_CHUNK_BYTES (16*1024) /* 16k output buffer */
+#define PROTO_REPLY_MIN_BYTES   (1024) /* Initial and minimum size of the
+                                          client static reply buffer. */
+#define PROTO_REPLY_PEAK_RESET_TIME 5000 /* Reply buffer peak reset period. */
+#define PROTO_REPLY_REF_MIN_BYTES (64*1024) /* Reference, don't copy, string
+                                               objects at least this big in
+                                               the client output buffer. */
 #define PROTO_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
 #define PROTO_MBULK_BIG_ARG     (1024*32)
 #define LONG_STR_SIZE      21          /* Bytes needed for long -> str + '\0' */
@@ -258,6 +286,13 @@ typedef long long ustime_t; /* microsecond time type. */
 #define CLIENT_LUA_DEBUG_SYNC (1<<26)  /* EVAL debugging without fork() */
 #define CLIENT_MODULE (1<<27) /* Non connected client used by some module. */
 #define CLIENT_PROTECTED (1<<28) /* Client should not be freed for now. */
+#define CLIENT_PENDING_READ (1<<29) /* The client has pending reads and was put
+                                       in the list of clients we can read
+                                       from. */
+#define CLIENT_PENDING_COMMAND (1<<30) /* Used in threaded I/O to signal after
+                                          we return single threaded that the
+                                          client has already pending commands
+                                          to be executed. */
 
 /* Client block type (btype field in client structure)
  * if CLIENT_BLOCKED flag is set. */
@@ -368,6 +403,7 @@ typedef long long ustime_t; /* microsecond time type. */
 /* List defaults */
 #define OBJ_LIST_MAX_ZIPLIST_SIZE -2
 #define OBJ_LIST_COMPRESS_DEPTH 0
+#define OBJ_LIST_COMPRESS_CODEC CODEC_LZF
 
 /* HyperLogLog defines */
 #define CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES 3000
@@ -383,6 +419,7 @@ typedef long long ustime_t; /* microsecond time type. */
 #define MAXMEMORY_FLAG_LRU (1<<0)
 #define MAXMEMORY_FLAG_LFU (1<<1)
 #define MAXMEMORY_FLAG_ALLKEYS (1<<2)
+#define MAXMEMORY_FLAG_SIZE (1<<3)      /* Rank keys by memory used as well. */
 #define MAXMEMORY_FLAG_NO_SHARED_INTEGERS \
     (MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_LFU)
 
@@ -394,6 +431,9 @@ typedef long long ustime_t; /* microsecond time type. */
 #define MAXMEMORY_ALLKEYS_LFU ((5<<8)|MAXMEMORY_FLAG_LFU|MAXMEMORY_FLAG_ALLKEYS)
 #define MAXMEMORY_ALLKEYS_RANDOM ((6<<8)|MAXMEMORY_FLAG_ALLKEYS)
 #define MAXMEMORY_NO_EVICTION (7<<8)
+#define MAXMEMORY_VOLATILE_GDSF ((8<<8)|MAXMEMORY_FLAG_LFU|MAXMEMORY_FLAG_SIZE)
+#define MAXMEMORY_ALLKEYS_GDSF ((9<<8)|MAXMEMORY_FLAG_LFU|MAXMEMORY_FLAG_SIZE|\
+                                MAXMEMORY_FLAG_ALLKEYS)
 
 #define CONFIG_DEFAULT_MAXMEMORY_POLICY MAXMEMORY_NO_EVICTION
 
@@ -600,34 +640,69 @@ typedef struct RedisModuleDigest {
 #define OBJ_ENCODING_HT 2      /* Encoded as hash table */
 #define OBJ_ENCODING_ZIPMAP 3  /* Encoded as zipmap */
 #define OBJ_ENCODING_LINKEDLIST 4 /* No longer used: old list encoding. */
-#define OBJ_ENCODING_ZIPLIST 5 /* Encoded as ziplist */
+#define OBJ_ENCODING_ZIPLIST 5 /* No longer used: old hash/zset encoding. */
 #define OBJ_ENCODING_INTSET 6  /* Encoded as intset */
 #define OBJ_ENCODING_SKIPLIST 7  /* Encoded as skiplist */
 #define OBJ_ENCODING_EMBSTR 8  /* Embedded sds string encoding */
-#define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of ziplists */
+#define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of listpacks */
 #define OBJ_ENCODING_STREAM 10 /* Encoded as a radix tree of listpacks */
+#define OBJ_ENCODING_LISTPACK 11 /* Encoded as a listpack */
 
 #define LRU_BITS 24
 #define LRU_CLOCK_MAX ((1<<LRU_BITS)-1) /* Max value of obj->lru */
 #define LRU_CLOCK_RESOLUTION 1000 /* LRU clock resolution in ms */
 
-#define OBJ_SHARED_REFCOUNT INT_MAX
+#define OBJ_REFCOUNT_BITS 30
+#define OBJ_SHARED_REFCOUNT ((1<<OBJ_REFCOUNT_BITS)-1)
 typedef struct redisObject {
     unsigned type:4;
     unsigned encoding:4;
     unsigned lru:LRU_BITS; /* LRU time (relative to global lru_clock) or
                             * LFU data (least significant 8 bits frequency
                             * and most significant 16 bits access time). */
-    int refcount;
+    unsigned embkey:1;     /* Key name embedded, see createCompactObject(). */
+    unsigned embexpire:1;  /* The embedded key name has a keyExpire header. */
+    unsigned refcount:OBJ_REFCOUNT_BITS;
     void *ptr;
 } robj;
 
+/* Set in the flags byte of the sds header of the key names embedded in
+ * compact objects, so that the keyspace dict does not free them. The sds
+ * functions only look at the SDS_TYPE_MASK bits of that byte. */
+#define OBJ_EMBKEY_SDS_FLAG (1<<7)
+#define isEmbeddedKey(s) (((s)[-1] & SDS_TYPE_MASK) != SDS_TYPE_5 && \
+                          ((s)[-1] & OBJ_EMBKEY_SDS_FLAG))
+
+/* The expire time of a key is stored in the keyspace, in a keyExpire header
+ * allocated right before the sds header of the key name, so that reading
+ * it costs no additional lookup. Keys with such a header are flagged with
+ * KEY_EXPIRE_SDS_FLAG. The header is created the first time an expire is
+ * set on the key (or earlier, when the caller knows the key is going to
+ * get one), and is kept with 'when' set to -1 when the key is persisted.
+ *
+ * 'pos' is the position of the key in the expire index of the DB, that is
+ * used by the active expire cycle to find the keys to expire, and by the
+ * eviction of volatile keys to sample the keys having an expire (see
+ * expireIndex). */
+typedef struct keyExpire {
+    long long when;         /* Unix time in milliseconds, or -1. */
+    unsigned long pos;      /* Position in the expire index. */
+} keyExpire;
+
+#define KEY_EXPIRE_SDS_FLAG (1<<6)
+#define keyHasExpireHeader(s) (((s)[-1] & SDS_TYPE_MASK) != SDS_TYPE_5 && \
+                               ((s)[-1] & KEY_EXPIRE_SDS_FLAG))
+#define keyExpireHeader(s) ((keyExpire*)sdsAllocPtr(s)-1)
+#define keyGetExpire(s) (keyHasExpireHeader(s) ? keyExpireHeader(s)->when : -1)
+
 /* Macro used to initialize a Redis object allocated on the stack.
  * Note that this macro is taken near the structure definition to make sure
  * we'll update it when the structure is changed, to avoid bugs like
  * bug #85 introduced exactly in this way. */
 #define initStaticStringObject(_var,_ptr) do { \
     _var.refcount = 1; \
+    _var.embkey = 0; \
+    _var.embexpire = 0; \
     _var.type = OBJ_STRING; \
     _var.encoding = OBJ_ENCODING_RAW; \
     _var.ptr = _ptr; \
@@ -636,18 +711,80 @@ typedef struct redisObject {
 struct evictionPoolEntry; /* Defined in evict.c */
 
 /* This structure is used in order to represent the output buffer of a client,
- * which is actually a linked list of blocks like that, that is: client->reply. */
+ * which is actually a linked list of blocks like that, that is: client->reply.
+ *
+ * A block may also reference a big string object instead of holding a copy
+ * of its content: in that case 'obj' is set, a reference to the object is
+ * retained until the block is released, and the 'used' bytes to send are
+ * the ones of the object string (size is equal to used, so nothing can be
+ * appended to such a block). Objects are never modified in place while their
+ * reference count is greater than one, see dbUnshareStringValue(). */
 typedef struct clientReplyBlock {
     size_t size, used;
+    robj *obj;
     char buf[];
 } clientReplyBlock;
 
+/* The expire index of a DB references the names of the keys having an
+ * expire set, ordered by expire time as a binary min-heap: the key at
+ * position N expires no later than the keys at positions 2N+1 and 2N+2, so
+ * the key expiring first is always at position 0. The active expire cycle
+ * uses it to expire exactly the keys that are due, and the eviction of
+ * volatile keys to sample them. The expire times are not stored here but
+ * in the keyspace, see keyExpire.
+ *
+ * The names are stored in segments of EXPIRE_INDEX_SEGMENT_LEN pointers,
+ * so that the index never needs to be copied when it grows or shrinks.
+ * Every key records its position in the index, so a key can be removed,
+ * or moved when its expire time changes, in logarithmic time. */
+#define EXPIRE_INDEX_SEGMENT_LEN 1024
+typedef struct expireIndex {
+    sds **segments;             /* Directory of segments of key names. */
+    unsigned long numsegments;  /* Number of allocated segments. */
+    unsigned long dirsize;      /* Number of slots of the directory. */
+    unsigned long size;         /* Number of keys in the index. */
+} expireIndex;
+
+#define expireIndexSize(idx) ((idx)->size)
+
+/* The expire times of the fields of a hash. Hashes having fields with an
+ * expire are referenced by name in db->hexpires, and ordered by the expire
+ * time of their first expiring field in db->hexpires_order, that is used by
+ * the active expire cycle. See the "Hash field expires" section of t_hash.c.
+ *
+ * The keys of both the 'order' radix tree of the fields and of the
+ * db->hexpires_order radix tree are the expire time as a 64 bit big endian
+ * integer, so that the lexicographic order is the time order, followed by
+ * the name of the field or of the hash. */
+typedef struct hashFieldExpires {
+    sds key;                /* Name of the hash. */
+    dict *fields;           /* Field -> unix time in milliseconds. */
+    rax *order;             /* Fields ordered by expire time. */
+    long long when;         /* First expire, as indexed in the DB, or -1. */
+} hashFieldExpires;
+
 /* Redis database representation. There are multiple databases identified
  * by integers from 0 (the default database) up to the max configured
- * database. The database number is the 'id' field in the structure. */
+ * database. The database number is the 'id' field in the structure.
+ *
+ * The keyspace is a single hash table, or in cluster mode one hash table
+ * per hash slot, so that the keys of a given slot can be counted, listed
+ * and deleted directly. In the latter case 'dicts_index' is a binary indexed
+ * tree of the number of keys of the tables, used to locate the N-th key of
+ * the keyspace in logarithmic time (see dbFindDictByKeyIndex()), and
+ * 'dicts_pending' lists the tables where keys were added or removed, so
+ * that the cron only checks those ones for rehashing and resizing. */
 typedef struct redisDb {
-    dict *dict;                 /* The keyspace for this DB */
-    dict *expires;              /* Timeout of keys with a timeout set */
+    dict **dicts;               /* The keyspace for this DB */
+    int numdicts;               /* Number of tables of the keyspace */
+    unsigned long *dicts_index; /* Keys per table tree, NULL with one table */
+    int *dicts_pending;         /* Tables that may need rehash or resize */
+    int numpending;             /* Number of tables in 'dicts_pending' */
+    unsigned char *dicts_queued; /* Non zero if the table is in the list */
+    int rehash_cursor;          /* Next 'dicts_pending' entry to rehash */
+    expireIndex *expires;       /* Keys with an expire set */
+    dict *hexpires;             /* Hashes with fields having an expire */
+    rax *hexpires_order;        /* The same hashes, by first field expire */
     dict *blocking_keys;        /* Keys with clients waiting for data (BLPOP)*/
     dict *ready_keys;           /* Blocked keys that received a PUSH */
     dict *watched_keys;         /* WATCHED keys for MULTI/EXEC CAS */
@@ -741,6 +878,7 @@ typedef struct client {
     long bulklen;           /* Length of bulk argument in multi bulk request. */
     list *reply;            /* List of reply objects to send to the client. */
     unsigned long long reply_bytes; /* Tot bytes of objects in reply list. */
+    unsigned long reply_obj_refs; /* Reply list blocks referencing objects. */
     size_t sentlen;         /* Amount of bytes already sent in the current
                                buffer or object being sent. */
     time_t ctime;           /* Client creation time. */
@@ -775,9 +913,15 @@ typedef struct client {
     sds peerid;             /* Cached peer ID. */
     listNode *client_list_node; /* list node in client list */
 
-    /* Response buffer */
+    /* Response buffer. It starts PROTO_REPLY_MIN_BYTES big and is resized
+     * by clientsCron() between PROTO_REPLY_MIN_BYTES and
+     * PROTO_REPLY_CHUNK_BYTES according to the recent peak usage, so that
+     * idle clients don't hold big buffers. */
     int bufpos;
-    char buf[PROTO_REPLY_CHUNK_BYTES];
+    size_t buf_usable_size; /* Allocated size of 'buf'. */
+    size_t buf_peak;        /* Peak used size of 'buf' in the last period. */
+    mstime_t buf_peak_last_reset_time; /* Last time buf_peak was reset. */
+    char *buf;
 } client;
 
 struct saveparam {
@@ -870,6 +1014,8 @@ struct redisMemOverhead {
     size_t repl_backlog;
     size_t clients_slaves;
     size_t clients_normal;
+    size_t clients_query_buffers;
+    size_t clients_reply_buffers;
     size_t aof_buffer;
     size_t lua_caches;
     size_t overhead_total;
@@ -891,6 +1037,7 @@ struct redisMemOverhead {
         size_t dbid;
         size_t overhead_ht_main;
         size_t overhead_ht_expires;
+        size_t overhead_ht_rehashing;
     } *db;
 };
 
@@ -956,6 +1103,11 @@ struct redisServer {
     unsigned int lruclock;      /* Clock for LRU eviction */
     int shutdown_asap;          /* SHUTDOWN needed ASAP */
     int activerehashing;        /* Incremental rehash in serverCron() */
+    int keyspace_open_addressing; /* Open addressing tables for the DBs? */
+    int keyspace_segmented_tables; /* Segmented tables for the DBs? */
+    int data_hash_function;     /* DICT_HASH_* used by the data dicts. */
+    int keyspace_compact_entries; /* Embed keys in small string values? */
+    int prefetch_batch_max_size; /* Max keys prefetched at once, 0 = off. */
     int active_defrag_running;  /* Active defragmentation running (holds current scan aggressiveness) */
     char *requirepass;          /* Pass for AUTH command, or NULL */
     char *pidfile;              /* PID file path */
@@ -976,11 +1128,12 @@ struct redisServer {
     /* Networking */
     int port;                   /* TCP listening port */
     int tcp_backlog;            /* TCP listen() backlog */
+    int tcp_listeners;          /* Listening sockets per bind address */
     char *bindaddr[CONFIG_BINDADDR_MAX]; /* Addresses we should bind to */
     int bindaddr_count;         /* Number of addresses in server.bindaddr[] */
     char *unixsocket;           /* UNIX socket path */
     mode_t unixsocketperm;      /* UNIX socket permission */
-    int ipfd[CONFIG_BINDADDR_MAX]; /* TCP socket file descriptors */
+    int ipfd[CONFIG_BINDADDR_MAX*CONFIG_TCP_LISTENERS_MAX]; /* TCP socket file descriptors */
     int ipfd_count;             /* Used slots in ipfd[] */
     int sofd;                   /* Unix socket file descriptor */
     int cfd[CONFIG_BINDADDR_MAX];/* Cluster bus listening socket */
@@ -988,6 +1141,10 @@ struct redisServer {
     list *clients;              /* List of active clients */
     list *clients_to_close;     /* Clients to close asynchronously */
     list *clients_pending_write; /* There is to write or install handler. */
+    list *clients_pending_read;  /* Client has pending read socket buffers. */
+    client **client_pool;       /* Released clients ready to be reused. */
+    int client_pool_count;      /* Number of clients in client_pool. */
+    int client_pool_alloc;      /* Allocated slots in client_pool. */
     list *slaves, *monitors;    /* List of slaves and MONITORs */
     client *current_client;     /* Current client executing the command. */
     long fixed_time_expire;     /* If > 0, expire keys against server.mstime. */
@@ -998,6 +1155,13 @@ struct redisServer {
     dict *migrate_cached_sockets;/* MIGRATE cached sockets */
     uint64_t next_client_id;    /* Next client unique ID. Incremental. */
     int protected_mode;         /* Don't accept external connections. */
+    int io_threads_num;         /* Number of IO threads to use. */
+    int io_threads_do_reads;    /* Read and parse from IO threads? */
+    int shared_query_buffer;    /* Read idle clients into a shared buffer? */
+    long long stat_io_reads_processed; /* Number of read events processed by
+                                          IO / main threads. */
+    long long stat_io_writes_processed; /* Number of write events processed
+                                           by IO / main threads. */
     /* RDB / AOF loading information */
     int loading;                /* We are loading data from disk if true */
     off_t loading_total_bytes;
@@ -1009,12 +1173,13 @@ struct redisServer {
                         *lpopCommand, *rpopCommand, *zpopminCommand,
                         *zpopmaxCommand, *sremCommand, *execCommand,
                         *expireCommand, *pexpireCommand, *xclaimCommand,
-                        *xgroupCommand;
+                        *xgroupCommand, *hdelCommand;
     /* Fields used only for stats */
     time_t stat_starttime;          /* Server start time */
     long long stat_numcommands;     /* Number of processed commands */
     long long stat_numconnections;  /* Number of connections received */
     long long stat_expiredkeys;     /* Number of expired keys */
+    long long stat_expired_hash_fields; /* Number of expired hash fields */
     double stat_expired_stale_perc; /* Percentage of keys probably expired */
     long long stat_expired_time_cap_reached_count; /* Early expire cylce stops.*/
     long long stat_evictedkeys;     /* Number of evicted keys (maxmemory) */
@@ -1029,6 +1194,8 @@ struct redisServer {
     long long stat_fork_time;       /* Time needed to perform latest fork() */
     double stat_fork_rate;          /* Fork rate in GB/sec. */
     long long stat_rejected_conn;   /* Clients rejected because of maxclients */
+    long long stat_client_pool_hits;   /* New clients taken from the pool. */
+    long long stat_client_pool_misses; /* New clients allocated. */
     long long stat_sync_full;       /* Number of full resyncs with slaves. */
     long long stat_sync_partial_ok; /* Number of accepted PSYNC requests. */
     long long stat_sync_partial_err;/* Number of unaccepted PSYNC requests. */
@@ -1054,6 +1221,7 @@ struct redisServer {
     int maxidletime;                /* Client timeout in seconds */
     int tcpkeepalive;               /* Set SO_KEEPALIVE if non-zero. */
     int active_expire_enabled;      /* Can be disabled for testing purposes. */
+    mstime_t reply_buffer_peak_reset_time; /* Can be changed for testing. */
     int active_defrag_enabled;
     size_t active_defrag_ignore_bytes; /* minimum amount of fragmentation waste to start active defrag */
     int active_defrag_threshold_lower; /* minimum percentage of fragmentation to start active defrag */
@@ -1113,6 +1281,7 @@ struct redisServer {
     int saveparamslen;              /* Number of saving points */
     char *rdb_filename;             /* Name of RDB file */
     int rdb_compression;            /* Use compression in RDB? */
+    int rdb_compression_codec;      /* Codec of compressed RDB strings. */
     int rdb_checksum;               /* Use RDB checksum? */
     time_t lastsave;                /* Unix time of last successful save */
     time_t lastbgsave_try;          /* Unix time of last attempted bgsave */
@@ -1200,9 +1369,12 @@ struct redisServer {
     int get_ack_from_slaves;            /* If true we send REPLCONF GETACK. */
     /* Limits */
     unsigned int maxclients;            /* Max number of simultaneous clients */
+    int client_pool_size;               /* Max number of pooled clients. */
     unsigned long long maxmemory;   /* Max number of memory bytes to use */
     int maxmemory_policy;           /* Policy for key eviction */
     int maxmemory_samples;          /* Pricision of random sampling */
+    int maxmemory_eviction_headroom; /* % of maxmemory to keep free evicting
+                                        keys in the background. */
     int lfu_log_factor;             /* LFU logarithmic counter factor. */
     int lfu_decay_time;             /* LFU counter decay factor. */
     long long proto_max_bulk_len;   /* Protocol bulk length maximum size. */
@@ -1229,6 +1401,7 @@ struct redisServer {
     /* List parameters */
     int list_max_ziplist_size;
     int list_compress_depth;
+    int list_compress_codec;
     /* time cache */
     time_t unixtime;    /* Unix time sampled every cron cycle. */
     time_t timezone;    /* Cached timezone. As set by tzset(). */
@@ -1395,11 +1568,14 @@ extern dictType zsetDictType;
 extern dictType clusterNodesDictType;
 extern dictType clusterNodesBlackListDictType;
 extern dictType dbDictType;
+extern dictType dbOpenDictType;
+extern dictType dbSegmentedDictType;
 extern dictType shaScriptObjectDictType;
 extern double R_Zero, R_PosInf, R_NegInf, R_Nan;
 extern dictType hashDictType;
+extern dictType hexpiresDictType;
+extern dictType hashFieldExpireDictType;
 extern dictType replScriptCacheDictType;
-extern dictType keyptrDictType;
 extern dictType modulesDictType;
 
 /*-----------------------------------------------------------------------------
@@ -1440,12 +1616,16 @@ client *createClient(int fd);
 void closeTimedoutClients(void);
 void freeClient(client *c);
 void freeClientAsync(client *c);
+void trimClientPool(void);
 void resetClient(client *c);
 void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask);
 void *addDeferredMultiBulkLength(client *c);
 void setDeferredMultiBulkLength(client *c, void *node, long length);
-void processInputBuffer(client *c);
-void processInputBufferAndReplicate(client *c);
+int processInputBuffer(client *c);
+int processInputBufferAndReplicate(client *c);
+#ifdef REDIS_TEST
+int networkingTest(int argc, char **argv);
+#endif
 void acceptHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask);
@@ -1472,6 +1652,7 @@ size_t sdsZmallocSize(sds s);
 size_t getStringObjectSdsUsedMemory(robj *o);
 void freeClientReplyValue(void *o);
 void *dupClientReplyValue(void *o);
+void unreferenceClientsReplyObjects(void);
 void getClientsMaxBuffers(unsigned long *longest_output_list,
                           unsigned long *biggest_input_buffer);
 char *getClientPeerId(client *client);
@@ -1488,15 +1669,22 @@ int getClientTypeByName(char *name);
 char *getClientTypeName(int class);
 void flushSlavesOutputBuffers(void);
 void disconnectSlaves(void);
-int listenToPort(int port, int *fds, int *count);
+int listenToPort(int port, int *fds, int *count, int listeners);
 void pauseClients(mstime_t duration);
 int clientsArePaused(void);
 int processEventsWhileBlocked(void);
 int handleClientsWithPendingWrites(void);
+int handleClientsWithPendingWritesUsingThreads(void);
+int handleClientsWithPendingReadsUsingThreads(void);
+int stopThreadedIOIfNeeded(void);
+void initThreadedIO(void);
+void killIOThreads(void);
+int ioThreadsActive(void);
 int clientHasPendingReplies(client *c);
 void unlinkClient(client *c);
 int writeToClient(int fd, client *c, int handler_installed);
 void linkClient(client *c);
+int listMatchObjects(void *a, void *b);
 void protectClient(client *c);
 void unprotectClient(client *c);
 
@@ -1522,7 +1710,6 @@ robj *listTypeGet(listTypeEntry *entry);
 void listTypeInsert(listTypeEntry *entry, robj *value, int where);
 int listTypeEqual(listTypeEntry *entry, robj *o);
 void listTypeDelete(listTypeIterator *iter, listTypeEntry *entry);
-void listTypeConvert(robj *subject, int enc);
 void unblockClientWaitingData(client *c);
 void popGenericCommand(client *c, int where);
 
@@ -1553,6 +1740,9 @@ robj *createStringObject(const char *ptr, size_t len);
 robj *createRawStringObject(const char *ptr, size_t len);
 robj *createEmbeddedStringObject(const char *ptr, size_t len);
 robj *dupStringObject(const robj *o);
+robj *createCompactObject(const sds key, const robj *val, int withexpire);
+sds objectEmbeddedKey(const robj *o);
+size_t keyComputeSize(sds key, robj *val, size_t sample_size);
 int isSdsRepresentableAsLongLong(sds s, long long *llval);
 int isObjectRepresentableAsLongLong(robj *o, long long *llongval);
 robj *tryObjectEncoding(robj *o);
@@ -1562,12 +1752,11 @@ robj *createStringObjectFromLongLong(long long value);
 robj *createStringObjectFromLongLongForValue(long long value);
 robj *createStringObjectFromLongDouble(long double value, int humanfriendly);
 robj *createQuicklistObject(void);
-robj *createZiplistObject(void);
 robj *createSetObject(void);
 robj *createIntsetObject(void);
 robj *createHashObject(void);
 robj *createZsetObject(void);
-robj *createZsetZiplistObject(void);
+robj *createZsetListpackObject(void);
 robj *createStreamObject(void);
 robj *createModuleObject(moduleType *mt, void *value);
 int getLongFromObjectOrReply(client *c, robj *o, long *target, const char *msg);
@@ -1698,14 +1887,14 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range);
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range);
 unsigned long zsetLength(const robj *zobj);
 void zsetConvert(robj *zobj, int encoding);
-void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen);
+void zsetConvertToListpackIfNeeded(robj *zobj, size_t maxelelen);
 int zsetScore(robj *zobj, sds member, double *score);
 unsigned long zslGetRank(zskiplist *zsl, double score, sds o);
 int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore);
 long zsetRank(robj *zobj, sds ele, int reverse);
 int zsetDel(robj *zobj, sds ele);
 void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey, robj *countarg);
-sds ziplistGetObject(unsigned char *sptr);
+sds lpGetObject(unsigned char *sptr);
 int zslValueGteMin(double value, zrangespec *spec);
 int zslValueLteMax(double value, zrangespec *spec);
 void zslFreeLexRange(zlexrangespec *spec);
@@ -1722,8 +1911,10 @@ int zslLexValueLteMax(sds value, zlexrangespec *spec);
 /* Core functions */
 int getMaxmemoryState(size_t *total, size_t *logical, size_t *tofree, float *level);
 size_t freeMemoryGetNotCountedMemory();
+int overMaxmemoryAfterAlloc(size_t moremem);
 int freeMemoryIfNeeded(void);
 int freeMemoryIfNeededAndSafe(void);
+void activeEvictionCycle(int type);
 int processCommand(client *c);
 void setupSignalHandlers(void);
 struct redisCommand *lookupCommand(sds name);
@@ -1750,6 +1941,7 @@ void serverLogFromHandler(int level, const char *msg);
 void usage(void);
 void updateDictResizePolicy(void);
 int htNeedsResize(dict *dict);
+int dictExpandAllowed(size_t moreMem);
 void populateCommandTable(void);
 void resetCommandTableStats(void);
 void adjustOpenFilesLimit(void);
@@ -1796,16 +1988,26 @@ unsigned long hashTypeLength(const robj *o);
 hashTypeIterator *hashTypeInitIterator(robj *subject);
 void hashTypeReleaseIterator(hashTypeIterator *hi);
 int hashTypeNext(hashTypeIterator *hi);
-void hashTypeCurrentFromZiplist(hashTypeIterator *hi, int what,
-                                unsigned char **vstr,
-                                unsigned int *vlen,
-                                long long *vll);
+void hashTypeCurrentFromListpack(hashTypeIterator *hi, int what,
+                                 unsigned char **vstr,
+                                 unsigned int *vlen,
+                                 long long *vll);
 sds hashTypeCurrentFromHashTable(hashTypeIterator *hi, int what);
 void hashTypeCurrentObject(hashTypeIterator *hi, int what, unsigned char **vstr, unsigned int *vlen, long long *vll);
 sds hashTypeCurrentObjectNewSds(hashTypeIterator *hi, int what);
 robj *hashTypeLookupWriteOrCreate(client *c, robj *key);
 robj *hashTypeGetValueObject(robj *o, sds field);
 int hashTypeSet(robj *o, sds field, sds value, int flags);
+long long hashTypeGetFieldExpire(redisDb *db, sds key, sds field);
+void hashTypeSetFieldExpire(redisDb *db, sds key, sds field, long long when);
+int hashTypeRemoveFieldExpire(redisDb *db, sds key, sds field);
+hashFieldExpires *hashTypeDetachFieldExpires(redisDb *db, sds key);
+void hashTypeAttachFieldExpires(redisDb *db, sds key, hashFieldExpires *hfe);
+void hashTypeDeleteFieldExpires(redisDb *db, sds key);
+void hashTypeEmptyFieldExpires(redisDb *db);
+int hashTypeExpireFields(redisDb *db, robj *key, robj *o);
+int hashTypeFieldIsExpired(redisDb *db, sds key, sds field);
+unsigned long hashTypeActiveExpire(redisDb *db);
 
 /* Pub / Sub */
 int pubsubUnsubscribeAllChannels(client *c, int notify);
@@ -1831,6 +2033,7 @@ int rewriteConfig(char *path);
 int removeExpire(redisDb *db, robj *key);
 void propagateExpire(redisDb *db, robj *key, int lazy);
 int expireIfNeeded(redisDb *db, robj *key);
+int expireTimeReached(mstime_t when);
 long long getExpire(redisDb *db, robj *key);
 void setExpire(client *c, redisDb *db, robj *key, long long when);
 robj *lookupKey(redisDb *db, robj *key, int flags);
@@ -1839,6 +2042,8 @@ robj *lookupKeyWrite(redisDb *db, robj *key);
 robj *lookupKeyReadOrReply(client *c, robj *key, robj *reply);
 robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply);
 robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags);
+void dbPrefetchKeys(redisDb *db, char **keys, size_t *lens, int count);
+void prefetchCommandKeys(client *c, int first, int j, int step);
 robj *objectCommandLookup(client *c, robj *key);
 robj *objectCommandLookupOrReply(client *c, robj *key, robj *reply);
 void objectSetLRUOrLFU(robj *val, long long lfu_freq, long long lru_idle,
@@ -1846,14 +2051,49 @@ void objectSetLRUOrLFU(robj *val, long long lfu_freq, long long lru_idle,
 #define LOOKUP_NONE 0
 #define LOOKUP_NOTOUCH (1<<0)
 void dbAdd(redisDb *db, robj *key, robj *val);
+void dbAddExpiring(redisDb *db, robj *key, robj *val);
 void dbOverwrite(redisDb *db, robj *key, robj *val);
 void setKey(redisDb *db, robj *key, robj *val);
+void genericSetKey(redisDb *db, robj *key, robj *val, int expiring);
+robj *dbCompactValue(robj *key, robj *val, int withexpire);
 int dbExists(redisDb *db, robj *key);
 robj *dbRandomKey(redisDb *db);
 int dbSyncDelete(redisDb *db, robj *key);
+int dbRemoveKeyExpire(redisDb *db, sds key);
 int dbDelete(redisDb *db, robj *key);
 robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o);
 
+/* db.c -- Keyspace tables API */
+typedef struct dbIterator {
+    redisDb *db;
+    int didx, safe;
+    dictIterator *di;
+} dbIterator;
+
+#define dbDictIndex(db,key) ((db)->numdicts == 1 ? 0 : \
+    (int)keyHashSlot((char*)(key),sdslen(key)))
+#define dbDictForKey(db,key) ((db)->dicts[dbDictIndex(db,key)])
+void dbCreateDicts(redisDb *db, dictType *type, int numdicts);
+void dbUpdateDictSize(redisDb *db, int didx, long delta);
+void dbResetDictsSize(redisDb *db);
+unsigned long long dbSize(redisDb *db);
+unsigned long long dbBuckets(redisDb *db);
+int dbFindDictByKeyIndex(redisDb *db, unsigned long idx);
+dictEntry *dbRandomEntry(redisDb *db);
+unsigned int dbGetSomeEntries(redisDb *db, dictEntry **des, unsigned int count);
+dbIterator *dbGetIterator(redisDb *db);
+dbIterator *dbGetSafeIterator(redisDb *db);
+dictEntry *dbIteratorNext(dbIterator *iter);
+void dbReleaseIterator(dbIterator *iter);
+unsigned long dbScan(redisDb *db, unsigned long cursor, dictScanFunction *fn, dictScanBucketFunction *bucketfn, void *privdata);
+void dbExpandDicts(redisDb *db, unsigned long size);
+void dbEmptyDicts(redisDb *db, void(callback)(void*));
+void dbResizeDicts(redisDb *db);
+int dbRehashDicts(redisDb *db, int ms);
+size_t dbDictsMemUsage(redisDb *db);
+size_t dbDictsRehashingOverhead(redisDb *db);
+void dbGetDictsStats(char *buf, size_t bufsize, redisDb *db);
+
 #define EMPTYDB_NO_FLAGS 0      /* No flags. */
 #define EMPTYDB_ASYNC (1<<0)    /* Reclaim memory in another thread. */
 long long emptyDb(int dbnum, int flags, void(callback)(void*));
@@ -1867,12 +2107,8 @@ unsigned int delKeysInSlot(unsigned int hashslot);
 int verifyClusterConfigWithData(void);
 void scanGenericCommand(client *c, robj *o, unsigned long cursor);
 int parseScanCursorOrReply(client *c, robj *o, unsigned long *cursor);
-void slotToKeyAdd(robj *key);
-void slotToKeyDel(robj *key);
-void slotToKeyFlush(void);
 int dbAsyncDelete(redisDb *db, robj *key);
 void emptyDbAsync(redisDb *db);
-void slotToKeyFlushAsync(void);
 size_t lazyfreeGetPendingObjectsCount(void);
 void freeObjAsync(robj *o);
 
@@ -1933,6 +2169,18 @@ void expireSlaveKeys(void);
 void rememberSlaveKeyWithExpire(redisDb *db, robj *key);
 void flushSlaveKeysWithExpireList(void);
 size_t getSlaveKeyWithExpireCount(void);
+expireIndex *expireIndexCreate(void);
+void expireIndexEmpty(expireIndex *idx);
+void expireIndexRelease(expireIndex *idx);
+void expireIndexSetExpire(expireIndex *idx, sds key, long long when);
+void expireIndexDelete(expireIndex *idx, sds key);
+void expireIndexReplace(expireIndex *idx, sds oldkey, sds newkey);
+void expireIndexUpdate(expireIndex *idx, sds key);
+sds expireIndexFirstKey(expireIndex *idx);
+sds expireIndexRandomKey(expireIndex *idx);
+unsigned int expireIndexGetSomeKeys(expireIndex *idx, sds *keys, unsigned int count);
+size_t expireIndexMemUsage(expireIndex *idx);
+void expireIndexGetStats(char *buf, size_t bufsize, expireIndex *idx);
 
 /* evict.c -- maxmemory handling and LRU eviction. */
 void evictionPoolAlloc(void);
@@ -1940,11 +2188,13 @@ void evictionPoolAlloc(void);
 unsigned long LFUGetTimeInMinutes(void);
 uint8_t LFULogIncr(uint8_t value);
 unsigned long LFUDecrAndReturn(robj *o);
+double LFUEstimateAccesses(unsigned long counter);
 
 /* Keys hashing / comparison functions for dict.c hash tables. */
 uint64_t dictSdsHash(const void *key);
 int dictSdsKeyCompare(void *privdata, const void *key1, const void *key2);
 void dictSdsDestructor(void *privdata, void *val);
+void dictKeyspaceKeyDestructor(void *privdata, void *key);
 
 /* Git SHA1 */
 char *redisGitSHA1(void);
@@ -2084,6 +2334,13 @@ void hvalsCommand(client *c);
 void hgetallCommand(client *c);
 void hexistsCommand(client *c);
 void hscanCommand(client *c);
+void hexpireCommand(client *c);
+void hpexpireCommand(client *c);
+void hexpireatCommand(client *c);
+void hpexpireatCommand(client *c);
+void httlCommand(client *c);
+void hpttlCommand(client *c);
+void hpersistCommand(client *c);
 void configCommand(client *c);
 void hincrbyCommand(client *c);
 void hincrbyfloatCommand(client *c);
@@ -35,12 +35,12 @@
  *----------------------------------------------------------------------------*/
 
 /* Check the length of a number of objects to see if we need to convert a
- * ziplist to a real hash. Note that we only check string encoded objects
+ * listpack to a real hash. Note that we only check string encoded objects
  * as their string length can be queried in constant time. */
 void hashTypeTryConversion(robj *o, robj **argv, int start, int end) {
     int i;
 
-    if (o->encoding != OBJ_ENCODING_ZIPLIST) return;
+    if (o->encoding != OBJ_ENCODING_LISTPACK) return;
 
     for (i = start; i <= end; i++) {
         if (sdsEncodedObject(argv[i]) &&
@@ -52,32 +52,30 @@ void hashTypeTryConversion(robj *o, robj **argv, int start, int end) {
     }
 }
 
-/* Get the value from a ziplist encoded hash, identified by field.
+/* Get the value from a listpack encoded hash, identified by field.
  * Returns -1 when the field cannot be found. */
-int hashTypeGetFromZiplist(robj *o, sds field,
-                           unsigned char **vstr,
-                           unsigned int *vlen,
-                           long long *vll)
+int hashTypeGetFromListpack(robj *o, sds field,
+                            unsigned char **vstr,
+                            unsigned int *vlen,
+                            long long *vll)
 {
-    unsigned char *zl, *fptr = NULL, *vptr = NULL;
-    int ret;
+    unsigned char *lp, *fptr = NULL, *vptr = NULL;
 
-    serverAssert(o->encoding == OBJ_ENCODING_ZIPLIST);
+    serverAssert(o->encoding == OBJ_ENCODING_LISTPACK);
 
-    zl = o->ptr;
-    fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+    lp = o->ptr;
+    fptr = lpFirst(lp);
     if (fptr != NULL) {
-        fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+        fptr = lpFind(lp, fptr, (unsigned char*)field, sdslen(field), 1);
         if (fptr != NULL) {
             /* Grab pointer to the value (fptr points to the field) */
-            vptr = ziplistNext(zl, fptr);
+            vptr = lpNext(lp, fptr);
             serverAssert(vptr != NULL);
         }
     }
 
     if (vptr != NULL) {
-        ret = ziplistGet(vptr, vstr, vlen, vll);
-        serverAssert(ret);
+        *vstr = lpGetValue(vptr, vlen, vll);
         return 0;
     }
 
@@ -107,9 +105,9 @@ sds hashTypeGetFromHashTable(robj *o, sds field) {
  * can always check the function return by checking the return value
  * for C_OK and checking if vll (or vstr) is NULL. */
 int hashTypeGetValue(robj *o, sds field, unsigned char **vstr, unsigned int *vlen, long long *vll) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         *vstr = NULL;
-        if (hashTypeGetFromZiplist(o, field, vstr, vlen, vll) == 0)
+        if (hashTypeGetFromListpack(o, field, vstr, vlen, vll) == 0)
             return C_OK;
     } else if (o->encoding == OBJ_ENCODING_HT) {
         sds value;
@@ -143,12 +141,12 @@ robj *hashTypeGetValueObject(robj *o, sds field) {
  * exist. */
 size_t hashTypeGetValueLength(robj *o, sds field) {
     size_t len = 0;
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        if (hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll) == 0)
+        if (hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll) == 0)
             len = vstr ? vlen : sdigits10(vll);
     } else if (o->encoding == OBJ_ENCODING_HT) {
         sds aux;
@@ -164,12 +162,12 @@ size_t hashTypeGetValueLength(robj *o, sds field) {
 /* Test if the specified field exists in the given hash. Returns 1 if the field
  * exists, and 0 when it doesn't. */
 int hashTypeExists(robj *o, sds field) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        if (hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll) == 0) return 1;
+        if (hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll) == 0) return 1;
     } else if (o->encoding == OBJ_ENCODING_HT) {
         if (hashTypeGetFromHashTable(o, field) != NULL) return 1;
     } else {
@@ -202,38 +200,33 @@ int hashTypeExists(robj *o, sds field) {
 int hashTypeSet(robj *o, sds field, sds value, int flags) {
     int update = 0;
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        unsigned char *zl, *fptr, *vptr;
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp, *fptr, *vptr;
 
-        zl = o->ptr;
-        fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+        lp = o->ptr;
+        fptr = lpFirst(lp);
         if (fptr != NULL) {
-            fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+            fptr = lpFind(lp, fptr, (unsigned char*)field, sdslen(field), 1);
             if (fptr != NULL) {
                 /* Grab pointer to the value (fptr points to the field) */
-                vptr = ziplistNext(zl, fptr);
+                vptr = lpNext(lp, fptr);
                 serverAssert(vptr != NULL);
                 update = 1;
 
-                /* Delete value */
-                zl = ziplistDelete(zl, &vptr);
-
-                /* Insert new value */
-                zl = ziplistInsert(zl, vptr, (unsigned char*)value,
+                /* Replace value */
+                lp = lpReplace(lp, &vptr, (unsigned char*)value,
                         sdslen(value));
             }
         }
 
         if (!update) {
-            /* Push new field/value pair onto the tail of the ziplist */
-            zl = ziplistPush(zl, (unsigned char*)field, sdslen(field),
-                    ZIPLIST_TAIL);
-            zl = ziplistPush(zl, (unsigned char*)value, sdslen(value),
-                    ZIPLIST_TAIL);
+            /* Push new field/value pair onto the tail of the listpack */
+            lp = lpAppend(lp, (unsigned char*)field, sdslen(field));
+            lp = lpAppend(lp, (unsigned char*)value, sdslen(value));
         }
-        o->ptr = zl;
+        o->ptr = lp;
 
-        /* Check if the ziplist needs to be converted to a hash table */
+        /* Check if the listpack needs to be converted to a hash table */
         if (hashTypeLength(o) > server.hash_max_ziplist_entries)
             hashTypeConvert(o, OBJ_ENCODING_HT);
     } else if (o->encoding == OBJ_ENCODING_HT) {
@@ -279,17 +272,17 @@ int hashTypeSet(robj *o, sds field, sds value, int flags) {
 int hashTypeDelete(robj *o, sds field) {
     int deleted = 0;
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        unsigned char *zl, *fptr;
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp, *fptr;
 
-        zl = o->ptr;
-        fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+        lp = o->ptr;
+        fptr = lpFirst(lp);
         if (fptr != NULL) {
-            fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+            fptr = lpFind(lp, fptr, (unsigned char*)field, sdslen(field), 1);
             if (fptr != NULL) {
-                zl = ziplistDelete(zl,&fptr); /* Delete the key. */
-                zl = ziplistDelete(zl,&fptr); /* Delete the value. */
-                o->ptr = zl;
+                /* Delete both the key and the value. */
+                lp = lpDeleteRangeWithEntry(lp,&fptr,2);
+                o->ptr = lp;
                 deleted = 1;
             }
         }
@@ -311,8 +304,8 @@ int hashTypeDelete(robj *o, sds field) {
 unsigned long hashTypeLength(const robj *o) {
     unsigned long length = ULONG_MAX;
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        length = ziplistLen(o->ptr) / 2;
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        length = lpLength(o->ptr) / 2;
     } else if (o->encoding == OBJ_ENCODING_HT) {
         length = dictSize((const dict*)o->ptr);
     } else {
@@ -326,7 +319,7 @@ hashTypeIterator *hashTypeInitIterator(robj *subject) {
     hi->subject = subject;
     hi->encoding = subject->encoding;
 
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         hi->fptr = NULL;
         hi->vptr = NULL;
     } else if (hi->encoding == OBJ_ENCODING_HT) {
@@ -346,27 +339,27 @@ void hashTypeReleaseIterator(hashTypeIterator *hi) {
 /* Move to the next entry in the hash. Return C_OK when the next entry
  * could be found and C_ERR when the iterator reaches the end. */
 int hashTypeNext(hashTypeIterator *hi) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
-        unsigned char *zl;
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp;
         unsigned char *fptr, *vptr;
 
-        zl = hi->subject->ptr;
+        lp = hi->subject->ptr;
         fptr = hi->fptr;
         vptr = hi->vptr;
 
         if (fptr == NULL) {
             /* Initialize cursor */
             serverAssert(vptr == NULL);
-            fptr = ziplistIndex(zl, 0);
+            fptr = lpFirst(lp);
         } else {
             /* Advance cursor */
             serverAssert(vptr != NULL);
-            fptr = ziplistNext(zl, vptr);
+            fptr = lpNext(lp, vptr);
         }
         if (fptr == NULL) return C_ERR;
 
         /* Grab pointer to the value (fptr points to the field) */
-        vptr = ziplistNext(zl, fptr);
+        vptr = lpNext(lp, fptr);
         serverAssert(vptr != NULL);
 
         /* fptr, vptr now point to the first or next pair */
@@ -381,22 +374,18 @@ int hashTypeNext(hashTypeIterator *hi) {
 }
 
 /* Get the field or value at iterator cursor, for an iterator on a hash value
- * encoded as a ziplist. Prototype is similar to `hashTypeGetFromZiplist`. */
-void hashTypeCurrentFromZiplist(hashTypeIterator *hi, int what,
-                                unsigned char **vstr,
-                                unsigned int *vlen,
-                                long long *vll)
+ * encoded as a listpack. Prototype is similar to `hashTypeGetFromListpack`. */
+void hashTypeCurrentFromListpack(hashTypeIterator *hi, int what,
+                                 unsigned char **vstr,
+                                 unsigned int *vlen,
+                                 long long *vll)
 {
-    int ret;
-
-    serverAssert(hi->encoding == OBJ_ENCODING_ZIPLIST);
+    serverAssert(hi->encoding == OBJ_ENCODING_LISTPACK);
 
     if (what & OBJ_HASH_KEY) {
-        ret = ziplistGet(hi->fptr, vstr, vlen, vll);
-        serverAssert(ret);
+        *vstr = lpGetValue(hi->fptr, vlen, vll);
     } else {
-        ret = ziplistGet(hi->vptr, vstr, vlen, vll);
-        serverAssert(ret);
+        *vstr = lpGetValue(hi->vptr, vlen, vll);
     }
 }
 
@@ -424,9 +413,9 @@ sds hashTypeCurrentFromHashTable(hashTypeIterator *hi, int what) {
  * can always check the function return by checking the return value
  * type checking if vstr == NULL. */
 void hashTypeCurrentObject(hashTypeIterator *hi, int what, unsigned char **vstr, unsigned int *vlen, long long *vll) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         *vstr = NULL;
-        hashTypeCurrentFromZiplist(hi, what, vstr, vlen, vll);
+        hashTypeCurrentFromListpack(hi, what, vstr, vlen, vll);
     } else if (hi->encoding == OBJ_ENCODING_HT) {
         sds ele = hashTypeCurrentFromHashTable(hi, what);
         *vstr = (unsigned char*) ele;
@@ -462,10 +451,10 @@ robj *hashTypeLookupWriteOrCreate(client *c, robj *key) {
     return o;
 }
 
-void hashTypeConvertZiplist(robj *o, int enc) {
-    serverAssert(o->encoding == OBJ_ENCODING_ZIPLIST);
+void hashTypeConvertListpack(robj *o, int enc) {
+    serverAssert(o->encoding == OBJ_ENCODING_LISTPACK);
 
-    if (enc == OBJ_ENCODING_ZIPLIST) {
+    if (enc == OBJ_ENCODING_LISTPACK) {
         /* Nothing to do... */
 
     } else if (enc == OBJ_ENCODING_HT) {
@@ -483,9 +472,9 @@ void hashTypeConvertZiplist(robj *o, int enc) {
             value = hashTypeCurrentObjectNewSds(hi,OBJ_HASH_VALUE);
             ret = dictAdd(dict, key, value);
             if (ret != DICT_OK) {
-                serverLogHexDump(LL_WARNING,"ziplist with dup elements dump",
-                    o->ptr,ziplistBlobLen(o->ptr));
-                serverPanic("Ziplist corruption detected");
+                serverLogHexDump(LL_WARNING,"listpack with dup elements dump",
+                    o->ptr,lpBytes(o->ptr));
+                serverPanic("Listpack corruption detected");
             }
         }
         hashTypeReleaseIterator(hi);
@@ -498,8 +487,8 @@ void hashTypeConvertZiplist(robj *o, int enc) {
 }
 
 void hashTypeConvert(robj *o, int enc) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        hashTypeConvertZiplist(o, enc);
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        hashTypeConvertListpack(o, enc);
     } else if (o->encoding == OBJ_ENCODING_HT) {
         serverPanic("Not implemented");
     } else {
@@ -507,6 +496,362 @@ void hashTypeConvert(robj *o, int enc) {
     }
 }
 
+/*-----------------------------------------------------------------------------
+ * Hash field expires
+ *
+ * The expire times of the fields of a hash are not stored in the hash value,
+ * that keeps its listpack or hash table encoding, but in a hashFieldExpires
+ * structure referenced by the name of the hash in db->hexpires (see the
+ * structure definition in server.h). So hashes without fields with an expire
+ * don't pay anything for the feature, and a key lookup only needs an
+ * additional lookup when the DB has hashes with expiring fields.
+ *
+ * Fields are expired like keys: lazily when the hash is looked up (see
+ * lookupKeyRead() and lookupKeyWrite()), and actively by activeExpireCycle()
+ * that reclaims the due fields of the hashes in db->hexpires_order. Expired
+ * fields are propagated to the AOF and the slaves as an HDEL. As for keys,
+ * slaves don't expire fields on their own but wait for the master HDELs:
+ * meanwhile the read only commands of the clients other than the master
+ * treat the due fields as missing (see hashTypeFieldIsExpired()), so that
+ * reads on slaves match the master.
+ *
+ * Setting the value of a field, deleting it, or deleting the hash removes
+ * the expire of the field.
+ *----------------------------------------------------------------------------*/
+
+/* Maximum number of fields of a single hash expired by every call of
+ * hashTypeActiveExpire(), so that a hash with many fields expiring at the
+ * same time does not block the server. */
+#define HASH_ACTIVE_EXPIRE_FIELDS_PER_CALL 64
+
+/* Return the key of the 'order' radix trees for the name 'name' of length
+ * 'len' expiring at 'when', as a new sds string. */
+static sds hashFieldExpireOrderKey(long long when, const char *name,
+                                   size_t len)
+{
+    uint64_t be = htonu64((uint64_t)when);
+    sds key = sdsnewlen(NULL,sizeof(be)+len);
+
+    memcpy(key,&be,sizeof(be));
+    memcpy(key+sizeof(be),name,len);
+    return key;
+}
+
+/* Return the expire time stored in the key of an 'order' radix tree. */
+static long long hashFieldExpireOrderTime(unsigned char *key) {
+    uint64_t be;
+
+    memcpy(&be,key,sizeof(be));
+    return (long long)ntohu64(be);
+}
+
+static void hashFieldExpireOrderInsert(rax *order, long long when,
+                                       sds name, void *data)
+{
+    sds key = hashFieldExpireOrderKey(when,name,sdslen(name));
+    raxInsert(order,(unsigned char*)key,sdslen(key),data,NULL);
+    sdsfree(key);
+}
+
+static void hashFieldExpireOrderRemove(rax *order, long long when, sds name) {
+    sds key = hashFieldExpireOrderKey(when,name,sdslen(name));
+    raxRemove(order,(unsigned char*)key,sdslen(key),NULL);
+    sdsfree(key);
+}
+
+static void freeHashFieldExpires(hashFieldExpires *hfe) {
+    sdsfree(hfe->key);
+    dictRelease(hfe->fields);
+    raxFree(hfe->order);
+    zfree(hfe);
+}
+
+/* Index the hash in db->hexpires_order with the expire time of its first
+ * expiring field, after the expire of some of its fields changed. */
+static void hashFieldExpiresUpdateOrder(redisDb *db, hashFieldExpires *hfe) {
+    long long first = -1;
+    raxIterator ri;
+
+    raxStart(&ri,hfe->order);
+    raxSeek(&ri,"^",NULL,0);
+    if (raxNext(&ri)) first = hashFieldExpireOrderTime(ri.key);
+    raxStop(&ri);
+
+    if (first == hfe->when) return;
+    if (hfe->when != -1)
+        hashFieldExpireOrderRemove(db->hexpires_order,hfe->when,hfe->key);
+    hfe->when = first;
+    if (first != -1)
+        hashFieldExpireOrderInsert(db->hexpires_order,first,hfe->key,hfe);
+}
+
+/* Return the expire time of the field 'field' of the hash 'key', or -1 if
+ * the field has no expire. */
+long long hashTypeGetFieldExpire(redisDb *db, sds key, sds field) {
+    hashFieldExpires *hfe;
+    dictEntry *de;
+
+    if (dictSize(db->hexpires) == 0) return -1;
+    if ((hfe = dictFetchValue(db->hexpires,key)) == NULL) return -1;
+    if ((de = dictFind(hfe->fields,field)) == NULL) return -1;
+    return dictGetSignedIntegerVal(de);
+}
+
+/* Set the expire time of the field 'field' of the hash 'key', that must
+ * exist, to 'when'. */
+void hashTypeSetFieldExpire(redisDb *db, sds key, sds field, long long when) {
+    hashFieldExpires *hfe = dictFetchValue(db->hexpires,key);
+    dictEntry *de;
+
+    if (hfe == NULL) {
+        hfe = zmalloc(sizeof(*hfe));
+        hfe->key = sdsdup(key);
+        hfe->fields = dictCreate(&hashFieldExpireDictType,NULL);
+        hfe->order = raxNew();
+        hfe->when = -1;
+        dictAdd(db->hexpires,hfe->key,hfe);
+    }
+
+    if ((de = dictFind(hfe->fields,field)) != NULL) {
+        hashFieldExpireOrderRemove(hfe->order,
+            dictGetSignedIntegerVal(de),dictGetKey(de));
+    } else {
+        de = dictAddRaw(hfe->fields,sdsdup(field),NULL);
+    }
+    dictSetSignedIntegerVal(de,when);
+    hashFieldExpireOrderInsert(hfe->order,when,dictGetKey(de),NULL);
+    hashFieldExpiresUpdateOrder(db,hfe);
+}
+
+/* Remove the expire of the field 'field' of the hash 'key'. Returns 1 if
+ * the field had an expire, otherwise 0. */
+int hashTypeRemoveFieldExpire(redisDb *db, sds key, sds field) {
+    hashFieldExpires *hfe;
+    dictEntry *de;
+
+    if (dictSize(db->hexpires) == 0) return 0;
+    if ((hfe = dictFetchValue(db->hexpires,key)) == NULL) return 0;
+    if ((de = dictFind(hfe->fields,field)) == NULL) return 0;
+
+    hashFieldExpireOrderRemove(hfe->order,
+        dictGetSignedIntegerVal(de),dictGetKey(de));
+    dictDelete(hfe->fields,field);
+    if (dictSize(hfe->fields) == 0)
+        hashTypeDeleteFieldExpires(db,key);
+    else
+        hashFieldExpiresUpdateOrder(db,hfe);
+    return 1;
+}
+
+/* Unlink the expires of the fields of the hash 'key' from the DB, and return
+ * them, or NULL if the hash has no field with an expire. Used together with
+ * hashTypeAttachFieldExpires() when a hash is renamed or moved. */
+hashFieldExpires *hashTypeDetachFieldExpires(redisDb *db, sds key) {
+    hashFieldExpires *hfe;
+
+    if (dictSize(db->hexpires) == 0) return NULL;
+    if ((hfe = dictFetchValue(db->hexpires,key)) == NULL) return NULL;
+    if (hfe->when != -1)
+        hashFieldExpireOrderRemove(db->hexpires_order,hfe->when,hfe->key);
+    hfe->when = -1;
+    dictDelete(db->hexpires,key);
+    return hfe;
+}
+
+/* Link the field expires 'hfe', returned by hashTypeDetachFieldExpires(), to
+ * the hash 'key' of the DB 'db'. */
+void hashTypeAttachFieldExpires(redisDb *db, sds key, hashFieldExpires *hfe) {
+    sdsfree(hfe->key);
+    hfe->key = sdsdup(key);
+    dictAdd(db->hexpires,hfe->key,hfe);
+    hashFieldExpiresUpdateOrder(db,hfe);
+}
+
+/* Remove the expires of all the fields of the hash 'key', if any. Called
+ * when the hash is deleted or overwritten. */
+void hashTypeDeleteFieldExpires(redisDb *db, sds key) {
+    hashFieldExpires *hfe = hashTypeDetachFieldExpires(db,key);
+
+    if (hfe) freeHashFieldExpires(hfe);
+}
+
+/* Remove the field expires of all the hashes of the DB, when it is flushed. */
+void hashTypeEmptyFieldExpires(redisDb *db) {
+    dictIterator *di;
+    dictEntry *de;
+
+    if (dictSize(db->hexpires) == 0) return;
+    di = dictGetIterator(db->hexpires);
+    while ((de = dictNext(di)) != NULL) freeHashFieldExpires(dictGetVal(de));
+    dictReleaseIterator(di);
+    dictEmpty(db->hexpires,NULL);
+    raxFree(db->hexpires_order);
+    db->hexpires_order = raxNew();
+}
+
+/* Propagate the expire of the fields 'fields' of the hash 'key' to the AOF
+ * and the slaves, as an HDEL. 'fields' has room for the command name and
+ * the key at its start. */
+static void propagateHashFieldsExpire(redisDb *db, robj *key, robj **argv,
+                                      int argc)
+{
+    argv[0] = createStringObject("HDEL",4);
+    argv[1] = key;
+    incrRefCount(key);
+
+    if (server.aof_state != AOF_OFF)
+        feedAppendOnlyFile(server.hdelCommand,db->id,argv,argc);
+    replicationFeedSlaves(server.slaves,db->id,argv,argc);
+
+    decrRefCount(argv[0]);
+    decrRefCount(argv[1]);
+}
+
+/* Delete from the hash 'o' stored at 'key' the fields that expired, up to
+ * 'max' fields if 'max' is not zero, starting from the field expiring first.
+ * Returns the number of fields deleted. If the hash remained empty it is
+ * deleted as well, and '*keyremoved' is set to 1. */
+static unsigned long hashTypeExpireDueFields(redisDb *db, robj *key, robj *o,
+                                             unsigned long max,
+                                             int *keyremoved)
+{
+    hashFieldExpires *hfe = dictFetchValue(db->hexpires,key->ptr);
+    robj **argv = NULL;
+    unsigned long expired = 0;
+    raxIterator ri;
+
+    *keyremoved = 0;
+    while (hfe && (max == 0 || expired < max)) {
+        long long when;
+        sds field;
+
+        raxStart(&ri,hfe->order);
+        raxSeek(&ri,"^",NULL,0);
+        if (!raxNext(&ri)) {
+            raxStop(&ri);
+            break;
+        }
+        when = hashFieldExpireOrderTime(ri.key);
+        if (!expireTimeReached(when)) {
+            raxStop(&ri);
+            break;
+        }
+        field = sdsnewlen(ri.key+sizeof(uint64_t),ri.key_len-sizeof(uint64_t));
+        raxStop(&ri);
+
+        /* hashTypeRemoveFieldExpire() releases the structure when the last
+         * field with an expire is removed. */
+        if (dictSize(hfe->fields) == 1) hfe = NULL;
+        hashTypeRemoveFieldExpire(db,key->ptr,field);
+        if (hashTypeDelete(o,field)) {
+            argv = zrealloc(argv,sizeof(robj*)*(expired+3));
+            argv[2+expired] = createObject(OBJ_STRING,field);
+            expired++;
+        } else {
+            sdsfree(field);
+        }
+    }
+    if (expired == 0) return 0;
+
+    propagateHashFieldsExpire(db,key,argv,2+expired);
+    for (unsigned long j = 0; j < expired; j++) decrRefCount(argv[2+j]);
+    zfree(argv);
+    server.stat_expired_hash_fields += expired;
+    notifyKeyspaceEvent(NOTIFY_HASH,"hexpired",key,db->id);
+    if (hashTypeLength(o) == 0) {
+        dbDelete(db,key);
+        notifyKeyspaceEvent(NOTIFY_GENERIC,"del",key,db->id);
+        *keyremoved = 1;
+    }
+    return expired;
+}
+
+/* Return true if the fields that expired but were not deleted yet should be
+ * hidden to the current client. This only happens on slaves, where fields
+ * are deleted by the master HDELs, for the same clients to which expired
+ * keys are reported as missing, see lookupKeyReadWithFlags(). */
+static int hashTypeHideExpiredFields(void) {
+    client *c = server.current_client;
+
+    return server.masterhost != NULL && c && c != server.master &&
+           c->cmd && (c->cmd->flags & CMD_READONLY);
+}
+
+/* Return the number of fields of the hash 'key' that expired but were not
+ * deleted yet. */
+static unsigned long hashTypeCountExpiredFields(redisDb *db, sds key) {
+    hashFieldExpires *hfe;
+    unsigned long count = 0;
+    raxIterator ri;
+
+    if (dictSize(db->hexpires) == 0) return 0;
+    if ((hfe = dictFetchValue(db->hexpires,key)) == NULL ||
+        !expireTimeReached(hfe->when)) return 0;
+    raxStart(&ri,hfe->order);
+    raxSeek(&ri,"^",NULL,0);
+    while (raxNext(&ri) && expireTimeReached(hashFieldExpireOrderTime(ri.key)))
+        count++;
+    raxStop(&ri);
+    return count;
+}
+
+/* Return 1 if the field 'field' of the hash 'key' expired, but is still
+ * there and must be treated as missing by the current command: see
+ * hashTypeHideExpiredFields(). Otherwise 0 is returned. */
+int hashTypeFieldIsExpired(redisDb *db, sds key, sds field) {
+    long long when;
+
+    if (dictSize(db->hexpires) == 0 || !hashTypeHideExpiredFields()) return 0;
+    when = hashTypeGetFieldExpire(db,key,field);
+    return when != -1 && expireTimeReached(when);
+}
+
+/* Delete the expired fields of the hash 'o' stored at 'key', that is going
+ * to be accessed. Returns 1 if all the fields expired, so that the hash was
+ * deleted, otherwise 0. In the context of a slave nothing is deleted, see
+ * the top comment of this section, but 1 is returned anyway if all the
+ * fields expired and they are hidden to the current client. */
+int hashTypeExpireFields(redisDb *db, robj *key, robj *o) {
+    hashFieldExpires *hfe = dictFetchValue(db->hexpires,key->ptr);
+    int keyremoved;
+
+    if (hfe == NULL || !expireTimeReached(hfe->when)) return 0;
+    if (server.masterhost != NULL) {
+        return hashTypeHideExpiredFields() &&
+               hashTypeCountExpiredFields(db,key->ptr) == hashTypeLength(o);
+    }
+    hashTypeExpireDueFields(db,key,o,0,&keyremoved);
+    return keyremoved;
+}
+
+/* Expire the due fields of the hash whose first field expires first, up to
+ * HASH_ACTIVE_EXPIRE_FIELDS_PER_CALL fields. Called by activeExpireCycle().
+ * Returns the number of fields expired, that is zero if no field of the DB
+ * is due. */
+unsigned long hashTypeActiveExpire(redisDb *db) {
+    hashFieldExpires *hfe = NULL;
+    unsigned long expired;
+    raxIterator ri;
+    dictEntry *de;
+    robj *keyobj;
+    int keyremoved;
+
+    if (raxSize(db->hexpires_order) == 0) return 0;
+    raxStart(&ri,db->hexpires_order);
+    raxSeek(&ri,"^",NULL,0);
+    if (raxNext(&ri)) hfe = ri.data;
+    raxStop(&ri);
+    if (hfe == NULL || !expireTimeReached(hfe->when)) return 0;
+
+    de = dictFind(dbDictForKey(db,hfe->key),hfe->key);
+    serverAssert(de != NULL);
+    keyobj = createStringObject(hfe->key,sdslen(hfe->key));
+    expired = hashTypeExpireDueFields(db,keyobj,dictGetVal(de),
+        HASH_ACTIVE_EXPIRE_FIELDS_PER_CALL,&keyremoved);
+    decrRefCount(keyobj);
+    return expired;
+}
+
 /*-----------------------------------------------------------------------------
  * Hash type commands
  *----------------------------------------------------------------------------*/
@@ -539,8 +884,10 @@ void hsetCommand(client *c) {
     if ((o = hashTypeLookupWriteOrCreate(c,c->argv[1])) == NULL) return;
     hashTypeTryConversion(o,c->argv,2,c->argc-1);
 
-    for (i = 2; i < c->argc; i += 2)
+    for (i = 2; i < c->argc; i += 2) {
+        hashTypeRemoveFieldExpire(c->db,c->argv[1]->ptr,c->argv[i]->ptr);
         created += !hashTypeSet(o,c->argv[i]->ptr,c->argv[i+1]->ptr,HASH_SET_COPY);
+    }
 
     /* HMSET (deprecated) and HSET return value is different. */
     char *cmdname = c->argv[0]->ptr;
@@ -584,6 +931,7 @@ void hincrbyCommand(client *c) {
     }
     value += incr;
     new = sdsfromlonglong(value);
+    hashTypeRemoveFieldExpire(c->db,c->argv[1]->ptr,c->argv[2]->ptr);
     hashTypeSet(o,c->argv[2]->ptr,new,HASH_SET_TAKE_VALUE);
     addReplyLongLong(c,value);
     signalModifiedKey(c->db,c->argv[1]);
@@ -623,6 +971,7 @@ void hincrbyfloatCommand(client *c) {
     char buf[MAX_LONG_DOUBLE_CHARS];
     int len = ld2string(buf,sizeof(buf),value,1);
     new = sdsnewlen(buf,len);
+    hashTypeRemoveFieldExpire(c->db,c->argv[1]->ptr,c->argv[2]->ptr);
     hashTypeSet(o,c->argv[2]->ptr,new,HASH_SET_TAKE_VALUE);
     addReplyBulkCBuffer(c,buf,len);
     signalModifiedKey(c->db,c->argv[1]);
@@ -644,17 +993,17 @@ void hincrbyfloatCommand(client *c) {
 static void addHashFieldToReply(client *c, robj *o, sds field) {
     int ret;
 
-    if (o == NULL) {
+    if (o == NULL || hashTypeFieldIsExpired(c->db,c->argv[1]->ptr,field)) {
         addReply(c, shared.nullbulk);
         return;
     }
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        ret = hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll);
+        ret = hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll);
         if (ret < 0) {
             addReply(c, shared.nullbulk);
         } else {
@@ -712,6 +1061,7 @@ void hdelCommand(client *c) {
 
     for (j = 2; j < c->argc; j++) {
         if (hashTypeDelete(o,c->argv[j]->ptr)) {
+            hashTypeRemoveFieldExpire(c->db,c->argv[1]->ptr,c->argv[j]->ptr);
             deleted++;
             if (hashTypeLength(o) == 0) {
                 dbDelete(c->db,c->argv[1]);
@@ -737,7 +1087,9 @@ void hlenCommand(client *c) {
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,OBJ_HASH)) return;
 
-    addReplyLongLong(c,hashTypeLength(o));
+    addReplyLongLong(c,hashTypeLength(o)-
+                       (hashTypeHideExpiredFields() ?
+                        hashTypeCountExpiredFields(c->db,c->argv[1]->ptr) : 0));
 }
 
 void hstrlenCommand(client *c) {
@@ -745,16 +1097,20 @@ void hstrlenCommand(client *c) {
 
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,OBJ_HASH)) return;
+    if (hashTypeFieldIsExpired(c->db,c->argv[1]->ptr,c->argv[2]->ptr)) {
+        addReply(c,shared.czero);
+        return;
+    }
     addReplyLongLong(c,hashTypeGetValueLength(o,c->argv[2]->ptr));
 }
 
 static void addHashIteratorCursorToReply(client *c, hashTypeIterator *hi, int what) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        hashTypeCurrentFromZiplist(hi, what, &vstr, &vlen, &vll);
+        hashTypeCurrentFromListpack(hi, what, &vstr, &vlen, &vll);
         if (vstr)
             addReplyBulkCBuffer(c, vstr, vlen);
         else
@@ -772,6 +1128,7 @@ void genericHgetallCommand(client *c, int flags) {
     hashTypeIterator *hi;
     int multiplier = 0;
     int length, count = 0;
+    unsigned long expired = 0;
 
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.emptymultibulk)) == NULL
         || checkType(c,o,OBJ_HASH)) return;
@@ -779,11 +1136,21 @@ void genericHgetallCommand(client *c, int flags) {
     if (flags & OBJ_HASH_KEY) multiplier++;
     if (flags & OBJ_HASH_VALUE) multiplier++;
 
-    length = hashTypeLength(o) * multiplier;
+    /* On slaves skip the fields that expired, see hashTypeFieldIsExpired(). */
+    if (hashTypeHideExpiredFields())
+        expired = hashTypeCountExpiredFields(c->db,c->argv[1]->ptr);
+    length = (hashTypeLength(o)-expired) * multiplier;
     addReplyMultiBulkLen(c, length);
 
     hi = hashTypeInitIterator(o);
     while (hashTypeNext(hi) != C_ERR) {
+        if (expired) {
+            sds field = hashTypeCurrentObjectNewSds(hi,OBJ_HASH_KEY);
+            int skip = hashTypeFieldIsExpired(c->db,c->argv[1]->ptr,field);
+
+            sdsfree(field);
+            if (skip) continue;
+        }
         if (flags & OBJ_HASH_KEY) {
             addHashIteratorCursorToReply(c, hi, OBJ_HASH_KEY);
             count++;
@@ -815,7 +1182,9 @@ void hexistsCommand(client *c) {
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,OBJ_HASH)) return;
 
-    addReply(c, hashTypeExists(o,c->argv[2]->ptr) ? shared.cone : shared.czero);
+    addReply(c, hashTypeExists(o,c->argv[2]->ptr) &&
+                !hashTypeFieldIsExpired(c->db,c->argv[1]->ptr,c->argv[2]->ptr) ?
+                shared.cone : shared.czero);
 }
 
 void hscanCommand(client *c) {
@@ -827,3 +1196,209 @@ void hscanCommand(client *c) {
         checkType(c,o,OBJ_HASH)) return;
     scanGenericCommand(c,o,cursor);
 }
+
+/* Parse the "FIELDS numfields field [field ...]" arguments of the hash field
+ * expire commands, starting at 'pos'. On success the index of the first
+ * field is returned, otherwise -1 is returned and an error is sent to the
+ * client. */
+static int hashFieldsArgumentsOrReply(client *c, int pos) {
+    long long numfields;
+
+    if (strcasecmp(c->argv[pos]->ptr,"fields")) {
+        addReply(c,shared.syntaxerr);
+        return -1;
+    }
+    if (getLongLongFromObjectOrReply(c,c->argv[pos+1],&numfields,
+        "numfields is not an integer or out of range") != C_OK) return -1;
+    if (numfields <= 0 || numfields != c->argc-pos-2) {
+        addReplyError(c,"numfields must match the number of fields");
+        return -1;
+    }
+    return pos+2;
+}
+
+/* HEXPIRE key seconds FIELDS numfields field [field ...]
+ * HPEXPIRE key milliseconds FIELDS numfields field [field ...]
+ * HEXPIREAT key timestamp FIELDS numfields field [field ...]
+ * HPEXPIREAT key ms-timestamp FIELDS numfields field [field ...]
+ *
+ * Reply with an array containing for every field -2 if the field does not
+ * exist, 1 if the expire was set, or 2 if the field was deleted since the
+ * time is in the past. Like for EXPIRE the command is propagated as an
+ * HPEXPIREAT with an absolute time, or as an HDEL of the deleted fields. */
+void hexpireGenericCommand(client *c, long long basetime, int unit) {
+    robj *key = c->argv[1], *o;
+    long long when;
+    int first, j, set = 0, keyremoved = 0;
+    robj **deleted = NULL;
+    int numdeleted = 0;
+
+    if (getLongLongFromObjectOrReply(c,c->argv[2],&when,NULL) != C_OK)
+        return;
+    if ((first = hashFieldsArgumentsOrReply(c,3)) == -1) return;
+    if (when < 0 ||
+        (unit == UNIT_SECONDS && when > LLONG_MAX/1000) ||
+        (unit == UNIT_SECONDS ? when*1000 : when) > LLONG_MAX-basetime)
+    {
+        addReplyError(c,"invalid expire time");
+        return;
+    }
+    if (unit == UNIT_SECONDS) when *= 1000;
+    when += basetime;
+
+    if ((o = lookupKeyWrite(c->db,key)) == NULL) {
+        addReplyMultiBulkLen(c,c->argc-first);
+        for (j = first; j < c->argc; j++) addReplyLongLong(c,-2);
+        return;
+    }
+    if (checkType(c,o,OBJ_HASH)) return;
+
+    /* As for keys, a time in the past deletes the fields, unless we are
+     * loading the AOF or in the context of a slave: in that case the expire
+     * is set anyway, and we wait for the HDEL of the master. */
+    int delete = when <= mstime() && !server.loading && !server.masterhost;
+
+    addReplyMultiBulkLen(c,c->argc-first);
+    for (j = first; j < c->argc; j++) {
+        sds field = c->argv[j]->ptr;
+
+        if (keyremoved || !hashTypeExists(o,field)) {
+            addReplyLongLong(c,-2);
+        } else if (delete) {
+            hashTypeRemoveFieldExpire(c->db,key->ptr,field);
+            hashTypeDelete(o,field);
+            deleted = zrealloc(deleted,sizeof(robj*)*(numdeleted+3));
+            deleted[2+numdeleted++] = c->argv[j];
+            incrRefCount(c->argv[j]);
+            addReplyLongLong(c,2);
+            if (hashTypeLength(o) == 0) {
+                dbDelete(c->db,key);
+                keyremoved = 1;
+            }
+        } else {
+            hashTypeSetFieldExpire(c->db,key->ptr,field,when);
+            addReplyLongLong(c,1);
+            set++;
+        }
+    }
+
+    if (numdeleted) {
+        /* Replicate/AOF this as an explicit HDEL. */
+        deleted[0] = createStringObject("HDEL",4);
+        deleted[1] = key;
+        incrRefCount(key);
+        replaceClientCommandVector(c,2+numdeleted,deleted);
+        key = c->argv[1];
+        signalModifiedKey(c->db,key);
+        notifyKeyspaceEvent(NOTIFY_HASH,"hdel",key,c->db->id);
+        if (keyremoved)
+            notifyKeyspaceEvent(NOTIFY_GENERIC,"del",key,c->db->id);
+        server.dirty += numdeleted;
+    } else if (set) {
+        /* Replicate/AOF this as an HPEXPIREAT with the absolute time, so
+         * that the fields expire at the same time everywhere. */
+        robj *aux = createStringObject("HPEXPIREAT",10);
+        rewriteClientCommandArgument(c,0,aux);
+        decrRefCount(aux);
+        aux = createStringObjectFromLongLong(when);
+        rewriteClientCommandArgument(c,2,aux);
+        decrRefCount(aux);
+        signalModifiedKey(c->db,key);
+        notifyKeyspaceEvent(NOTIFY_HASH,"hexpire",key,c->db->id);
+        server.dirty += set;
+    }
+}
+
+/* HEXPIRE key seconds FIELDS numfields field [field ...] */
+void hexpireCommand(client *c) {
+    hexpireGenericCommand(c,mstime(),UNIT_SECONDS);
+}
+
+/* HPEXPIRE key milliseconds FIELDS numfields field [field ...] */
+void hpexpireCommand(client *c) {
+    hexpireGenericCommand(c,mstime(),UNIT_MILLISECONDS);
+}
+
+/* HEXPIREAT key timestamp FIELDS numfields field [field ...] */
+void hexpireatCommand(client *c) {
+    hexpireGenericCommand(c,0,UNIT_SECONDS);
+}
+
+/* HPEXPIREAT key ms-timestamp FIELDS numfields field [field ...] */
+void hpexpireatCommand(client *c) {
+    hexpireGenericCommand(c,0,UNIT_MILLISECONDS);
+}
+
+/* Implements HTTL and HPTTL. Reply with an array containing for every field
+ * -2 if the field does not exist, -1 if it has no expire, or its TTL. */
+void httlGenericCommand(client *c, int output_ms) {
+    robj *o;
+    int first, j;
+
+    if ((first = hashFieldsArgumentsOrReply(c,2)) == -1) return;
+    o = lookupKeyReadWithFlags(c->db,c->argv[1],LOOKUP_NOTOUCH);
+    if (o != NULL && checkType(c,o,OBJ_HASH)) return;
+
+    addReplyMultiBulkLen(c,c->argc-first);
+    for (j = first; j < c->argc; j++) {
+        sds field = c->argv[j]->ptr;
+        long long expire, ttl;
+
+        if (o == NULL || !hashTypeExists(o,field) ||
+            hashTypeFieldIsExpired(c->db,c->argv[1]->ptr,field))
+        {
+            addReplyLongLong(c,-2);
+            continue;
+        }
+        expire = hashTypeGetFieldExpire(c->db,c->argv[1]->ptr,field);
+        if (expire == -1) {
+            addReplyLongLong(c,-1);
+            continue;
+        }
+        ttl = expire-mstime();
+        if (ttl < 0) ttl = 0;
+        addReplyLongLong(c,output_ms ? ttl : ((ttl+500)/1000));
+    }
+}
+
+/* HTTL key FIELDS numfields field [field ...] */
+void httlCommand(client *c) {
+    httlGenericCommand(c,0);
+}
+
+/* HPTTL key FIELDS numfields field [field ...] */
+void hpttlCommand(client *c) {
+    httlGenericCommand(c,1);
+}
+
+/* HPERSIST key FIELDS numfields field [field ...]
+ *
+ * Reply with an array containing for every field -2 if the field does not
+ * exist, -1 if it has no expire, or 1 if the expire was removed. */
+void hpersistCommand(client *c) {
+    robj *o;
+    int first, j, removed = 0;
+
+    if ((first = hashFieldsArgumentsOrReply(c,2)) == -1) return;
+    o = lookupKeyWrite(c->db,c->argv[1]);
+    if (o != NULL && checkType(c,o,OBJ_HASH)) return;
+
+    addReplyMultiBulkLen(c,c->argc-first);
+    for (j = first; j < c->argc; j++) {
+        sds field = c->argv[j]->ptr;
+
+        if (o == NULL || !hashTypeExists(o,field)) {
+            addReplyLongLong(c,-2);
+        } else if (hashTypeRemoveFieldExpire(c->db,c->argv[1]->ptr,field)) {
+            addReplyLongLong(c,1);
+            removed++;
+        } else {
+            addReplyLongLong(c,-1);
+        }
+    }
+    if (removed) {
+        signalModifiedKey(c->db,c->argv[1]);
+        notifyKeyspaceEvent(NOTIFY_HASH,"hpersist",c->argv[1],c->db->id);
+        server.dirty += removed;
+    }
+}
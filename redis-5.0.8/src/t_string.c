@@ -83,7 +83,7 @@ void setGenericCommand(client *c, int flags, robj *key, robj *val, robj *expire,
         addReply(c, abort_reply ? abort_reply : shared.nullbulk);
         return;
     }
-    setKey(c->db,key,val);
+    genericSetKey(c->db,key,val,expire != NULL);
     server.dirty++;
     if (expire) setExpire(c,c->db,key,mstime()+milliseconds);
     notifyKeyspaceEvent(NOTIFY_STRING,"set",key,c->db->id);
@@ -287,7 +287,10 @@ void mgetCommand(client *c) {
 
     addReplyMultiBulkLen(c,c->argc-1);
     for (j = 1; j < c->argc; j++) {
-        robj *o = lookupKeyRead(c->db,c->argv[j]);
+        robj *o;
+
+        prefetchCommandKeys(c,1,j,1);
+        o = lookupKeyRead(c->db,c->argv[j]);
         if (o == NULL) {
             addReply(c,shared.nullbulk);
         } else {
@@ -312,6 +315,7 @@ void msetGenericCommand(client *c, int nx) {
      * set anything if at least one key alerady exists. */
     if (nx) {
         for (j = 1; j < c->argc; j += 2) {
+            prefetchCommandKeys(c,1,j,2);
             if (lookupKeyWrite(c->db,c->argv[j]) != NULL) {
                 addReply(c, shared.czero);
                 return;
@@ -320,6 +324,7 @@ void msetGenericCommand(client *c, int nx) {
     }
 
     for (j = 1; j < c->argc; j += 2) {
+        prefetchCommandKeys(c,1,j,2);
         c->argv[j+1] = tryObjectEncoding(c->argv[j+1]);
         setKey(c->db,c->argv[j],c->argv[j+1]);
         notifyKeyspaceEvent(NOTIFY_STRING,"set",c->argv[j],c->db->id);
@@ -360,6 +365,8 @@ void incrDecrCommand(client *c, long long incr) {
         o->ptr = (void*)((long)value);
     } else {
         new = createStringObjectFromLongLongForValue(value);
+        new = dbCompactValue(c->argv[1],new,
+                             o && getExpire(c->db,c->argv[1]) != -1);
         if (o) {
             dbOverwrite(c->db,c->argv[1],new);
         } else {
@@ -412,6 +419,8 @@ void incrbyfloatCommand(client *c) {
         return;
     }
     new = createStringObjectFromLongDouble(value,1);
+    new = dbCompactValue(c->argv[1],new,
+                         o && getExpire(c->db,c->argv[1]) != -1);
     if (o)
         dbOverwrite(c->db,c->argv[1],new);
     else
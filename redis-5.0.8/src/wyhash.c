@@ -0,0 +1,125 @@
+/*
+   wyhash, a fast non cryptographic hash function.
+
+   Based on the final version 4 of wyhash by Wang Yi <godspeed_china@yeah.net>,
+   released into the public domain (The Unlicense):
+   <https://github.com/wangyi-fudan/wyhash>
+
+   ----------------------------------------------------------------------------
+
+   This version was adapted for Redis in the following ways:
+
+   1. Only the hash function itself is provided, with the default secret.
+   2. The seed is mixed with the secret once, by wyhashSeed(), and not at
+      every call: the hash tables always use the same seed, derived from the
+      16 bytes random seed of dict.c.
+   3. The 64x64 -> 128 bits multiplication uses the compiler 128 bits type
+      when available, otherwise a portable implementation.
+   4. Reads are performed with memcpy() so that they work on any CPU. The
+      value of the hash depends on the endianess, which is fine since it is
+      never stored nor sent to other hosts.
+
+   Unlike SipHash, wyhash is not designed to resist hash flooding attacks
+   from clients able to guess the seed, or to find collisions that are
+   independent from the seed: it is about twice as fast with short strings,
+   so it makes sense only when the clients are trusted.
+ */
+#include <stdint.h>
+#include <string.h>
+
+static const uint64_t wyhash_secret[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+    0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
+
+/* Multiply A and B, storing the low 64 bits of the result in A and the high
+ * 64 bits in B. */
+static inline void wymum(uint64_t *A, uint64_t *B) {
+#if defined(__SIZEOF_INT128__)
+    __extension__ typedef unsigned __int128 uint128;
+    uint128 r = *A;
+
+    r *= *B;
+    *A = (uint64_t)r;
+    *B = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *A >> 32, hb = *B >> 32;
+    uint64_t la = (uint32_t)*A, lb = (uint32_t)*B;
+    uint64_t rh = ha*hb, rm0 = ha*lb, rm1 = hb*la, rl = la*lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+
+    c += lo < t;
+    *A = lo;
+    *B = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t wymix(uint64_t A, uint64_t B) {
+    wymum(&A,&B);
+    return A^B;
+}
+
+static inline uint64_t wyr8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v,p,8);
+    return v;
+}
+
+static inline uint64_t wyr4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v,p,4);
+    return v;
+}
+
+/* Read 1 to 3 bytes. */
+static inline uint64_t wyr3(const uint8_t *p, size_t k) {
+    return (((uint64_t)p[0]) << 16) | (((uint64_t)p[k>>1]) << 8) | p[k-1];
+}
+
+/* Turn the 16 bytes seed 'k' into the seed used by wyhash(). */
+uint64_t wyhashSeed(const uint8_t *k) {
+    uint64_t seed = wyr8(k) ^ wymix(wyr8(k+8),wyhash_secret[2]);
+    return seed ^ wymix(seed^wyhash_secret[0],wyhash_secret[1]);
+}
+
+uint64_t wyhash(const uint8_t *in, const size_t inlen, uint64_t seed) {
+    const uint8_t *p = in;
+    size_t i = inlen;
+    uint64_t a, b;
+
+    if (inlen <= 16) {
+        if (inlen >= 4) {
+            a = (wyr4(p) << 32) | wyr4(p+((inlen>>3)<<2));
+            b = (wyr4(p+inlen-4) << 32) | wyr4(p+inlen-4-((inlen>>3)<<2));
+        } else if (inlen > 0) {
+            a = wyr3(p,inlen);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wymix(wyr8(p)^wyhash_secret[1],wyr8(p+8)^seed);
+                see1 = wymix(wyr8(p+16)^wyhash_secret[2],wyr8(p+24)^see1);
+                see2 = wymix(wyr8(p+32)^wyhash_secret[3],wyr8(p+40)^see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1^see2;
+        }
+        while (i > 16) {
+            seed = wymix(wyr8(p)^wyhash_secret[1],wyr8(p+8)^seed);
+            i -= 16;
+            p += 16;
+        }
+        a = wyr8(p+i-16);
+        b = wyr8(p+i-8);
+    }
+    a ^= wyhash_secret[1];
+    b ^= seed;
+    wymum(&a,&b);
+    return wymix(a^wyhash_secret[0]^inlen,b^wyhash_secret[1]);
+}
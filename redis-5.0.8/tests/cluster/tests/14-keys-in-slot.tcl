@@ -0,0 +1,77 @@
+# Check the keyspace of cluster nodes, that has a hash table per slot.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 1 node cluster" {
+    create_cluster 1 0
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+set slot [R 0 cluster keyslot {tag}]
+
+test "Keys are counted and listed per slot" {
+    for {set j 0} {$j < 100} {incr j} {
+        R 0 set "{tag}:$j" $j
+    }
+    for {set j 0} {$j < 1000} {incr j} {
+        R 0 set "key:$j" $j
+    }
+    assert {[R 0 dbsize] == 1100}
+    assert {[R 0 cluster countkeysinslot $slot] == 100}
+    assert {[llength [R 0 cluster getkeysinslot $slot 10]] == 10}
+    set keys [R 0 cluster getkeysinslot $slot 1000]
+    assert {[llength $keys] == 100}
+    foreach key $keys {
+        assert {[string match "{tag}:*" $key]}
+    }
+    R 0 del "{tag}:0"
+    assert {[R 0 cluster countkeysinslot $slot] == 99}
+}
+
+test "SCAN and KEYS return every key" {
+    set cursor 0
+    set keys {}
+    while 1 {
+        set res [R 0 scan $cursor count 50]
+        set cursor [lindex $res 0]
+        lappend keys {*}[lindex $res 1]
+        if {$cursor == 0} break
+    }
+    assert {[llength [lsort -unique $keys]] == 1099}
+    assert {[llength [R 0 keys *]] == 1099}
+}
+
+test "RANDOMKEY returns existing keys" {
+    for {set j 0} {$j < 100} {incr j} {
+        assert {[R 0 exists [R 0 randomkey]] == 1}
+    }
+}
+
+test "Keys are expired from the slot tables" {
+    for {set j 0} {$j < 100} {incr j} {
+        R 0 set "{exp}:$j" $j px 100
+    }
+    wait_for_condition 50 100 {
+        [R 0 dbsize] == 1099
+    } else {
+        fail "The volatile keys were not expired"
+    }
+    assert {[R 0 cluster countkeysinslot [R 0 cluster keyslot {exp}]] == 0}
+}
+
+test "Keys in slot are preserved by DEBUG RELOAD" {
+    set digest [R 0 debug digest]
+    R 0 debug reload
+    assert {[R 0 debug digest] eq $digest}
+    assert {[R 0 cluster countkeysinslot $slot] == 99}
+}
+
+test "Keys in slot are removed by FLUSHALL" {
+    R 0 flushall async
+    assert {[R 0 dbsize] == 0}
+    assert {[R 0 cluster countkeysinslot $slot] == 0}
+    assert {[R 0 cluster getkeysinslot $slot 10] eq {}}
+}
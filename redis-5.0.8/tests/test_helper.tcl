@@ -26,6 +26,7 @@ set ::all_tests {
     unit/type/set
     unit/type/zset
     unit/type/hash
+    unit/type/hash-field-expire
     unit/type/stream
     unit/type/stream-cgroups
     unit/sort
@@ -62,6 +63,7 @@ set ::all_tests {
     unit/lazyfree
     unit/wait
     unit/pendingquerybuf
+    unit/networking
 }
 # Index to the next test to run in the ::all_tests list.
 set ::next_test 0
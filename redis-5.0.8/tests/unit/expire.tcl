@@ -152,14 +152,35 @@ start_server {tags {"expire"}} {
         r psetex key2 500 a
         r psetex key3 500 a
         set size1 [r dbsize]
-        # Redis expires random keys ten times every second so we are
-        # fairly sure that all the three keys should be evicted after
+        # Redis expires the keys that are due ten times every second so we
+        # are fairly sure that all the three keys should be evicted after
         # one second.
         after 1000
         set size2 [r dbsize]
         list $size1 $size2
     } {3 0}
 
+    test {Active expire reclaims due keys among many keys with a long TTL} {
+        r flushdb
+        r debug populate 20000 long 1
+        for {set j 0} {$j < 20000} {incr j} {
+            r pexpire long:$j 1000000
+        }
+        for {set j 0} {$j < 1000} {incr j} {
+            r psetex short:$j [expr {100+$j%200}] a
+        }
+        # Only 5% of the keys with an expire are due, so random sampling
+        # alone would take a long time to find them all.
+        wait_for_condition 100 100 {
+            [r dbsize] == 20000
+        } else {
+            fail "Keys with a short TTL were not actively expired"
+        }
+        # The keys with a long TTL were all kept.
+        assert_equal 3 [r exists long:0 long:10000 long:19999]
+        assert {[r ttl long:0] > 0}
+    }
+
     test {Redis should lazy expire keys} {
         r flushdb
         r debug set-active-expire 0
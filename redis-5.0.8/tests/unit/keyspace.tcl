@@ -273,3 +273,342 @@ start_server {tags {"keyspace"}} {
         r keys *
     } {dlskeriewrioeuwqoirueioqwrueoqwrueqw}
 }
+
+start_server {tags {"keyspace"} overrides {keyspace-open-addressing yes}} {
+    test {Open addressing keyspace: CONFIG GET} {
+        lindex [r config get keyspace-open-addressing] 1
+    } {yes}
+
+    test {Open addressing keyspace: add, lookup, expire and delete} {
+        r flushdb
+        for {set j 0} {$j < 5000} {incr j} {
+            r set key:$j $j
+            if {$j % 2} {r expire key:$j 1000}
+        }
+        assert_equal 5000 [r dbsize]
+        for {set j 0} {$j < 5000} {incr j 7} {
+            assert_equal $j [r get key:$j]
+            set ttl [r ttl key:$j]
+            if {$j % 2} {
+                assert {$ttl > 990 && $ttl <= 1000}
+            } else {
+                assert_equal -1 $ttl
+            }
+        }
+        for {set j 0} {$j < 5000} {incr j 3} {
+            r del key:$j
+        }
+        assert_equal [expr {5000-1667}] [r dbsize]
+        assert_equal {} [r get key:3]
+        assert_equal 1 [r get key:1]
+        assert_equal 4 [r get key:4]
+        r set key:3 again
+        assert_equal again [r get key:3]
+        r pexpire key:3 1
+        after 10
+        assert_equal {} [r get key:3]
+    }
+
+    test {Open addressing keyspace: SCAN and KEYS return every key} {
+        r flushdb
+        r debug populate 10000
+        set keys {}
+        set cur 0
+        while 1 {
+            set res [r scan $cur count 20]
+            set cur [lindex $res 0]
+            lappend keys {*}[lindex $res 1]
+            # Keep the table changing while scanning.
+            r set extra:[llength $keys] x
+            if {$cur == 0} break
+        }
+        set keys [lsort -unique $keys]
+        set count 0
+        foreach k $keys {if {[string match key:* $k]} {incr count}}
+        assert_equal 10000 $count
+        assert_equal 10000 [llength [r keys key:*]]
+    }
+
+    test {Open addressing keyspace: RANDOMKEY, UNLINK and FLUSHALL ASYNC} {
+        r flushdb
+        r debug populate 1000
+        for {set j 0} {$j < 100} {incr j} {
+            assert_match {key:*} [r randomkey]
+        }
+        r lpush biglist {*}[lrepeat 100 x]
+        r config set lazyfree-lazy-server-del yes
+        assert_equal 1 [r unlink biglist]
+        assert_equal 0 [r exists biglist]
+        r set key:0 overwritten
+        assert_equal overwritten [r get key:0]
+        r config set lazyfree-lazy-server-del no
+        r flushall async
+        assert_equal 0 [r dbsize]
+        r set foo bar
+        assert_equal bar [r get foo]
+    }
+
+    test {Open addressing keyspace: DEBUG RELOAD and DEBUG HTSTATS} {
+        r flushdb
+        r debug populate 1000
+        r expire key:10 1000
+        r debug reload
+        assert_equal 1000 [r dbsize]
+        assert_equal 1000 [r ttl key:10]
+        set stats [r debug htstats 9]
+        assert_match {*tombstones:*} $stats
+        assert_match {*avg probe length:*} $stats
+        assert {[dict get [r memory stats] db.9 overhead.hashtable.main] > 0}
+    }
+}
+
+start_server {tags {"keyspace"} overrides {keyspace-segmented-tables yes}} {
+    test {Segmented keyspace: CONFIG GET} {
+        lindex [r config get keyspace-segmented-tables] 1
+    } {yes}
+
+    test {Segmented keyspace: add, lookup and delete while rehashing} {
+        r flushdb
+        r config set activerehashing no
+        for {set j 0} {$j < 5000} {incr j} {
+            r set key:$j $j
+            if {$j % 2} {r expire key:$j 1000}
+        }
+        r debug populate 20000 big
+        assert_equal 25000 [r dbsize]
+        for {set j 0} {$j < 5000} {incr j 3} {
+            r del key:$j
+        }
+        for {set j 0} {$j < 5000} {incr j} {
+            assert_equal [expr {$j % 3 ? $j : {}}] [r get key:$j]
+        }
+        assert {[dict get [r memory stats] db.9 overhead.hashtable.rehashing] >= 0}
+        r config set activerehashing yes
+        wait_for_condition 50 100 {
+            [dict get [r memory stats] db.9 overhead.hashtable.rehashing] == 0
+        } else {
+            fail "The keyspace tables are still rehashing"
+        }
+        assert_equal 3334 [r get key:3334]
+    }
+
+    test {Segmented keyspace: SCAN returns every key} {
+        r flushdb
+        r debug populate 10000
+        set keys {}
+        set cur 0
+        while 1 {
+            set res [r scan $cur count 20]
+            set cur [lindex $res 0]
+            lappend keys {*}[lindex $res 1]
+            r set extra:[llength $keys] x
+            if {$cur == 0} break
+        }
+        set keys [lsort -unique $keys]
+        set count 0
+        foreach k $keys {if {[string match key:* $k]} {incr count}}
+        assert_equal 10000 $count
+    }
+
+    test {Segmented keyspace: RANDOMKEY, FLUSHALL ASYNC and DEBUG RELOAD} {
+        r flushdb
+        r debug populate 3000
+        for {set j 0} {$j < 100} {incr j} {
+            assert_match {key:*} [r randomkey]
+        }
+        r debug reload
+        assert_equal 3000 [r dbsize]
+        assert_match {*table size: 4096*} [r debug htstats 9]
+        r flushall async
+        assert_equal 0 [r dbsize]
+        r set foo bar
+        assert_equal bar [r get foo]
+    }
+}
+
+start_server {tags {"keyspace"} overrides {data-hash-function wyhash}} {
+    test {Wyhash data hash function: CONFIG GET} {
+        lindex [r config get data-hash-function] 1
+    } {wyhash}
+
+    test {Wyhash data hash function: keys, sets, hashes and sorted sets} {
+        r flushdb
+        r debug populate 5000
+        for {set j 0} {$j < 1000} {incr j} {
+            r sadd set $j
+            r hset hash field:$j $j
+            r zadd zset $j member:$j
+        }
+        assert_encoding hashtable set
+        assert_encoding hashtable hash
+        assert_encoding skiplist zset
+        assert_equal 5003 [r dbsize]
+        assert_equal value:4999 [r get key:4999]
+        assert_equal {1 0} [list [r sismember set 999] [r sismember set 1000]]
+        assert_equal 500 [r hget hash field:500]
+        assert_equal 700 [r zscore zset member:700]
+        assert_equal 2000 [r zunionstore zset2 2 zset set]
+        r debug reload
+        assert_equal 5004 [r dbsize]
+        assert_equal 1000 [r scard set]
+        assert_equal 999 [r hget hash field:999]
+        assert_equal 1111 [llength [r keys key:1*]]
+    }
+}
+
+start_server {tags {"keyspace"} overrides {keyspace-compact-entries yes}} {
+    test {Compact entries: CONFIG GET and SET} {
+        assert_equal {keyspace-compact-entries yes} \
+            [r config get keyspace-compact-entries]
+        r config set keyspace-compact-entries no
+        r set plain somevalue
+        r config set keyspace-compact-entries yes
+        r set compact somevalue
+        assert_match {*key_zmalloc: 0,*} [r debug sdslen compact]
+        assert {![string match {*key_zmalloc: 0,*} [r debug sdslen plain]]}
+        assert_equal [r get plain] [r get compact]
+    }
+
+    test {Compact entries: overwrites keep the key and its TTL} {
+        r flushdb
+        r set foo bar ex 100
+        r set foo 12345
+        assert_equal -1 [r ttl foo]
+        r expire foo 100
+        r incrby foo 100000
+        r incrbyfloat foo 0.5
+        assert_equal 112345.5 [r get foo]
+        r append foo xyz
+        assert_equal 112345.5xyz [r get foo]
+        assert_encoding raw foo
+        set ttl [r ttl foo]
+        assert {$ttl > 90 && $ttl <= 100}
+        r set foo [string repeat x 100]
+        r set foo 7
+        assert_equal 7 [r get foo]
+        assert_equal 1 [r dbsize]
+    }
+
+    test {Compact entries: RENAME, MOVE, expire and DEBUG RELOAD} {
+        r flushdb
+        r select 10
+        r flushdb
+        r select 9
+        for {set j 0} {$j < 1000} {incr j} {
+            r set key:$j value:$j
+            if {$j % 2} {r expire key:$j 1000}
+        }
+        r rename key:1 renamed
+        r move key:2 10
+        assert_equal value:1 [r get renamed]
+        set ttl [r ttl renamed]
+        assert {$ttl > 900 && $ttl <= 1000}
+        r select 10
+        assert_equal value:2 [r get key:2]
+        r select 9
+        r persist key:3
+        assert_equal -1 [r ttl key:3]
+        r debug reload
+        assert_equal 999 [r dbsize]
+        set volatile 0
+        foreach k [r keys key:*] {
+            if {[r ttl $k] > 0} {incr volatile}
+        }
+        assert_equal 498 $volatile
+        assert_equal value:999 [r get key:999]
+        assert_encoding embstr key:999
+        r del renamed key:999
+        assert_equal 997 [r dbsize]
+    }
+}
+
+proc keyspace_expires {} {
+    regexp {db9:keys=[0-9]+,expires=([0-9]+)} [r info keyspace] - expires
+    return $expires
+}
+
+foreach compact {no yes} {
+    start_server [list tags {"keyspace"} overrides [list keyspace-compact-entries $compact]] {
+        test "Keyspace expires: the index follows the keyspace (compact $compact)" {
+            r flushdb
+            for {set j 0} {$j < 3000} {incr j} {
+                if {$j % 3 == 0} {
+                    r set key:$j $j ex 1000
+                } elseif {$j % 3 == 1} {
+                    r set key:$j $j
+                    r expire key:$j 1000
+                } else {
+                    r set key:$j $j
+                }
+            }
+            assert_equal 2000 [keyspace_expires]
+            for {set j 0} {$j < 300} {incr j} {
+                r persist key:$j
+                r del key:[expr {$j+300}]
+                r set key:[expr {$j+600}] again
+                r incr key:[expr {$j+900}]
+                r expire key:[expr {$j+1200}] 2000
+            }
+            # 200 persisted, 200 deleted, 200 reset by SET, 100 new.
+            assert_equal 1500 [keyspace_expires]
+            set ttl [r ttl key:1200]
+            assert {$ttl > 1900 && $ttl <= 2000}
+            set ttl [r ttl key:901]
+            assert {$ttl > 900 && $ttl <= 1000}
+            assert_equal 902 [r get key:901]
+            r debug reload
+            assert_equal 1500 [keyspace_expires]
+            assert_equal 2700 [r dbsize]
+            r swapdb 9 10
+            assert_equal 0 [r dbsize]
+            r swapdb 9 10
+            assert_equal 1500 [keyspace_expires]
+            r flushdb
+            r set foo bar
+            r expire foo 100
+            assert_equal 1 [keyspace_expires]
+        }
+
+        test "Keyspace expires: RENAME and MOVE keep the TTL (compact $compact)" {
+            r flushdb
+            r select 10
+            r flushdb
+            r select 9
+            r set foo bar ex 100
+            r set small 1 ex 100
+            r move foo 10
+            r rename small renamed
+            r set foo other
+            assert_equal {-1 1} [list [r ttl foo] [r get renamed]]
+            set ttl [r ttl renamed]
+            assert {$ttl > 90 && $ttl <= 100}
+            r select 10
+            assert_equal bar [r get foo]
+            set ttl [r ttl foo]
+            assert {$ttl > 90 && $ttl <= 100}
+            r move foo 9
+            r select 9
+            assert_equal 1 [r exists foo]
+            set ttl [r ttl renamed]
+            assert {$ttl > 90 && $ttl <= 100}
+            assert_equal 1 [keyspace_expires]
+        }
+
+        test "Keyspace expires: active expiry reclaims the volatile keys (compact $compact)" {
+            r flushdb
+            set expired [s expired_keys]
+            for {set j 0} {$j < 2000} {incr j} {
+                r psetex volatile:$j 100 $j
+                r set persistent:$j $j
+            }
+            wait_for_condition 50 100 {
+                [r dbsize] == 2000
+            } else {
+                fail "The volatile keys were not expired"
+            }
+            assert_equal 0 [keyspace_expires]
+            assert_equal 2000 [expr {[s expired_keys]-$expired}]
+            assert_equal 1999 [r get persistent:1999]
+        }
+    }
+}
@@ -24,7 +24,8 @@ start_server {tags {"maxmemory"}} {
     }
 
     foreach policy {
-        allkeys-random allkeys-lru allkeys-lfu volatile-lru volatile-lfu volatile-random volatile-ttl
+        allkeys-random allkeys-lru allkeys-lfu allkeys-gdsf volatile-lru
+        volatile-lfu volatile-gdsf volatile-random volatile-ttl
     } {
         test "maxmemory - is the memory limit honoured? (policy $policy)" {
             # make sure to start with a blank instance
@@ -56,7 +57,8 @@ start_server {tags {"maxmemory"}} {
     }
 
     foreach policy {
-        allkeys-random allkeys-lru volatile-lru volatile-random volatile-ttl
+        allkeys-random allkeys-lru allkeys-gdsf volatile-lru volatile-gdsf
+        volatile-random volatile-ttl
     } {
         test "maxmemory - only allkeys-* should remove non-volatile keys ($policy)" {
             # make sure to start with a blank instance
@@ -98,7 +100,7 @@ start_server {tags {"maxmemory"}} {
     }
 
     foreach policy {
-        volatile-lru volatile-lfu volatile-random volatile-ttl
+        volatile-lru volatile-lfu volatile-gdsf volatile-random volatile-ttl
     } {
         test "maxmemory - policy $policy should only remove volatile keys." {
             # make sure to start with a blank instance
@@ -141,6 +143,32 @@ start_server {tags {"maxmemory"}} {
             }
         }
     }
+
+    test "maxmemory - allkeys-gdsf evicts big keys before small hot keys" {
+        r flushall
+        r config set maxmemory 0
+        r config set maxmemory-policy allkeys-gdsf
+        r config resetstat
+        for {set j 0} {$j < 200} {incr j} {
+            r set small:$j [string repeat x 100]
+        }
+        for {set j 0} {$j < 10} {incr j} {
+            r set big:$j [string repeat x 50000]
+        }
+        for {set k 0} {$k < 5} {incr k} {
+            for {set j 0} {$j < 200} {incr j} {
+                r get small:$j
+            }
+        }
+        # Reclaiming 100k requires to evict just a few big keys, while
+        # policies not considering the size would evict hundreds of keys.
+        # Since keys are sampled a few small keys may be evicted too.
+        r config set maxmemory [expr {[s used_memory]-100*1024}]
+        r set trigger x
+        assert {[llength [r keys big:*]] <= 8}
+        assert {[s evicted_keys] < 30}
+        r config set maxmemory 0
+    }
 }
 
 proc test_slave_buffers {test_name cmd_count payload_len limit_memory pipeline} {
@@ -241,3 +269,78 @@ test_slave_buffers {slave buffer are counted correctly} 1000000 10 0 1
 # test again with fewer (and bigger) commands without pipeline, but with eviction
 test_slave_buffers "replica buffer don't induce eviction" 100000 100 1 0
 
+
+foreach segmented {no yes} {
+    start_server [list tags {"maxmemory"} overrides [list keyspace-segmented-tables $segmented]] {
+        test "Keyspace table is not expanded over maxmemory (segmented $segmented)" {
+            # Chained tables grow when the keys reach the slots, open
+            # addressing tables when they reach 7/8 of the slots.
+            if {[lindex [r config get keyspace-open-addressing] 1] eq {yes}} {
+                set size 131072
+                set keys 114688
+            } else {
+                set size 65536
+                set keys 65536
+            }
+            r flushdb
+            r debug populate $keys
+            wait_for_condition 50 100 {
+                ![string match {*rehashing target*} [r debug htstats 9]]
+            } else {
+                fail "The keyspace table is still rehashing"
+            }
+            assert_match "*table size: $size*" [r debug htstats 9]
+
+            # The next key would double the table: there is no room for that.
+            r config set maxmemory-policy allkeys-lru
+            r config set maxmemory [expr {[s used_memory]+100000}]
+            for {set j 0} {$j < 10} {incr j} {
+                r set extra:$j x
+            }
+            set stats [r debug htstats 9]
+            assert_match "*table size: $size*" $stats
+            assert_match "*number of elements: [expr {$keys+10}]*" $stats
+            assert_equal [expr {$keys+10}] [r dbsize]
+
+            r config set maxmemory 0
+            r set extra:10 x
+            # The new table may still be empty, wait for the rehashing.
+            wait_for_condition 50 100 {
+                [string match {*table size: 262144*} [r debug htstats 9]]
+            } else {
+                fail "The keyspace table was not expanded"
+            }
+        }
+    }
+}
+
+start_server {tags {"maxmemory"}} {
+    test "Keys are evicted in the background to keep the eviction headroom" {
+        assert_error {*Invalid argument*} {r config set maxmemory-eviction-headroom 60}
+        r config set maxmemory-policy allkeys-lru
+        r debug populate 20000 key 100
+        set used [s used_memory]
+        r config set maxmemory [expr {$used/100*105}]
+        assert_equal 20000 [r dbsize]
+        assert_equal 0 [s evicted_keys]
+
+        # No command needs memory: the keys are evicted by the server
+        # alone to return under 90% of maxmemory.
+        r config set maxmemory-eviction-headroom 10
+        set target [expr {$used/100*105/100*90}]
+        wait_for_condition 500 100 {
+            [s used_memory] <= $target
+        } else {
+            fail "Keys were not evicted in the background"
+        }
+        assert {[s evicted_keys] > 0}
+        assert {[r dbsize] < 20000}
+
+        # Once the headroom is restored nothing else is evicted.
+        set evicted [s evicted_keys]
+        after 200
+        assert_equal $evicted [s evicted_keys]
+        r config set maxmemory-eviction-headroom 0
+        r config set maxmemory 0
+    }
+}
@@ -0,0 +1,360 @@
+start_server {tags {"networking"} overrides {io-threads 4 io-threads-do-reads yes}} {
+    test {CONFIG GET reports the threaded I/O configuration} {
+        list [lindex [r config get io-threads] 1] \
+             [lindex [r config get io-threads-do-reads] 1]
+    } {4 yes}
+
+    test {Threaded I/O serves many clients with pending replies} {
+        set numclients 20
+        set clients {}
+        for {set j 0} {$j < $numclients} {incr j} {
+            lappend clients [redis_deferring_client]
+        }
+
+        # Pause the clients so that all the commands are served in the
+        # same event loop iteration once the pause expires: this way there
+        # are enough clients with pending writes to activate the threads.
+        r set foo bar
+        r client pause 500
+        foreach rd $clients {
+            $rd get foo
+        }
+        foreach rd $clients {
+            assert_equal bar [$rd read]
+        }
+        assert {[s io_threaded_writes_processed] >= $numclients}
+        foreach rd $clients {
+            $rd close
+        }
+    }
+
+    test {Threaded I/O keeps pipelined replies in order} {
+        set numclients 20
+        set clients {}
+        for {set j 0} {$j < $numclients} {incr j} {
+            lappend clients [redis_deferring_client]
+        }
+        for {set round 0} {$round < 10} {incr round} {
+            set i 0
+            foreach rd $clients {
+                for {set k 0} {$k < 100} {incr k} {
+                    $rd set "key:$i:$k" [string repeat x $k]
+                    $rd get "key:$i:$k"
+                }
+                incr i
+            }
+            foreach rd $clients {
+                for {set k 0} {$k < 100} {incr k} {
+                    assert_equal OK [$rd read]
+                    assert_equal [string repeat x $k] [$rd read]
+                }
+            }
+        }
+        foreach rd $clients {
+            $rd close
+        }
+        r ping
+    } {PONG}
+
+    test {Threaded I/O transfers large replies} {
+        r del biglist
+        for {set j 0} {$j < 10000} {incr j} {
+            r rpush biglist [string repeat y 100]
+        }
+        set clients {}
+        for {set j 0} {$j < 10} {incr j} {
+            lappend clients [redis_deferring_client]
+        }
+        foreach rd $clients {
+            $rd lrange biglist 0 -1
+        }
+        foreach rd $clients {
+            assert_equal 10000 [llength [$rd read]]
+            $rd close
+        }
+    }
+}
+
+start_server {tags {"networking"}} {
+    test {Replies spanning many reply blocks are transferred intact} {
+        r del biglist
+        set elements {}
+        for {set j 0} {$j < 2000} {incr j} {
+            lappend elements "$j:[string repeat z [expr {$j % 1000}]]"
+        }
+        r rpush biglist {*}$elements
+        set rd [redis_deferring_client]
+        # Queue a few large replies before reading, so that the static
+        # buffer and many reply list nodes are pending at the same time.
+        $rd ping
+        for {set j 0} {$j < 5} {incr j} {
+            $rd lrange biglist 0 -1
+        }
+        assert_equal PONG [$rd read]
+        for {set j 0} {$j < 5} {incr j} {
+            assert_equal $elements [$rd read]
+        }
+        $rd close
+    }
+}
+
+start_server {tags {"networking"}} {
+    # Big values are referenced by the client output buffer instead of being
+    # copied: make sure that modifying or deleting the key while the reply is
+    # still pending does not affect the data sent to the client.
+    proc big_value {} {
+        string repeat "abcdefghij" 300000
+    }
+
+    foreach {desc cmd} {
+        SETRANGE {r setrange big 0 XXXXXXXXXX}
+        APPEND {r append big XXXXXXXXXX}
+        SET {r set big XXXXXXXXXX}
+        DEL {r del big}
+        UNLINK {r unlink big}
+        {FLUSHALL ASYNC} {r flushall async}
+    } {
+        test "Big value replies are not affected by $desc of the key" {
+            r flushall
+            r set big [big_value]
+            set rd [redis_deferring_client]
+            for {set j 0} {$j < 5} {incr j} {
+                $rd get big
+            }
+            # Give the server the time to fill the socket buffers, so that
+            # most of the replies are still pending.
+            after 100
+            eval $cmd
+            for {set j 0} {$j < 5} {incr j} {
+                assert_equal [big_value] [$rd read]
+            }
+            $rd close
+            r ping
+        } {PONG}
+    }
+
+    test {Big value replies are accounted in the client output buffer} {
+        r flushall
+        r set big [big_value]
+        set rd [redis_deferring_client]
+        $rd client setname bigreader
+        $rd read
+        for {set j 0} {$j < 20} {incr j} {
+            $rd get big
+        }
+        after 100
+        set omem 0
+        foreach line [split [r client list] "\n"] {
+            if {[string match {*name=bigreader*} $line]} {
+                regexp {omem=([0-9]+)} $line - omem
+            }
+        }
+        for {set j 0} {$j < 20} {incr j} {
+            $rd read
+        }
+        $rd close
+        assert {$omem > 1000000}
+    }
+}
+
+start_server {tags {"networking"}} {
+    proc client_reply_buffer_size {} {
+        set id [r client id]
+        foreach line [split [r client list] "\n"] {
+            if {[string match "id=$id *" $line]} {
+                regexp {rbs=([0-9]+)} $line - rbs
+                return $rbs
+            }
+        }
+    }
+
+    test "New clients start with a small reply buffer" {
+        reconnect
+        assert_equal 1024 [client_reply_buffer_size]
+    }
+
+    test "Reply buffer grows for clients receiving big replies" {
+        r set bigkey [string repeat x 10000]
+        wait_for_condition 100 50 {
+            [string length [r get bigkey]] == 10000 &&
+            [client_reply_buffer_size] == 16384
+        } else {
+            fail "Reply buffer did not grow: [r client list]"
+        }
+    }
+
+    test "Reply buffer shrinks when the client is idle" {
+        r debug replybuffer-peak-reset-time 100
+        wait_for_condition 100 50 {
+            [client_reply_buffer_size] == 1024
+        } else {
+            fail "Reply buffer did not shrink: [r client list]"
+        }
+        r debug replybuffer-peak-reset-time 5000
+    }
+
+    test "INFO memory reports the clients buffers" {
+        set info [r info memory]
+        assert_match {*mem_clients_query_buffers:*} $info
+        regexp {mem_clients_reply_buffers:([0-9]+)} $info - rbuf
+        assert {$rbuf >= 1024}
+    }
+}
+
+start_server {tags {"networking"}} {
+    proc client_query_buffer {id} {
+        foreach line [split [r client list] "\n"] {
+            if {[string match "id=$id *" $line]} {
+                regexp {qbuf=([0-9]+) qbuf-free=([0-9]+)} $line - qbuf free
+                return [list $qbuf $free]
+            }
+        }
+    }
+
+    foreach shared {yes no} {
+        r config set shared-query-buffer $shared
+
+        test "Idle clients query buffer (shared-query-buffer $shared)" {
+            set rd [redis_deferring_client]
+            $rd client id
+            set id [$rd read]
+            $rd set foo bar
+            assert_equal OK [$rd read]
+            lassign [client_query_buffer $id] qbuf free
+            assert_equal 0 $qbuf
+            if {$shared eq {yes}} {
+                assert_equal 0 $free
+            } else {
+                assert {$free > 0}
+            }
+            $rd close
+        }
+
+        test "Commands split across reads (shared-query-buffer $shared)" {
+            set rd [redis_deferring_client]
+            $rd write "*3\r\n\$3\r\nSET\r\n\$3\r\nkey\r\n\$5\r\nva"
+            $rd flush
+            after 100
+            $rd write "lue\r\n*2\r\n\$3\r\nGET\r\n\$3\r\nkey\r\n*1\r\n\$4\r\nPI"
+            $rd flush
+            after 100
+            $rd write "NG\r\n"
+            $rd flush
+            assert_equal OK [$rd read]
+            assert_equal value [$rd read]
+            assert_equal PONG [$rd read]
+            $rd close
+        }
+
+        test "Pipeline resumed after a blocking command (shared-query-buffer $shared)" {
+            r del mylist
+            set rd [redis_deferring_client]
+            $rd write "*3\r\n\$5\r\nBLPOP\r\n\$6\r\nmylist\r\n\$1\r\n0\r\n"
+            $rd write "*2\r\n\$4\r\nECHO\r\n\$5\r\nhello\r\n"
+            $rd flush
+            wait_for_condition 50 100 {
+                [s blocked_clients] == 1
+            } else {
+                fail "Client was not blocked"
+            }
+            r rpush mylist a
+            assert_equal {mylist a} [$rd read]
+            assert_equal hello [$rd read]
+            $rd close
+        }
+    }
+
+    test "Many idle clients use little query buffer memory" {
+        r config set shared-query-buffer yes
+        set clients {}
+        for {set j 0} {$j < 100} {incr j} {
+            set rd [redis_deferring_client]
+            $rd ping
+            $rd read
+            lappend clients $rd
+        }
+        regexp {mem_clients_query_buffers:([0-9]+)} [r info memory] - qbufmem
+        assert {$qbufmem < 100*1024}
+        foreach rd $clients {$rd close}
+    }
+}
+
+start_server {tags {"networking"}} {
+    test "Released clients are pooled and reused" {
+        r config resetstat
+        for {set j 0} {$j < 10} {incr j} {
+            set rd [redis_deferring_client]
+            $rd ping
+            $rd read
+            $rd close
+        }
+        wait_for_condition 50 100 {
+            [s pooled_clients] >= 1
+        } else {
+            fail "Released clients were not pooled"
+        }
+        assert {[s client_pool_hits] >= 9}
+    }
+
+    test "Reused clients don't inherit Pub/Sub, WATCH or blocking state" {
+        set rd [redis_deferring_client]
+        $rd subscribe chan
+        $rd read
+        $rd close
+        set rd [redis_deferring_client]
+        $rd watch foo
+        $rd read
+        $rd close
+        set rd [redis_deferring_client]
+        $rd blpop mylist 0
+        wait_for_condition 50 100 {
+            [s blocked_clients] == 1
+        } else {
+            fail "Client was not blocked"
+        }
+        $rd close
+        wait_for_condition 50 100 {
+            [s blocked_clients] == 0
+        } else {
+            fail "Blocked client was not released"
+        }
+
+        for {set j 0} {$j < 3} {incr j} {
+            set rd [redis_deferring_client]
+            $rd client list
+            set clients [$rd read]
+            assert {![string match {*sub=[1-9]*} $clients]}
+            $rd multi
+            $rd set foo bar
+            $rd exec
+            assert_equal {OK QUEUED OK} [list [$rd read] [$rd read] [$rd read]]
+            $rd close
+        }
+        assert_equal 0 [r publish chan hello]
+        assert_equal 0 [r llen mylist]
+    }
+
+    test "CONFIG SET client-pool-size 0 empties the pool" {
+        r config set client-pool-size 0
+        assert_equal 0 [s pooled_clients]
+        set rd [redis_deferring_client]
+        $rd ping
+        $rd read
+        $rd close
+        after 100
+        assert_equal 0 [s pooled_clients]
+        r config set client-pool-size 1024
+    }
+}
+
+start_server {tags {"networking"} overrides {tcp-listeners 4}} {
+    test "Connections are accepted with multiple TCP listeners" {
+        assert_equal {tcp-listeners 4} [r config get tcp-listeners]
+        for {set j 0} {$j < 20} {incr j} {
+            set rd [redis_deferring_client]
+            $rd ping
+            assert_equal PONG [$rd read]
+            $rd close
+        }
+    }
+}
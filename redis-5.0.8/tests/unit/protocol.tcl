@@ -55,6 +55,31 @@ start_server {tags {"protocol"}} {
         assert_error "*expected '$', got 'f'*" {r read}
     }
 
+    test "Pipelined multibulk commands split at every byte" {
+        reconnect
+        r del mylist
+        set buf {}
+        for {set j 0} {$j < 10} {incr j} {
+            append buf "*3\r\n\$5\r\nRPUSH\r\n\$6\r\nmylist\r\n"
+            append buf "\$[string length $j$j]\r\n$j$j\r\n"
+        }
+        foreach byte [split $buf {}] {
+            r write $byte
+            r flush
+        }
+        for {set j 0} {$j < 10} {incr j} {
+            assert_equal [expr {$j+1}] [r read]
+        }
+        r lrange mylist 0 -1
+    } {00 11 22 33 44 55 66 77 88 99}
+
+    test "Multibulk length with leading zeroes" {
+        reconnect
+        r write "*3\r\n\$3\r\nSET\r\n\$01\r\nx\r\n\$1\r\n1\r\n"
+        r flush
+        assert_error "*invalid bulk length*" {r read}
+    }
+
     test "Generic wrong number of args" {
         reconnect
         assert_error "*wrong*arguments*ping*" {r ping x y z}
@@ -0,0 +1,222 @@
+start_server {tags {"hash"}} {
+    foreach {type entries} {listpack 128 hashtable 0} {
+        test "HEXPIRE/HTTL/HPERSIST replies - $type" {
+            r config set hash-max-ziplist-entries $entries
+            r del myhash
+            r hset myhash a 1 b 2 c 3
+            assert_encoding $type myhash
+            assert_equal {1 -2} [r hexpire myhash 100 FIELDS 2 a x]
+            assert_equal {100 -1 -2} [r httl myhash FIELDS 3 a b x]
+            set pttl [r hpttl myhash FIELDS 1 a]
+            assert {$pttl > 99000 && $pttl <= 100000}
+            assert_equal {-1 1 -2} [r hpersist myhash FIELDS 3 b a x]
+            assert_equal {-1} [r httl myhash FIELDS 1 a]
+            assert_equal {-2 -2} [r httl nokey FIELDS 2 a b]
+            assert_equal {-2} [r hexpire nokey 100 FIELDS 1 a]
+        }
+
+        test "Hash fields are lazily expired - $type" {
+            r del myhash
+            r hset myhash a 1 b 2 c 3
+            r hpexpire myhash 50 FIELDS 2 a b
+            after 100
+            assert_equal {c 3} [r hgetall myhash]
+            assert_equal 1 [r hlen myhash]
+        }
+
+        test "Hash fields are actively expired - $type" {
+            r del myhash
+            r hset myhash a 1 b 2 c 3
+            r hpexpire myhash 50 FIELDS 3 a b c
+            wait_for_condition 50 100 {
+                [r dbsize] == 0
+            } else {
+                fail "The hash fields were not expired"
+            }
+        }
+    }
+
+    r config set hash-max-ziplist-entries 128
+
+    test {HEXPIRE with a time in the past deletes the fields} {
+        r del myhash
+        r hset myhash a 1 b 2
+        assert_equal {2 -2} [r hexpireat myhash 1 FIELDS 2 a x]
+        assert_equal {b 2} [r hgetall myhash]
+        assert_equal {2} [r hpexpire myhash 0 FIELDS 1 b]
+        r exists myhash
+    } {0}
+
+    test {HEXPIRE argument errors} {
+        r del myhash
+        r hset myhash a 1
+        assert_error {*syntax*} {r hexpire myhash 100 FOO 1 a}
+        assert_error {*numfields*} {r hexpire myhash 100 FIELDS 2 a}
+        assert_error {*numfields*} {r httl myhash FIELDS 0 a}
+        assert_error {*not an integer*} {r hexpire myhash abc FIELDS 1 a}
+        assert_error {*invalid expire*} {r hexpire myhash -1 FIELDS 1 a}
+        r set mystring foo
+        assert_error {*WRONGTYPE*} {r hexpire mystring 100 FIELDS 1 a}
+    }
+
+    test {Writing a field removes its expire} {
+        r del myhash
+        r hset myhash a 1 b 2 c 3 d 4
+        r hexpire myhash 100 FIELDS 4 a b c d
+        r hset myhash a 10
+        r hincrby myhash b 1
+        r hincrbyfloat myhash c 1.5
+        r hdel myhash d
+        r hset myhash d 5
+        r httl myhash FIELDS 4 a b c d
+    } {-1 -1 -1 -1}
+
+    test {Deleting or overwriting a hash removes the field expires} {
+        r del myhash
+        r hset myhash a 1
+        r hexpire myhash 100 FIELDS 1 a
+        r del myhash
+        r hset myhash a 1
+        assert_equal {-1} [r httl myhash FIELDS 1 a]
+        r hexpire myhash 100 FIELDS 1 a
+        r set myhash foo
+        r del myhash
+        r hset myhash a 1
+        r httl myhash FIELDS 1 a
+    } {-1}
+
+    test {RENAME and MOVE keep the field expires} {
+        r flushall
+        r hset myhash a 1 b 2
+        r hexpire myhash 100 FIELDS 1 a
+        r rename myhash newhash
+        assert_equal {100 -1} [r httl newhash FIELDS 2 a b]
+        r move newhash 10
+        r select 10
+        set ttl [r httl newhash FIELDS 2 a b]
+        r flushdb
+        r select 9
+        set ttl
+    } {100 -1}
+
+    test {SWAPDB swaps the field expires} {
+        r flushall
+        r hset myhash a 1
+        r hpexpire myhash 100 FIELDS 1 a
+        r swapdb 9 10
+        r select 10
+        wait_for_condition 50 100 {
+            [r dbsize] == 0
+        } else {
+            fail "The hash fields were not expired after SWAPDB"
+        }
+        r select 9
+        r flushall
+    }
+
+    test {Field expires are preserved by DEBUG RELOAD} {
+        r del myhash
+        r hset myhash a 1 b 2 c 3
+        r hexpire myhash 100 FIELDS 1 a
+        r hexpire myhash 200 FIELDS 1 b
+        set digest [r debug digest]
+        r debug reload
+        assert_equal $digest [r debug digest]
+        r httl myhash FIELDS 3 a b c
+    } {100 200 -1}
+
+    test {Field expires are preserved by DUMP/RESTORE} {
+        r del myhash
+        r hset myhash a 1 b 2
+        r hexpire myhash 100 FIELDS 1 a
+        set dump [r dump myhash]
+        r del myhash
+        r restore myhash 0 $dump
+        assert_equal {100 -1} [r httl myhash FIELDS 2 a b]
+        r set mystring foo
+        r restore myhash2 0 [r dump mystring]
+        r get myhash2
+    } {foo}
+
+    test {Field expires are preserved by AOF rewrite} {
+        r config set appendonly yes
+        waitForBgrewriteaof r
+        r del myhash
+        r hset myhash a 1 b 2 c 3
+        r hexpire myhash 100 FIELDS 2 a b
+        r bgrewriteaof
+        waitForBgrewriteaof r
+        r debug loadaof
+        lassign [r httl myhash FIELDS 3 a b c] ttla ttlb ttlc
+        assert {$ttla > 90 && $ttla <= 100 && $ttla == $ttlb && $ttlc == -1}
+        r hpexpire myhash 1 FIELDS 1 a
+        after 2000
+        r debug loadaof
+        r config set appendonly no
+        r hgetall myhash
+    } {b 2 c 3}
+
+    test {Expired hash fields are counted in INFO} {
+        r config resetstat
+        r del myhash
+        r hset myhash a 1 b 2 c 3
+        r hpexpire myhash 10 FIELDS 2 a b
+        after 50
+        r hlen myhash
+        s expired_hash_fields
+    } {2}
+}
+
+start_server {tags {"hash repl"}} {
+    start_server {} {
+        set master [srv -1 client]
+        set master_host [srv -1 host]
+        set master_port [srv -1 port]
+        set slave [srv 0 client]
+
+        test {Field expires are propagated to the slave} {
+            $slave slaveof $master_host $master_port
+            wait_for_condition 50 100 {
+                [s 0 master_link_status] eq {up}
+            } else {
+                fail "Replication not started."
+            }
+            $master hset myhash a 1 b 2 c 3
+            $master hexpire myhash 100 FIELDS 1 c
+            $master hpexpire myhash 100 FIELDS 2 a b
+            wait_for_condition 50 100 {
+                [$slave hlen myhash] == 1
+            } else {
+                fail "The expired fields were not deleted in the slave"
+            }
+            assert_equal {c 3} [$slave hgetall myhash]
+            assert_equal {100} [$slave httl myhash FIELDS 1 c]
+        }
+
+        test {Slave reads treat the expired fields as missing} {
+            # The master doesn't delete the due fields until they are
+            # accessed: the slave still has them, but hides them.
+            $master debug set-active-expire 0
+            $master del myhash
+            $master hset myhash a 1 b 2 c 3
+            $master hpexpire myhash 100 FIELDS 2 a b
+            $master hset gone x 1
+            $master hpexpire gone 100 FIELDS 1 x
+            wait_for_ofs_sync $master $slave
+            after 200
+            assert_equal 2 [$slave dbsize]
+            assert_equal {} [$slave hget myhash a]
+            assert_equal {{} {} 3} [$slave hmget myhash a b c]
+            assert_equal 0 [$slave hexists myhash b]
+            assert_equal 0 [$slave hstrlen myhash b]
+            assert_equal 1 [$slave hlen myhash]
+            assert_equal {c 3} [$slave hgetall myhash]
+            assert_equal {c} [$slave hkeys myhash]
+            assert_equal {0 {c 3}} [$slave hscan myhash 0]
+            assert_equal {-2 -2 -1} [$slave httl myhash FIELDS 3 a b c]
+            assert_equal 0 [$slave exists gone]
+            assert_equal 0 [$slave hlen gone]
+            $master debug set-active-expire 1
+        }
+    }
+}
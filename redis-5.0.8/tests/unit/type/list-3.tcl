@@ -57,6 +57,70 @@ start_server {
         }
     }
 
+    test {LINDEX, LSET and LRANGE on a long list modified at both ends} {
+        r del key
+        set mylist {}
+        for {set j 0} {$j < 2000} {incr j} {
+            r rpush key $j
+            lappend mylist $j
+        }
+        for {set j 0} {$j < 2000} {incr j} {
+            set len [llength $mylist]
+            set idx [randomInt $len]
+            switch [randomInt 8] {
+                0 {r lpush key a$j; set mylist [linsert $mylist 0 a$j]}
+                1 {r rpush key b$j; lappend mylist b$j}
+                2 {r lpop key; set mylist [lrange $mylist 1 end]}
+                3 {r rpop key; set mylist [lrange $mylist 0 end-1]}
+                4 {
+                    r ltrim key 3 -4
+                    set mylist [lrange $mylist 3 end-3]
+                }
+                5 {
+                    r lset key $idx c$j
+                    lset mylist $idx c$j
+                }
+                6 {
+                    r linsert key before [lindex $mylist $idx] d$j
+                    set mylist [linsert $mylist $idx d$j]
+                }
+                7 {
+                    r lrem key 1 [lindex $mylist $idx]
+                    set mylist [lreplace $mylist $idx $idx]
+                }
+            }
+            set idx [randomInt [llength $mylist]]
+            assert_equal [lindex $mylist $idx] [r lindex key $idx]
+            assert_equal [lindex $mylist end-$idx] [r lindex key [expr {-$idx-1}]]
+            assert_equal [lrange $mylist $idx [expr {$idx+10}]] \
+                         [r lrange key $idx [expr {$idx+10}]]
+        }
+        assert_equal $mylist [r lrange key 0 -1]
+    }
+
+    test {Compressed lists with every available codec survive DEBUG RELOAD} {
+        r config set list-compress-depth 1
+        foreach codec {lzf lz4 zstd} {
+            # lz4 and zstd are only available if Redis was built with them.
+            if {[catch {r config set list-compress-codec $codec}]} continue
+            r config set rdbcompression-codec $codec
+            r del key
+            set mylist {}
+            for {set j 0} {$j < 500} {incr j} {
+                set v "user:[randomInt 100],text:[string repeat x [randomInt 50]]"
+                r rpush key $v
+                lappend mylist $v
+            }
+            r lset key 250 changed
+            lset mylist 250 changed
+            r debug reload
+            assert_equal $mylist [r lrange key 0 -1]
+        }
+        r config set list-compress-depth 0
+        r config set list-compress-codec lzf
+        r config set rdbcompression-codec lzf
+    }
+
     tags {slow} {
         test {ziplist implementation: value encoding and backlink} {
             if {$::accurate} {set iterations 100} else {set iterations 10}
@@ -147,6 +147,46 @@ start_server {tags {"string"}} {
         list [r msetnx x1 xxx y2 yyy] [r get x1] [r get y2]
     } {1 xxx yyy}
 
+    foreach batch {16 3 0} {
+        test "MSET/MGET/EXISTS with many keys, prefetch-batch-max-size $batch" {
+            r flushdb
+            r config set prefetch-batch-max-size $batch
+            set args {}
+            set keys {}
+            set vals {}
+            for {set j 0} {$j < 100} {incr j} {
+                lappend args key:$j [string repeat $j 50]
+                lappend keys key:$j
+                lappend vals [string repeat $j 50]
+            }
+            r mset {*}$args
+            assert_equal $vals [r mget {*}$keys]
+            assert_equal [list {} {*}$vals {}] [r mget nokey {*}$keys nokey]
+            assert_equal 100 [r exists {*}$keys nokey]
+            assert_equal 0 [r msetnx newkey 1 {*}$args]
+            assert_equal 0 [r exists newkey]
+        }
+
+        test "Pipelined multibulk commands, prefetch-batch-max-size $batch" {
+            set fd [r channel]
+            set buf {}
+            for {set j 0} {$j < 100} {incr j} {
+                append buf "*2\r\n\$3\r\nGET\r\n\$[string length key:$j]\r\nkey:$j\r\n"
+                append buf "*3\r\n\$3\r\nSET\r\n\$[string length new:$j]\r\nnew:$j\r\n\$1\r\nx\r\n"
+                append buf "*1\r\n\$4\r\nPING\r\n"
+            }
+            puts -nonewline $fd $buf
+            flush $fd
+            for {set j 0} {$j < 100} {incr j} {
+                assert_equal [string repeat $j 50] [r read]
+                assert_equal OK [r read]
+                assert_equal PONG [r read]
+            }
+            assert_equal x [r get new:99]
+        }
+    }
+    r config set prefetch-batch-max-size 16
+
     test "STRLEN against non-existing key" {
         assert_equal 0 [r strlen notakey]
     }
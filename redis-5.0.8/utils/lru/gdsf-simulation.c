@@ -0,0 +1,238 @@
+/* Simulation of the Redis approximated LRU, LFU and GDSF eviction policies
+ * against a workload of keys having very different sizes, in order to
+ * compare the hit ratio and the number of evictions they obtain with the
+ * same amount of memory.
+ *
+ * The simulation uses the same sampling of the Redis implementation: every
+ * time a key must be evicted a few random keys are added to a pool of good
+ * candidates, and the best candidate of the pool is evicted. The access
+ * frequency is tracked with the same logarithmic counter of Redis, however
+ * the counters are never decremented since the simulation has no notion of
+ * time.
+ *
+ * Compile with: cc -O2 -o gdsf-simulation gdsf-simulation.c -lm */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+int keyspace_size = 200000;
+int requests = 10000000;
+int cache_perc = 10;        /* Memory available, as % of the dataset size. */
+int samples = 5;            /* Like maxmemory-samples. */
+int log_factor = 10;        /* Like lfu-log-factor. */
+double zipf_alpha = 0.9;    /* Skew of the access pattern. */
+
+#define POOL_SIZE 16
+#define COUNTER_INIT_VAL 5
+
+#define POLICY_LRU 0
+#define POLICY_LFU 1
+#define POLICY_GDSF 2
+char *policy_names[] = {"allkeys-lru","allkeys-lfu","allkeys-gdsf"};
+
+struct entry {
+    uint32_t size;      /* Memory used by the key, in bytes. */
+    uint8_t counter;    /* Logarithmic counter. */
+    uint64_t atime;     /* Logical time of last access. */
+    long pos;           /* Position in the 'cached' array, or -1. */
+};
+
+struct poolEntry {
+    double score;       /* Higher score means better candidate. */
+    long idx;           /* Entry index, or -1 if empty. */
+};
+
+struct entry *entries;
+double *zipf_cdf;
+long *cached;           /* Indexes of the cached entries. */
+long numcached;
+
+/* Increment a counter logarithmically, like LFULogIncr(). */
+uint8_t log_incr(uint8_t counter) {
+    if (counter == 255) return counter;
+    double r = (double)rand()/RAND_MAX;
+    double baseval = counter-COUNTER_INIT_VAL;
+    if (baseval < 0) baseval = 0;
+    double limit = 1.0/(baseval*log_factor+1);
+    if (r < limit) counter++;
+    return counter;
+}
+
+/* Estimate the number of accesses given a counter, like
+ * LFUEstimateAccesses(). */
+double estimate_accesses(uint8_t counter) {
+    double base;
+
+    if (counter <= COUNTER_INIT_VAL)
+        return (double)(counter+1)/(COUNTER_INIT_VAL+1);
+    base = counter-COUNTER_INIT_VAL;
+    return 1+base+log_factor*base*(base-1)/2;
+}
+
+/* Return the eviction score of an entry for the given policy. */
+double entry_score(int policy, struct entry *e, uint64_t now) {
+    switch(policy) {
+    case POLICY_LRU: return now-e->atime;
+    case POLICY_LFU: return 255-e->counter;
+    default: return e->size/estimate_accesses(e->counter);
+    }
+}
+
+/* Return a random number with a long tailed distribution of the kind of
+ * the sizes of cached objects: most keys are small, a few are very big. */
+uint32_t random_size(void) {
+    double r = (double)rand()/RAND_MAX;
+
+    if (r < 0.80) return 50+rand()%500;         /* Small strings. */
+    if (r < 0.98) return 1000+rand()%10000;     /* Small aggregates. */
+    return 50000+rand()%500000;                 /* Big aggregates. */
+}
+
+/* Return a random key index with a Zipf distribution. Popularity is not
+ * related to the size since sizes are assigned at random. */
+long random_key(void) {
+    double r = (double)rand()/RAND_MAX;
+    long lo = 0, hi = keyspace_size-1;
+
+    while (lo < hi) {
+        long mid = (lo+hi)/2;
+        if (zipf_cdf[mid] < r) lo = mid+1; else hi = mid;
+    }
+    return lo;
+}
+
+void cache_add(long idx) {
+    entries[idx].pos = numcached;
+    cached[numcached++] = idx;
+}
+
+void cache_remove(long idx) {
+    long last = cached[--numcached];
+
+    cached[entries[idx].pos] = last;
+    entries[last].pos = entries[idx].pos;
+    entries[idx].pos = -1;
+}
+
+/* Add 'idx' to the pool if it is a better candidate than the worst one,
+ * keeping the pool sorted by ascending score. */
+void pool_insert(struct poolEntry *pool, long idx, double score) {
+    int k, j;
+
+    for (k = 0; k < POOL_SIZE; k++)
+        if (pool[k].idx == idx) return;
+    k = 0;
+    while (k < POOL_SIZE && pool[k].idx != -1 && pool[k].score < score) k++;
+    if (k == 0 && pool[POOL_SIZE-1].idx != -1) return;
+    if (pool[POOL_SIZE-1].idx == -1) {
+        for (j = POOL_SIZE-1; j > k; j--) pool[j] = pool[j-1];
+    } else {
+        k--;
+        for (j = 0; j < k; j++) pool[j] = pool[j+1];
+    }
+    pool[k].idx = idx;
+    pool[k].score = score;
+}
+
+/* Evict the best candidate among the pool and a few sampled keys, and
+ * return its index. */
+long evict_one(int policy, struct poolEntry *pool, uint64_t now) {
+    int j, k;
+
+    while(1) {
+        for (j = 0; j < samples; j++) {
+            long idx = cached[rand()%numcached];
+            pool_insert(pool,idx,entry_score(policy,entries+idx,now));
+        }
+        for (k = POOL_SIZE-1; k >= 0; k--) {
+            long idx = pool[k].idx;
+
+            if (idx == -1) continue;
+            for (j = k; j < POOL_SIZE-1; j++) pool[j] = pool[j+1];
+            pool[POOL_SIZE-1].idx = -1;
+            if (entries[idx].pos != -1) {
+                cache_remove(idx);
+                return idx;
+            }
+        }
+    }
+}
+
+void simulate(int policy, uint64_t maxmemory) {
+    struct poolEntry pool[POOL_SIZE];
+    uint64_t used = 0, hits = 0, hit_bytes = 0, total_bytes = 0;
+    uint64_t evictions = 0, now;
+    long j;
+
+    srand(1234);
+    for (j = 0; j < keyspace_size; j++) {
+        entries[j].counter = COUNTER_INIT_VAL;
+        entries[j].atime = 0;
+        entries[j].pos = -1;
+    }
+    for (j = 0; j < POOL_SIZE; j++) pool[j].idx = -1;
+    numcached = 0;
+
+    for (now = 1; now <= (uint64_t)requests; now++) {
+        long idx = random_key();
+        struct entry *e = entries+idx;
+
+        total_bytes += e->size;
+        if (e->pos != -1) {
+            hits++;
+            hit_bytes += e->size;
+            e->counter = log_incr(e->counter);
+        } else {
+            /* Cache miss: the key is added back, like a cache would do
+             * after fetching the value from the primary storage. */
+            while (used+e->size > maxmemory && numcached) {
+                used -= entries[evict_one(policy,pool,now)].size;
+                evictions++;
+            }
+            e->counter = COUNTER_INIT_VAL;
+            cache_add(idx);
+            used += e->size;
+        }
+        e->atime = now;
+    }
+    printf("%-14s hits: %6.2f%%  byte hits: %6.2f%%  evictions: %llu\n",
+        policy_names[policy],
+        (double)hits*100/requests, (double)hit_bytes*100/total_bytes,
+        (unsigned long long)evictions);
+}
+
+int main(int argc, char **argv) {
+    uint64_t dataset = 0, maxmemory;
+    double sum = 0, acc = 0;
+    long j;
+    int policy;
+
+    if (argc > 1) cache_perc = atoi(argv[1]);
+    if (argc > 2) zipf_alpha = atof(argv[2]);
+
+    entries = malloc(sizeof(*entries)*keyspace_size);
+    zipf_cdf = malloc(sizeof(double)*keyspace_size);
+    cached = malloc(sizeof(long)*keyspace_size);
+
+    srand(42);
+    for (j = 0; j < keyspace_size; j++) {
+        entries[j].size = random_size();
+        dataset += entries[j].size;
+        sum += 1.0/pow(j+1,zipf_alpha);
+    }
+    for (j = 0; j < keyspace_size; j++) {
+        acc += 1.0/pow(j+1,zipf_alpha)/sum;
+        zipf_cdf[j] = acc;
+    }
+    zipf_cdf[keyspace_size-1] = 1;
+    maxmemory = dataset/100*cache_perc;
+
+    printf("%d keys, %llu bytes, memory %d%% of the dataset, zipf %.2f, "
+           "%d requests\n", keyspace_size, (unsigned long long)dataset,
+           cache_perc, zipf_alpha, requests);
+    for (policy = POLICY_LRU; policy <= POLICY_GDSF; policy++)
+        simulate(policy,maxmemory);
+    return 0;
+}